@@ -132,3 +132,30 @@ QString getDeviceName(cl_device_id device)
 
     return name;
 }
+
+QString getDriverVersion(cl_device_id device)
+{
+    cl_int rv = CL_SUCCESS;
+    size_t size = 0;
+
+    rv = clGetDeviceInfo(device, CL_DRIVER_VERSION, 0, NULL, &size);
+
+    if (rv != CL_SUCCESS || !size)
+    {
+        return QString();
+    }
+
+    QByteArray version;
+    version.resize((int)(size) + 1);
+
+    rv = clGetDeviceInfo(device, CL_DRIVER_VERSION, version.size(),
+                         version.data(), NULL);
+
+    if (rv != CL_SUCCESS)
+    {
+        return QString();
+    }
+    version.data()[size] = '\0';
+
+    return version;
+}
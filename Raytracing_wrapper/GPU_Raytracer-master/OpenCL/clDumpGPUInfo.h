@@ -44,4 +44,11 @@ QString getPlatformName(cl_platform_id platform);
  */
 QString getDeviceName(cl_device_id device);
 
+/**
+ * @brief getDriverVersion: get the version of the driver of a device
+ * @param device: the device id
+ * @return: the driver version
+ */
+QString getDriverVersion(cl_device_id device);
+
 #endif // CLDUMPGPUINFO_H
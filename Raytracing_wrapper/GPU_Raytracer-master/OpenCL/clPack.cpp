@@ -0,0 +1,510 @@
+/*!
+    @file clPack.cpp
+    @desc: definitions of the OpenCL setup helpers
+    @author: yanli
+    @date: May 2013
+ */
+#include "clPack.h"
+#include "clDumpGPUInfo.h"
+#include "global.h"
+#include <QCoreApplication>
+#include <QCryptographicHash>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <iostream>
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+using std::endl;
+using std::cout;
+using std::cerr;
+
+#define MAX_CL_KERNELS 7 // Kernels of the wavefront
+#define CL_CACHE_SIZE_TAG "binary: " // Line of a cached program giving the
+                                     // size of its binary
+
+CLPack::CLPack()
+{
+    m_platform          = NULL;
+    m_context           = NULL;
+    m_queue             = NULL;
+    m_transferQueue     = NULL;
+    m_program           = NULL;
+    m_uiDevCount        = 0;
+    m_device            = NULL;
+    m_kernelGenerate    = NULL;
+    m_kernelIntersect   = NULL;
+    m_kernelShade       = NULL;
+    m_kernelShadow      = NULL;
+    m_kernelAccumulate  = NULL;
+    m_kernelRefine      = NULL;
+    m_kernelResolve     = NULL;
+    m_cmPbo             = NULL;
+    m_cmOut[0]          = NULL;
+    m_cmOut[1]          = NULL;
+    m_localWorkSize     = 0;
+}
+
+/**
+ * @brief createContext: create a context and a queue on the first device of
+ *                       a type that takes them
+ * @param cl: the package, should be returned
+ * @param type: the device type
+ * @return: true for success and false for failure
+ */
+static bool createContext(CLPack& cl, cl_device_type type)
+{
+
+    QVector<cl_platform_id> platforms = getPlatformList();
+    for (int p = 0; p < platforms.size(); p++)
+    {
+        QVector<cl_device_id> devices = getDeviceList(platforms[p], type);
+        for (int d = 0; d < devices.size(); d++)
+        {
+            cl_context_properties props[] = {
+                CL_CONTEXT_PLATFORM, (cl_context_properties)platforms[p],
+                0};
+
+            cl_int ciErrNum;
+            cl_device_id device = devices[d];
+            cl_context context  = clCreateContext(props, 1, &device, NULL,
+                                                  NULL, &ciErrNum);
+            if (ciErrNum != CL_SUCCESS || !context)
+                continue;
+
+            cl_command_queue queue = clCreateCommandQueue(context, device, 0,
+                                                          &ciErrNum);
+            if (ciErrNum != CL_SUCCESS)
+            {
+                clReleaseContext(context);
+                continue;
+            }
+
+            cl.m_platform   = platforms[p];
+            cl.m_deviceList = devices;
+            cl.m_uiDevCount = devices.size();
+            cl.m_device     = device;
+            cl.m_context    = context;
+            cl.m_queue      = queue;
+            if (!createTransferQueue(cl))
+            {
+                clReleaseCommandQueue(queue);
+                clReleaseContext(context);
+                cl = CLPack();
+                continue;
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+bool initHeadlessCL(CLPack& cl, cl_device_type type)
+{
+
+    bool found;
+    if (type == CL_DEVICE_TYPE_DEFAULT)
+        found = createContext(cl, CL_DEVICE_TYPE_GPU) ||
+                createContext(cl, CL_DEVICE_TYPE_CPU) ||
+                createContext(cl, CL_DEVICE_TYPE_ALL);
+    else
+        found = createContext(cl, type);
+
+    if (!found)
+    {
+        cerr << "No OpenCL device available in line:" << __LINE__
+             << ", File:" << __FILE__ << endl;
+        return false;
+    }
+
+    cout << "We are going to use:" << endl;
+    cout << getPlatformName(cl.m_platform).toStdString().c_str()
+         << ": " << getDeviceName(cl.m_device).toStdString().c_str() << endl;
+    return true;
+}
+
+bool createTransferQueue(CLPack& cl)
+{
+
+    assert(cl.m_context && cl.m_device);
+
+    cl_int ciErrNum;
+    cl.m_transferQueue = clCreateCommandQueue(cl.m_context, cl.m_device, 0,
+                                              &ciErrNum);
+    if (ciErrNum != CL_SUCCESS)
+    {
+        cerr << "Create transfer queue failed in line:" << __LINE__
+             << ", File:" << __FILE__ << endl;
+        cl.m_transferQueue = NULL;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief kernelSlots: get the kernel members of a package with their names
+ *                     in the program
+ * @param cl: the package
+ * @param kernels: the members, should be returned
+ * @param names: the names, should be returned
+ * @return: the number of kernels
+ */
+static int kernelSlots(CLPack& cl, cl_kernel** kernels, const char** names)
+{
+
+    kernels[0] = &cl.m_kernelGenerate;
+    names[0]   = "generateRays";
+    kernels[1] = &cl.m_kernelIntersect;
+    names[1]   = "intersectRays";
+    kernels[2] = &cl.m_kernelShade;
+    names[2]   = "shadeRays";
+    kernels[3] = &cl.m_kernelShadow;
+    names[3]   = "shadowRays";
+    kernels[4] = &cl.m_kernelAccumulate;
+    names[4]   = "accumulateSamples";
+    kernels[5] = &cl.m_kernelRefine;
+    names[5]   = "refinePixels";
+    kernels[6] = &cl.m_kernelResolve;
+    names[6]   = "resolvePixels";
+    return 7;
+}
+
+/**
+ * @brief buildProgram: build a program for the device of a package, the
+ *                      log is printed if it fails
+ * @param cl: the package, its program should be returned
+ * @param program: the program created from source or from a binary, NULL
+ *                 if it couldn't be created
+ * @param quiet: don't print the failures, the caller falls back
+ * @return: true for success and false for failure
+ */
+static bool buildProgram(CLPack& cl, cl_program program, bool quiet = false)
+{
+
+    if (!program)
+    {
+        if (!quiet)
+            cerr << "Create program failed in line:"
+                 << __LINE__ << ", File:" << __FILE__ << endl;
+        return false;
+    }
+
+    cl_int ciErrNum = clBuildProgram(program, 1, &cl.m_device,
+                                     CL_BUILD_OPTIONS, NULL, NULL);
+    if (ciErrNum != CL_SUCCESS)
+    {
+        if (!quiet)
+        {
+            cerr << "Build program failed in line:"
+                 << __LINE__ << ", File:" << __FILE__ << endl;
+
+            cerr << "The log is: " << endl;
+
+            size_t logSize;
+            clGetProgramBuildInfo(program, cl.m_device,
+                                  CL_PROGRAM_BUILD_LOG, 0, NULL, &logSize);
+            QByteArray buildLog(logSize + 1, '\0');
+            clGetProgramBuildInfo(program, cl.m_device,
+                                  CL_PROGRAM_BUILD_LOG, logSize,
+                                  buildLog.data(), NULL);
+            cout << buildLog.constData() << endl;
+        }
+        clReleaseProgram(program);
+        return false;
+    }
+
+    cl.m_program = program;
+    return true;
+}
+
+/**
+ * @brief getProgramKey: describe the program the sources build on the
+ *                       device of a package, a binary built for another
+ *                       description is never loaded
+ * @param cl: the package with a device
+ * @param sources: the sources of the program
+ * @param count: the number of sources
+ * @return: the description, a few lines of text
+ */
+static QByteArray getProgramKey(CLPack& cl,
+                                const QByteArray* sources,
+                                int count)
+{
+
+    QCryptographicHash sourceHash(QCryptographicHash::Sha1);
+    for (int i = 0; i < count; i++)
+        sourceHash.addData(sources[i]);
+
+    QByteArray key;
+    key.append("device: " + getDeviceName(cl.m_device).toUtf8() + "\n");
+    key.append("driver: " + getDriverVersion(cl.m_device).toUtf8() + "\n");
+    key.append("options: " CL_BUILD_OPTIONS "\n");
+    key.append("source: " + sourceHash.result().toHex() + "\n");
+    return key;
+}
+
+/**
+ * @brief loadCachedProgram: build the program of a package from a cached
+ *                           binary. The file starts with the key it was
+ *                           built for and the size of the binary, followed
+ *                           by an empty line and the binary
+ * @param cl: the package, its program should be returned
+ * @param key: the description of the program, see getProgramKey()
+ * @param cacheFile: path to the cached binary
+ * @return: true for success, false if there is no binary or it doesn't
+ *          match
+ */
+static bool loadCachedProgram(CLPack& cl,
+                              const QByteArray& key,
+                              const QString& cacheFile)
+{
+
+    QFile file(cacheFile);
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+    QByteArray data = file.readAll();
+
+    int headerEnd = data.indexOf("\n\n", key.size());
+    if (!data.startsWith(key) || headerEnd < 0)
+    {
+        cout << "Cached program \"" << qPrintable(cacheFile)
+             << "\" doesn't match, building from source" << endl;
+        return false;
+    }
+
+    // A binary of another size than its header gives is never handed to
+    // the driver, some accept a truncated one
+    QByteArray sizeLine = data.mid(key.size(), headerEnd - key.size());
+    int binaryStart = headerEnd + 2;
+    bool sizeRead = false;
+    qulonglong binarySize = 0;
+    if (sizeLine.startsWith(CL_CACHE_SIZE_TAG))
+        binarySize = sizeLine.mid(strlen(CL_CACHE_SIZE_TAG)).toULongLong(
+                    &sizeRead);
+    if (!sizeRead || binarySize == 0 ||
+        binarySize != (qulonglong)(data.size() - binaryStart))
+    {
+        cout << "Cached program \"" << qPrintable(cacheFile)
+             << "\" is incomplete, building from source" << endl;
+        return false;
+    }
+
+    const unsigned char* binary =
+            (const unsigned char*)data.constData() + binaryStart;
+    size_t binaryLength = binarySize;
+    cl_int binaryStatus;
+    cl_int ciErrNum;
+    cl_program program = clCreateProgramWithBinary(cl.m_context,
+                                                   1,
+                                                   &cl.m_device,
+                                                   &binaryLength,
+                                                   &binary,
+                                                   &binaryStatus,
+                                                   &ciErrNum);
+    if (ciErrNum != CL_SUCCESS || binaryStatus != CL_SUCCESS)
+        program = NULL;
+
+    if (!buildProgram(cl, program, true))
+    {
+        cout << "Cached program \"" << qPrintable(cacheFile)
+             << "\" was rejected by the driver, building from source"
+             << endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief saveCachedProgram: write the binary of the program of a package
+ *                           to the cache, failures only cost the next
+ *                           start its build. The file is written under a
+ *                           temporary name and renamed into place, so a
+ *                           reader never sees it half written
+ * @param cl: the package with a built program
+ * @param key: the description of the program, see getProgramKey()
+ * @param cacheFile: path to the cached binary
+ */
+static void saveCachedProgram(CLPack& cl,
+                              const QByteArray& key,
+                              const QString& cacheFile)
+{
+
+    // The program is built for the one device of the package
+    size_t binarySize = 0;
+    cl_int ciErrNum = clGetProgramInfo(cl.m_program,
+                                       CL_PROGRAM_BINARY_SIZES,
+                                       sizeof(size_t), &binarySize, NULL);
+    if (ciErrNum != CL_SUCCESS || binarySize == 0)
+    {
+        cout << "The driver gives no program binary to cache" << endl;
+        return;
+    }
+
+    QByteArray data = key + CL_CACHE_SIZE_TAG +
+            QByteArray::number((qulonglong)binarySize) + "\n\n";
+    int binaryStart = data.size();
+    data.resize(binaryStart + binarySize);
+    unsigned char* binary = (unsigned char*)data.data() + binaryStart;
+    ciErrNum = clGetProgramInfo(cl.m_program, CL_PROGRAM_BINARIES,
+                                sizeof(unsigned char*), &binary, NULL);
+
+    // Every process writes its own temporary file
+    QString tempFile = cacheFile + "." +
+            QString::number(QCoreApplication::applicationPid()) + ".tmp";
+    QFile file(tempFile);
+    bool written = ciErrNum == CL_SUCCESS && QDir().mkpath(CL_CACHE_DIR) &&
+            file.open(QIODevice::WriteOnly) &&
+            file.write(data) == data.size();
+    file.close();
+
+    if (!written || rename(qPrintable(tempFile), qPrintable(cacheFile)) != 0)
+    {
+        cerr << "Could not cache the program in \""
+             << qPrintable(cacheFile) << "\"" << endl;
+        QFile::remove(tempFile);
+    }
+}
+
+bool buildCLKernels(CLPack& cl, const char* sourceFile)
+{
+
+    assert(cl.m_context && cl.m_device);
+
+    // The shared header comes first, the kernels call into it
+    const char* files[2] = {CL_SHARED_SOURCE, sourceFile};
+    QByteArray sources[2];
+    for (int i = 0; i < 2; i++)
+    {
+        QFile file(files[i]);
+        if (!file.open(QIODevice::ReadOnly))
+        {
+            cerr << "Could not read the kernel source \"" << files[i]
+                 << "\"" << endl;
+            return false;
+        }
+        sources[i] = file.readAll();
+    }
+
+    // A cached binary is only taken for the very program the sources build
+    QElapsedTimer timer;
+    timer.start();
+    QByteArray key     = getProgramKey(cl, sources, 2);
+    QByteArray keyHash = QCryptographicHash::hash(key,
+                                                  QCryptographicHash::Sha1);
+    QString cacheFile  = QDir(CL_CACHE_DIR).filePath(keyHash.toHex() +
+                                                     ".bin");
+    bool cached = settings.useProgramCache &&
+            loadCachedProgram(cl, key, cacheFile);
+
+    if (!cached)
+    {
+        const char* sourceData[2] = {sources[0].constData(),
+                                     sources[1].constData()};
+        size_t sourceLength[2]    = {(size_t)sources[0].size(),
+                                     (size_t)sources[1].size()};
+        if (!buildProgram(cl, clCreateProgramWithSource(cl.m_context,
+                                                        2,
+                                                        sourceData,
+                                                        sourceLength,
+                                                        NULL)))
+            return false;
+        if (settings.useProgramCache)
+            saveCachedProgram(cl, key, cacheFile);
+    }
+    cout << "Program " << (cached ? "loaded from the binary cache" :
+                                    "built from source")
+         << " in " << timer.elapsed() << " ms" << endl;
+
+    cl_int ciErrNum;
+    cl_kernel* kernels[MAX_CL_KERNELS];
+    const char* names[MAX_CL_KERNELS];
+    int kernelCount = kernelSlots(cl, kernels, names);
+
+    // Every stage runs with the same group size, the smallest the kernels
+    // allow
+    cl.m_localWorkSize = GPU_LOCAL_WORK_SIZE;
+    for (int i = 0; i < kernelCount; i++)
+    {
+        *kernels[i] = clCreateKernel(cl.m_program, names[i], &ciErrNum);
+        if (ciErrNum != CL_SUCCESS)
+        {
+            cerr << "Create kernel " << names[i] << " failed in line:"
+                 << __LINE__ << ", File:" << __FILE__ << endl;
+            *kernels[i] = NULL;
+            return false;
+        }
+
+        size_t maxGroupSize = 0;
+        clGetKernelWorkGroupInfo(*kernels[i], cl.m_device,
+                                 CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t),
+                                 &maxGroupSize, NULL);
+        while (maxGroupSize > 0 && cl.m_localWorkSize > maxGroupSize)
+            cl.m_localWorkSize >>= 1;
+    }
+
+    cout << "Local work size " << cl.m_localWorkSize << endl;
+    return true;
+}
+
+bool createCLOutput(CLPack& cl, int width, int height)
+{
+
+    assert(cl.m_context);
+
+    for (int i = 0; i < 2; i++)
+    {
+        cl_int ciErrNum;
+        cl.m_cmOut[i] = clCreateBuffer(cl.m_context,
+                                       CL_MEM_WRITE_ONLY,
+                                       width * height * sizeof(cl_uint),
+                                       NULL,
+                                       &ciErrNum);
+        if (ciErrNum != CL_SUCCESS)
+        {
+            cerr << "Create output buffer failed in line:" << __LINE__
+                 << ", File:" << __FILE__ << endl;
+            cl.m_cmOut[i] = NULL;
+            return false;
+        }
+    }
+    return true;
+}
+
+void releaseCLPack(CLPack& cl)
+{
+
+    if (cl.m_queue)
+    {
+        clFinish(cl.m_queue);
+        clReleaseCommandQueue(cl.m_queue);
+    }
+    if (cl.m_transferQueue)
+    {
+        clFinish(cl.m_transferQueue);
+        clReleaseCommandQueue(cl.m_transferQueue);
+    }
+
+    cl_kernel* kernels[MAX_CL_KERNELS];
+    const char* names[MAX_CL_KERNELS];
+    int kernelCount = kernelSlots(cl, kernels, names);
+    for (int i = 0; i < kernelCount; i++)
+    {
+        if (*kernels[i])
+            clReleaseKernel(*kernels[i]);
+    }
+    if (cl.m_program)
+        clReleaseProgram(cl.m_program);
+    if (cl.m_cmPbo)
+        clReleaseMemObject(cl.m_cmPbo);
+    for (int i = 0; i < 2; i++)
+    {
+        if (cl.m_cmOut[i])
+            clReleaseMemObject(cl.m_cmOut[i]);
+    }
+    if (cl.m_context)
+        clReleaseContext(cl.m_context);
+
+    cl = CLPack();
+}
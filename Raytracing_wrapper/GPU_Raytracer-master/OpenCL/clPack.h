@@ -0,0 +1,109 @@
+/*!
+    @file clPack.h
+    @desc: the OpenCL objects of the GPU tracer and the helpers setting them
+           up, shared by the GL view and the headless batch renderer
+    @author: yanli
+    @date: May 2013
+ */
+#ifndef CLPACK_H
+#define CLPACK_H
+
+#include "CL/cl.h"
+#include <QVector>
+
+#define CL_RAYTRACE_SOURCE "./OpenCL/shader/raytraceGPU.cl" // Kernel source
+#define CL_SHARED_SOURCE "./intersect/shape_math.h" // Shape math of both
+                                                    // tracers, built in
+                                                    // front of the kernels
+#define CL_BUILD_OPTIONS "" // Options of the program build
+#define CL_CACHE_DIR "./OpenCL/cache" // Directory of the program binaries
+
+/**
+ * @struct: CLPack
+ * @brief The CLPack struct is merely used for storing OpenCL platform informations
+ */
+struct CLPack
+{
+    CLPack();
+
+    cl_platform_id m_platform;
+    cl_context m_context;
+    cl_command_queue m_queue;
+    cl_command_queue m_transferQueue; // Uploads and read backs, beside the
+                                      // kernels of m_queue
+    cl_program m_program;
+    cl_uint m_uiDevCount;
+    cl_device_id m_device;
+    cl_kernel m_kernelGenerate; // Pushes the rays of the pixels
+    cl_kernel m_kernelIntersect; // Finds the closest hits of a queue
+    cl_kernel m_kernelShade; // Shades the hits and pushes the next bounce
+    cl_kernel m_kernelShadow; // Lights the hits into the samples
+    cl_kernel m_kernelAccumulate; // Adds the samples to the pixels
+    cl_kernel m_kernelRefine; // Marks the pixels to supersample
+    cl_kernel m_kernelResolve; // Averages the pixels into the output
+
+    cl_mem m_cmPbo; // Pixel buffer shared with GL, NULL when headless
+    cl_mem m_cmOut[2]; // Plain output buffers, one per frame in flight,
+                       // NULL when the view uses the PBO
+
+    size_t m_localWorkSize; // Work group size of every kernel
+
+    QVector<cl_device_id> m_deviceList;
+};
+
+/**
+ * @brief initHeadlessCL: create a context and a queue without GL sharing.
+ *                        The platforms are searched in order for a device of
+ *                        the type, CL_DEVICE_TYPE_DEFAULT takes a GPU if
+ *                        there is one and a CPU implementation otherwise
+ * @param cl: the package, should be returned
+ * @param type: the device type
+ * @return: true for success and false for failure
+ */
+bool initHeadlessCL(CLPack& cl, cl_device_type type);
+
+/**
+ * @brief createTransferQueue: create the second queue of the package, the
+ *                             buffers are written and read on it while the
+ *                             kernels run on the first
+ * @param cl: the package with a context and a device
+ * @return: true for success and false for failure
+ */
+bool createTransferQueue(CLPack& cl);
+
+/**
+ * @brief buildCLKernels: build the ray tracing program and create the kernels
+ *                        of its wavefront. The program is the shape math of
+ *                        CL_SHARED_SOURCE followed by the kernel source, the
+ *                        C++ tracer compiles the same file. With
+ *                        settings.useProgramCache the binary built last for
+ *                        the same device, driver, options and sources is
+ *                        loaded from CL_CACHE_DIR instead, the source is
+ *                        built and cached when none matches. The kernels are
+ *                        one dimensional,
+ *                        the local work size is shrunk to fit every one of
+ *                        them, CPU implementations often have smaller groups
+ * @param cl: the package with a context and a device
+ * @param sourceFile: path to the kernel source
+ * @return: true for success and false for failure
+ */
+bool buildCLKernels(CLPack& cl, const char* sourceFile);
+
+/**
+ * @brief createCLOutput: create the plain output buffers of a headless image,
+ *                        a frame is read back from one while the next is
+ *                        traced into the other
+ * @param cl: the package with a context
+ * @param width: width of the image
+ * @param height: height of the image
+ * @return: true for success and false for failure
+ */
+bool createCLOutput(CLPack& cl, int width, int height);
+
+/**
+ * @brief releaseCLPack: release every object of the package
+ * @param cl: the package
+ */
+void releaseCLPack(CLPack& cl);
+
+#endif // CLPACK_H
@@ -3,6 +3,10 @@
  @file raytraceGPU.cl
  @desc: this is the sole shader file which mocks all of the computations
         in CPU side. It may look like a duplicate but shader file must be separate.
+        The intersection and inside tests of the unit primitives, the slab
+        test, the sample offsets and the lighting terms of a light are not
+        duplicated, they come from intersect/shape_math.h, which the program
+        is built with in front of this file.
         This file uses the same syntax as C language but the structure definitions
         are all from OpenCL's library. On GPU side, the computation basically just
         distribute the same computation into different computing unit of GPU. So 
@@ -29,10 +33,26 @@
 #define INVALID_POS ((float4)(-1, -1, -1, -1))
 #define INVALID_DIR ((float4)(0, 0, 0, 0))
 
-#define MAX_RAY        128
 #define MAX_INDEX_MAP  10
 #define MAX_OBJECT_DST 100
 
+#define KD_LEAF       3 // Axis value of a kdtree leaf
+#define KD_STACK_SIZE 34 // Postponed kdtree nodes, one per level at most
+
+#define WAVEFRONT_RAY_COUNT     0 // Counters of the rays pushed to the two
+                                  // queues, one each
+#define WAVEFRONT_RECORD_COUNT  2 // Counter of the hits queued for the lights
+#define WAVEFRONT_REFINED_COUNT 3 // Counter of the pixels to supersample
+#define WAVEFRONT_DROPPED_COUNT 4 // Counter of the rays dropped from full
+                                  // queues, never reset
+#define FIXED_ONE 65536.f // One in the fixed point colors of the samples
+
+#define MIP_TILE_SHIFT 2 // A tile is 1 << MIP_TILE_SHIFT texels per side
+#define MIP_TILE_WIDTH (1 << MIP_TILE_SHIFT) // Texels per side of a tile
+#define MIP_TILE_SIZE (MIP_TILE_WIDTH * MIP_TILE_WIDTH) // Texels of a tile
+#define LOD_MIN_COSINE 0.01f // Smallest cosine of the incident angle a
+                             // texture footprint is stretched by
+
 // enum PRIMITIVE_TYPE: type of primitives
 enum PRIMITIVE_TYPE
 {
@@ -124,49 +144,57 @@ typedef struct
     int traceRecursion;
 	int useReflection;
     int useKdTree;
+    int maxSamples;
+    float sampleContrast;
+    int useMipmaps;
+    float4 kdBoxBegin;
+    float4 kdBoxSize;
 }GlobalSettingDevice;
 
 /**
  * @struct: KdTreeNodedevice
  * @brief The KdTreeNodeDevice struct is used for storing the kdtree node's data
-          in device
+          in device. It's the same 8 byte layout as KdFlatNode on the host:
+          data is the split position (as float) of an interior node or the
+          primitive offset of a leaf, the low 2 bits of flags are the axis
+          (KD_LEAF for leaves) and the upper bits are the right child index
+          or the primitive count. The left child is the next node
  */
 typedef struct
 {
-	float3 boxBegin;
-	float3 boxSize;
-	float split;
-
-	int leaf;
-	int axis;
-	int leftIndex;
-	int rightIndex;
-	int objIndex;	
+	uint data;
+	uint flags;
 } KdTreeNodeDevice;
 
-/**
- * @struct: ObjectNodedevice
- * @brief The ObjectNodeDevice struct is used for storing the object node's data
-          in device
- */
-typedef struct
-{
-	int objectIndex;
-	int nextNodeIndex;
-} ObjectNodeDevice;
-
 /**
  * @struct: Ray
- * @brief The Ray struct is used for storing the ray's information
+ * @brief The Ray struct is used for storing the ray's information in the
+          queues of the wavefront. The footprint of the ray is a cone, as
+          RayCone on the CPU side
  */
 typedef struct
 {
     float4 nextPos;
     float4 nextDir;
     float4 attenuation;
+    int pixel;
     int curIndex;
+    float coneWidth;
+    float coneSpread;
 } Ray;
 
+/**
+ * @struct: RayHit
+ * @brief The RayHit struct is used for storing the closest hit of a ray of
+          the queue, t is not positive for a miss
+ */
+typedef struct
+{
+    float t;
+    int object;
+    int face;
+} RayHit;
+
 // Sampler
 __constant sampler_t sampler = CLK_NORMALIZED_COORDS_TRUE | 
                                CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_LINEAR;
@@ -180,6 +208,9 @@ inline float16 transpose(float16 M);
 inline bool EQ4(float4 v1, float4 v2);
 inline bool EQ16(float16 m1, float16 m2);
 inline float getAxisElem4(float4 vec, int axis);
+inline ShapeVec toShapeVec(float4 v);
+inline ShapeVec toShapePoint(float4 pos);
+inline float3 fromShapeVec(ShapeVec v);
 
 // Forward declaration of regular functions
 void checkPos(
@@ -196,10 +227,29 @@ bool checkCylinder(float4 posInObjSpace );
 bool checkCone(float4 posInObjSpace);
 bool checkSphere(float4 posInObjSpace);
 bool boxContain(float3 start, float3 size, float3 pos);
-bool checkRange(float4 intersect, float4 range, int axis);
-void doIntersectRayKdBox(
+bool doIntersectRaySlabs(
     float4 eyePos,
-    float4 d,
+    float4 invD,
+    float3 lower,
+    float3 upper,
+    float* near,
+    float* far,
+    int* nearFace,
+    int* farFace
+);
+bool doIntersectRayKdBox(
+    float4 eyePos,
+    float4 invD,
+    float* near,
+    float* far,
+    int* nearFace,
+    int* farFace,
+    float3 boxStart,
+    float3 boxSize
+);
+bool doIntersectRayKdSlab(
+    float4 eyePos,
+    float4 invD,
     float* near,
     float* far,
     float3 boxStart,
@@ -217,8 +267,8 @@ float intersect(
     int* faceIndex,
     __global KdTreeNodeDevice* kdtreeNodes,
     int kdtreeNodeCount,
-    __global ObjectNodeDevice* objectNodes,
-    int objectNodeCount
+    __global int* kdtreePrims,
+    int kdtreePrimCount
 );
 
 float intersectLocal(
@@ -297,6 +347,25 @@ float2 getSphereIntersectTexCoord(
     float4 intersectPoint
 );
 
+float2 getIntersectTexCoord(
+    int type,
+    int faceIndex,
+    float4 intersectPoint
+);
+
+float getTextureLod(
+    int type,
+    int faceIndex,
+    float4 point,
+    float2 texCoord,
+    float4 d,
+    float3 norm,
+    float footprint,
+    float16 invTransform,
+    int width,
+    int height
+);
+
 float4 computeObjectColor(
     int objectIndex,
     __global ObjectDataDevice* objects,
@@ -311,51 +380,19 @@ float4 computeObjectColor(
 	float4 textureColor,
 	__global KdTreeNodeDevice* kdtreeNodes,
 	int kdtreeNodeCount,
-	__global ObjectNodeDevice* objectNodes,
-	int objectNodeCount
+	__global int* kdtreePrims,
+	int kdtreePrimCount
 );
 
-float4 getPixelColor(
-    float4 eyePos,
-    float4 d,
-    __global GlobalSettingDevice* globalSetting,
-    __global LightDataDevice* lightData,
-    int lightCount,
-    __global ObjectDataDevice* objectData,
-    int objectCount,
-    float4 globalData,
-    __global unsigned int* pixels,
-    int pixelCount,
-    __global unsigned int* offsets,
-    int offsetCount,
-    __global KdTreeNodeDevice* kdtreeNodes,
-    int kdtreeNodeCount,
-    __global ObjectNodeDevice* objectNodes,
-    int objectNodeCount
+void pushRay(
+    __global Ray* queue,
+    volatile __global int* counters,
+    int queueIndex,
+    int capacity,
+    Ray ray
 );
 
-__kernel void raytrace(
-    __global unsigned int* uiOutputImage,
-    unsigned int width,
-    unsigned int height,
-    __global GlobalSettingDevice* globalSetting,
-    __global LightDataDevice* lightData,
-    int lightCount,
-    __global ObjectDataDevice* objectData,
-    int objectCount,
-    float4 globalData,
-    float4 eyePos,
-    float eyeNear,
-    float16 invMat,
-    __global unsigned int* pixels,
-    int pixelCount,
-    __global unsigned int* offsets,
-    int offsetCount,
-    __global KdTreeNodeDevice* kdtreeNodes,
-    int kdtreeNodeCount,
-    __global ObjectNodeDevice* objectNodes,
-    int objectNodeCount
-);
+float2 getSampleOffset(int index, int sample, int maxSamples);
 
 /**
  * @brief rgbaFloat4ToUint: convert rgba from float4 format to unsigned int
@@ -392,13 +429,38 @@ inline float4 rgbaUintToFloat4(unsigned int rgba)
 }
 
 /**
- * @brief bilinearInterpTexel: bilinear interpolation on texels
+ * @brief getMipTexel: get a texel of a mip level, the level is stored in
+          tiles of MIP_TILE_WIDTH x MIP_TILE_WIDTH texels like in MipTexture
+ * @param texPixels: buffer holding texture pixels
+ * @param offset: starting point of the level in the buffer
+ * @param tilesPerRow: tiles per row of the level
+ * @param x: column of the texel
+ * @param y: row of the texel
+ * @return: the texel
+ */
+inline unsigned int getMipTexel(
+    __global unsigned int* texPixels,
+    int offset,
+    int tilesPerRow,
+    int x,
+    int y
+)
+{
+    int tile = (y >> MIP_TILE_SHIFT) * tilesPerRow + (x >> MIP_TILE_SHIFT);
+    return texPixels[offset + tile * MIP_TILE_SIZE +
+        ((y & (MIP_TILE_WIDTH - 1)) << MIP_TILE_SHIFT) +
+        (x & (MIP_TILE_WIDTH - 1))];
+}
+
+/**
+ * @brief bilinearInterpTexel: bilinear interpolation on the texels of a mip
+          level
  * @param texPixels: buffer holding texture pixels
  * @param x: x position
  * @param y: y position
- * @param width: width of the texture
- * @param height: height of the texture
- * @param offset: starting point in the texture
+ * @param width: width of the level
+ * @param height: height of the level
+ * @param offset: starting point of the level in the buffer
  * @return: the color after interpolation
  */
 float4 bilinearInterpTexel(
@@ -421,31 +483,82 @@ float4 bilinearInterpTexel(
 
 	int X = (int)x;
 	int Y = (int)y;
+	int X1 = min(X + 1, width - 1);
+	int Y1 = min(Y + 1, height - 1);
+	int tilesPerRow = (width + MIP_TILE_WIDTH - 1) >> MIP_TILE_SHIFT;
 	float s1 = x - X;
 	float s0 = 1.f - s1;
 	float t1 = y - Y;
 	float t0 = 1.f - t1;
-	unsigned int e1, e2, e3, e4;
 	float4 r1, r2, r3, r4;
 	float4 result;
-	e1 = e2 = e3 = e4 = 0;
-	e1 = texPixels[offset + Y * width + X];
-	if (Y + 1 <= height - 1)
-		e2 = texPixels[offset + (Y + 1) * width + X];
-	if (X  + 1 <= width -1)
-		e3 = texPixels[offset + (Y) * width + X + 1];
-	if (Y + 1 <= height - 1 && X + 1 <= width - 1)
-		e4 = texPixels[offset + (Y + 1) * width + X + 1];
-
-	r1 = rgbaUintToFloat4(e1);
-	r2 = rgbaUintToFloat4(e2);
-	r3 = rgbaUintToFloat4(e3);
-	r4 = rgbaUintToFloat4(e4);
+
+	r1 = rgbaUintToFloat4(getMipTexel(texPixels, offset, tilesPerRow, X, Y));
+	r2 = rgbaUintToFloat4(getMipTexel(texPixels, offset, tilesPerRow, X, Y1));
+	r3 = rgbaUintToFloat4(getMipTexel(texPixels, offset, tilesPerRow, X1, Y));
+	r4 = rgbaUintToFloat4(getMipTexel(texPixels, offset, tilesPerRow, X1, Y1));
 
 	result = s0 * (t0 * r1 + t1 * r2) + s1 * (t0 * r3 + t1 * r4);
     return result;
 }
 
+/**
+ * @brief getMipLevelSize: get the number of texels of a mip level, a whole
+          number of tiles
+ * @param width: width of the level
+ * @param height: height of the level
+ * @return: the number of texels
+ */
+inline int getMipLevelSize(int width, int height)
+{
+    return ((width + MIP_TILE_WIDTH - 1) >> MIP_TILE_SHIFT) *
+        ((height + MIP_TILE_WIDTH - 1) >> MIP_TILE_SHIFT) * MIP_TILE_SIZE;
+}
+
+/**
+ * @brief sampleMipTexture: trilinear lookup in the mip chain of a texture,
+          the levels follow each other from the full resolution down to a
+          single texel, every one half the size of the one before
+ * @param texPixels: buffer holding texture pixels
+ * @param texCoord: the uv coordinate
+ * @param width: width of the texture
+ * @param height: height of the texture
+ * @param offset: starting point of the texture in the buffer
+ * @param lod: level of detail, 0 is the full resolution
+ * @return: the color after interpolation
+ */
+float4 sampleMipTexture(
+    __global unsigned int* texPixels,
+    float2 texCoord,
+    int width,
+    int height,
+    int offset,
+    float lod
+)
+{
+    // Skip the levels finer than the level of detail
+    lod = max(lod, 0.f);
+    while (lod >= 1 && (width > 1 || height > 1))
+    {
+        offset += getMipLevelSize(width, height);
+        width   = max(width >> 1, 1);
+        height  = max(height >> 1, 1);
+        lod    -= 1;
+    }
+
+    float4 fine = bilinearInterpTexel(texPixels, texCoord.s0 * width,
+        texCoord.s1 * height, width, height, offset);
+    if (lod <= 0 || (width == 1 && height == 1))
+        return fine;
+
+    offset += getMipLevelSize(width, height);
+    width   = max(width >> 1, 1);
+    height  = max(height >> 1, 1);
+    float4 coarse = bilinearInterpTexel(texPixels, texCoord.s0 * width,
+        texCoord.s1 * height, width, height, offset);
+    return mix(fine, coarse, lod);
+}
+
 /**
  * @brief Det4x4: compute the determinant of the matrix 
  * @param M: the matrix
@@ -571,6 +684,37 @@ inline float getAxisElem4(float4 vec, int axis)
 		return -1;
 }
 
+/**
+ * @brief toShapeVec: convert a vector for the code shared with the CPU
+ * @param v: the vector
+ * @return: its x, y and z
+ */
+inline ShapeVec toShapeVec(float4 v)
+{
+    return shapeVec(v.x, v.y, v.z);
+}
+
+/**
+ * @brief toShapePoint: unhomogenize a position for the code shared with the
+          CPU
+ * @param pos: the position
+ * @return: the point
+ */
+inline ShapeVec toShapePoint(float4 pos)
+{
+    return shapeVec(pos.x / pos.w, pos.y / pos.w, pos.z / pos.w);
+}
+
+/**
+ * @brief fromShapeVec: convert a vector of the code shared with the CPU
+ * @param v: the vector
+ * @return: the vector
+ */
+inline float3 fromShapeVec(ShapeVec v)
+{
+    return (float3)(v.x, v.y, v.z);
+}
+
 /**
  * @brief getReflectionDir: get the reflection direction of the incident vector
  * @param norm: the normal vector
@@ -677,13 +821,7 @@ void checkPos(
  */
 bool checkCube(float4 posInObjSpace)
 {
-    float3 pos3 = (float3)(posInObjSpace.x / posInObjSpace.w,
-                            posInObjSpace.y / posInObjSpace.w,
-                            posInObjSpace.z / posInObjSpace.w
-                           );
-
-    return pos3.x < 0.5 && pos3.x > -0.5 && pos3.y < 0.5 &&
-     pos3.y > -0.5 && pos3.z < 0.5 && pos3.z > -0.5 ? true : false;
+    return shapeInsideCube(toShapePoint(posInObjSpace));
 }
 
 /**
@@ -694,14 +832,7 @@ bool checkCube(float4 posInObjSpace)
  */
 bool checkCylinder(float4 posInObjSpace )
 {
-    float3 pos3 = (float3)(posInObjSpace.x / posInObjSpace.w,
-                            posInObjSpace.y / posInObjSpace.w,
-                            posInObjSpace.z / posInObjSpace.w
-                           );
-
-    float3 pos3H = (float3)(pos3.x, 0, pos3.z);
-    return dot(pos3H, pos3H) < 0.25 && pos3.y > -0.5 && 
-    pos3.y < 0.5 ? true : false;
+    return shapeInsideCylinder(toShapePoint(posInObjSpace));
 }
 
 /**
@@ -711,19 +842,7 @@ bool checkCylinder(float4 posInObjSpace )
  */
 bool checkCone(float4 posInObjSpace)
 {
-    float3 pos3 = (float3)(posInObjSpace.x / posInObjSpace.w,
-                            posInObjSpace.y / posInObjSpace.w,
-                            posInObjSpace.z / posInObjSpace.w
-                           );
-
-
-    if (pos3.y > -0.5 && pos3.y < 0.5)
-    {
-        float3 pos3H = (float3)(pos3.x, 0, pos3.z);
-        float length = 0.25 - 0.5*pos3.y;
-        return dot(pos3H, pos3H) < (length * length) ? true : false;
-    }
-   return false;
+    return shapeInsideCone(toShapePoint(posInObjSpace));
 }
 
 /**
@@ -733,11 +852,7 @@ bool checkCone(float4 posInObjSpace)
  */
 bool checkSphere(float4 posInObjSpace)
 {
-    float3 pos3 = (float3)(posInObjSpace.x / posInObjSpace.w,
-                            posInObjSpace.y / posInObjSpace.w,
-                            posInObjSpace.z / posInObjSpace.w
-                           );
-    return dot(pos3, pos3) < 0.25 ? true : false;
+    return shapeInsideSphere(toShapePoint(posInObjSpace));
 }
 
 /**
@@ -757,97 +872,94 @@ bool boxContain(float3 start, float3 size, float3 pos)
 }
 
 /**
- * @brief checkRange: only used for KdNode intersecting test
- * @param intersect: the intersect point
- * @param range: 4-D range
- * @param axis: the axis, 0 for X, 1 for Y and 2 for Z
- * @return: the result of the condition test
+ * @brief doIntersectRaySlabs: intersect the line of a ray with the three
+          slabs of an axis aligned box, see shapeIntersectSlabs()
+ * @param eyePos: the eye position
+ * @param invD: the reciprocal of the direction
+ * @param lower: the lower corner of the box
+ * @param upper: the upper corner of the box
+ * @param *near: "t" value entering the box, should be returned
+ * @param *far: "t" value leaving the box, should be returned
+ * @param *nearFace: the face entering the box, axis * 2 for the plane
+          through the lower corner and axis * 2 + 1 for the upper one, should
+          be returned
+ * @param *farFace: the face leaving the box, should be returned
+ * @return: true if the line hits the box, the hits may be behind the eye
  */
-bool checkRange(float4 intersect, float4 range, int axis)
+bool doIntersectRaySlabs(
+    float4 eyePos,
+    float4 invD,
+    float3 lower,
+    float3 upper,
+    float* near,
+    float* far,
+    int* nearFace,
+    int* farFace
+)
 {
-    bool result = false;
-    switch(axis)
-    {
-    case 0: // X axis range
-        if (intersect.y >= range.x && intersect.y <= range.y &&
-                intersect.z >= range.z && intersect.z <= range.w)
-          result = true;
-        break;
-    case 1: // Y axis range
-        if (intersect.x >= range.x && intersect.x <= range.y &&
-                intersect.z >= range.z && intersect.z <= range.w)
-          result = true;
-        break;
-    case 2: // Z axis range
-        if (intersect.x >= range.x && intersect.x <= range.y &&
-                intersect.y >= range.z && intersect.y <= range.w)
-          result = true;
-        break;
-    default:
-        break;
-    }
-    return result;
+    return shapeIntersectSlabs(toShapeVec(eyePos), toShapeVec(invD),
+                               shapeVec(lower.x, lower.y, lower.z),
+                               shapeVec(upper.x, upper.y, upper.z),
+                               near, far, nearFace, farFace);
 }
 
 /**
  * @brief doIntersectRayKdBox: do the intersection detection with KdNode's bounding
-          box
+          box, a branchless slab test
  * @param eyePos: the eye position
- * @param d: the direction of the ray
- * @param *near: "t" value intersecting the near plane, should be returned
- * @param *far: "t" value intersecting the far plane, should be returned
+ * @param invD: the reciprocal of the direction
+ * @param *near: "t" value entering the box, should be returned
+ * @param *far: "t" value leaving the box, should be returned
+ * @param *nearFace: the face entering the box, see doIntersectRaySlabs(),
+          should be returned
+ * @param *farFace: the face leaving the box, should be returned
  * @param boxStart: box's starting corner position
  * @param boxSize: the 3-D size of the box
+ * @return: true if the ray hits the box in front of the eye, near is negative
+            when the eye is inside
  */
-void doIntersectRayKdBox(
+bool doIntersectRayKdBox(
     float4 eyePos,
-    float4 d,
+    float4 invD,
     float* near,
     float* far,
+    int* nearFace,
+    int* farFace,
     float3 boxStart,
     float3 boxSize
 )
 {
+    return doIntersectRaySlabs(eyePos, invD, boxStart, boxStart + boxSize,
+                               near, far, nearFace, farFace) && *far > 0;
+}
 
-    *near = -1;
-    *far  = -1;
-    float3 start = boxStart;
-    float3 end = boxStart + boxSize;
-    float3 norm[3] = {(float3)(1, 0, 0), (float3)(0, 1, 0), (float3)(0, 0, 1)};
-
-
-    float4 range[3] = {
-		(float4)(start.y, end.y, start.z, end.z),
-		(float4)(start.x, end.x, start.z, end.z),
-		(float4)(start.x, end.x, start.y, end.y)
-	};
-    float t[6];
-    t[0] = doIntersectPlane(start, norm[0], eyePos, d);
-    t[1] = doIntersectPlane(end, norm[0], eyePos, d);
-    t[2] = doIntersectPlane(start, norm[1], eyePos, d);
-    t[3] = doIntersectPlane(end, norm[1], eyePos, d);
-    t[4] = doIntersectPlane(start, norm[2], eyePos, d);
-    t[5] = doIntersectPlane(end, norm[2], eyePos, d);
-
-    float4 intersectPoint[6];
-    float min = POS_INF;
-    float max = -POS_INF;
-    for (int i = 0; i < 6; i++)
-    {
-        intersectPoint[i] = eyePos + t[i] * d;
-        if (t[i] > 0 && checkRange(intersectPoint[i], range[i / 2], i / 2) && 
-            min > t[i])
-        {
-            min   = t[i];
-            *near = t[i];
-        }
-        if (t[i] > 0 && checkRange(intersectPoint[i], range[i / 2], i / 2) && 
-            max < t[i])
-        {
-            max  = t[i];
-            *far = t[i];
-        }
-    }
+/**
+ * @brief doIntersectRayKdSlab: intersect the ray with the box's three slabs,
+          the cheap test used once per ray by kdtree traversal
+ * @param eyePos: the eye position
+ * @param invD: the reciprocal of the direction
+ * @param *near: "t" value entering the box, should be returned
+ * @param *far: "t" value leaving the box, should be returned
+ * @param boxStart: box's starting corner position
+ * @param boxSize: the 3-D size of the box
+ * @return: true if the ray hits the box in front of the eye
+ */
+bool doIntersectRayKdSlab(
+    float4 eyePos,
+    float4 invD,
+    float* near,
+    float* far,
+    float3 boxStart,
+    float3 boxSize
+)
+{
+    // Clip the line to the part in front of the eye
+    int nearFace, farFace;
+    doIntersectRaySlabs(eyePos, invD, boxStart, boxStart + boxSize,
+                        near, far, &nearFace, &farFace);
+    *near = fmax(*near, 0.f);
+    *far  = fmin(*far, (float)POS_INF);
+    return *near <= *far;
 }
 
 /**
@@ -861,15 +973,9 @@ void doIntersectRayKdBox(
  */
 float doIntersectPlane(float3 point, float3 norm, float4 eyePos, float4 d)
 {
-
-    float t = -1;
-    float denominator = (norm.x*d.x+norm.y*d.y+norm.z*d.z);
-    if (fabs(denominator)>EPSILON)
-    {
-        t = (dot(norm, point)-dot(norm, (float3)(eyePos.x, eyePos.y, eyePos.z)))/(denominator);
-    }
-
-    return t;
+    return shapeIntersectPlane(shapeVec(point.x, point.y, point.z),
+                               shapeVec(norm.x, norm.y, norm.z),
+                               toShapeVec(eyePos), toShapeVec(d));
 }
 
 /**
@@ -886,78 +992,14 @@ float doIntersectUnitCone(
     int *faceIndex
 )
 {
-	//!  cone has two parts, the bottom cap and the side.
-
-	float result = -1;
-	float3 norms[2];
-	float t[2];
-
-	// firstly check if the ray intersects the bottom;
-	t[0] = -1;
-	norms[0] = (float3)(0,-1,0);
-
-	t[0] = doIntersectPlane((float3)(0, -0.5, 0), norms[0], eyePos, d);
-	float4 intersect = eyePos + t[0] * d;
-	if (!(SQ(intersect.x) + SQ(intersect.z) <= 0.25))
-		t[0] = -1;
-
-	// then check the intersect point on the side
-	t[1] = -1;
-	float A = d.x * d.x + d.z * d.z - 0.25 * d.y * d.y;
-	float B = 2 * eyePos.x * d.x + 2 * eyePos.z * d.z -
-    0.5 * eyePos.y * d.y + 0.25 * d.y;
-	float C = eyePos.x * eyePos.x + eyePos.z * eyePos.z -
-    0.25 * eyePos.y * eyePos.y + 0.25 * eyePos.y - 0.0625;
-
-	float determinant = B * B - 4 * A * C;
-	if (determinant >= 0)
-	{
-		float t1 = (-B + sqrt(determinant)) / (2 * A);
-		float t2 = (-B - sqrt(determinant)) / (2 * A);
-
-		if (!(eyePos.y + t1 * d.y <= 0.5 + EPSILON
-			  &&eyePos.y + t1 * d.y >= -0.5 - EPSILON))
-		{
-			t1 = -1;
-		}
-
-		if (!(eyePos.y + t2 * d.y <= 0.5 + EPSILON
-			  &&eyePos.y + t2 * d.y >= -0.5 - EPSILON))
-		{
-			t2 = -1;
-		}
-
-		if (t1 > 0 && t2 <= 0)
-			t[1] = t1;
-		else if (t1 <= 0 && t2 >0)
-			t[1] = t2;
-		else if (t1 > 0 && t2 >0)
-			t[1] = MIN(t1, t2);
-	}
-
-	intersect = eyePos + t[1] * d;
-	norms[1] = (float3)(2 * (intersect.x), 0.25 - 0.5 * (intersect.y),
-                        2 * (intersect.z));
-	norms[1] = fast_normalize(norms[1]);
-	float minT = POS_INF;
-	for (int i = 0; i < 2; i++)
-	{
-		if (t[i] > 0 && t[i] < minT)
-		{
-			minT = t[i];
-            *faceIndex = i;
-		}
-	}
-	if (minT != POS_INF)
-		result = minT;
-
-	return result;
+    return shapeIntersectUnitCone(toShapeVec(eyePos), toShapeVec(d),
+                                  faceIndex);
 }
 
 /**
  * @brief getConeNorm: get the normal vector of the intersecting
           point on unit cone
- * @param intersect: the intersection position         
+ * @param intersect: the intersection position
  * @param faceIndex: the face index of unit cone
  * @return: the normal vector
  */
@@ -966,13 +1008,7 @@ float3 getConeNorm(
         int faceIndex
        )
 {
-     float3 norms[2];
-      norms[0] = (float3)(0, -1, 0);
-      norms[1] = (float3)(2 * (intersect.x), 
-        0.25 - 0.5 * (intersect.y), 2 * (intersect.z));
-     norms[1] = fast_normalize(norms[1]);
-
-     return norms[faceIndex];
+    return fromShapeVec(shapeConeNorm(toShapeVec(intersect), faceIndex));
 }
 
 /**
@@ -1031,102 +1067,29 @@ float doIntersectUnitCube(
     int *faceIndex
 )
 {
-	//! Cube has six faces, we do intersection test in these six planes
-
-
-	float result = -1;
-
-	float3 norms[6];
-	// front
-	norms[0] = (float3)(0, 0, 1);
-	// back
-	norms[1] = (float3)(0, 0, -1);
-	// left
-	norms[2] = (float3)(-1, 0, 0);
-	// right
-	norms[3] = (float3)(1, 0, 0);
-	// top
-	norms[4] = (float3)(0, 1, 0);
-	// down
-	norms[5] = (float3)(0, -1, 0);
-
-	float3 points[6];
-	// front
-	points[0] = (float3)(0, 0, 0.5);
-	// back
-	points[1] = (float3)(0, 0, -0.5);
-	// left
-	points[2] = (float3)(-0.5, 0, 0);
-	// right
-	points[3] = (float3)(0.5, 0, 0);
-	// top
-	points[4] = (float3)(0, 0.5, 0);
-	// bottom
-	points[5] = (float3)(0, -0.5, 0);
-
-
-	float t[6];
-	for (int i = 0; i < 6; i++)
-	{
-		t[i] = doIntersectPlane(points[i], norms[i], eyePos,d);
-	}
-
-	float4 intersect = eyePos + t[0] * d;
-
-	if (!(intersect.y <= 0.5 + EPSILON
-		 &&intersect.y >= -0.5 - EPSILON
-		 &&intersect.x >= -0.5 - EPSILON
-		 &&intersect.x <= 0.5 + EPSILON))
-		t[0] = -1;
-	intersect = eyePos + t[1] * d;
-	if (!(intersect.y <= 0.5 + EPSILON
-		 &&intersect.y >= -0.5 - EPSILON
-		 &&intersect.x >= -0.5 - EPSILON
-		 &&intersect.x <= 0.5 + EPSILON))
-		t[1] = -1;
-
-	intersect = eyePos + t[2] * d;
-	if (!(intersect.y <= 0.5 + EPSILON
-		 &&intersect.y >= -0.5 - EPSILON
-		 &&intersect.z >= -0.5 - EPSILON
-		 &&intersect.z <= 0.5 + EPSILON))
-		t[2] = -1;
-
-	intersect = eyePos + t[3] * d;
-	if (!(intersect.y <= 0.5 + EPSILON
-		 &&intersect.y >= -0.5 - EPSILON
-		 &&intersect.z >= -0.5 - EPSILON
-		 &&intersect.z <= 0.5 + EPSILON))
-		t[3] = -1;
-
-	intersect = eyePos + t[4] * d;
-	if (!(intersect.z <= 0.5 + EPSILON
-		 &&intersect.z >= -0.5 - EPSILON
-		 &&intersect.x>=-0.5 - EPSILON
-		 &&intersect.x <= 0.5 + EPSILON))
-		t[4] = -1;
-
-	intersect = eyePos + t[5] * d;
-	if (!(intersect.z <= 0.5 + EPSILON
-		 &&intersect.z >= -0.5 - EPSILON
-		 &&intersect.x >= -0.5 - EPSILON
-		 &&intersect.x <= 0.5 + EPSILON))
-		t[5] = -1;
-
-	float minT = POS_INF;
-
-	for (int i = 0; i < 6; i++)
-	{
-		if (t[i] > 0 && t[i] < minT)
-		{
-			minT = t[i];
-            *faceIndex = i;
-		}
-	}
-	if (minT != POS_INF)
-		result = minT;
-
-	return result;
+    // The cube's face index of each slab face: left, right, bottom, top,
+    // back and front
+    const int cubeFaces[6] = {2, 3, 5, 4, 1, 0};
+
+    float4 invD = (float4)(1.f / d.xyz, 0);
+    float near, far;
+    int nearFace, farFace;
+    if (!doIntersectRaySlabs(eyePos, invD, (float3)(-0.5f), (float3)(0.5f),
+                             &near, &far, &nearFace, &farFace))
+        return -1;
+
+    // From inside the cube the ray leaves through the far face
+    if (near > 0)
+    {
+        *faceIndex = cubeFaces[nearFace];
+        return near;
+    }
+    if (far > 0)
+    {
+        *faceIndex = cubeFaces[farFace];
+        return far;
+    }
+    return -1;
 }
 
 /**
@@ -1234,73 +1197,8 @@ float doIntersectUnitCylinder(
     int* faceIndex
 	)
 {
-	// Cylinder has three parts: top, bottom and side.
-	float result = -1;
-
-	float t[3];
-	float3 norms[3];
-
-	// firstly check if the ray intersects the bottom;
-	t[0] = -1;
-	norms[0] = (float3)(0, -1, 0);
-	t[0] = doIntersectPlane((float3)(0,- 0.5, 0), norms[0], eyePos, d);
-	float4 intersect = eyePos + t[0] * d;
-	if (t[0] != -1 && !(SQ(intersect.x) + SQ(intersect.z) <= 0.25))
-		t[0] = -1;
-
-	// secondly check if the ray intersects the top
-	t[1] = -1;
-	norms[1] = (float3)(0, 1, 0);
-	t[1] = doIntersectPlane((float3)(0, 0.5, 0), norms[1], eyePos, d);
-
-	intersect = eyePos + t[1] * d;
-	if (t[1] != -1 && !(SQ(intersect.x) + SQ(intersect.z) <= 0.25))
-		t[1] = -1;
-
-	// at last check if the ray intersects the side
-	t[2] = -1;
-	float A = d.x * d.x + d.z * d.z;
-	float B = 2 * eyePos.x * d.x + 2 * eyePos.z * d.z;
-	float C = eyePos.x * eyePos.x + eyePos.z * eyePos.z - 0.25;
-	float determinant = B * B - 4 * A * C;
-	if (determinant >= 0)
-	{
-		float t1 = (-B + sqrt(determinant)) / (2 * A);
-		float t2 = (-B - sqrt(determinant)) / (2 * A);
-
-		if (!(eyePos.y + t1 * d.y <= 0.5 + EPSILON && 
-            eyePos.y + t1 * d.y >= -0.5 - EPSILON))
-		{
-			t1 = -1;
-		}
-
-		if (!(eyePos.y + t2 * d.y <= 0.5 + EPSILON && 
-            eyePos.y + t2 * d.y >= -0.5 - EPSILON))
-		{
-			t2 = -1;
-		}
-		if (t1 > 0 && t2 <= 0)
-			t[2] = t1;
-		else if (t1 <= 0 && t2 > 0)
-			t[2] = t2;
-		else if (t1 > 0 && t2 > 0)
-			t[2] = MIN(t1, t2);
-	}
-
-	float minT = POS_INF;
-	for (int i = 0; i < 3; i++)
-	{
-		if (t[i]> 0 && t[i] < minT)
-		{
-			minT = t[i];
-            *faceIndex = i;
-		}
-	}
-
-	if (minT != POS_INF)
-		result = minT;
-
-	return result;
+    return shapeIntersectUnitCylinder(toShapeVec(eyePos), toShapeVec(d),
+                                      faceIndex);
 }
 
 /**
@@ -1315,12 +1213,8 @@ float3 getCylinderNorm(
     int faceIndex
 )
 {
-   float3 norms[3];
-    norms[0] = (float3)(0, -1, 0);
-    norms[1] = (float3)(0, 1, 0);
-    norms[2] = fast_normalize((float3)(intersectPoint.x, 0, intersectPoint.z));
-
-    return norms[faceIndex];
+    return fromShapeVec(shapeCylinderNorm(toShapeVec(intersectPoint),
+                                          faceIndex));
 }
 
 /**
@@ -1383,35 +1277,7 @@ float doIntersectUnitSphere(
     float4 d
 )
 {
-	// Sphere has only one part that needs to be checked!
-	float result = -1;
-
-	float t = -1;
-	float3 norms;
-	float A = d.x * d.x + d.y * d.y + d.z * d.z;
-	float B = 2 * eyePos.x * d.x + 2 * eyePos.y * d.y+ 2 * eyePos.z * d.z;
-	float C = eyePos.x * eyePos.x + eyePos.y * eyePos.y + 
-    eyePos.z * eyePos.z - 0.25;
-	float determinant = B * B - 4 * A * C;
-
-	if (determinant >= 0)
-	{
-		float t1 = (-B + sqrt(determinant)) / (2 * A);
-		float t2 = (-B - sqrt(determinant)) / (2 * A);
-		if (t1 > EPSILON && t2 <= EPSILON)
-			t = t1;
-		else if (t1 <= EPSILON && t2 > EPSILON)
-			t = t2;
-		else if (t1 > EPSILON&& t2 > EPSILON)
-			t = MIN(t1, t2);
-	}
-
-	if (t > 0)
-	{
-		result = t;
-	}
-
-	return result;
+    return shapeIntersectUnitSphere(toShapeVec(eyePos), toShapeVec(d));
 }
 
 /**
@@ -1424,11 +1290,7 @@ float3 getSphereNorm(
     float4 intersectPoint
 )
 {
-    float3 norm = (float3)(intersectPoint.x / intersectPoint.w,
-     intersectPoint.y / intersectPoint.w,
-     intersectPoint.z / intersectPoint.w);
-
-    return fast_normalize(norm);
+    return fromShapeVec(shapeSphereNorm(toShapePoint(intersectPoint)));
 }
 
 /**
@@ -1461,6 +1323,99 @@ float2 getSphereIntersectTexCoord(
     return texCoord;
 }
 
+/**
+ * @brief getIntersectTexCoord: get the texture coordinate of a point of an
+          object
+ * @param type: the type of the object
+ * @param faceIndex: the face the point is on
+ * @param intersectPoint: the point in object space
+ * @return: the uv coordinate, (-1, -1) for none
+ */
+float2 getIntersectTexCoord(
+    int type,
+    int faceIndex,
+    float4 intersectPoint
+)
+{
+    switch(type)
+    {
+    case PRIMITIVE_CUBE:
+        return getCubeIntersectTexCoord(faceIndex, intersectPoint);
+    case PRIMITIVE_CYLINDER:
+        return getCylinderIntersectTexCoord(faceIndex, intersectPoint);
+    case PRIMITIVE_CONE:
+        return getConeIntersectTexCoord(faceIndex, intersectPoint);
+    case PRIMITIVE_SPHERE:
+        return getSphereIntersectTexCoord(intersectPoint);
+    default:
+        return (float2)(-1, -1);
+    }
+}
+
+/**
+ * @brief getTextureLod: get the level of detail of a texture from the
+          footprint of a ray, the same as on the CPU side. The footprint is
+          a disk across the ray, on the surface it's stretched along the ray
+          by the incident angle. Its two axes are the ray differentials, the
+          texture coordinates one axis away from the hit give the texels
+          covered
+ * @param type: the type of the object hit
+ * @param faceIndex: the face hit
+ * @param point: the hit in object space
+ * @param texCoord: the uv coordinate of the hit
+ * @param d: direction of the ray
+ * @param norm: normal at the hit in world space
+ * @param footprint: width of the footprint at the hit
+ * @param invTransform: world to object transform of the object
+ * @param width: width of the texture
+ * @param height: height of the texture
+ * @return: the level of detail, 0 for the full resolution
+ */
+float getTextureLod(
+    int type,
+    int faceIndex,
+    float4 point,
+    float2 texCoord,
+    float4 d,
+    float3 norm,
+    float footprint,
+    float16 invTransform,
+    int width,
+    int height
+)
+{
+    float3 dir    = (float3)(d.x, d.y, d.z);
+    float cosine  = dot(dir, norm);
+    float3 along  = dir - norm * cosine;
+    if (dot(along, along) < EPSILON * EPSILON)
+    {
+        // A ray head on stretches no axis, any tangent will do
+        along = fabs(norm.x) < 0.5f ? cross((float3)(1, 0, 0), norm) :
+                                      cross((float3)(0, 1, 0), norm);
+    }
+    along         = normalize(along);
+    float3 across = cross(norm, along);
+    along        *= footprint / max(fabs(cosine), LOD_MIN_COSINE);
+    across       *= footprint;
+
+    float3 axes[2] = {along, across};
+    float texels   = 0;
+    for (int i = 0; i < 2; i++)
+    {
+        float4 axis = matMult(invTransform,
+            (float4)(axes[i].x, axes[i].y, axes[i].z, 0));
+        float2 delta = getIntersectTexCoord(type, faceIndex, point + axis) -
+            texCoord;
+
+        // The coordinates wrap around at the seams of the round objects
+        delta  = (delta - floor(delta + 0.5f)) * (float2)(width, height);
+        texels = max(texels, length(delta));
+    }
+
+    // Magnified textures are read at the full resolution
+    return texels > 1 ? log2(texels) : 0;
+}
+
 /**
  * @brief intersect: the wrapper for doing intersecting detection on
  *                   all possible objects
@@ -1473,8 +1428,8 @@ float2 getSphereIntersectTexCoord(
  * @param *faceIndex: return the face index
  * @param *kdtreeNodes: kdtree nodes
  * @param kdtreeNodeCount: number of kdtree nodes
- * @param objectNodes: object nodes
- * @param objectNodeCount: object node count
+ * @param kdtreePrims: object indices of the kdtree leaves
+ * @param kdtreePrimCount: number of object indices
  * @return: the 't' value
  */
 float intersect(
@@ -1487,8 +1442,8 @@ float intersect(
     int* faceIndex,
     __global KdTreeNodeDevice* kdtreeNodes,
     int kdtreeNodeCount,
-    __global ObjectNodeDevice* objectNodes,
-    int objectNodeCount
+    __global int* kdtreePrims,
+    int kdtreePrimCount
 )
 {
 	float minT = POS_INF;
@@ -1520,65 +1475,72 @@ float intersect(
 	}
 	else
 	{
+		// Clip the ray against the scene once, the nodes below only split
+		// the [near, far] segment at their planes
+		float4 invD = (float4)(1.f / d.x, 1.f / d.y, 1.f / d.z, 0);
 		float near, far;
-		KdTreeNodeDevice root = kdtreeNodes[0];
-		doIntersectRayKdBox(eyePos, d, &near, &far, root.boxBegin, root.boxSize);
-		if (near <= 0 && far <= 0)
+		if (!doIntersectRayKdSlab(eyePos, invD, &near, &far,
+            globalSetting->kdBoxBegin.xyz, globalSetting->kdBoxSize.xyz))
 			return -1;
 
-		int nodeStack[1024];
+		int nodeStack[KD_STACK_SIZE];
+		float nearStack[KD_STACK_SIZE];
+		float farStack[KD_STACK_SIZE];
 		int stackTop = 0;
-		int nextIndex = 0;
-		
-		while (nextIndex != -1)
+		int current = 0;
+
+		while (true)
 		{
-			KdTreeNodeDevice current = kdtreeNodes[nextIndex];
-			
-			while (!current.leaf)
+			KdTreeNodeDevice node = kdtreeNodes[current];
+
+			while ((node.flags & 3) != KD_LEAF)
 			{
-				float3 curBoxStart = current.boxBegin;
-				float3 curBoxSize = current.boxSize;
-				float near, far;
-				doIntersectRayKdBox(eyePos, d, &near, &far, curBoxStart, 
-                    curBoxSize);
-				int axis = current.axis;
-				float splitPos = current.split;
-				if (near == far)// inside the box
-					near = 0;
-				float4 nearPos = eyePos + d * near;
-				float4 farPos  = eyePos + d * far;
-				
-                if (getAxisElem4(nearPos, axis) <= splitPos )
+				int axis = node.flags & 3;
+				float splitPos = as_float(node.data);
+				float origin = getAxisElem4(eyePos, axis);
+				float dir = getAxisElem4(d, axis);
+
+				// The child on the eye's side of the plane comes first
+				int first = current + 1;
+				int second = node.flags >> 2;
+				if (origin > splitPos || (origin == splitPos && dir > 0))
 				{
-					if (getAxisElem4(farPos, axis) <= splitPos)
-					{
-                        current = kdtreeNodes[current.leftIndex];
-                        continue;
-                    }
-                    nodeStack[stackTop++] = current.rightIndex;
-                    current = kdtreeNodes[current.leftIndex];
-                }
-                else
-                {
-                   if (getAxisElem4(farPos, axis) > splitPos)
-                   {
-                    current = kdtreeNodes[current.rightIndex];
-                    continue;
-                   }
-                    nodeStack[stackTop++] = current.leftIndex;
-                    current = kdtreeNodes[current.rightIndex];
-                }
+					first = second;
+					second = current + 1;
+				}
+
+				float tSplit = dir != 0 ?
+                    (splitPos - origin) * getAxisElem4(invD, axis) : POS_INF;
+
+				if (tSplit > far || tSplit <= 0)
+				{
+					current = first;
+				}
+				else if (tSplit < near)
+				{
+					current = second;
+				}
+				else
+				{
+					// Preserve the far side
+					nodeStack[stackTop] = second;
+					nearStack[stackTop] = tSplit;
+					farStack[stackTop] = far;
+					stackTop++;
+
+					current = first;
+					far = tSplit;
+				}
+				node = kdtreeNodes[current];
             }
 
 		    // Then we found an near leaf, find if there is intersect
-            int objIndex = current.objIndex;
-
-            minT = POS_INF;
+            int primOffset = node.data;
+            int primCount  = node.flags >> 2;
 
-            while (objIndex != -1)
+            for (int i = 0; i < primCount; i++)
             {
-                ObjectNodeDevice objList = objectNodes[objIndex];
-                int sceneObjIndex = objList.objectIndex;
+                int sceneObjIndex = kdtreePrims[primOffset + i];
 
                 ObjectDataDevice curSceneObj = objectData[sceneObjIndex];
 
@@ -1595,35 +1557,24 @@ float intersect(
                    *objectIndex = sceneObjIndex;
                    *faceIndex = tempFaceIndex;
                 }
-                objIndex = objList.nextNodeIndex;
             }
 
+            // The postponed nodes are all behind this leaf, a hit inside the
+            // leaf's segment can't be beaten
+            if (minT <= far || stackTop == 0)
+                break;
 
-            float4 dst = (eyePos + minT * d);
-			// Here we need to enlarge the bounding box a little bit
-            float3 boxStart = current.boxBegin - 
-            (float3)(EPSILON, EPSILON, EPSILON);
-            
-            float3 boxSize = current.boxSize + 
-            2 * (float3)(EPSILON, EPSILON, EPSILON);
+            stackTop--;
+            current = nodeStack[stackTop];
+            near    = nearStack[stackTop];
+            far     = farStack[stackTop];
 
-            if (minT != POS_INF && boxContain(boxStart, boxSize, 
-                (float3)(dst.x, dst.y, dst.z)))
-            {
-                resultT = minT;
-                break;
-            }
-			// Else we need to get one node from the stack
-            if (stackTop == 0)
-            {
-				// No more nodes, meaning there is no intersect
+            // A hit from an earlier leaf may end before this node begins
+            if (minT < near)
                 break;
-            }
-            else
-            {
-                nextIndex = nodeStack[--stackTop];
-            }
         }
+        if (minT != POS_INF)
+            resultT = minT;
     }
     return resultT;
 }
@@ -1745,8 +1696,8 @@ float doIntersect(
  * @param textureColor: texture color at that point
  * @param *kdtreeNodes: kdtree nodes buffer
  * @param kdtreeNodeCount: number of kdtree node
- * @param objectNodes: object nodes buffer 
- * @param objectNodeCount: number of object nodes
+ * @param kdtreePrims: object indices of the kdtree leaves
+ * @param kdtreePrimCount: number of object indices
  * @return: the final color
  */
 float4 computeObjectColor(
@@ -1763,8 +1714,8 @@ float4 computeObjectColor(
 	float4 textureColor,
 	__global KdTreeNodeDevice* kdtreeNodes,
 	int kdtreeNodeCount,
-	__global ObjectNodeDevice* objectNodes,
-	int objectNodeCount
+	__global int* kdtreePrims,
+	int kdtreePrimCount
 )
 {
     ObjectDataDevice object = objects[objectIndex];
@@ -1777,6 +1728,8 @@ float4 computeObjectColor(
     // specular color, and reflective color(recursive)
     float4 lightSum = (float4)(0, 0, 0, 0);
 	float4 norm4 = (float4)(norm.x, norm.y, norm.z, 0);
+    ShapeVec shapeNorm  = toShapeVec(norm4);
+    ShapeVec shapeSight = toShapeVec(fast_normalize(eyePos - pos));
     for (int i = 0; i < lightCount; i++)
     {
         LightDataDevice currentLight = lights[i];
@@ -1787,11 +1740,10 @@ float4 computeObjectColor(
         if (currentLight.type != LIGHT_DIRECTIONAL)
         {
             // compute the attenuation
-            float dLight = sqrt(SQ(currentLight.pos.x - pos.x) + 
-                SQ(currentLight.pos.y - pos.y) + SQ(currentLight.pos.z - pos.z));
-            attenuation = MIN(1.0 / (currentLight.function.x + 
-                currentLight.function.y * dLight + 
-                currentLight.function.z * SQ(dLight)), 1);
+            float dLight;
+            attenuation = shapeLightAttenuation(toShapeVec(currentLight.pos),
+                toShapeVec(pos), shapeVec(currentLight.function.x,
+                currentLight.function.y, currentLight.function.z), &dLight);
         }
 
         float4 lightIntensity = currentLight.color;
@@ -1829,22 +1781,9 @@ float4 computeObjectColor(
 				lightDir = fast_normalize((currentLight.pos - pos));
 				float4 majorDir = -fast_normalize(currentLight.dir);
 
-				float lightRadians = currentLight.penumbra / 180.0 * M_PI;
-
-				float spotIntensity = dot(lightDir, majorDir);
-
-				// the object is not in the cone
-				if (spotIntensity < cos(lightRadians))
-				{
-					// the intersect point is out of the cone of the light, 
-                    // should not be lightted
-					lightIntensity.s0 = lightIntensity.s1 = lightIntensity.s2;
-				}
-				else
-				{
-					float temp = pow(spotIntensity, 5);
-					lightIntensity = temp * lightIntensity;
-				}
+				// 0 when the object is not in the cone
+				lightIntensity *= shapeSpotFactor(toShapeVec(lightDir),
+                    toShapeVec(majorDir), currentLight.penumbra);
 			}
 			else
 			{
@@ -1867,11 +1806,8 @@ float4 computeObjectColor(
         if (unapplicable)
             continue;
         
-        // in intersect assignment,
-        // this is used for checking if the object is in shadow
-        float dotLN = dot(lightDir, norm4);
-        if (dotLN < 0.0)
-            dotLN = 0.0;
+        ShapeVec shapeLightDir = toShapeVec(lightDir);
+        float dotLN = shapeDiffuseFactor(shapeLightDir, shapeNorm);
 
 		// Check if the object is in shadow of light
 		if (globalSetting->useShadow)
@@ -1885,13 +1821,13 @@ float4 computeObjectColor(
 				lightPos = currentLight.pos;
 				intersect(lightPos, globalSetting, objects, objectCount, 
                     -lightDir,  &objectIndex2, &faceIndex, kdtreeNodes, 
-                    kdtreeNodeCount, objectNodes, objectNodeCount);
+                    kdtreeNodeCount, kdtreePrims, kdtreePrimCount);
 			}
 			else
 			{
 				intersect(pos + (norm4)*EPSILON, globalSetting, objects, 
                     objectCount, (lightDir), &objectIndex2, &faceIndex, 
-                    kdtreeNodes, kdtreeNodeCount, objectNodes, objectNodeCount);
+                    kdtreeNodes, kdtreeNodeCount, kdtreePrims, kdtreePrimCount);
 			}
 			// this means the object is in shadow
 
@@ -1905,7 +1841,7 @@ float4 computeObjectColor(
 
         // compute diffuse light color
         // if using texture mapping, then blend the diffuse with diffuse color
-		if (globalSetting->showTexture && object.texHandle > 0)
+		if (globalSetting->showTexture && object.texWidth > 0)
 		{
 			lightSum += attenuation * lightIntensity * dotLN * (globalData.s1 *
                 ((object.diffuse*textureColor)));
@@ -1915,18 +1851,9 @@ float4 computeObjectColor(
 		    lightSum += attenuation * lightIntensity * dotLN * globalData.s1 * 
             (object.diffuse);
 		}
-		// No specular
-        // the following steps are computing the specular color
-        float4 sight = eyePos - pos;
-        sight = fast_normalize(sight);
-
-        float4 reflection = getReflectionDir(norm4, -lightDir);
-        float dotEN  = dot(sight, reflection);
-        if (dotEN < 0.0)
-        {
-            dotEN = 0.0;
-        }
-        dotEN = pow(dotEN, object.shininess);
+        // the specular color
+        float dotEN = shapeSpecularFactor(shapeLightDir, shapeNorm,
+            shapeSight, object.shininess);
         lightSum += attenuation * lightIntensity * dotEN * globalData.s2 * 
         object.specular;
     }
@@ -1942,362 +1869,585 @@ float4 computeObjectColor(
 }
 
 /**
- * @brief getPixelColor: compute the texture pixel color at the intersecting point
+ * @brief pushRay: append a ray to a queue, the rays beyond its capacity are
+ *                 dropped and counted
+ * @param *queue: the queue
+ * @param *counters: the counters of the wavefront
+ * @param queueIndex: which of the two queues it is
+ * @param capacity: number of rays the queue holds
+ * @param ray: the ray
+ */
+void pushRay(
+    __global Ray* queue,
+    volatile __global int* counters,
+    int queueIndex,
+    int capacity,
+    Ray ray
+)
+{
+    int slot = atomic_inc(&counters[WAVEFRONT_RAY_COUNT + queueIndex]);
+    if (slot < capacity)
+        queue[slot] = ray;
+    else
+        atomic_inc(&counters[WAVEFRONT_DROPPED_COUNT]);
+}
+
+/**
+ * @brief getSampleOffset: get where a sample lies in its pixel, see
+ *                         shapeSampleOffset()
+ * @param index: index of the pixel
+ * @param sample: index of the sample
+ * @param maxSamples: most samples of a pixel
+ * @return: offset from the center in [-0.5, 0.5)
+ */
+float2 getSampleOffset(int index, int sample, int maxSamples)
+{
+    float dx, dy;
+    shapeSampleOffset(index, sample, shapeSampleGridSize(maxSamples),
+                      &dx, &dy);
+    return (float2)(dx, dy);
+}
+
+/**
+ * @brief generateRays: the first stage of the wavefront, push a sample ray
+ *                      of every pixel of a wave to the first queue. Sample 0
+ *                      is the center of every pixel, the other samples are
+ *                      only traced for the pixels refineMask marks
+ * @param *rays: the first queue
+ * @param *counters: the counters of the wavefront
+ * @param capacity: number of rays the queue holds
+ * @param width: width of the image
+ * @param height: height of the image
+ * @param firstPixel: index of the first pixel of the wave
+ * @param pixelCount: number of pixels of the wave
+ * @param sample: index of the sample
+ * @param *globalSetting: global setting
+ * @param *refineMask: the pixels to supersample
  * @param eyePos: eye position
- * @param d: direction
- * @param *globalSetting: global setting data
- * @param *lightData: light data buffer
- * @param lightCount: number of lights
- * @param objectData: objects
+ * @param eyeNear: near plane position
+ * @param invMat: inverse of view matrix
+ */
+__kernel void generateRays(
+    __global Ray* rays,
+    volatile __global int* counters,
+    int capacity,
+    unsigned int width,
+    unsigned int height,
+    int firstPixel,
+    int pixelCount,
+    int sample,
+    __global GlobalSettingDevice* globalSetting,
+    __global int* refineMask,
+    float4 eyePos,
+    float eyeNear,
+    float16 invMat
+)
+{
+    int id = get_global_id(0);
+    if (id >= pixelCount)
+        return;
+
+    int index = firstPixel + id;
+    if (sample > 0 && !refineMask[index])
+        return;
+
+    float2 pos = (float2)((float)(index % width), (float)(index / width)) +
+        getSampleOffset(index, sample, globalSetting->maxSamples);
+
+    float4 pFilmCam = (float4)(((float)(2 * pos.x)) / width - 1,
+        1 - ((float)(2 * pos.y)) / height, -1, 1);
+    float4 pFilmWorld = matMult(invMat, pFilmCam);
+    float4 d = pFilmWorld - eyePos;
+
+    d = fast_normalize(d);
+
+    // The cone of the ray spans a pixel, its spread is the angle to the ray
+    // of the next pixel
+    float4 pNextWorld = matMult(invMat,
+        pFilmCam + (float4)(2.f / width, 0, 0, 0));
+    float spread = fast_length(fast_normalize(pNextWorld - eyePos) - d);
+
+    Ray ray;
+    ray.nextPos     = eyePos + d * eyeNear;
+    ray.nextDir     = d;
+    ray.attenuation = (float4)(1, 1, 1, 1);
+    ray.pixel       = index;
+    ray.curIndex    = -1;
+    ray.coneWidth   = spread * eyeNear;
+    ray.coneSpread  = spread;
+    pushRay(rays, counters, 0, capacity, ray);
+}
+
+/**
+ * @brief intersectRays: the intersection stage, find the closest hit of
+ *                       every ray of a queue. It is launched for the most
+ *                       rays the queue may hold, the items beyond the rays
+ *                       pushed return at once
+ * @param *rays: the queue of the rays
+ * @param *hits: the hits, one per ray
+ * @param *counters: the counters of the wavefront
+ * @param queue: which of the two queues the rays are in
+ * @param capacity: number of rays a queue holds
+ * @param primary: are they the center rays of the pixels?
+ * @param *firstObjects: objects hit by the center rays of the pixels
+ * @param *globalSetting: global setting
+ * @param *objectData: object data buffer
+ * @param objectCount: number of objects
+ * @param *kdtreeNodes: kdtree nodes buffer
+ * @param kdtreeNodeCount: number of kdtree node
+ * @param kdtreePrims: object indices of the kdtree leaves
+ * @param kdtreePrimCount: number of object indices
+ */
+__kernel void intersectRays(
+    __global Ray* rays,
+    __global RayHit* hits,
+    __global int* counters,
+    int queue,
+    int capacity,
+    int primary,
+    __global int* firstObjects,
+    __global GlobalSettingDevice* globalSetting,
+    __global ObjectDataDevice* objectData,
+    int objectCount,
+    __global KdTreeNodeDevice* kdtreeNodes,
+    int kdtreeNodeCount,
+    __global int* kdtreePrims,
+    int kdtreePrimCount
+)
+{
+    int id = get_global_id(0);
+    if (id >= min(counters[WAVEFRONT_RAY_COUNT + queue], capacity))
+        return;
+
+    Ray ray = rays[id];
+    int objectIndex = -1;
+    int faceIndex   = -1;
+    float t = intersect(ray.nextPos, globalSetting, objectData, objectCount,
+        ray.nextDir, &objectIndex, &faceIndex, kdtreeNodes, kdtreeNodeCount,
+        kdtreePrims, kdtreePrimCount);
+
+    // The refine pass compares the first hits of the neighbours
+    if (primary)
+        firstObjects[ray.pixel] = t > 0 ? objectIndex : -1;
+
+    RayHit hit;
+    hit.t      = t;
+    hit.object = objectIndex;
+    hit.face   = faceIndex;
+    hits[id]   = hit;
+}
+
+/**
+ * @brief shadeRays: the shading stage, find the normal and the texture color
+ *                   of every hit, queue the hit for the lights and push its
+ *                   reflected and refracted rays to the next queue. It is
+ *                   launched like intersectRays
+ * @param *rays: the queue of the rays
+ * @param *hits: the hits, one per ray
+ * @param queue: which of the two queues the rays are in, the next bounce
+ *               is pushed to the other
+ * @param *nextRays: the queue of the next bounce
+ * @param *shading: normal and texture color of the hits, two per ray
+ * @param *lightQueue: indices of the hits queued for the lights
+ * @param *counters: the counters of the wavefront
+ * @param capacity: number of rays a queue holds
+ * @param spawn: push the reflected and refracted rays?
+ * @param *globalSetting: global setting
+ * @param *objectData: object data buffer
  * @param objectCount: number of objects
  * @param globalData: global coefficient data
  * @param *pixels: texture pixels
  * @param pixelCount: number of texture pixels
  * @param *offsets: offset buffer
  * @param offsetCount: length of offsets
- * @param *kdtreeNodes: kdtree nodes buffer
- * @param kdtreeNodeCount: number of kdtree node
- * @param objectNodes: object nodes buffer 
- * @param objectNodeCount: number of object nodes
- * @return: the texture color
  */
-float4 getPixelColor(
-    float4 eyePos,
-    float4 d,
+__kernel void shadeRays(
+    __global Ray* rays,
+    __global RayHit* hits,
+    int queue,
+    __global Ray* nextRays,
+    __global float4* shading,
+    __global int* lightQueue,
+    volatile __global int* counters,
+    int capacity,
+    int spawn,
     __global GlobalSettingDevice* globalSetting,
-    __global LightDataDevice* lightData,
-    int lightCount,
     __global ObjectDataDevice* objectData,
     int objectCount,
     float4 globalData,
     __global unsigned int* pixels,
     int pixelCount,
     __global unsigned int* offsets,
-    int offsetCount,
-    __global KdTreeNodeDevice* kdtreeNodes,
-    int kdtreeNodeCount,
-    __global ObjectNodeDevice* objectNodes,
-    int objectNodeCount
+    int offsetCount
 )
 {
+    int id = get_global_id(0);
+    if (id >= min(counters[WAVEFRONT_RAY_COUNT + queue], capacity))
+        return;
+
+    RayHit hit = hits[id];
+    if (hit.t <= 0)
+        return;
+
+    Ray ray           = rays[id];
+    int objectIndex   = hit.object;
+    int faceIndex     = hit.face;
+    float t           = hit.t;
+    float4 curNextPos = ray.nextPos;
+    float4 curNextDir = ray.nextDir;
+
+    float4 texColor               = (float4)(0, 0, 0, 0);
+    float3 norm                   = (float3)(0, 1, 0);
+    float4 intersectPoint         = curNextPos + t * curNextDir;
+    float4 eyeSpaceIntersectPoint = matMult(
+        objectData[objectIndex].invTransform,curNextPos) +
+        t * matMult(objectData[objectIndex].invTransform, curNextDir);
+
+    switch(objectData[objectIndex].type)
+    {
+    case PRIMITIVE_CUBE:
+        norm = getCubeNorm(faceIndex);
+        break;
+    case PRIMITIVE_CYLINDER:
+        norm = getCylinderNorm(eyeSpaceIntersectPoint, faceIndex);
+        break;
+    case PRIMITIVE_CONE:
+        norm = getConeNorm(eyeSpaceIntersectPoint, faceIndex);
+        break;
+    case PRIMITIVE_SPHERE:
+        norm= getSphereNorm(eyeSpaceIntersectPoint);
+        break;
+    default:
+        break;
+    }
 
-	float4 result = (float4)(0, 0, 0, 0);
-    Ray rays[MAX_RAY];
-    rays[0].nextPos     = eyePos;
-    rays[0].nextDir     = d;
-    rays[0].curIndex    = -1;
-    rays[0].attenuation = (float4)(1, 1, 1, 1);
+    float4 tempNorm = (float4)(norm.s0, norm.s1, norm.s2, 0);
 
-    int last = 0;
-    int nextCount = 1;
-    for (int i = 0; i < globalSetting->traceRecursion; i++)
-	{
-		// No more rays
-		if (last == nextCount)
-			break;
+    tempNorm = matMult(objectData[objectIndex].invTTransformWithoutTrans,
+        tempNorm);
+    norm = (float3)(tempNorm.s0, tempNorm.s1, tempNorm.s2);
+    norm = fast_normalize(norm);
 
-		int curCount = nextCount;
-		for (int j = last; j < curCount; j++)
-		{
-			if (EQ4(rays[j].nextPos, INVALID_POS))
-				continue;
+    // The footprint has grown along the ray up to the hit
+    float footprint = ray.coneWidth + ray.coneSpread * t;
 
-			int objectIndex   = -1;
-			int faceIndex     = -1;
-			float4 curNextPos = rays[j].nextPos;
-			float4 curNextDir = rays[j].nextDir;
-			float t = intersect(curNextPos, globalSetting, objectData, 
-                objectCount, curNextDir, &objectIndex, 
-                &faceIndex, kdtreeNodes, kdtreeNodeCount, 
-                objectNodes, objectNodeCount);
-			
-            if (t > 0)
-			{
-                float4 colorNormal            = (float4)(0, 0, 0, 0);
-				float4 texColor               = (float4)(0, 0, 0, 0);
-				float3 norm                   = (float3)(0, 1, 0);
-				float4 intersectPoint         = curNextPos + t * curNextDir;
-				float4 eyeSpaceIntersectPoint = matMult(
-                    objectData[objectIndex].invTransform,curNextPos) + 
-                    t * matMult(objectData[objectIndex].invTransform, curNextDir);
-
-				switch(objectData[objectIndex].type)
-				{
-				case PRIMITIVE_CUBE: 
-                norm = getCubeNorm(faceIndex);
-                break;
-				case PRIMITIVE_CYLINDER: 
-                norm = getCylinderNorm(eyeSpaceIntersectPoint, faceIndex);
-                break;
-				case PRIMITIVE_CONE: 
-                norm = getConeNorm(eyeSpaceIntersectPoint, faceIndex);
-                break;
-				case PRIMITIVE_SPHERE:
-                norm= getSphereNorm(eyeSpaceIntersectPoint);
-                break;
-				case PRIMITIVE_MESH: 
-                break;
-				case PRIMITIVE_TORUS: 
-                break;
-				default:
-                break;
-				}
+    // Headless scenes have no GL textures, a loaded texture has a size
+    if (objectData[objectIndex].texWidth > 0 && globalSetting->showTexture)
+    {
+        float2 texCoord = getIntersectTexCoord(objectData[objectIndex].type,
+            faceIndex, eyeSpaceIntersectPoint);
 
-				if (objectData[objectIndex].texHandle > 0
-					&& globalSetting->showTexture)
-				{
-					float2 texCoord = (float2)(-1, -1);
-					switch(objectData[objectIndex].type)
-					{
-					case PRIMITIVE_CUBE: 
-                    texCoord = getCubeIntersectTexCoord(faceIndex, 
-                        eyeSpaceIntersectPoint);
-                    break;
-					case PRIMITIVE_CYLINDER: 
-                    texCoord = getCylinderIntersectTexCoord(faceIndex, 
-                        eyeSpaceIntersectPoint);
-                    break;
-					case PRIMITIVE_CONE: 
-                    texCoord = getConeIntersectTexCoord(faceIndex, 
-                        eyeSpaceIntersectPoint);
-                    break;
-					case PRIMITIVE_SPHERE: 
-                    texCoord = getSphereIntersectTexCoord(eyeSpaceIntersectPoint);
-                    break;
-					case PRIMITIVE_MESH: break;
-					case PRIMITIVE_TORUS: break;
-					default:break;
-					}
-
-					if (texCoord.s0 != -1 && texCoord.s1 != -1)
-					{
-						float xt = texCoord.s0 * objectData[objectIndex].texWidth;
-						float yt = texCoord.s1 * objectData[objectIndex].texHeight;
-						texColor = bilinearInterpTexel(
-                            pixels,
-							xt,
-							yt,
-							objectData[objectIndex].texWidth,
-							objectData[objectIndex].texHeight,
-							offsets[objectData[objectIndex].texMapID]);
-					}
-				}
-				
-                float4 tempNorm = (float4)(norm.s0, norm.s1, norm.s2, 0);
-
-				tempNorm = matMult(objectData[objectIndex].invTTransformWithoutTrans, 
-                    tempNorm);
-				norm = (float3)(tempNorm.s0, tempNorm.s1, tempNorm.s2);
-				norm = fast_normalize(norm);
-
-				colorNormal = computeObjectColor(objectIndex, objectData, 
-                    objectCount, lightData, lightCount, globalSetting, globalData,
-                    intersectPoint, norm, curNextPos, texColor, kdtreeNodes,
-                    kdtreeNodeCount, objectNodes, objectNodeCount);
-                
-                result += colorNormal * rays[j].attenuation;
-
-				if (globalSetting->useReflection)
-				{
-					bool zeroReflection = EQ4(objectData[objectIndex].reflective,
-                     (float4)(0, 0, 0, 0));
-
-					float projection = -(curNextDir.x * norm.x + 
-                        curNextDir.y * norm.y + curNextDir.z * norm.z);
-
-					if (projection > 0 && globalData.s2 > 0 && !zeroReflection)
-					{
-						float4 norm4 = (float4)(norm.x, norm.y, norm.z, 0);
-
-						float4 reflection = getReflectionDir(norm4, curNextDir);
-						rays[nextCount].nextPos = intersectPoint + 
-                        reflection * EPSILON;
-						rays[nextCount].nextPos.s3  = 1;
-						rays[nextCount].nextDir     = reflection;
-						rays[nextCount].curIndex    = rays[j].curIndex;
-						rays[nextCount].attenuation = rays[j].attenuation *
-                         objectData[objectIndex].reflective*globalData.s2;
-						nextCount++;
-					}
-
-					bool zeroRefraction = EQ4(objectData[objectIndex].transparent,
-                        0);
-					
-                    if (!zeroRefraction)
-					{
-						// Refracetion part
-						float n1, n2;
-						int curIndex = rays[j].curIndex;
-						if (curIndex != -1)
-						{
-							// The ray may be inside an object
-							n1 = objectData[curIndex].ior;
-							float3 normFace;
-							// bump the start point to be a little bit
-							if (curNextDir.x * norm.x + curNextDir.y * norm.y + 
-                                curNextDir.z*norm.z > 0)
-								normFace = (float3)(-norm.x, -norm.y, -norm.z);
-							else
-								normFace = norm;
-
-							int indexMap[MAX_INDEX_MAP];
-							int indexCount;
-							ObjectDataDevice list[MAX_OBJECT_DST];
-							int listCount;
-							float4 bumpPos = intersectPoint + (float4)(-normFace.x,
-                             -normFace.y, -normFace.z, 0) * EPSILON * 2;
-                
-							checkPos(objectData, objectCount, list, &listCount, 
-                                bumpPos, indexMap, &indexCount);
-							int dummyObjectIndex = -1, dummyFaceindex = -1;
-							float t2 = -1;
-							if (listCount != 0)
-								t2 = intersectLocal(bumpPos, list, listCount, 
-                                    (float4)(-normFace.x, -normFace.y, 
-                                        -normFace.z, 0), &dummyObjectIndex, 
-                                    &dummyFaceindex);
-							
-                            if (t2 > 0)
-							{
-								n2 = list[dummyObjectIndex].ior;
-								curIndex = indexMap[dummyObjectIndex];
-							}
-							else
-							{
-								// The ray is towards air
-								n2 = 1;
-								curIndex = -1;
-							}
-						}
-						else
-						{
-							// If curIndex == -1, then the ray is from air
-							n1       = 1;
-							n2       = objectData[objectIndex].ior;
-							curIndex = objectIndex;
-						}
-
-						float4 refraction;
-						// Check the angle between incident ray and norm
-						if (curNextDir.x * norm.x + curNextDir.y * norm.y + 
-                            curNextDir.z * norm.z > 0)
-							refraction = getRefractionDir(-norm, curNextDir, n1, n2);
-						else
-							refraction = getRefractionDir(norm, curNextDir, n1, n2);
-
-						if (!EQ4(refraction, INVALID_DIR))
-						{
-							rays[nextCount].nextPos     = intersectPoint + 
-                            refraction * EPSILON * 2;
-							rays[nextCount].nextPos.s3  = 1;
-							rays[nextCount].nextDir     = refraction;
-							rays[nextCount].attenuation = rays[j].attenuation * 
-                            objectData[objectIndex].transparent;
-							rays[nextCount].curIndex    = curIndex;
-							nextCount++;
-						}
-					}
-                }
-			}
-		}
-		last = curCount;
-	}
+        if (texCoord.s0 != -1 && texCoord.s1 != -1)
+        {
+            float lod = 0;
+            if (globalSetting->useMipmaps)
+                lod = getTextureLod(objectData[objectIndex].type, faceIndex,
+                    eyeSpaceIntersectPoint, texCoord, curNextDir, norm,
+                    footprint, objectData[objectIndex].invTransform,
+                    objectData[objectIndex].texWidth,
+                    objectData[objectIndex].texHeight);
+            texColor = sampleMipTexture(pixels, texCoord,
+                objectData[objectIndex].texWidth,
+                objectData[objectIndex].texHeight,
+                offsets[objectData[objectIndex].texMapID], lod);
+        }
+    }
 
-	result.s0 = clamp(result.s0, 0.f, 1.f);
-	result.s1 = clamp(result.s1, 0.f, 1.f);
-	result.s2 = clamp(result.s2, 0.f, 1.f);
-	result.s3 = clamp(result.s3, 0.f, 1.f);
-	return result;
+    // Every hit is lit, the queue leaves out the rays that missed
+    shading[2 * id]     = (float4)(norm.x, norm.y, norm.z, 0);
+    shading[2 * id + 1] = texColor;
+    lightQueue[atomic_inc(&counters[WAVEFRONT_RECORD_COUNT])] = id;
+
+    if (!spawn || !globalSetting->useReflection)
+        return;
+
+    bool zeroReflection = EQ4(objectData[objectIndex].reflective,
+        (float4)(0, 0, 0, 0));
+
+    float projection = -(curNextDir.x * norm.x + curNextDir.y * norm.y +
+        curNextDir.z * norm.z);
+
+    if (projection > 0 && globalData.s2 > 0 && !zeroReflection)
+    {
+        float4 norm4 = (float4)(norm.x, norm.y, norm.z, 0);
+
+        float4 reflection = getReflectionDir(norm4, curNextDir);
+        Ray next;
+        next.nextPos     = intersectPoint + reflection * EPSILON;
+        next.nextPos.s3  = 1;
+        next.nextDir     = reflection;
+        next.attenuation = ray.attenuation *
+            objectData[objectIndex].reflective * globalData.s2;
+        next.pixel       = ray.pixel;
+        next.curIndex    = ray.curIndex;
+        next.coneWidth   = footprint;
+        next.coneSpread  = ray.coneSpread;
+        pushRay(nextRays, counters, 1 - queue, capacity, next);
+    }
+
+    bool zeroRefraction = EQ4(objectData[objectIndex].transparent, 0);
+    if (zeroRefraction)
+        return;
+
+    // Refracetion part
+    float n1, n2;
+    int curIndex = ray.curIndex;
+    if (curIndex != -1)
+    {
+        // The ray may be inside an object
+        n1 = objectData[curIndex].ior;
+        float3 normFace;
+        // bump the start point to be a little bit
+        if (curNextDir.x * norm.x + curNextDir.y * norm.y +
+            curNextDir.z * norm.z > 0)
+            normFace = (float3)(-norm.x, -norm.y, -norm.z);
+        else
+            normFace = norm;
+
+        int indexMap[MAX_INDEX_MAP];
+        int indexCount;
+        ObjectDataDevice list[MAX_OBJECT_DST];
+        int listCount;
+        float4 bumpPos = intersectPoint + (float4)(-normFace.x,
+            -normFace.y, -normFace.z, 0) * EPSILON * 2;
+
+        checkPos(objectData, objectCount, list, &listCount, bumpPos,
+            indexMap, &indexCount);
+        int dummyObjectIndex = -1, dummyFaceindex = -1;
+        float t2 = -1;
+        if (listCount != 0)
+            t2 = intersectLocal(bumpPos, list, listCount,
+                (float4)(-normFace.x, -normFace.y, -normFace.z, 0),
+                &dummyObjectIndex, &dummyFaceindex);
+
+        if (t2 > 0)
+        {
+            n2 = list[dummyObjectIndex].ior;
+            curIndex = indexMap[dummyObjectIndex];
+        }
+        else
+        {
+            // The ray is towards air
+            n2 = 1;
+            curIndex = -1;
+        }
+    }
+    else
+    {
+        // If curIndex == -1, then the ray is from air
+        n1       = 1;
+        n2       = objectData[objectIndex].ior;
+        curIndex = objectIndex;
+    }
+
+    float4 refraction;
+    // Check the angle between incident ray and norm
+    if (curNextDir.x * norm.x + curNextDir.y * norm.y +
+        curNextDir.z * norm.z > 0)
+        refraction = getRefractionDir(-norm, curNextDir, n1, n2);
+    else
+        refraction = getRefractionDir(norm, curNextDir, n1, n2);
+
+    if (!EQ4(refraction, INVALID_DIR))
+    {
+        Ray next;
+        next.nextPos     = intersectPoint + refraction * EPSILON * 2;
+        next.nextPos.s3  = 1;
+        next.nextDir     = refraction;
+        next.attenuation = ray.attenuation *
+            objectData[objectIndex].transparent;
+        next.pixel       = ray.pixel;
+        next.curIndex    = curIndex;
+        next.coneWidth   = footprint;
+        next.coneSpread  = ray.coneSpread;
+        pushRay(nextRays, counters, 1 - queue, capacity, next);
+    }
 }
 
 /**
- * @brief raytrace: the main function receives all of the data from CPU side 
- * @param *uiOutputImage: the output buffer
- * @param width: width of the image
- * @param height: height of the image
+ * @brief shadowRays: the shadow stage, light the queued hits, tracing a
+ *                    shadow ray per light, and add them to the colors of
+ *                    the samples of their pixels. It is launched like
+ *                    intersectRays
+ * @param *rays: the queue of the rays
+ * @param *hits: the hits, one per ray
+ * @param *shading: normal and texture color of the hits, two per ray
+ * @param *lightQueue: indices of the hits queued for the lights
+ * @param *counters: the counters of the wavefront
+ * @param *sampleColors: color of the sample of every pixel in fixed point
  * @param *globalSetting: global setting
  * @param *lightData: light data buffer
  * @param lightCount: number of lights
- * @param *objectsData: object data buffer
+ * @param *objectData: object data buffer
  * @param objectCount: number of objects
  * @param globalData: global coefficient data
- * @param eyePos: eye position
- * @param eyeNear: near plane position
- * @param invMat: inverse of view matrix
- * @param *pixels: texture pixels
- * @param pixelCount: number of texture pixels
- * @param *offsets: offset buffer
- * @param offsetCount: length of offsets
  * @param *kdtreeNodes: kdtree nodes buffer
  * @param kdtreeNodeCount: number of kdtree node
- * @param objectNodes: object nodes buffer 
- * @param objectNodeCount: number of object nodes
+ * @param kdtreePrims: object indices of the kdtree leaves
+ * @param kdtreePrimCount: number of object indices
  */
-__kernel void raytrace(
-    __global unsigned int* uiOutputImage,
-	unsigned int width,
-	unsigned int height,
-	__global GlobalSettingDevice* globalSetting,
-	__global LightDataDevice* lightData,
-	int lightCount,
-	__global ObjectDataDevice* objectData,
-	int objectCount,
-	float4 globalData,
-	float4 eyePos,
-    float eyeNear,
-	float16 invMat,
-	__global unsigned int* pixels,
-	int pixelCount,
-	__global unsigned int* offsets,
-	int offsetCount,
-	__global KdTreeNodeDevice* kdtreeNodes,
-	int kdtreeNodeCount,
-	__global ObjectNodeDevice* objectNodes,
-	int objectNodeCount
+__kernel void shadowRays(
+    __global Ray* rays,
+    __global RayHit* hits,
+    __global float4* shading,
+    __global int* lightQueue,
+    __global int* counters,
+    volatile __global int* sampleColors,
+    __global GlobalSettingDevice* globalSetting,
+    __global LightDataDevice* lightData,
+    int lightCount,
+    __global ObjectDataDevice* objectData,
+    int objectCount,
+    float4 globalData,
+    __global KdTreeNodeDevice* kdtreeNodes,
+    int kdtreeNodeCount,
+    __global int* kdtreePrims,
+    int kdtreePrimCount
+)
+{
+    int id = get_global_id(0);
+    if (id >= counters[WAVEFRONT_RECORD_COUNT])
+        return;
+
+    int slot   = lightQueue[id];
+    Ray ray    = rays[slot];
+    RayHit hit = hits[slot];
+    float4 norm4          = shading[2 * slot];
+    float4 intersectPoint = ray.nextPos + hit.t * ray.nextDir;
+
+    float4 color = computeObjectColor(hit.object, objectData, objectCount,
+        lightData, lightCount, globalSetting, globalData, intersectPoint,
+        norm4.xyz, ray.nextPos, shading[2 * slot + 1], kdtreeNodes,
+        kdtreeNodeCount, kdtreePrims, kdtreePrimCount) * ray.attenuation;
+
+    // Several hits of a pixel may be in flight, they're added in fixed
+    // point since integer atomics give the same sum in any order
+    volatile __global int* sampleColor = sampleColors + ray.pixel * 4;
+    atomic_add(&sampleColor[0], convert_int_rte(color.x * FIXED_ONE));
+    atomic_add(&sampleColor[1], convert_int_rte(color.y * FIXED_ONE));
+    atomic_add(&sampleColor[2], convert_int_rte(color.z * FIXED_ONE));
+}
+
+/**
+ * @brief accumulateSamples: the accumulation stage, add the finished sample
+ *                           of every pixel to its color and clear it for the
+ *                           next sample
+ * @param *sampleColors: color of the sample of every pixel in fixed point
+ * @param *colorSums: sum of the samples of every pixel
+ * @param *sampleCounts: number of samples of every pixel
+ * @param *refineMask: the pixels to supersample
+ * @param pixelCount: number of pixels
+ * @param sample: index of the sample
+ */
+__kernel void accumulateSamples(
+    volatile __global int* sampleColors,
+    __global float4* colorSums,
+    __global int* sampleCounts,
+    __global int* refineMask,
+    int pixelCount,
+    int sample
 )
 {
-    size_t globalPosX = get_global_id(0);
-    size_t globalPosY = get_global_id(1);
+    int index = get_global_id(0);
+    if (index >= pixelCount)
+        return;
+    if (sample > 0 && !refineMask[index])
+        return;
+
+    volatile __global int* sampleColor = sampleColors + index * 4;
+    float4 color = convert_float4((int4)(sampleColor[0], sampleColor[1],
+        sampleColor[2], 0)) / FIXED_ONE;
+    color = clamp(color, 0.f, 1.f);
+
+    sampleColor[0] = 0;
+    sampleColor[1] = 0;
+    sampleColor[2] = 0;
+
+    if (sample == 0)
+    {
+        colorSums[index]    = color;
+        sampleCounts[index] = 1;
+    }
+    else
+    {
+        colorSums[index] += color;
+        sampleCounts[index]++;
+    }
+}
 
-    if (globalPosX >= 0 && globalPosX < width &&
-        globalPosY >= 0 && globalPosY < height)
+/**
+ * @brief refinePixels: mark the pixels whose center differs from a
+ *                      neighbour's, in object or in color, the same test as
+ *                      SampleBuffer::checkRefine
+ * @param *colorSums: the center colors of the pixels
+ * @param *firstObjects: objects hit by the center rays of the pixels
+ * @param *refineMask: the pixels to supersample, should be returned
+ * @param *counters: the counters of the wavefront
+ * @param width: width of the image
+ * @param height: height of the image
+ * @param *globalSetting: global setting
+ */
+__kernel void refinePixels(
+    __global float4* colorSums,
+    __global int* firstObjects,
+    __global int* refineMask,
+    volatile __global int* counters,
+    unsigned int width,
+    unsigned int height,
+    __global GlobalSettingDevice* globalSetting
+)
+{
+    int index = get_global_id(0);
+    if (index >= (int)(width * height))
+        return;
+
+    int x         = index % (int)width;
+    int y         = index / (int)width;
+    float4 center = colorSums[index];
+    int object    = firstObjects[index];
+
+    int2 steps[4] = {(int2)(-1, 0), (int2)(1, 0),
+                     (int2)(0, -1), (int2)(0, 1)};
+    bool refine = false;
+    for (int n = 0; n < 4 && !refine; n++)
     {
-		int k = 0, size = 1;
-		float2 poses[5];
-		poses[0] = (float2)(globalPosX, globalPosY);
-		float weight = 1.f;
-		float4 colorSum = (float4)(0,0,0,0);
+        int nx = x + steps[n].x;
+        int ny = y + steps[n].y;
+        if (nx < 0 || ny < 0 || nx >= (int)width || ny >= (int)height)
+            continue;
 
-		if (globalSetting->useSupersampling)
-		{
-			poses[1] = (float2)(globalPosX - 0.5, globalPosY - 0.5);
-			poses[2] = (float2)(globalPosX - 0.5, globalPosY + 0.5);
-			poses[3] = (float2)(globalPosX + 0.5, globalPosY - 0.5);
-			poses[4] = (float2)(globalPosX + 0.5, globalPosY + 0.5);
+        int other = ny * (int)width + nx;
+        float4 difference = fabs(colorSums[other] - center);
+        refine = firstObjects[other] != object ||
+            difference.x > globalSetting->sampleContrast ||
+            difference.y > globalSetting->sampleContrast ||
+            difference.z > globalSetting->sampleContrast;
+    }
 
-			weight = 1.f / 5;
-			size = 5;
-		}
-		do
-		{
-			float4 pFilmCam = (float4)(((float)(2 * poses[k].x)) / width - 1,
-             1 - ((float)(2 * poses[k].y)) / height, -1, 1);
-			float4 pFilmWorld = matMult(invMat, pFilmCam);
-			float4 d = pFilmWorld - eyePos;
-
-			d = fast_normalize(d);
-            float4 eyePosNear = eyePos + d * eyeNear;
-            colorSum +=
-            weight * getPixelColor(eyePosNear,
-            d, globalSetting, lightData, lightCount, objectData, objectCount, 
-            globalData, pixels, pixelCount, offsets, offsetCount, kdtreeNodes, 
-            kdtreeNodeCount, objectNodes, objectNodeCount);
-
-
-			k++;
-		}while (k < size);
-		
-        uiOutputImage[globalPosY * width + globalPosX] = 
-        rgbaFloat4ToUint(colorSum);
-	}
+    refineMask[index] = refine;
+    if (refine)
+        atomic_inc(&counters[WAVEFRONT_REFINED_COUNT]);
+}
+
+/**
+ * @brief resolvePixels: the last stage, average the samples of every pixel
+ *                       into the image
+ * @param *uiOutputImage: the output buffer
+ * @param *colorSums: sum of the samples of every pixel
+ * @param *sampleCounts: number of samples of every pixel
+ * @param pixelCount: number of pixels
+ */
+__kernel void resolvePixels(
+    __global unsigned int* uiOutputImage,
+    __global float4* colorSums,
+    __global int* sampleCounts,
+    int pixelCount
+)
+{
+    int index = get_global_id(0);
+    if (index >= pixelCount)
+        return;
+
+    uiOutputImage[index] = rgbaFloat4ToUint(colorSums[index] /
+        (float)sampleCounts[index]);
 }
@@ -6,7 +6,9 @@
  */
 
 #include "aabb.h"
+#ifndef NO_GL
 #include <qgl.h>
+#endif
 
 AABB computeCubeAABB(const Matrix4x4 transform)
 {
@@ -187,6 +189,7 @@ AABB computeCylinderAABB(const Matrix4x4 transform)
     return result;
 }
 
+#ifndef NO_GL
 void drawAABB(AABB& aabb, float color[3])
 {
 
@@ -264,3 +267,4 @@ void drawAABB(AABB& aabb, float color[3])
     glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
     glEnable(GL_LIGHTING);
 }
+#endif
@@ -101,11 +101,13 @@ AABB computeConeAABB(const Matrix4x4 transform) ;
  */
 AABB computeCylinderAABB(const Matrix4x4 transform);
 
+#ifndef NO_GL
 /**
  * @brief drawAABB: draw the bounding box
  * @param aabb: the boudning box
  * @param color: the color in rgb
  */
 void drawAABB(AABB& aabb, float color[3]);
+#endif
 
 #endif
@@ -0,0 +1,155 @@
+#
+# Headless batch renderer for the CPU ray tracer, no GUI or GL context needed.
+# It builds without GL and OpenCL, qmake CONFIG+=opencl adds --opencl and
+# --compare, which trace with the kernel of the GPU tracer on any OpenCL
+# device and need GL and an OpenCL ICD like the GUI does
+#
+
+QT += core gui xml
+
+TARGET = batch
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+
+INCLUDEPATH += lib \
+    math \
+    support \
+    global \
+    scene \
+    scene/trace_thread \
+    scene/kdtree \
+    scene/bvh \
+    scene/mesh \
+    scene/group \
+    scene/texture \
+    intersect \
+    shape \
+    OpenCL \
+    aabb \
+
+DEPENDPATH += lib \
+    math \
+    support \
+    global \
+    scene \
+    scene/trace_thread \
+    scene/kdtree \
+    scene/bvh \
+    scene/mesh \
+    scene/group \
+    scene/texture \
+    intersect \
+    shape \
+    OpenCL \
+    aabb \
+
+SOURCES += support/batch.cpp \
+    support/batch_primary.cpp \
+    support/batch_view.cpp \
+    support/batch_box.cpp \
+    support/batch_animate.cpp \
+    support/batch_preview.cpp \
+    support/camtrans_camera.cpp \
+    math/CS123Matrix.cpp \
+    math/CS123Matrix.inl \
+    math/CS123Vector.inl \
+    scene/CS123XmlSceneParser.cpp \
+    scene/scene.cpp \
+    lib/utils.cpp \
+    lib/recourceloader.cpp \
+    lib/glm.cpp \
+    lib/targa.cpp \
+    scene/CPUrayscene.cpp \
+    intersect/cone_intersect.cpp \
+    intersect/cube_intersect.cpp \
+    intersect/cylinder_intersect.cpp \
+    intersect/sphere_intersect.cpp \
+    intersect/plane_intersect.cpp \
+    scene/trace.cpp \
+    intersect/intersect.cpp \
+    scene/trace_thread/trace_thread.cpp \
+    scene/trace_thread/tile_scheduler.cpp \
+    scene/trace_thread/trace_pool.cpp \
+    scene/trace_thread/sample_buffer.cpp \
+    intersect/pos_check.cpp \
+    aabb/aabb.cpp \
+    scene/kdtree/kdtree.cpp \
+    scene/kdtree/kdbuild_pool.cpp \
+    scene/bvh/bvh.cpp \
+    scene/mesh/mesh.cpp \
+    scene/group/scene_group.cpp \
+    scene/texture/mip_texture.cpp \
+    intersect/mesh_intersect.cpp \
+    intersect/bvhbox_intersect.cpp \
+    intersect/packet_intersect.cpp \
+    intersect/intersect_view.cpp \
+    intersect/kdbox_intersect.cpp \
+    global/global.cpp
+
+HEADERS += support/batch.h \
+    support/camtrans_camera.h \
+    global/global.h \
+    global/defaults.h \
+    math/CS123Algebra.h \
+    global/CS123Common.h \
+    math/vector.h \
+    scene/CS123XmlSceneParser.h \
+    scene/CS123SceneData.h \
+    scene/CS123ISceneParser.h \
+    scene/scene.h \
+    lib/utils.h \
+    lib/glm.h \
+    lib/targa.h \
+    scene/CPUrayscene.h \
+    lib/resource_loader.h \
+    intersect/cone_intersect.h \
+    intersect/cube_intersect.h \
+    intersect/cylinder_intersect.h \
+    intersect/sphere_intersect.h \
+    intersect/plane_intersect.h \
+    intersect/intersect.h \
+    scene/trace.h \
+    scene/trace_thread/trace_thread.h \
+    scene/trace_thread/tile_scheduler.h \
+    scene/trace_thread/trace_pool.h \
+    scene/trace_thread/sample_buffer.h \
+    intersect/pos_check.h \
+    intersect/shape_math.h \
+    aabb/aabb.h \
+    scene/kdtree/kdtree.h \
+    scene/kdtree/kdbuild_pool.h \
+    scene/bvh/bvh.h \
+    scene/mesh/mesh.h \
+    scene/group/scene_group.h \
+    scene/texture/mip_texture.h \
+    intersect/mesh_intersect.h \
+    intersect/bvhbox_intersect.h \
+    intersect/packet_intersect.h \
+    intersect/intersect_view.h \
+    scene/kdtree/kdtreecommon.h \
+    intersect/slab_intersect.h \
+    intersect/kdbox_intersect.h
+
+opencl {
+    QT += opengl
+    DEFINES += BATCH_OPENCL
+
+    SOURCES += support/batch_opencl.cpp \
+        support/view2d.cpp \
+        shape/shape_draw.cpp \
+        scene/GPUrayscene.cpp \
+        OpenCL/clPack.cpp \
+        OpenCL/clDumpGPUInfo.cpp
+
+    HEADERS += support/view2d.h \
+        shape/shape_draw.h \
+        scene/GPUrayscene.h \
+        OpenCL/clPack.h \
+        OpenCL/clDumpGPUInfo.h
+
+    unix|win32: LIBS += -lGLU -lOpenCL
+} else {
+    # The GL drawing of the shared sources is left out
+    DEFINES += NO_GL
+}
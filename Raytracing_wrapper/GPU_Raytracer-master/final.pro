@@ -19,6 +19,10 @@ INCLUDEPATH += lib \
     scene \
     scene/trace_thread \
     scene/kdtree \
+    scene/bvh \
+    scene/mesh \
+    scene/group \
+    scene/texture \
     intersect \
     shape \
     OpenCL \
@@ -31,6 +35,10 @@ DEPENDPATH += lib \
     scene \
     scene/trace_thread \
     scene/kdtree \
+    scene/bvh \
+    scene/mesh \
+    scene/group \
+    scene/texture \
     intersect \
     shape \
     OpenCL \
@@ -60,13 +68,25 @@ SOURCES += support/main.cpp \
     scene/trace.cpp \
     intersect/intersect.cpp \
     scene/trace_thread/trace_thread.cpp \
+    scene/trace_thread/tile_scheduler.cpp \
+    scene/trace_thread/trace_pool.cpp \
+    scene/trace_thread/sample_buffer.cpp \
     scene/GPUrayscene.cpp \
     OpenCL/oclUtils.cpp \
     OpenCL/clDumpGPUInfo.cpp \
+    OpenCL/clPack.cpp \
     intersect/pos_check.cpp \
     aabb/aabb.cpp \
     scene/kdtree/kdtree.cpp \
-    scene/kdtree/kdtreenode.cpp \
+    scene/kdtree/kdbuild_pool.cpp \
+    scene/bvh/bvh.cpp \
+    scene/mesh/mesh.cpp \
+    scene/group/scene_group.cpp \
+    scene/texture/mip_texture.cpp \
+    intersect/mesh_intersect.cpp \
+    intersect/bvhbox_intersect.cpp \
+    intersect/packet_intersect.cpp \
+    intersect/intersect_view.cpp \
     intersect/kdbox_intersect.cpp \
     global/global.cpp
 
@@ -75,6 +95,7 @@ HEADERS += support/mainwindow.h \
     lib/glm.h \
     lib/targa.h \
     global/global.h \
+    global/defaults.h \
     math/CS123Algebra.h \
     global/CS123Common.h \
     math/vector.h \
@@ -96,6 +117,9 @@ HEADERS += support/mainwindow.h \
     intersect/intersect.h \
     scene/trace.h \
     scene/trace_thread/trace_thread.h \
+    scene/trace_thread/tile_scheduler.h \
+    scene/trace_thread/trace_pool.h \
+    scene/trace_thread/sample_buffer.h \
     scene/GPUrayscene.h \
     OpenCL/CL/opencl.h \
     OpenCL/CL/cl_platform.h \
@@ -106,11 +130,22 @@ HEADERS += support/mainwindow.h \
     OpenCL/oclUtils.h \
     OpenCL/shrUtils.h \
     OpenCL/clDumpGPUInfo.h \
+    OpenCL/clPack.h \
     intersect/pos_check.h \
+    intersect/shape_math.h \
     aabb/aabb.h \
     scene/kdtree/kdtree.h \
-    scene/kdtree/kdtreenode.h \
+    scene/kdtree/kdbuild_pool.h \
+    scene/bvh/bvh.h \
+    scene/mesh/mesh.h \
+    scene/group/scene_group.h \
+    scene/texture/mip_texture.h \
+    intersect/mesh_intersect.h \
+    intersect/bvhbox_intersect.h \
+    intersect/packet_intersect.h \
+    intersect/intersect_view.h \
     scene/kdtree/kdtreecommon.h \
+    intersect/slab_intersect.h \
     intersect/kdbox_intersect.h \
     ui_mainwindow.h
 
@@ -0,0 +1,19 @@
+/*!
+    @file defaults.h
+    @desc: the default values of the tracer settings, kept apart so the
+           settings don't depend on the tracer's headers
+    @author: yanli
+    @date: May 2013
+ */
+
+#ifndef DEFAULTS_H
+#define DEFAULTS_H
+
+#define TILE_SIZE 16 // Default tile size in pixels
+#define SAMPLE_MAX_COUNT 8 // Default most samples of a pixel
+#define SAMPLE_CONTRAST 0.05f // Default color difference refining a pixel
+#define PREVIEW_STEP 8 // Default pixels per side of the coarsest preview
+                       // blocks
+#define PREVIEW_BUDGET 30.f // Default time of a preview frame in ms
+
+#endif // DEFAULTS_H
@@ -6,7 +6,10 @@
  */
 
 #include "global.h"
+#ifndef NO_GL
 #include "GL/glu.h"
+#endif
+#include <QThread>
 
 Settings settings;
 
@@ -23,18 +26,40 @@ void Settings::initSettings()
     useDirectionalLights = true;
     showAxis             = true;
     showTexture          = true;
+    useMipmaps           = true;
     useMultithread       = false;
     useSupersampling     = false;
+    useProgressive       = false;
+    useInteractivePreview = false;
     useShadow            = false;
+    useTransparentShadows = false;
     useSpotLights        = false;
     useReflection        = true;
     traceRaycursion      = 4;
-    traceThreadNum       = 5;
+    traceThreadNum       = QThread::idealThreadCount();
+    traceTileSize        = TILE_SIZE;
+    kdBuildThreadNum     = QThread::idealThreadCount();
+    maxSamples           = SAMPLE_MAX_COUNT;
+    sampleContrast       = SAMPLE_CONTRAST;
+    previewStep          = PREVIEW_STEP;
+    previewBudget        = PREVIEW_BUDGET;
     showBoundingBox      = false;
     showKdTree           = false;
     useKdTree            = true;
+    accelStruct          = KDTREE;
+    useSimd              = true;
+    usePacketTracing     = true;
+    useInstancing        = true;
+    useProgramCache      = true;
+
+    // Unknown core count
+    if (traceThreadNum < 1)
+        traceThreadNum = 1;
+    if (kdBuildThreadNum < 1)
+        kdBuildThreadNum = 1;
 }
 
+#ifndef NO_GL
 /**
  * @brief getGLErrorString: get GL error string
  * @return: the error string
@@ -50,3 +75,4 @@ const char* getGLErrorString()
         return NULL;
 
 }
+#endif
@@ -8,16 +8,22 @@
 #ifndef GLOBAL_H
 #define GLOBAL_H
 
+// NO_GL leaves the GL drawing and the GPU tracer out, batch.pro builds the
+// headless batch renderer with it
+#ifndef NO_GL
 #include <qgl.h>
-#include <iostream>
 #include "GPUrayscene.h"
+#else
+#include <QtGui>
+#endif
+#include <iostream>
+#include "defaults.h"
 #include <QVector>
 
 #define WIN_WIDTH 600 // Window width
 #define WIN_HEIGHT 600 // Window height
 
-#define GPU_LOCAL_WORK_SIZE_X 32 // GPU working size in X dimension
-#define GPU_LOCAL_WORK_SIZE_Y 32 // GPU working size in Y dimension
+#define GPU_LOCAL_WORK_SIZE 64 // GPU working size of the wavefront kernels
 
 #define MAX_ARRAY 1024 // Max array size
 
@@ -30,6 +36,13 @@ enum TRACEMODE
     CPU
 };
 
+// Acceleration structure of the CPU tracer
+enum ACCELSTRUCT
+{
+    KDTREE,
+    BVH
+};
+
 // Polygon display mode
 enum POLYGONMODE
 {
@@ -55,26 +68,43 @@ struct Settings
     bool usePointLights;
     bool showAxis;
     bool showTexture;
+    bool useMipmaps; // Textures are filtered over the ray footprints
     bool useMultithread;
     bool useSupersampling;
+    bool useProgressive; // Supersampled frames keep adding samples
+    bool useInteractivePreview; // View2D refines a coarse image over time
     bool useShadow;
+    bool useTransparentShadows; // Transparent objects cast no shadows
     bool useSpotLights;
     bool useReflection;
     bool showBoundingBox;
     bool showKdTree;
     bool useKdTree;
+    ACCELSTRUCT accelStruct;
+    bool useSimd; // The BVH is traversed 4 wide with SSE, there is no AVX
+                  // or 8 wide path. Off, or without SSE, the binary nodes
+                  // are traversed
+    bool usePacketTracing;
+    bool useInstancing; // Masters used several times share their objects
+    bool useProgramCache; // The OpenCL program is loaded from a binary
+                          // cached on disk when one matches
 
     int traceRaycursion;
     int traceThreadNum;
+    int traceTileSize;
+    int kdBuildThreadNum;
+    int maxSamples; // Most samples of a supersampled pixel
+    float sampleContrast; // Color difference to a neighbour refining a pixel
+    int previewStep; // Pixels per side of the coarsest preview blocks
+    float previewBudget; // Time of a preview frame in ms
 };
 
 // External variables
 extern Settings settings;
-extern QVector<KdTreeNodeHost> kdnode_test;
-extern QVector<ObjectNodeHost> objnode_test;
 
 #define OFFSET(offset) ((char*)NULL + offset)
 
+#ifndef NO_GL
 /**
  * @brief getGLErrorString: get GL error string
  * @return: the error string
@@ -89,4 +119,6 @@ const char* getGLErrorString();
         std::cout<<"GL error: "<<error<<std::endl;\
     }\
 })
+#endif
+
 #endif // GLOBAL_H
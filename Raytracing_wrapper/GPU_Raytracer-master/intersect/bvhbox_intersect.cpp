@@ -0,0 +1,85 @@
+/*!
+    @file bvhbox_intersect.cpp
+    @desc: definition of the functions doing BVH box's intersecting
+           detection
+    @author: yanli
+    @date: May 2013
+ */
+
+#include "bvhbox_intersect.h"
+#include "global.h"
+
+#ifdef BVH_USE_SSE
+#include <xmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+/**
+ * @brief checkCpuSse: ask the CPU whether it has SSE
+ * @return: true if it has
+ */
+static bool checkCpuSse()
+{
+
+#if !defined(BVH_USE_SSE)
+    return false;
+#elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[3] & (1 << 25)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse");
+#endif
+}
+
+void initBvhWideRay(BvhWideRay& ray, const Vector4& eyePos, const Vector4& d)
+{
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        ray.m_origin[axis] = eyePos.data[axis];
+        ray.m_invD[axis]   = 1.f / d.data[axis];
+        ray.m_sign[axis]   = ray.m_invD[axis] < 0 ? 1 : 0;
+    }
+}
+
+bool checkBvhSse()
+{
+
+    // Asking the CPU once is enough
+    static const bool cpuHasSse = checkCpuSse();
+    return cpuHasSse && settings.useSimd;
+}
+
+#ifdef BVH_USE_SSE
+int doIntersectRayBvhWideBoxSse(const BvhWideRay& ray,
+                                const BvhWideNode& node,
+                                REAL maxT,
+                                float* near)
+{
+
+    __m128 tNear = _mm_setzero_ps();
+    __m128 tFar  = _mm_set1_ps(maxT);
+    for (int axis = 0; axis < 3; axis++)
+    {
+        int sign      = ray.m_sign[axis];
+        __m128 origin = _mm_set1_ps(ray.m_origin[axis]);
+        __m128 invD   = _mm_set1_ps(ray.m_invD[axis]);
+        __m128 t0 = _mm_mul_ps(_mm_sub_ps(
+                        _mm_load_ps(node.m_bounds[sign][axis]), origin), invD);
+        __m128 t1 = _mm_mul_ps(_mm_sub_ps(
+                        _mm_load_ps(node.m_bounds[1 - sign][axis]), origin),
+                               invD);
+
+        // Min and max return the second operand for NaN, which keeps the old
+        // range like the binary test
+        tNear = _mm_max_ps(t0, tNear);
+        tFar  = _mm_min_ps(t1, tFar);
+    }
+    _mm_storeu_ps(near, tNear);
+    return _mm_movemask_ps(_mm_cmple_ps(tNear, tFar));
+}
+#endif
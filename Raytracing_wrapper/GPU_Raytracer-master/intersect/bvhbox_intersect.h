@@ -0,0 +1,103 @@
+/*!
+    @file bvhbox_intersect.h
+    @desc: declarations of the functions doing BVH box's intersecting
+           detection
+    @author: yanli
+    @date: May 2013
+ */
+
+#ifndef BVHBOX_INTERSECT_H
+#define BVHBOX_INTERSECT_H
+
+#include "CS123Algebra.h"
+#include "bvh.h"
+
+// SSE is available to the compiler, whether the CPU has it is checked at
+// run time
+#if defined(__SSE__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define BVH_USE_SSE
+#endif
+
+/**
+ * @struct: BvhWideRay
+ * @brief The BvhWideRay struct is a ray prepared for the wide and the binary
+ *        box tests
+ */
+struct BvhWideRay
+{
+    float m_origin[3]; // The eye position
+    float m_invD[3]; // The reciprocal of the direction
+    int m_sign[3]; // 1 if the ray enters a box through the upper corner's
+                   // plane on the axis, otherwise 0
+};
+
+/**
+ * @brief initBvhWideRay: prepare a ray for the box tests
+ * @param ray: the prepared ray, should be returned
+ * @param eyePos: the eye position
+ * @param d: the direction
+ */
+void initBvhWideRay(BvhWideRay& ray, const Vector4& eyePos, const Vector4& d);
+
+/**
+ * @brief checkBvhSse: check whether to traverse the wide nodes with SSE,
+ *                     that is the compiler and the CPU support it and it's
+ *                     not turned off in the settings. Otherwise the binary
+ *                     nodes are traversed
+ * @return: true for SSE and false for the binary traversal
+ */
+bool checkBvhSse();
+
+/**
+ * @brief doIntersectRayBvhBox: intersect the ray with the box of a binary
+ *                              BVH node
+ * @param ray: the prepared ray
+ * @param node: the binary BVH node
+ * @param maxT: the closest hit so far, farther boxes are missed
+ * @param near: the 't' value entering the box, should be returned
+ * @return: true if the ray hits the box between the eye and maxT
+ */
+inline bool doIntersectRayBvhBox(const BvhWideRay& ray,
+                                 const BvhFlatNode& node,
+                                 REAL maxT,
+                                 REAL& near)
+{
+
+    const float* bounds[2] = {node.m_min, node.m_max};
+    REAL far = maxT;
+    near     = 0;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        int sign = ray.m_sign[axis];
+        REAL t0  = (bounds[sign][axis] - ray.m_origin[axis]) *
+                ray.m_invD[axis];
+        REAL t1  = (bounds[1 - sign][axis] - ray.m_origin[axis]) *
+                ray.m_invD[axis];
+
+        // NaN (the eye on a slab parallel to the ray) keeps the old range
+        near = t0 > near ? t0 : near;
+        far  = t1 < far ? t1 : far;
+    }
+    return near <= far;
+}
+
+#ifdef BVH_USE_SSE
+/**
+ * @brief doIntersectRayBvhWideBoxSse: intersect the ray with the children's
+ *                                     boxes of a wide BVH node all at once,
+ *                                     only call it if checkBvhSse() is true
+ * @param ray: the prepared ray
+ * @param node: the wide BVH node, aligned to 16 bytes
+ * @param maxT: the closest hit so far, farther boxes are missed
+ * @param near: the 't' values entering the boxes, should be returned
+ * @return: bit c is set if the ray hits the box of child c between the eye
+ *          and maxT
+ */
+int doIntersectRayBvhWideBoxSse(const BvhWideRay& ray,
+                                const BvhWideNode& node,
+                                REAL maxT,
+                                float* near);
+#endif
+
+#endif // BVHBOX_INTERSECT_H
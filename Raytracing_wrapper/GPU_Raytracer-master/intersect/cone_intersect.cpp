@@ -6,7 +6,7 @@
  */
 
 #include "cone_intersect.h"
-#include "plane_intersect.h"
+#include "shape_math.h"
 #include "utils.h"
 
 REAL doIntersectUnitCone(const Vector4& eyePos,
@@ -17,100 +17,28 @@ REAL doIntersectUnitCone(const Vector4& eyePos,
     assert(EQ(eyePos.w, 1.f));
     assert(EQ(d.w, 0.f));
 
-    REAL result = -1;
-    Vector3 norms[2];
-    REAL t[2];
-
-    // firstly check if the ray intersects the bottom;
-    t[0] = -1;
-    norms[0] = Vector3(0,-1,0);
-
-    t[0] = doIntersectPlane(Vector3(0, -0.5, 0), norms[0], eyePos, d);
-    Vector4 intersect = eyePos + t[0] * d;
-    if (!(SQ(intersect.x) + SQ(intersect.z) <= 0.25))
-        t[0] = -1;
-
-    // then check the intersect point on the side
-    t[1] = -1;
-
-    REAL A = d.x * d.x + d.z * d.z -0.25 * d.y * d.y;
-    REAL B =
-            2 * eyePos.x * d.x +
-            2 * eyePos.z * d.z - 0.5 * eyePos.y * d.y + 0.25 * d.y;
-    REAL C =
-            eyePos.x * eyePos.x + eyePos.z * eyePos.z -
-            0.25 * eyePos.y * eyePos.y + 0.25 * eyePos.y - 0.0625;
-
-    REAL determinant = B * B - 4 * A * C;
-
-    if (determinant >= 0)
-    {
-        REAL t1 = (-B + sqrt(determinant))  / (2 * A);
-        REAL t2 = (-B - sqrt(determinant))  / (2 * A);
-
-        if (!(eyePos.y + t1 * d.y <= 0.5+EPSILON &&
-              eyePos.y + t1 * d.y >= -0.5-EPSILON))
-        {
-            t1 = -1;
-        }
-
-        if (!(eyePos.y + t2 * d.y <= 0.5+EPSILON &&
-              eyePos.y + t2 * d.y >= -0.5-EPSILON))
-        {
-            t2 = -1;
-        }
-
-        if (t1 > 0 && t2 <= 0)
-            t[1] = t1;
-        else if (t1 <= 0 && t2 > 0)
-            t[1] = t2;
-        else if (t1 > 0 && t2 > 0)
-            t[1] = MIN(t1, t2);
-    }
-    REAL minT = POS_INF;
-    for (int i = 0; i < 2; i++)
-    {
-        if (t[i] > 0 && t[i] < minT)
-        {
-            minT = t[i];
-            faceIndex = i;
-        }
-    }
-    if (minT != POS_INF)
-        result = minT;
-
-    return result;
+    return shapeIntersectUnitCone(shapeVec(eyePos.x, eyePos.y, eyePos.z),
+                                  shapeVec(d.x, d.y, d.z), &faceIndex);
 }
 
 Vector3 getConeNorm(const Vector4& intersect, const int faceIndex)
 {
 
-     Vector3 norms[2];
-     norms[0] = Vector3(0, -1, 0);
-     norms[1] = Vector3(2 * (intersect.x),
-                        0.25 - 0.5 * (intersect.y),
-                        2 * (intersect.z));
-
-     norms[1] = norms[1].unit();
-
-     if (faceIndex < 0 || faceIndex > 1)
-         assert(0);
+    if (faceIndex < 0 || faceIndex > 1)
+        assert(0);
 
-     return norms[faceIndex];
+    ShapeVec norm = shapeConeNorm(shapeVec(intersect.x, intersect.y,
+                                           intersect.z),
+                                  faceIndex);
+    return Vector3(norm.x, norm.y, norm.z);
 }
 
-CS123SceneColor getConeIntersectTexColor(const SceneObject& object,
-                                         const int faceIndex,
-                                         const Vector4& intersect)
+void getConeIntersectTexCoord(const int faceIndex,
+                              const Vector4& intersect,
+                              REAL& u,
+                              REAL& v)
 {
 
-    CS123SceneColor resultColor;
-
-    int width  = object.m_texture.m_texWidth;
-    int height = object.m_texture.m_texHeight;
-
-    REAL x,y;
-    REAL u,v;
     switch (faceIndex)
     {
     // bottom
@@ -141,15 +69,4 @@ CS123SceneColor getConeIntersectTexColor(const SceneObject& object,
         assert(0);
         break;
     }
-
-    x = (width-1) * u;
-    y = (height-1) * v;
-
-    resultColor = bilinearInterpTexel(object.m_texture.m_texPointer,
-                                      x,
-                                      y,
-                                      width,
-                                      height);
-    resultColor.a = 0;
-    return resultColor;
 }
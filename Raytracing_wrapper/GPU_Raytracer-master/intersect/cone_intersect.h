@@ -32,13 +32,15 @@ Vector3 getConeNorm(const Vector4& intersectPoint,
                     const int faceIndex);
 
 /**
- * @brief getConeIntersectTexColor: get the texture color from intersection point
- * @param object: the scene object
+ * @brief getConeIntersectTexCoord: get the texture coordinates of the
+ *                                  intersection point
  * @param faceIndex: the face index of cone
  * @param intersect: the intersection point
- * @return: the color
+ * @param u: horizontal coordinate in [0, 1], should be returned
+ * @param v: vertical coordinate in [0, 1], should be returned
  */
-CS123SceneColor getConeIntersectTexColor(const SceneObject& object,
-                                         const int faceIndex,
-                                         const Vector4& intersect);
+void getConeIntersectTexCoord(const int faceIndex,
+                              const Vector4& intersect,
+                              REAL& u,
+                              REAL& v);
 #endif
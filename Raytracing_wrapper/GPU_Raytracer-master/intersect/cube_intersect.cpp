@@ -6,7 +6,7 @@
  */
 
 #include "cube_intersect.h"
-#include "plane_intersect.h"
+#include "slab_intersect.h"
 #include "utils.h"
 
 REAL doIntersectUnitCube(const Vector4& eyePos,
@@ -14,106 +14,34 @@ REAL doIntersectUnitCube(const Vector4& eyePos,
                          int& faceIndex)
 {
 
-    //! Cube has six faces, we do intersection test in these six planes
-
     assert(EQ(eyePos.w, 1));
     assert(EQ(d.w, 0));
 
-    REAL result = -1;
-
-    Vector3 norms[6];
-    // front
-    norms[0] = Vector3(0, 0, 1);
-    // back
-    norms[1] = Vector3(0, 0, -1);
-    // left
-    norms[2] = Vector3(-1, 0, 0);
-    // right
-    norms[3] = Vector3(1, 0, 0);
-    // top
-    norms[4] = Vector3(0, 1, 0);
-    // down
-    norms[5] = Vector3(0, -1, 0);
-
-    Vector3 points[6];
-    // front
-    points[0] = Vector3(0, 0, 0.5);
-    // back
-    points[1] = Vector3(0, 0, -0.5);
-    // left
-    points[2] = Vector3(-0.5, 0, 0);
-    // right
-    points[3] = Vector3(0.5, 0, 0);
-    // top
-    points[4] = Vector3(0, 0.5, 0);
-    // bottom
-    points[5] = Vector3(0, -0.5, 0);
-
-
-    REAL t[6];
-
-    for  (int i = 0; i < 6; i++)
+    // The cube's face index of each slab face: left, right, bottom, top,
+    // back and front
+    static const int cubeFaces[6] = {2, 3, 5, 4, 1, 0};
+    Vector3 lower(-0.5f, -0.5f, -0.5f);
+    Vector3 upper(0.5f, 0.5f, 0.5f);
+
+    Vector4 invD(1.f / d.x, 1.f / d.y, 1.f / d.z, 0);
+    REAL near, far;
+    int nearFace, farFace;
+    if (!doIntersectRaySlabs(eyePos, invD, lower, upper, near, far,
+                             nearFace, farFace))
+        return -1;
+
+    // From inside the cube the ray leaves through the far face
+    if (near > 0)
     {
-        t[i] = doIntersectPlane(points[i], norms[i], eyePos, d);
+        faceIndex = cubeFaces[nearFace];
+        return near;
     }
-
-    Vector4 intersect = eyePos + t[0] * d;
-
-    if (!(intersect.y <= 0.5 + EPSILON &&
-          intersect.y >= -0.5 - EPSILON &&
-          intersect.x >= -0.5 - EPSILON &&
-          intersect.x >= 0.5 + EPSILON))
-        t[0] = -1;
-
-    intersect = eyePos + t[1] * d;
-    if (!(intersect.y <= 0.5 + EPSILON &&
-          intersect.y >= -0.5 - EPSILON &&
-          intersect.x >= -0.5 - EPSILON &&
-          intersect.x >= 0.5 + EPSILON))
-        t[1] = -1;
-
-    intersect = eyePos + t[2] * d;
-    if (!(intersect.y <= 0.5 + EPSILON &&
-          intersect.y >= -0.5 - EPSILON &&
-          intersect.z >= -0.5 - EPSILON &&
-          intersect.z >= 0.5 + EPSILON))
-        t[2] = -1;
-
-    intersect = eyePos + t[3] * d;
-    if (!(intersect.y <= 0.5 + EPSILON &&
-          intersect.y >= -0.5 - EPSILON &&
-          intersect.z >= -0.5-EPSILON &&
-          intersect.z <= 0.5 + EPSILON))
-        t[3] = -1;
-
-    intersect = eyePos + t[4] * d;
-    if (!(intersect.z <= 0.5 + EPSILON &&
-          intersect.z >= -0.5 - EPSILON &&
-          intersect.x >= -0.5 - EPSILON &&
-          intersect.x >= 0.5 + EPSILON))
-        t[4] = -1;
-
-    intersect = eyePos + t[5] * d;
-    if (!(intersect.z <= 0.5 + EPSILON &&
-          intersect.z >= -0.5 - EPSILON &&
-          intersect.x >= -0.5 - EPSILON &&
-          intersect.x >= 0.5 + EPSILON))
-        t[5] = -1;
-
-    REAL minT = POS_INF;
-
-    for (int i = 0; i < 6; i++)
+    if (far > 0)
     {
-        if (t[i] > 0 && t[i] < minT)
-        {
-            minT = t[i];
-            faceIndex = i;
-        }
+        faceIndex = cubeFaces[farFace];
+        return far;
     }
-    if (minT != POS_INF)
-        result = minT;
-
-    return result;
+    return -1;
 }
 
 Vector3 getCubeNorm(const int faceIndex)
@@ -139,72 +67,58 @@ Vector3 getCubeNorm(const int faceIndex)
     return norms[faceIndex];
 }
 
-CS123SceneColor getCubeIntersectTexColor(const SceneObject& object,
-                                         const int faceIndex,
-                                         const Vector4& intersect)
+void getCubeIntersectTexCoord(const int faceIndex,
+                              const Vector4& intersect,
+                              REAL& u,
+                              REAL& v)
 {
 
-    CS123SceneColor resultColor;
-
-    int width = object.m_texture.m_texWidth;
-    int height = object.m_texture.m_texHeight;
-
-    REAL y,x;
-
     switch (faceIndex)
     {
     // front
     case 0:
     {
-        y = ((height - 1) * ((intersect.y + 0.5)));
-        x = ((width - 1) * ((intersect.x + 0.5)));
+        v = intersect.y + 0.5;
+        u = intersect.x + 0.5;
         break;
     }
         // back
     case 1:
     {
-        y = ((height - 1) * ((intersect.y +  0.5)));
-        x = ((width - 1) * ((0.5 - intersect.x)));
+        v = intersect.y +  0.5;
+        u = 0.5 - intersect.x;
         break;
     }
         // left
     case 2:
     {
-        y = ((height - 1) * ((intersect.y + 0.5)));
-        x = ((width - 1) * ((intersect.z + 0.5)));
+        v = intersect.y + 0.5;
+        u = intersect.z + 0.5;
         break;
     }
         // right
     case 3:
     {
-        y = ((height - 1) * ((0.5 + intersect.y)));
-        x = ((width - 1) * ((0.5 - intersect.z)));
+        v = 0.5 + intersect.y;
+        u = 0.5 - intersect.z;
         break;
     }
         // top
     case 4:
     {
-        y = ((height - 1) * ((0.5 - intersect.z)));
-        x = ((width - 1) * ((0.5 + intersect.x)));
+        v = 0.5 - intersect.z;
+        u = 0.5 + intersect.x;
         break;
     }
         // down
     case 5:
     {
-        y = ((height - 1) * ((0.5 + intersect.z)));
-        x = ((width - 1) * ((0.5 + intersect.x)));
+        v = 0.5 + intersect.z;
+        u = 0.5 + intersect.x;
         break;
     }
     default:
         assert(0);
         break;
     }
-
-    resultColor = bilinearInterpTexel(object.m_texture.m_texPointer,
-                                      x,
-                                      y,
-                                      width,
-                                      height);
-    resultColor.a = 0;
-    return resultColor;
 }
@@ -30,13 +30,15 @@ REAL doIntersectUnitCube(const Vector4& eyePos,
 Vector3 getCubeNorm(const int faceIndex);
 
 /**
- * @brief getCubeIntersectTexColor: get the texture color from intersection point
- * @param object: the scene object
+ * @brief getCubeIntersectTexCoord: get the texture coordinates of the
+ *                                  intersection point
  * @param faceIndex: the face index of cube
  * @param intersect: the intersection point
- * @return: the color
+ * @param u: horizontal coordinate in [0, 1], should be returned
+ * @param v: vertical coordinate in [0, 1], should be returned
  */
-CS123SceneColor getCubeIntersectTexColor(const SceneObject& object,
-                                         const int faceIndex,
-                                         const Vector4& intersect);
+void getCubeIntersectTexCoord(const int faceIndex,
+                              const Vector4& intersect,
+                              REAL& u,
+                              REAL& v);
 #endif
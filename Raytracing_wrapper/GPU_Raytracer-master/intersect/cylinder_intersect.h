@@ -32,14 +32,15 @@ Vector3 getCylinderNorm(const Vector4& intersectPoint,
                         const int faceIndex);
 
 /**
- * @brief getCylinderIntersectTexColor: get the texture color
- *                                      from intersection point
- * @param object: the scene object
+ * @brief getCylinderIntersectTexCoord: get the texture coordinates of the
+ *                                      intersection point
  * @param faceIndex: the face index of cylinder
  * @param intersect: the intersection point
- * @return: the color
+ * @param u: horizontal coordinate in [0, 1], should be returned
+ * @param v: vertical coordinate in [0, 1], should be returned
  */
-CS123SceneColor getCylinderIntersectTexColor(const SceneObject& object,
-                                             const int index,
-                                             const Vector4& intersect);
+void getCylinderIntersectTexCoord(const int index,
+                                  const Vector4& intersect,
+                                  REAL& u,
+                                  REAL& v);
 #endif
@@ -12,147 +12,425 @@
 #include "sphere_intersect.h"
 #include "cylinder_intersect.h"
 #include "plane_intersect.h"
+#include "mesh_intersect.h"
 #include "kdbox_intersect.h"
+#include "bvhbox_intersect.h"
 
 #include "global.h"
 #include "kdtree.h"
+#include "bvh.h"
+#include "scene_group.h"
+#include <algorithm>
 
-QVector<KdTreeNodeHost> kdnode_test;
-QVector<ObjectNodeHost> objnode_test;
+/**
+ * @struct: BvhStackEntry
+ * @brief The BvhStackEntry struct is a postponed child of a BVH node
+ */
+struct BvhStackEntry
+{
+    int child; // Child node, or first primitive of a leaf
+    int count; // Primitive count of a leaf, -1 for a node
+    float near; // 't' value entering the child's box
+};
+
+/**
+ * @struct: KdStackEntry
+ * @brief The KdStackEntry struct is a postponed kdtree node and the part of
+ *        the ray inside it
+ */
+struct KdStackEntry
+{
+    const KdFlatNode* node; // The compiled node
+    REAL near; // 't' value entering the node
+    REAL far; // 't' value leaving the node
+};
+
+/**
+ * @brief intersectObject: intersect a ray with an object of a view, the
+ *                         objects of a group are intersected through its
+ *                         BVH
+ * @param view: the objects as seen by the intersection loops
+ * @param prim: index of the object in the view
+ * @param eyePos: eye position
+ * @param d: eye direction
+ * @param maxT: the closest hit so far, a group misses the farther hits
+ * @param objectIndex: the object index in the scene, the index of the
+ *                     object hit for a group, should be returned
+ * @param faceIndex: the face index, should be returned
+ * @return: the 't' value
+ */
+static inline REAL intersectObject(const IntersectView& view,
+                                   int prim,
+                                   const Vector4& eyePos,
+                                   const Vector4& d,
+                                   REAL maxT,
+                                   int& objectIndex,
+                                   int& faceIndex)
+{
+
+    Vector4 eyePosObjSpace, dObjSpace;
+    view.transform(prim, eyePos, d, eyePosObjSpace, dObjSpace);
+    objectIndex = view.getObjectId(prim);
+    if (view.getType(prim) != PRIMITIVE_GROUP)
+        return doIntersect(view.getType(prim), view.getMesh(prim),
+                           eyePosObjSpace, dObjSpace, faceIndex);
+
+    int groupObject = -1;
+    REAL t = intersectGroup(view.getGroup(prim), eyePosObjSpace, dObjSpace,
+                            maxT, groupObject, faceIndex);
+    objectIndex += groupObject;
+    return t;
+}
+
+/**
+ * @brief intersectBvhFlat: find the closest hit of a ray among the objects
+ *                          of a view by traversing the binary nodes of a BVH
+ *                          over them, for intersectBvh() without SSE
+ * @param eyePos: eye position
+ * @param view: the objects as seen by the intersection loops
+ * @param d: eye direction
+ * @param bvh: the BVH over the objects of the view
+ * @param minT: the closest hit so far, farther hits are missed, updated
+ * @param objectIndex: the object index in the scene, updated
+ * @param faceIndex: the face index, updated
+ */
+static void intersectBvhFlat(const Vector4& eyePos,
+                             const IntersectView& view,
+                             const Vector4& d,
+                             const Bvh& bvh,
+                             REAL& minT,
+                             int& objectIndex,
+                             int& faceIndex)
+{
+
+    BvhWideRay ray;
+    initBvhWideRay(ray, eyePos, d);
+
+    const BvhFlatNode* nodes = bvh.getFlatNodes();
+    const int* prims         = bvh.getPrimitives();
+    int tempObjectIndex      = -1;
+    int tempFaceIndex        = -1;
+
+    REAL near;
+    if (!doIntersectRayBvhBox(ray, nodes[0], minT, near))
+        return;
+
+    BvhStackEntry nodeStack[BVH_FLAT_STACK_SIZE];
+    int stackTop = 0;
+    int current  = 0;
+
+    while (true)
+    {
+        const BvhFlatNode& node = nodes[current];
+        if (!node.isLeaf())
+        {
+            // Test both children, the nearer one goes first and the other
+            // one is more likely to be culled once it's popped
+            int left  = current + 1;
+            int right = node.getRight();
+            REAL leftNear, rightNear;
+            bool hitLeft  = doIntersectRayBvhBox(ray, nodes[left], minT,
+                                                 leftNear);
+            bool hitRight = doIntersectRayBvhBox(ray, nodes[right], minT,
+                                                 rightNear);
+            if (hitLeft && hitRight)
+            {
+                assert(stackTop < BVH_FLAT_STACK_SIZE);
+                BvhStackEntry& far = nodeStack[stackTop++];
+                far.count = -1;
+                if (rightNear < leftNear)
+                {
+                    far.child = left;
+                    far.near  = leftNear;
+                    current   = right;
+                }
+                else
+                {
+                    far.child = right;
+                    far.near  = rightNear;
+                    current   = left;
+                }
+                continue;
+            }
+            if (hitLeft || hitRight)
+            {
+                current = hitLeft ? left : right;
+                continue;
+            }
+        }
+        else
+        {
+            const int* leafPrims = prims + node.getPrimOffset();
+            for (unsigned i = 0; i < node.getPrimCount(); i++)
+            {
+                REAL t = intersectObject(view, leafPrims[i], eyePos, d, minT,
+                                         tempObjectIndex, tempFaceIndex);
+                if (t > 0 && t < minT)
+                {
+                    minT = t;
+                    objectIndex = tempObjectIndex;
+                    faceIndex = tempFaceIndex;
+                }
+            }
+        }
+
+        // Skip the children beginning behind a hit found after they
+        // were pushed
+        bool found = false;
+        while (stackTop > 0 && !found)
+        {
+            const BvhStackEntry& entry = nodeStack[--stackTop];
+            current = entry.child;
+            found   = entry.near <= minT;
+        }
+        if (!found)
+            break;
+    }
+}
+
+/**
+ * @brief intersectBvh: find the closest hit of a ray among the objects of a
+ *                      view by traversing a BVH over them, the wide nodes
+ *                      with SSE and otherwise the binary ones
+ * @param eyePos: eye position
+ * @param view: the objects as seen by the intersection loops
+ * @param d: eye direction
+ * @param bvh: the BVH over the objects of the view
+ * @param minT: the closest hit so far, farther hits are missed, updated
+ * @param objectIndex: the object index in the scene, updated
+ * @param faceIndex: the face index, updated
+ */
+static void intersectBvh(const Vector4& eyePos,
+                         const IntersectView& view,
+                         const Vector4& d,
+                         const Bvh& bvh,
+                         REAL& minT,
+                         int& objectIndex,
+                         int& faceIndex)
+{
+
+#ifdef BVH_USE_SSE
+    if (!checkBvhSse())
+#endif
+    {
+        intersectBvhFlat(eyePos, view, d, bvh, minT, objectIndex, faceIndex);
+        return;
+    }
+
+#ifdef BVH_USE_SSE
+    BvhWideRay ray;
+    initBvhWideRay(ray, eyePos, d);
+
+    const BvhWideNode* nodes = bvh.getNodes();
+    const int* prims         = bvh.getPrimitives();
+    int tempObjectIndex      = -1;
+    int tempFaceIndex        = -1;
+
+    BvhStackEntry nodeStack[BVH_STACK_SIZE];
+    int stackTop = 0;
+    BvhStackEntry current;
+    current.child = 0;
+    current.count = -1;
+    current.near  = 0;
+
+    while (true)
+    {
+        if (current.count < 0)
+        {
+            // Test all of the children at once, boxes behind the closest
+            // hit so far are missed
+            const BvhWideNode& node = nodes[current.child];
+            float near[BVH_WIDTH];
+            int mask = doIntersectRayBvhWideBoxSse(ray, node, minT, near);
+
+            // Push the hits farthest first, so the nearest one is popped
+            // first and the others are more likely to be culled
+            int first = stackTop;
+            for (int c = 0; c < BVH_WIDTH; c++)
+            {
+                if (!(mask & (1 << c)))
+                    continue;
+
+                int j = stackTop++;
+                assert(stackTop <= BVH_STACK_SIZE);
+                while (j > first && nodeStack[j - 1].near < near[c])
+                {
+                    nodeStack[j] = nodeStack[j - 1];
+                    j--;
+                }
+                nodeStack[j].child = node.m_child[c];
+                nodeStack[j].count = node.m_count[c];
+                nodeStack[j].near  = near[c];
+            }
+        }
+        else
+        {
+            const int* leafPrims = prims + current.child;
+
+            for (int i = 0; i < current.count; i++)
+            {
+                REAL t = intersectObject(view, leafPrims[i], eyePos, d, minT,
+                                         tempObjectIndex, tempFaceIndex);
+                if (t > 0 && t < minT)
+                {
+                    minT = t;
+                    objectIndex = tempObjectIndex;
+                    faceIndex = tempFaceIndex;
+                }
+            }
+        }
+
+        // Skip the children beginning behind a hit found after they
+        // were pushed
+        bool found = false;
+        while (stackTop > 0 && !found)
+        {
+            current = nodeStack[--stackTop];
+            found   = current.near <= minT;
+        }
+        if (!found)
+            break;
+    }
+#endif
+}
+
+REAL intersectGroup(const SceneGroup* group,
+                    const Vector4& eyePos,
+                    const Vector4& d,
+                    REAL maxT,
+                    int& objectIndex,
+                    int& faceIndex)
+{
+
+    REAL minT = maxT;
+    objectIndex = -1;
+    intersectBvh(eyePos, group->getIntersectView(), d, group->getBvh(),
+                 minT, objectIndex, faceIndex);
+    return objectIndex >= 0 ? minT : -1;
+}
 
 REAL intersect(const Vector4& eyePos,
-               const QVector<SceneObject>& objects,
+               const IntersectView& view,
                const Vector4& d,
                int& objectIndex,
                int& faceIndex,
                KdTree* tree,
-               AABB extends,
-               bool refract)
+               Bvh* bvh,
+               AABB extends)
 {
 
-    REAL minT         = POS_INF;
-    REAL resultT      = -1;
-    int tempFaceIndex = -1;
+    REAL minT           = POS_INF;
+    REAL resultT        = -1;
+    int tempObjectIndex = -1;
+    int tempFaceIndex   = -1;
 
-    if (settings.useKdTree && tree && !refract)
+    if (settings.useKdTree && settings.accelStruct == BVH && bvh)
+    {
+        intersectBvh(eyePos, view, d, *bvh, minT, objectIndex, faceIndex);
+        if (minT != POS_INF)
+            resultT = minT;
+    }
+    else if (settings.useKdTree && tree)
     {
         assert(EQ(eyePos.w, 1) && EQ(d.w, 0));
 
-        REAL near = -1, far = -1;
-        doIntersectRayKdBox(eyePos, d, near, far, extends);
-        if (near <= 0 && far <= 0)
+        // Clip the ray against the scene once, the nodes below only split
+        // the [near, far] segment at their planes
+        Vector4 invD(1.f / d.x, 1.f / d.y, 1.f / d.z, 0);
+        REAL near, far;
+        if (!doIntersectRayKdSlab(eyePos, invD, near, far, extends))
             return -1;
 
-        QVector<KdTreeNode*> nodeStack;
-        KdTreeNode* current = tree->getRoot();
+        const KdFlatNode* nodes = tree->getFlatNodes();
+        const int* prims        = tree->getFlatPrimitives();
 
-        while (current)
+        KdStackEntry nodeStack[KD_STACK_SIZE];
+        int stackTop = 0;
+        const KdFlatNode* current = nodes;
+
+        while (true)
         {
             while (!current->isLeaf())
             {
-                AABB curBox = current->getAABB();
-                REAL near, far;
-                doIntersectRayKdBox(eyePos, d, near, far, curBox);
-
-                int axis       = current->getAxis();
-                float splitPos = current->getSplitPos();
-
-                if (near == far)  // inside the box
-                    near = 0;
-                Vector4 nearPos = eyePos + d * near;
-                Vector4 farPos  = eyePos + d * far;
-                if (nearPos.data[axis] <= splitPos)
+                int axis      = current->getAxis();
+                REAL splitPos = current->m_split;
+                REAL origin   = eyePos.data[axis];
+
+                // The child on the eye's side of the plane comes first
+                const KdFlatNode* first  = current + 1;
+                const KdFlatNode* second = nodes + current->getRight();
+                if (origin > splitPos ||
+                        (origin == splitPos && d.data[axis] > 0))
+                    std::swap(first, second);
+
+                REAL tSplit = d.data[axis] != 0 ?
+                            (splitPos - origin) * invD.data[axis] : POS_INF;
+
+                if (tSplit > far || tSplit <= 0)
+                {
+                    current = first;
+                }
+                else if (tSplit < near)
                 {
-                    if (farPos.data[axis] <= splitPos)
-                    {
-                        current = current->getLeft();
-                        continue;
-                    }
-                    KdTreeNode* right = current->getRight();
-                    current = current->getLeft();
-
-                    // Preserve the right
-                    nodeStack.push_back(right);
+                    current = second;
                 }
                 else
                 {
-                    if (farPos.data[axis] > splitPos)
-                    {
-                        current = current->getRight();
-                        continue;
-                    }
-                    KdTreeNode* left = current->getLeft();
-                    current = current->getRight();
-                    nodeStack.push_back(left);
+                    // Preserve the far side
+                    assert(stackTop < KD_STACK_SIZE);
+                    nodeStack[stackTop].node = second;
+                    nodeStack[stackTop].near = tSplit;
+                    nodeStack[stackTop].far  = far;
+                    stackTop++;
+
+                    current = first;
+                    far     = tSplit;
                 }
             }
 
             // Then we found an near leaf, find if there is intersect
-            ObjectNode* objList = current->getObjectList();
-            minT = POS_INF;
+            const int* leafPrims = prims + current->m_primOffset;
+            int primCount        = current->getPrimCount();
 
-            while (objList)
+            for (int i = 0; i < primCount; i++)
             {
-                SceneObject* curObj  = objList->getObject();
-                Matrix4x4 invCompMat = (*curObj).m_invTransform;
-
-                Vector4 eyePosObjSpace = invCompMat * eyePos;
-                Vector4 dObjSpace      = invCompMat * d;
-
-                REAL t = doIntersect(*curObj,
-                                     eyePosObjSpace,
-                                     dObjSpace,
-                                     tempFaceIndex);
+                REAL t = intersectObject(view, leafPrims[i], eyePos, d, minT,
+                                         tempObjectIndex, tempFaceIndex);
                 if (t > 0 && t < minT)
                 {
                     minT = t;
-                    objectIndex = curObj->m_arrayID;
+                    objectIndex = tempObjectIndex;
                     faceIndex = tempFaceIndex;
                 }
-                objList = objList->getNext();
             }
-            Vector4 dst = eyePos + minT * d;
-            // Here we need to enlarge the bounding box a little bit
-            AABB curBox = AABB(current->getAABB().getPos() -
-                               Vector3(EPSILON,EPSILON, EPSILON),
-                               current->getAABB().getSize() +
-                               2 * Vector3(EPSILON, EPSILON, EPSILON));
-
-            if (minT != POS_INF &&
-                    curBox.contains(Vector3(dst.x, dst.y, dst.z)))
-            {
-                resultT = minT;
+
+            // The postponed nodes are all behind this leaf, a hit inside
+            // the leaf's segment can't be beaten
+            if (minT <= far || stackTop == 0)
                 break;
-            }
-            // Else we need to get one node from the stack
-            if (nodeStack.empty())
-            {
-                // No more nodes, meaning there is no intersect
+
+            stackTop--;
+            current = nodeStack[stackTop].node;
+            near    = nodeStack[stackTop].near;
+            far     = nodeStack[stackTop].far;
+
+            // A hit from an earlier leaf may end before this node begins
+            if (minT < near)
                 break;
-            }
-            else
-            {
-                current = nodeStack.at(nodeStack.size() - 1);
-                nodeStack.pop_back();
-            }
         }
+        if (minT != POS_INF)
+            resultT = minT;
     }
     else
     {
-        for (int i = 0; i < objects.size(); i++)
+        for (int i = 0; i < view.getCount(); i++)
         {
-            const SceneObject& curObj = objects[i];
-            Matrix4x4 invCompMat = curObj.m_invTransform;
-
-            Vector4 eyePosObjSpace = invCompMat * eyePos;
-            Vector4 dObjSpace      = invCompMat * d;
-
-            REAL t = doIntersect(curObj, eyePosObjSpace,
-                                 dObjSpace, tempFaceIndex);
+            REAL t = intersectObject(view, i, eyePos, d, minT,
+                                     tempObjectIndex, tempFaceIndex);
             if (t > 0 && t < minT)
             {
                 minT = t;
-                objectIndex = i;
+                objectIndex = tempObjectIndex;
                 faceIndex = tempFaceIndex;
             }
         }
@@ -164,14 +442,322 @@ REAL intersect(const Vector4& eyePos,
     return resultT;
 }
 
-REAL doIntersect(const SceneObject &object,
+/**
+ * @brief occludeObject: check if an object of the view lies on a segment of
+ *                       a ray, for occlude()
+ * @param view: the objects as seen by the intersection loops
+ * @param prim: index of the object in the view
+ * @param eyePos: start of the segment
+ * @param d: direction of the segment
+ * @param maxT: the 't' value ending the segment
+ * @param skipObject: the object that never occludes, unless it is a mesh
+ * @param skipTransparent: ignore the objects with a transparent material
+ * @return: true if the object lies on the segment
+ */
+static inline bool occludeObject(const IntersectView& view,
+                                 int prim,
+                                 const Vector4& eyePos,
+                                 const Vector4& d,
+                                 REAL maxT,
+                                 int skipObject,
+                                 bool skipTransparent)
+{
+
+    // The ids of a group's objects count from the group's id
+    if (view.getType(prim) == PRIMITIVE_GROUP)
+    {
+        Vector4 eyePosObjSpace, dObjSpace;
+        view.transform(prim, eyePos, d, eyePosObjSpace, dObjSpace);
+        return occludeGroup(view.getGroup(prim), eyePosObjSpace, dObjSpace,
+                            maxT, skipObject - view.getObjectId(prim),
+                            skipTransparent);
+    }
+
+    // A convex primitive can't shadow the point it was hit at, a mesh can:
+    // it is tested like the others and the triangle hit is left behind by
+    // the segment starting off the surface
+    if ((view.getObjectId(prim) == skipObject &&
+         view.getType(prim) != PRIMITIVE_MESH) ||
+        (skipTransparent && view.isTransparent(prim)))
+        return false;
+
+    int faceIndex = -1;
+    Vector4 eyePosObjSpace, dObjSpace;
+    view.transform(prim, eyePos, d, eyePosObjSpace, dObjSpace);
+    REAL t = doIntersect(view.getType(prim), view.getMesh(prim),
+                         eyePosObjSpace, dObjSpace, faceIndex);
+    return t > 0 && t < maxT;
+}
+
+/**
+ * @brief occludeBvhFlat: check if an object of a view lies on a segment of
+ *                        a ray by traversing the binary nodes of a BVH over
+ *                        the objects, for occludeBvh() without SSE
+ * @param start: start of the segment
+ * @param view: the objects as seen by the intersection loops
+ * @param d: direction of the segment
+ * @param bvh: the BVH over the objects of the view
+ * @param maxT: the 't' value ending the segment
+ * @param skipObject: the object that never occludes
+ * @param skipTransparent: ignore the objects with a transparent material
+ * @return: true if an object lies on the segment
+ */
+static bool occludeBvhFlat(const Vector4& start,
+                           const IntersectView& view,
+                           const Vector4& d,
+                           const Bvh& bvh,
+                           REAL maxT,
+                           int skipObject,
+                           bool skipTransparent)
+{
+
+    BvhWideRay ray;
+    initBvhWideRay(ray, start, d);
+
+    const BvhFlatNode* nodes = bvh.getFlatNodes();
+    const int* prims         = bvh.getPrimitives();
+
+    // Any hit will do, so the children are visited in no special order
+    int nodeStack[BVH_FLAT_STACK_SIZE];
+    int stackTop = 0;
+    int current  = 0;
+
+    while (true)
+    {
+        const BvhFlatNode& node = nodes[current];
+        REAL near;
+        if (doIntersectRayBvhBox(ray, node, maxT, near))
+        {
+            if (!node.isLeaf())
+            {
+                assert(stackTop < BVH_FLAT_STACK_SIZE);
+                nodeStack[stackTop++] = node.getRight();
+                current = current + 1;
+                continue;
+            }
+
+            const int* leafPrims = prims + node.getPrimOffset();
+            for (unsigned i = 0; i < node.getPrimCount(); i++)
+            {
+                if (occludeObject(view, leafPrims[i], start, d, maxT,
+                                  skipObject, skipTransparent))
+                    return true;
+            }
+        }
+
+        if (stackTop == 0)
+            break;
+        current = nodeStack[--stackTop];
+    }
+    return false;
+}
+
+/**
+ * @brief occludeBvh: check if an object of a view lies on a segment of a
+ *                    ray by traversing a BVH over the objects, the wide
+ *                    nodes with SSE and otherwise the binary ones
+ * @param start: start of the segment
+ * @param view: the objects as seen by the intersection loops
+ * @param d: direction of the segment
+ * @param bvh: the BVH over the objects of the view
+ * @param maxT: the 't' value ending the segment
+ * @param skipObject: the object that never occludes
+ * @param skipTransparent: ignore the objects with a transparent material
+ * @return: true if an object lies on the segment
+ */
+static bool occludeBvh(const Vector4& start,
+                       const IntersectView& view,
+                       const Vector4& d,
+                       const Bvh& bvh,
+                       REAL maxT,
+                       int skipObject,
+                       bool skipTransparent)
+{
+
+#ifdef BVH_USE_SSE
+    if (!checkBvhSse())
+#endif
+        return occludeBvhFlat(start, view, d, bvh, maxT, skipObject,
+                              skipTransparent);
+
+#ifdef BVH_USE_SSE
+    BvhWideRay ray;
+    initBvhWideRay(ray, start, d);
+
+    const BvhWideNode* nodes = bvh.getNodes();
+    const int* prims         = bvh.getPrimitives();
+
+    // Any hit will do, so the children are visited in no special order
+    BvhStackEntry nodeStack[BVH_STACK_SIZE];
+    int stackTop = 0;
+    BvhStackEntry current;
+    current.child = 0;
+    current.count = -1;
+
+    while (true)
+    {
+        if (current.count < 0)
+        {
+            const BvhWideNode& node = nodes[current.child];
+            float near[BVH_WIDTH];
+            int mask = doIntersectRayBvhWideBoxSse(ray, node, maxT, near);
+
+            for (int c = 0; c < BVH_WIDTH; c++)
+            {
+                if (!(mask & (1 << c)))
+                    continue;
+
+                assert(stackTop < BVH_STACK_SIZE);
+                nodeStack[stackTop].child = node.m_child[c];
+                nodeStack[stackTop].count = node.m_count[c];
+                stackTop++;
+            }
+        }
+        else
+        {
+            const int* leafPrims = prims + current.child;
+            for (int i = 0; i < current.count; i++)
+            {
+                if (occludeObject(view, leafPrims[i], start, d, maxT,
+                                  skipObject, skipTransparent))
+                    return true;
+            }
+        }
+
+        if (stackTop == 0)
+            break;
+        current = nodeStack[--stackTop];
+    }
+    return false;
+#endif
+}
+
+bool occludeGroup(const SceneGroup* group,
+                  const Vector4& eyePos,
+                  const Vector4& d,
+                  REAL maxT,
+                  int skipObject,
+                  bool skipTransparent)
+{
+
+    return occludeBvh(eyePos, group->getIntersectView(), d, group->getBvh(),
+                      maxT, skipObject, skipTransparent);
+}
+
+bool occlude(const Vector4& eyePos,
+             const IntersectView& view,
+             const Vector4& d,
+             REAL minT,
+             REAL maxT,
+             int skipObject,
+             bool skipTransparent,
+             KdTree* tree,
+             Bvh* bvh,
+             AABB extends)
+{
+
+    // Start the segment at minT, an object the point lies inside of is hit
+    // where the segment leaves it
+    Vector4 start = eyePos + d * minT;
+    maxT -= minT;
+
+    if (settings.useKdTree && settings.accelStruct == BVH && bvh)
+        return occludeBvh(start, view, d, *bvh, maxT, skipObject,
+                          skipTransparent);
+    if (settings.useKdTree && tree)
+    {
+        assert(EQ(eyePos.w, 1) && EQ(d.w, 0));
+
+        // Only the segment up to maxT is walked
+        Vector4 invD(1.f / d.x, 1.f / d.y, 1.f / d.z, 0);
+        REAL near, far;
+        if (!doIntersectRayKdSlab(start, invD, near, far, extends) ||
+            near >= maxT)
+            return false;
+        far = far < maxT ? far : maxT;
+
+        const KdFlatNode* nodes = tree->getFlatNodes();
+        const int* prims        = tree->getFlatPrimitives();
+
+        KdStackEntry nodeStack[KD_STACK_SIZE];
+        int stackTop = 0;
+        const KdFlatNode* current = nodes;
+
+        while (true)
+        {
+            while (!current->isLeaf())
+            {
+                int axis      = current->getAxis();
+                REAL splitPos = current->m_split;
+                REAL origin   = start.data[axis];
+
+                const KdFlatNode* first  = current + 1;
+                const KdFlatNode* second = nodes + current->getRight();
+                if (origin > splitPos ||
+                        (origin == splitPos && d.data[axis] > 0))
+                    std::swap(first, second);
+
+                REAL tSplit = d.data[axis] != 0 ?
+                            (splitPos - origin) * invD.data[axis] : POS_INF;
+
+                if (tSplit > far || tSplit <= 0)
+                {
+                    current = first;
+                }
+                else if (tSplit < near)
+                {
+                    current = second;
+                }
+                else
+                {
+                    assert(stackTop < KD_STACK_SIZE);
+                    nodeStack[stackTop].node = second;
+                    nodeStack[stackTop].near = tSplit;
+                    nodeStack[stackTop].far  = far;
+                    stackTop++;
+
+                    current = first;
+                    far     = tSplit;
+                }
+            }
+
+            const int* leafPrims = prims + current->m_primOffset;
+            int primCount        = current->getPrimCount();
+            for (int i = 0; i < primCount; i++)
+            {
+                if (occludeObject(view, leafPrims[i], start, d, maxT,
+                                  skipObject, skipTransparent))
+                    return true;
+            }
+
+            if (stackTop == 0)
+                break;
+            stackTop--;
+            current = nodeStack[stackTop].node;
+            near    = nodeStack[stackTop].near;
+            far     = nodeStack[stackTop].far;
+        }
+        return false;
+    }
+
+    for (int i = 0; i < view.getCount(); i++)
+    {
+        if (occludeObject(view, i, start, d, maxT, skipObject,
+                          skipTransparent))
+            return true;
+    }
+    return false;
+}
+
+REAL doIntersect(PrimitiveType type,
+                 const Mesh* mesh,
                  const Vector4& eyePos,
                  const Vector4& d,
                  int& faceIndex)
 {
 
     REAL t = -1;
-    switch (object.m_primitive.type)
+    switch (type)
     {
     case PRIMITIVE_CUBE:
     {
@@ -201,8 +787,7 @@ REAL doIntersect(const SceneObject &object,
     }
     case PRIMITIVE_MESH:
     {
-        // not support mesh
-        //assert(0);
+        t = doIntersectMesh(mesh, eyePos, d, faceIndex);
         break;
     }
     default:
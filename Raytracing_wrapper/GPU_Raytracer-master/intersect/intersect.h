@@ -15,39 +15,115 @@
 #include "aabb.h"
 #include "CS123Algebra.h"
 #include "scene.h"
+#include "intersect_view.h"
 
 class KdTree;
+class Bvh;
 
 /**
  * @brief intersect: the wrapper for doing intersecting detection on
  *                   all possible objects
  * @param eyePos: eye position
- * @param objects: the list of objects
+ * @param view: the objects as seen by the intersection loops
  * @param d: eye direction
- * @param objectIndex: the object index, should be returned
+ * @param objectIndex: the object index in the scene, should be returned
  * @param faceIndex: the face index, should be returned
  * @param tree: the pointer to the kdtree
+ * @param bvh: the pointer to the BVH, used instead of the kdtree when
+ *             settings.accelStruct is BVH
  * @param extends: the bounding box of the whole scene
- * @param refract: enabling refraction or not
  * @return: the 't' value
  */
 REAL intersect(const Vector4& eyePos,
-               const QVector<SceneObject>& objects,
+               const IntersectView& view,
                const Vector4& d,
                int& objectIndex,
                int& faceIndex,
                KdTree* tree,
-               AABB extends,
-               bool refract = false);
+               Bvh* bvh,
+               AABB extends);
+
+/**
+ * @brief occlude: check if anything lies on a segment of a ray, the shadow
+ *                 query. Unlike intersect() it stops at the first hit found
+ *                 instead of looking for the closest one
+ * @param eyePos: start of the ray, the point in question
+ * @param view: the objects as seen by the intersection loops
+ * @param d: direction of the ray, towards the light
+ * @param minT: the segment starts at this 't' value, off the surface the
+ *              point is on
+ * @param maxT: the segment ends at this 't' value, the distance to the
+ *              light or POS_INF
+ * @param skipObject: the object the ray starts on, it never occludes
+ *                    unless it is a mesh, which can shadow itself
+ * @param skipTransparent: ignore the objects with a transparent material
+ * @param tree: the pointer to the kdtree
+ * @param bvh: the pointer to the BVH, used instead of the kdtree when
+ *             settings.accelStruct is BVH
+ * @param extends: the bounding box of the whole scene
+ * @return: true if an object lies on the segment
+ */
+bool occlude(const Vector4& eyePos,
+             const IntersectView& view,
+             const Vector4& d,
+             REAL minT,
+             REAL maxT,
+             int skipObject,
+             bool skipTransparent,
+             KdTree* tree,
+             Bvh* bvh,
+             AABB extends);
+
+/**
+ * @brief intersectGroup: find the closest hit of a ray among the objects of
+ *                        a group by traversing its BVH
+ * @param group: the group
+ * @param eyePos: eye position in the space of the group
+ * @param d: eye direction in the space of the group
+ * @param maxT: the closest hit so far, farther hits are missed
+ * @param objectIndex: the index of the object hit in the group, should be
+ *                     returned
+ * @param faceIndex: the face index, should be returned
+ * @return: the 't' value, -1 for no hit
+ */
+REAL intersectGroup(const SceneGroup* group,
+                    const Vector4& eyePos,
+                    const Vector4& d,
+                    REAL maxT,
+                    int& objectIndex,
+                    int& faceIndex);
+
+/**
+ * @brief occludeGroup: check if an object of a group lies on a segment of
+ *                      a ray, the shadow query of occlude() for a group
+ * @param group: the group
+ * @param eyePos: start of the segment in the space of the group
+ * @param d: direction of the segment in the space of the group
+ * @param maxT: the 't' value ending the segment
+ * @param skipObject: the index in the group of the object that never
+ *                    occludes, unless it is a mesh
+ * @param skipTransparent: ignore the objects with a transparent material
+ * @return: true if an object lies on the segment
+ */
+bool occludeGroup(const SceneGroup* group,
+                  const Vector4& eyePos,
+                  const Vector4& d,
+                  REAL maxT,
+                  int skipObject,
+                  bool skipTransparent);
 
 /**
  * @brief doIntersect: do intersecting detection on specific object
+ * @param type: the primitive type of the object
+ * @param mesh: the triangles of a mesh, NULL for the other types
  * @param eyePos: eye position
  * @param d: eye direction
- * @param faceIndex: the face index, should be returned
+ * @param faceIndex: the face index, the triangle of a mesh, should be
+ *                   returned
  * @return: the 't' value
  */
-REAL doIntersect(const SceneObject &object,
+REAL doIntersect(PrimitiveType type,
+                 const Mesh* mesh,
                  const Vector4& eyePos,
                  const Vector4& d,
                  int& faceIndex);
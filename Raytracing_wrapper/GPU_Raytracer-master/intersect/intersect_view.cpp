@@ -0,0 +1,102 @@
+/*!
+    @file intersect_view.cpp
+    @desc: definitions of IntersectView class
+    @author: yanli
+    @date: May 2013
+ */
+
+#include "intersect_view.h"
+
+IntersectView::IntersectView()
+{
+
+    m_types         = NULL;
+    m_transparent   = NULL;
+    m_invTransforms = NULL;
+    m_objectIds     = NULL;
+    m_meshes        = NULL;
+    m_groups        = NULL;
+    m_count         = 0;
+}
+
+IntersectView::~IntersectView()
+{
+
+    freeMem();
+}
+
+void IntersectView::build(const QVector<SceneObject>& objects)
+{
+
+    freeMem();
+
+    m_count = objects.size();
+    int size = qMax(m_count, 1);
+    m_types = (unsigned char*)qMallocAligned(size,
+                                             INTERSECT_VIEW_ALIGNMENT);
+    m_transparent = (unsigned char*)qMallocAligned(size,
+                                                   INTERSECT_VIEW_ALIGNMENT);
+    m_invTransforms = (REAL*)qMallocAligned(size * 12 * sizeof(REAL),
+                                            INTERSECT_VIEW_ALIGNMENT);
+    m_objectIds = (int*)qMallocAligned(size * sizeof(int),
+                                       INTERSECT_VIEW_ALIGNMENT);
+    m_meshes = (const Mesh**)qMallocAligned(size * sizeof(const Mesh*),
+                                            INTERSECT_VIEW_ALIGNMENT);
+    m_groups = (const SceneGroup**)qMallocAligned(
+                size * sizeof(const SceneGroup*), INTERSECT_VIEW_ALIGNMENT);
+
+    for (int i = 0; i < m_count; i++)
+        setObject(i, objects[i]);
+}
+
+void IntersectView::update(const SceneObject& object)
+{
+
+    assert(object.m_arrayID >= 0 && object.m_arrayID < m_count);
+    setObject(object.m_arrayID, object);
+}
+
+void IntersectView::setObject(int i, const SceneObject& object)
+{
+
+    const Matrix4x4& invTransform = object.m_invTransform;
+
+    // The last row is dropped, it has to be (0, 0, 0, 1) up to the
+    // rounding of the inverse
+    assert(EQ(invTransform.m, 0) && EQ(invTransform.n, 0) &&
+           EQ(invTransform.o, 0) && EQ(invTransform.p, 1));
+
+    const CS123SceneColor& transparent =
+            object.m_primitive.material.cTransparent;
+    m_types[i] = object.m_primitive.type;
+    m_transparent[i] = !EQ4(transparent.a, transparent.r,
+                            transparent.g, transparent.b, 0);
+    memcpy(m_invTransforms + i * 12, invTransform.data, 12 * sizeof(REAL));
+    m_objectIds[i] = object.m_flatID;
+    m_meshes[i]    = object.m_mesh;
+    m_groups[i]    = object.m_group;
+}
+
+void IntersectView::freeMem()
+{
+
+    if (m_types)
+        qFreeAligned(m_types);
+    if (m_transparent)
+        qFreeAligned(m_transparent);
+    if (m_invTransforms)
+        qFreeAligned(m_invTransforms);
+    if (m_objectIds)
+        qFreeAligned(m_objectIds);
+    if (m_meshes)
+        qFreeAligned(m_meshes);
+    if (m_groups)
+        qFreeAligned(m_groups);
+    m_types         = NULL;
+    m_transparent   = NULL;
+    m_invTransforms = NULL;
+    m_objectIds     = NULL;
+    m_meshes        = NULL;
+    m_groups        = NULL;
+    m_count         = 0;
+}
@@ -0,0 +1,121 @@
+/*!
+    @file intersect_view.h
+    @desc: declarations of IntersectView class
+    @author: yanli
+    @date: May 2013
+ */
+
+#ifndef INTERSECT_VIEW_H
+#define INTERSECT_VIEW_H
+
+#include "scene.h"
+
+#define INTERSECT_VIEW_ALIGNMENT 64 // Alignment of the arrays in bytes
+#define INTERSECT_VIEW_OBJECT_SIZE (2 + 12 * sizeof(REAL) + sizeof(int) + \
+                                    2 * sizeof(void*)) // Bytes per object in
+                                                       // the view
+
+/**
+ * @class: IntersectView
+ * @brief The IntersectView class is the compact copy of the scene objects
+ *        read by the intersection loops: the primitive type, whether the
+ *        material is transparent, the inverse transform without its
+ *        constant last row, the id of the object, the mesh of the mesh
+ *        objects and the group of the group objects, each in an array of
+ *        its own. A SceneObject is several hundred bytes, this is
+ *        INTERSECT_VIEW_OBJECT_SIZE bytes, so the loops touch a cache line
+ *        per object instead of many. Materials and textures are only looked
+ *        up in the SceneObject of the closest hit
+ */
+class IntersectView
+{
+public:
+
+    IntersectView();
+    ~IntersectView();
+
+    /**
+     * @brief build: copy what the intersection loops need from the objects
+     * @param objects: the objects, their transforms have to be affine
+     */
+    void build(const QVector<SceneObject>& objects);
+
+    /**
+     * @brief update: copy an object again after its transform changed
+     * @param object: the object, at index m_arrayID in the view
+     */
+    void update(const SceneObject& object);
+
+    /**
+     * @brief transform: transform a ray into the space of an object, the
+     *                   same way as Matrix4x4 * Vector4 would
+     * @param i: index of the object in the view
+     * @param eyePos: the eye position
+     * @param d: the direction
+     * @param eyePosObjSpace: the eye position in object space, should be
+     *                        returned
+     * @param dObjSpace: the direction in object space, should be returned
+     */
+    inline void transform(int i, const Vector4& eyePos, const Vector4& d,
+                          Vector4& eyePosObjSpace, Vector4& dObjSpace) const
+    {
+        const REAL* row = m_invTransforms + i * 12;
+        for (int k = 0; k < 3; k++, row += 4)
+        {
+            eyePosObjSpace.data[k] = row[0] * eyePos.x + row[1] * eyePos.y +
+                    row[2] * eyePos.z + row[3] * eyePos.w;
+            dObjSpace.data[k] = row[0] * d.x + row[1] * d.y +
+                    row[2] * d.z + row[3] * d.w;
+        }
+        eyePosObjSpace.w = eyePos.w;
+        dObjSpace.w      = d.w;
+    }
+
+    /**
+     * Getters
+     */
+    int getCount() const { return m_count; }
+    PrimitiveType getType(int i) const { return (PrimitiveType)m_types[i]; }
+    bool isTransparent(int i) const { return m_transparent[i] != 0; }
+    const REAL* getInvTransform(int i) const
+    {
+        return m_invTransforms + i * 12;
+    }
+    int getObjectId(int i) const { return m_objectIds[i]; }
+    const Mesh* getMesh(int i) const { return m_meshes[i]; }
+    const SceneGroup* getGroup(int i) const { return m_groups[i]; }
+
+private:
+
+    // The view owns its arrays, it's never copied
+    IntersectView(const IntersectView&);
+    IntersectView& operator=(const IntersectView&);
+
+    /**
+     * @brief setObject: copy an object into the arrays
+     * @param i: index of the object in the view
+     * @param object: the object, its transform has to be affine
+     */
+    void setObject(int i, const SceneObject& object);
+
+    /**
+     * @brief freeMem: free all
+     */
+    void freeMem();
+
+private:
+
+    unsigned char* m_types; // Primitive types
+    unsigned char* m_transparent; // 1 for the objects letting light through
+    REAL* m_invTransforms; // Upper 3 rows of the inverse transforms, 12
+                           // floats per object
+    int* m_objectIds; // Id of each object in the scene with its groups
+                      // expanded
+    const Mesh** m_meshes; // Triangles of the meshes, NULL for the other
+                           // types
+    const SceneGroup** m_groups; // Objects of the groups, NULL for the
+                                 // other types
+    int m_count; // Number of objects
+};
+
+#endif // INTERSECT_VIEW_H
@@ -13,17 +13,42 @@
 #include "aabb.h"
 
 /**
- * @brief doIntersectRayKdBox: do the intersecting detection with KD box
+ * @brief doIntersectRayKdBox: do the intersecting detection with KD box,
+ *                             a branchless slab test
  * @param eyePos: the eye position
- * @param d: the direction
- * @param near: the 't' value intersecting near plane
- * @param far: the 't' value intersecting far plane
+ * @param invD: the reciprocal of the direction
+ * @param near: the 't' value entering the box, should be returned
+ * @param far: the 't' value leaving the box, should be returned
+ * @param nearFace: the face entering the box, see doIntersectRaySlabs(),
+ *                  should be returned
+ * @param farFace: the face leaving the box, should be returned
  * @param box: the AABB box
+ * @return: true if the ray hits the box in front of the eye, near is
+ *          negative when the eye is inside
  */
-void doIntersectRayKdBox(const Vector4& eyePos,
-                         const Vector4& d,
+bool doIntersectRayKdBox(const Vector4& eyePos,
+                         const Vector4& invD,
                          REAL& near,
                          REAL& far,
+                         int& nearFace,
+                         int& farFace,
                          AABB box);
 
+/**
+ * @brief doIntersectRayKdSlab: intersect the ray with the box's three slabs,
+ *                              the cheap test used once per ray by kdtree
+ *                              traversal
+ * @param eyePos: the eye position
+ * @param invD: the reciprocal of the direction
+ * @param near: the 't' value entering the box, should be returned
+ * @param far: the 't' value leaving the box, should be returned
+ * @param box: the AABB box
+ * @return: true if the ray hits the box in front of the eye
+ */
+bool doIntersectRayKdSlab(const Vector4& eyePos,
+                          const Vector4& invD,
+                          REAL& near,
+                          REAL& far,
+                          AABB box);
+
 #endif // KDBOX_INTERSECT_H
@@ -0,0 +1,418 @@
+/*!
+    @file mesh_intersect.cpp
+    @desc: definitions of the functions doing mesh's intersecting detection
+    @author: yanli
+    @date: May 2013
+ */
+
+#include "mesh_intersect.h"
+#include "bvhbox_intersect.h"
+#include "mesh.h"
+#include "utils.h"
+#include <math.h>
+
+/**
+ * @struct: MeshRay
+ * @brief The MeshRay struct is a ray prepared for the watertight triangle
+ *        test: the axis the ray runs along the most becomes z and the
+ *        vertices are sheared so the ray runs along it, the test is then
+ *        done in 2D on the edge functions
+ */
+struct MeshRay
+{
+    float m_origin[3]; // The eye position
+    int m_kx, m_ky, m_kz; // Axes of the sheared space, m_kz is the largest
+                          // component of the direction
+    float m_sx, m_sy, m_sz; // Shear and scale of the vertices
+};
+
+/**
+ * @struct: MeshStackEntry
+ * @brief The MeshStackEntry struct is a postponed child of a node of the
+ *        mesh's BVH
+ */
+struct MeshStackEntry
+{
+    int child; // Child node, or first triangle of a leaf
+    int count; // Triangle count of a leaf, -1 for a node
+    float near; // 't' value entering the child's box
+};
+
+/**
+ * @brief initMeshRay: prepare a ray for the watertight triangle test
+ * @param ray: the prepared ray, should be returned
+ * @param eyePos: eye position in object space
+ * @param d: eye direction in object space
+ */
+static void initMeshRay(MeshRay& ray, const Vector4& eyePos, const Vector4& d)
+{
+
+    int kz = 0;
+    for (int k = 1; k < 3; k++)
+    {
+        if (fabsf(d.data[k]) > fabsf(d.data[kz]))
+            kz = k;
+    }
+    int kx = (kz + 1) % 3;
+    int ky = (kx + 1) % 3;
+
+    // Keep the winding of the triangles
+    if (d.data[kz] < 0)
+        std::swap(kx, ky);
+
+    for (int k = 0; k < 3; k++)
+        ray.m_origin[k] = eyePos.data[k];
+    ray.m_kx = kx;
+    ray.m_ky = ky;
+    ray.m_kz = kz;
+    ray.m_sx = d.data[kx] / d.data[kz];
+    ray.m_sy = d.data[ky] / d.data[kz];
+    ray.m_sz = 1.f / d.data[kz];
+}
+
+/**
+ * @brief doIntersectTriangle: intersect a ray with a triangle, watertight
+ *                             after Woop et al.: the edge functions are
+ *                             evaluated in the same way for the triangles
+ *                             sharing an edge and recomputed in double when
+ *                             one is zero, so no ray slips through
+ * @param ray: the prepared ray
+ * @param a: the first vertex
+ * @param b: the second vertex
+ * @param c: the third vertex
+ * @param maxT: the closest hit so far, farther hits are missed
+ * @param t: the 't' value of the hit, should be returned
+ * @return: true if the ray hits the triangle between the eye and maxT
+ */
+static inline bool doIntersectTriangle(const MeshRay& ray,
+                                       const float* a,
+                                       const float* b,
+                                       const float* c,
+                                       REAL maxT,
+                                       REAL& t)
+{
+
+    int kx = ray.m_kx;
+    int ky = ray.m_ky;
+    int kz = ray.m_kz;
+
+    // The vertices relative to the eye, sheared and scaled
+    float aZ = a[kz] - ray.m_origin[kz];
+    float bZ = b[kz] - ray.m_origin[kz];
+    float cZ = c[kz] - ray.m_origin[kz];
+    float aX = a[kx] - ray.m_origin[kx] - ray.m_sx * aZ;
+    float aY = a[ky] - ray.m_origin[ky] - ray.m_sy * aZ;
+    float bX = b[kx] - ray.m_origin[kx] - ray.m_sx * bZ;
+    float bY = b[ky] - ray.m_origin[ky] - ray.m_sy * bZ;
+    float cX = c[kx] - ray.m_origin[kx] - ray.m_sx * cZ;
+    float cY = c[ky] - ray.m_origin[ky] - ray.m_sy * cZ;
+
+    float u = cX * bY - cY * bX;
+    float v = aX * cY - aY * cX;
+    float w = bX * aY - bY * aX;
+
+    // The ray passes close to an edge, float can't tell the side
+    if (u == 0 || v == 0 || w == 0)
+    {
+        u = (float)((double)cX * bY - (double)cY * bX);
+        v = (float)((double)aX * cY - (double)aY * cX);
+        w = (float)((double)bX * aY - (double)bY * aX);
+    }
+
+    // Both windings hit
+    if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0))
+        return false;
+
+    float det = u + v + w;
+    if (det == 0)
+        return false;
+
+    float tScaled = (u * aZ + v * bZ + w * cZ) * ray.m_sz;
+    t = tScaled / det;
+    return t > 0 && t < maxT;
+}
+
+/**
+ * @brief doIntersectMeshFlat: intersect a ray with the triangles of a mesh
+ *                             by traversing the binary nodes of its BVH,
+ *                             for doIntersectMesh() without SSE
+ * @param mesh: the mesh
+ * @param ray: the ray prepared for the triangle test
+ * @param boxRay: the ray prepared for the box test
+ * @param faceIndex: the triangle hit, should be returned
+ * @return: "t" value, POS_INF for none
+ */
+static REAL doIntersectMeshFlat(const Mesh* mesh,
+                                const MeshRay& ray,
+                                const BvhWideRay& boxRay,
+                                int& faceIndex)
+{
+
+    const BvhFlatNode* nodes = mesh->getBvh().getFlatNodes();
+    const float* positions   = mesh->getPositions();
+    const int* triangles     = mesh->getTriangles();
+
+    REAL minT = POS_INF;
+    REAL near;
+    if (!doIntersectRayBvhBox(boxRay, nodes[0], minT, near))
+        return minT;
+
+    MeshStackEntry nodeStack[BVH_FLAT_STACK_SIZE];
+    int stackTop = 0;
+    int current  = 0;
+
+    while (true)
+    {
+        const BvhFlatNode& node = nodes[current];
+        if (!node.isLeaf())
+        {
+            // Nearer child first
+            int left  = current + 1;
+            int right = node.getRight();
+            REAL leftNear, rightNear;
+            bool hitLeft  = doIntersectRayBvhBox(boxRay, nodes[left], minT,
+                                                 leftNear);
+            bool hitRight = doIntersectRayBvhBox(boxRay, nodes[right], minT,
+                                                 rightNear);
+            if (hitLeft && hitRight)
+            {
+                assert(stackTop < BVH_FLAT_STACK_SIZE);
+                MeshStackEntry& far = nodeStack[stackTop++];
+                far.count = -1;
+                if (rightNear < leftNear)
+                {
+                    far.child = left;
+                    far.near  = leftNear;
+                    current   = right;
+                }
+                else
+                {
+                    far.child = right;
+                    far.near  = rightNear;
+                    current   = left;
+                }
+                continue;
+            }
+            if (hitLeft || hitRight)
+            {
+                current = hitLeft ? left : right;
+                continue;
+            }
+        }
+        else
+        {
+            int end = node.getPrimOffset() + node.getPrimCount();
+            for (int i = node.getPrimOffset(); i < end; i++)
+            {
+                const int* triangle = triangles + i * 3;
+                REAL t;
+                if (doIntersectTriangle(ray,
+                                        positions + triangle[0] * 3,
+                                        positions + triangle[1] * 3,
+                                        positions + triangle[2] * 3,
+                                        minT, t))
+                {
+                    minT      = t;
+                    faceIndex = i;
+                }
+            }
+        }
+
+        bool found = false;
+        while (stackTop > 0 && !found)
+        {
+            const MeshStackEntry& entry = nodeStack[--stackTop];
+            current = entry.child;
+            found   = entry.near <= minT;
+        }
+        if (!found)
+            break;
+    }
+
+    return minT;
+}
+
+REAL doIntersectMesh(const Mesh* mesh,
+                     const Vector4& eyePos,
+                     const Vector4& d,
+                     int& faceIndex)
+{
+
+    if (!mesh || !mesh->getTriangleCount())
+        return -1;
+
+    MeshRay ray;
+    initMeshRay(ray, eyePos, d);
+    BvhWideRay boxRay;
+    initBvhWideRay(boxRay, eyePos, d);
+#ifdef BVH_USE_SSE
+    if (!checkBvhSse())
+#endif
+    {
+        REAL t = doIntersectMeshFlat(mesh, ray, boxRay, faceIndex);
+        return t != POS_INF ? t : -1;
+    }
+
+#ifdef BVH_USE_SSE
+    // The triangles are stored in leaf order, a leaf's range of primitives
+    // is its range of triangles
+    const BvhWideNode* nodes = mesh->getBvh().getNodes();
+    const float* positions   = mesh->getPositions();
+    const int* triangles     = mesh->getTriangles();
+
+    REAL minT = POS_INF;
+    MeshStackEntry nodeStack[BVH_STACK_SIZE];
+    int stackTop = 0;
+    MeshStackEntry current;
+    current.child = 0;
+    current.count = -1;
+    current.near  = 0;
+
+    while (true)
+    {
+        if (current.count < 0)
+        {
+            const BvhWideNode& node = nodes[current.child];
+            float near[BVH_WIDTH];
+            int mask = doIntersectRayBvhWideBoxSse(boxRay, node, minT, near);
+
+            // Nearest child on top of the stack
+            int first = stackTop;
+            for (int c = 0; c < BVH_WIDTH; c++)
+            {
+                if (!(mask & (1 << c)))
+                    continue;
+
+                int j = stackTop++;
+                assert(stackTop <= BVH_STACK_SIZE);
+                while (j > first && nodeStack[j - 1].near < near[c])
+                {
+                    nodeStack[j] = nodeStack[j - 1];
+                    j--;
+                }
+                nodeStack[j].child = node.m_child[c];
+                nodeStack[j].count = node.m_count[c];
+                nodeStack[j].near  = near[c];
+            }
+        }
+        else
+        {
+            int end = current.child + current.count;
+            for (int i = current.child; i < end; i++)
+            {
+                const int* triangle = triangles + i * 3;
+                REAL t;
+                if (doIntersectTriangle(ray,
+                                        positions + triangle[0] * 3,
+                                        positions + triangle[1] * 3,
+                                        positions + triangle[2] * 3,
+                                        minT, t))
+                {
+                    minT      = t;
+                    faceIndex = i;
+                }
+            }
+        }
+
+        bool found = false;
+        while (stackTop > 0 && !found)
+        {
+            current = nodeStack[--stackTop];
+            found   = current.near <= minT;
+        }
+        if (!found)
+            break;
+    }
+
+    return minT != POS_INF ? minT : -1;
+#endif
+}
+
+/**
+ * @brief getBarycentrics: get the weights of the vertices of a triangle at
+ *                         a point on it
+ * @param mesh: the mesh
+ * @param faceIndex: the triangle
+ * @param point: the point in object space
+ * @param weights: the weights of the three vertices, should be returned
+ */
+static void getBarycentrics(const Mesh* mesh,
+                            int faceIndex,
+                            const Vector4& point,
+                            REAL* weights)
+{
+
+    const float* positions = mesh->getPositions();
+    const int* triangle    = mesh->getTriangles() + faceIndex * 3;
+    const float* a = positions + triangle[0] * 3;
+    const float* b = positions + triangle[1] * 3;
+    const float* c = positions + triangle[2] * 3;
+
+    Vector3 e1(b[0] - a[0], b[1] - a[1], b[2] - a[2]);
+    Vector3 e2(c[0] - a[0], c[1] - a[1], c[2] - a[2]);
+    Vector3 p(point.x / point.w - a[0],
+              point.y / point.w - a[1],
+              point.z / point.w - a[2]);
+
+    REAL d11   = e1.dot(e1);
+    REAL d12   = e1.dot(e2);
+    REAL d22   = e2.dot(e2);
+    REAL p1    = p.dot(e1);
+    REAL p2    = p.dot(e2);
+    REAL denom = d11 * d22 - d12 * d12;
+    if (denom == 0)
+    {
+        weights[0] = weights[1] = weights[2] = 1.f / 3;
+        return;
+    }
+
+    weights[1] = (d22 * p1 - d12 * p2) / denom;
+    weights[2] = (d11 * p2 - d12 * p1) / denom;
+    weights[0] = 1 - weights[1] - weights[2];
+}
+
+Vector3 getMeshNorm(const Mesh* mesh,
+                    const int faceIndex,
+                    const Vector4& intersectPoint)
+{
+
+    REAL weights[3];
+    getBarycentrics(mesh, faceIndex, intersectPoint, weights);
+
+    const float* normals = mesh->getNormals();
+    const int* triangle  = mesh->getTriangles() + faceIndex * 3;
+    Vector3 norm(0, 0, 0);
+    for (int j = 0; j < 3; j++)
+    {
+        const float* n = normals + triangle[j] * 3;
+        norm += Vector3(n[0], n[1], n[2]) * weights[j];
+    }
+    return norm;
+}
+
+bool getMeshIntersectTexCoord(const Mesh* mesh,
+                              const int faceIndex,
+                              const Vector4& intersectPoint,
+                              REAL& u,
+                              REAL& v)
+{
+
+    const float* texCoords = mesh->getTexCoords();
+    if (!texCoords)
+        return false;
+
+    REAL weights[3];
+    getBarycentrics(mesh, faceIndex, intersectPoint, weights);
+
+    const int* triangle = mesh->getTriangles() + faceIndex * 3;
+    u = 0;
+    v = 0;
+    for (int j = 0; j < 3; j++)
+    {
+        u += texCoords[triangle[j] * 2] * weights[j];
+        v += texCoords[triangle[j] * 2 + 1] * weights[j];
+    }
+    u -= floorf(u);
+    v -= floorf(v);
+    return true;
+}
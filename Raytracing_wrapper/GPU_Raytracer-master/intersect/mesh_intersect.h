@@ -0,0 +1,62 @@
+/*!
+    @file mesh_intersect.h
+    @desc: declarations of the functions doing mesh's intersecting detection
+    @author: yanli
+    @date: May 2013
+ */
+
+#ifndef MESH_INTERSECT_H
+#define MESH_INTERSECT_H
+
+#include "vector.h"
+#include "scene.h"
+
+class Mesh;
+
+/**
+ * @brief doIntersectMesh: return the 't' value of the closest triangle of a
+ *                         mesh hit by the line given by eye. The mesh's BVH
+ *                         is traversed in object space and the triangles
+ *                         are tested watertight, a ray through a shared
+ *                         edge or vertex hits at least one of the triangles
+ * @param mesh: the mesh
+ * @param eyePos: eye position in object space
+ * @param d: eye direction in object space
+ * @param faceIndex: the triangle hit, should be returned
+ * @return: the 't' value, -1 for no hit
+ */
+REAL doIntersectMesh(const Mesh* mesh,
+                     const Vector4& eyePos,
+                     const Vector4& d,
+                     int& faceIndex);
+
+/**
+ * @brief getMeshNorm: get the normal interpolated from the vertices of the
+ *                     triangle hit
+ * @param mesh: the mesh
+ * @param faceIndex: the triangle hit
+ * @param intersectPoint: the intersection point in object space
+ * @return: the normal vector
+ */
+Vector3 getMeshNorm(const Mesh* mesh,
+                    const int faceIndex,
+                    const Vector4& intersectPoint);
+
+/**
+ * @brief getMeshIntersectTexCoord: get the texture coordinates interpolated
+ *                                  from the vertices of the triangle hit,
+ *                                  they wrap around outside of [0, 1]
+ * @param mesh: the mesh
+ * @param faceIndex: the triangle hit
+ * @param intersectPoint: the intersection point in object space
+ * @param u: horizontal coordinate in [0, 1], should be returned
+ * @param v: vertical coordinate in [0, 1], should be returned
+ * @return: false if the mesh has no texture coordinates
+ */
+bool getMeshIntersectTexCoord(const Mesh* mesh,
+                              const int faceIndex,
+                              const Vector4& intersectPoint,
+                              REAL& u,
+                              REAL& v);
+
+#endif // MESH_INTERSECT_H
@@ -0,0 +1,516 @@
+/*!
+    @file packet_intersect.cpp
+    @desc: definitions of the functions intersecting packets of rays
+    @author: yanli
+    @date: May 2013
+ */
+
+#include "packet_intersect.h"
+#include "intersect.h"
+#include "bvhbox_intersect.h"
+#include "global.h"
+
+#ifdef BVH_USE_SSE
+#include <xmmintrin.h>
+#include <math.h>
+
+/**
+ * @struct: PacketStackEntry
+ * @brief The PacketStackEntry struct is a postponed child of a wide BVH node
+ *        and the rays of the packet that hit its box
+ */
+struct PacketStackEntry
+{
+    int child; // Child node, or first primitive of a leaf
+    int count; // Primitive count of a leaf, -1 for a node
+    int mask; // Bit i is set if ray i hit the child's box
+    float near; // Lowest 't' value entering the child's box
+};
+
+/**
+ * @struct: PacketSse
+ * @brief The PacketSse struct is a packet loaded into SSE registers, group g
+ *        holds the rays g * RAY_PACKET_LANES and up
+ */
+struct PacketSse
+{
+    __m128 m_origin[3][RAY_PACKET_GROUPS]; // Starts of the rays
+    __m128 m_dir[3][RAY_PACKET_GROUPS]; // Directions of the rays
+    __m128 m_invD[3][RAY_PACKET_GROUPS]; // Reciprocals of the directions
+    __m128 m_negative[3][RAY_PACKET_GROUPS]; // All bits set for the lanes
+                                             // with a negative invD
+    __m128 m_t[RAY_PACKET_GROUPS]; // Closest hits so far, POS_INF for none
+};
+
+/**
+ * @brief selectSse: pick lanes of two registers
+ * @param mask: all bits set for the lanes of a
+ * @param a: the register picked by the mask
+ * @param b: the register picked elsewhere
+ * @return: the picked lanes
+ */
+static inline __m128 selectSse(__m128 mask, __m128 a, __m128 b)
+{
+
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+/**
+ * @brief transformSse: multiply a row of a matrix with 4 vectors, in the
+ *                      same order of operations as Matrix4x4 * Vector4
+ * @param row: the row of the matrix
+ * @param x: the x components
+ * @param y: the y components
+ * @param z: the z components
+ * @param w: the w component, the same for all of the vectors
+ * @return: the products
+ */
+static inline __m128 transformSse(const REAL* row, __m128 x, __m128 y,
+                                  __m128 z, __m128 w)
+{
+
+    __m128 sum = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(row[0]), x),
+                            _mm_mul_ps(_mm_set1_ps(row[1]), y));
+    sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(row[2]), z));
+    return _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(row[3]), w));
+}
+
+/**
+ * @brief intersectSphereSse: doIntersectUnitSphere() for 4 rays
+ * @param o: the starts of the rays in object space, per axis
+ * @param d: the directions of the rays in object space, per axis
+ * @return: the 't' values, -1 for a miss
+ */
+static inline __m128 intersectSphereSse(const __m128* o, const __m128* d)
+{
+
+    __m128 zero = _mm_setzero_ps();
+    __m128 two  = _mm_set1_ps(2.f);
+
+    __m128 A = _mm_add_ps(_mm_add_ps(_mm_mul_ps(d[0], d[0]),
+                                     _mm_mul_ps(d[1], d[1])),
+                          _mm_mul_ps(d[2], d[2]));
+    __m128 B = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_mul_ps(two, o[0]), d[0]),
+                                     _mm_mul_ps(_mm_mul_ps(two, o[1]), d[1])),
+                          _mm_mul_ps(_mm_mul_ps(two, o[2]), d[2]));
+    __m128 C = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(o[0], o[0]),
+                                                _mm_mul_ps(o[1], o[1])),
+                                     _mm_mul_ps(o[2], o[2])),
+                          _mm_set1_ps(0.25f));
+
+    __m128 determinant = _mm_sub_ps(_mm_mul_ps(B, B),
+                                    _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(4.f),
+                                                          A), C));
+    __m128 root = _mm_sqrt_ps(determinant);
+    __m128 negB = _mm_xor_ps(B, _mm_set1_ps(-0.f));
+    __m128 twoA = _mm_mul_ps(two, A);
+    __m128 t1   = _mm_div_ps(_mm_add_ps(negB, root), twoA);
+    __m128 t2   = _mm_div_ps(_mm_sub_ps(negB, root), twoA);
+
+    // The same cases as the scalar test, the closer root in front wins
+    __m128 front1 = _mm_cmpgt_ps(t1, zero);
+    __m128 front2 = _mm_cmpgt_ps(t2, zero);
+    __m128 only1  = _mm_and_ps(front1, _mm_cmple_ps(t2, zero));
+    __m128 only2  = _mm_and_ps(_mm_cmple_ps(t1, zero), front2);
+    __m128 both   = _mm_and_ps(front1, front2);
+
+    __m128 t = selectSse(both, _mm_min_ps(t1, t2), _mm_set1_ps(-1.f));
+    t = selectSse(only2, t2, t);
+    t = selectSse(only1, t1, t);
+    return selectSse(_mm_cmpge_ps(determinant, zero), t, _mm_set1_ps(-1.f));
+}
+
+/**
+ * @brief intersectCubeSse: doIntersectUnitCube() for 4 rays
+ * @param o: the starts of the rays in object space, per axis
+ * @param d: the directions of the rays in object space, per axis
+ * @param faceIndex: the faces hit as floats, should be returned
+ * @return: the 't' values, -1 for a miss
+ */
+static inline __m128 intersectCubeSse(const __m128* o, const __m128* d,
+                                      __m128& faceIndex)
+{
+
+    // Faces through the lower and the upper corner on each axis, the same
+    // faces as doIntersectUnitCube() gives
+    static const float lowerFaces[3] = {2, 5, 1};
+    static const float upperFaces[3] = {3, 4, 0};
+
+    __m128 zero   = _mm_setzero_ps();
+    __m128 one    = _mm_set1_ps(1.f);
+    __m128 half   = _mm_set1_ps(0.5f);
+    __m128 maxInf = _mm_set1_ps(INFINITY);
+    __m128 minInf = _mm_set1_ps(-INFINITY);
+
+    // doIntersectRaySlabs() one axis at a time, the first axis wins ties
+    __m128 near, far, nearFace, farFace;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        __m128 inv      = _mm_div_ps(one, d[axis]);
+        __m128 negative = _mm_cmplt_ps(inv, zero);
+        __m128 first    = selectSse(negative, half, _mm_sub_ps(zero, half));
+        __m128 second   = _mm_sub_ps(zero, first);
+        __m128 lower    = _mm_set1_ps(lowerFaces[axis]);
+        __m128 upper    = _mm_set1_ps(upperFaces[axis]);
+
+        __m128 t0 = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(first, o[axis]), inv),
+                               minInf);
+        __m128 t1 = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(second, o[axis]), inv),
+                               maxInf);
+        __m128 face0 = selectSse(negative, upper, lower);
+        __m128 face1 = selectSse(negative, lower, upper);
+        if (axis == 0)
+        {
+            near     = t0;
+            far      = t1;
+            nearFace = face0;
+            farFace  = face1;
+            continue;
+        }
+
+        __m128 enter = _mm_cmpgt_ps(t0, near);
+        __m128 leave = _mm_cmplt_ps(t1, far);
+        near     = selectSse(enter, t0, near);
+        nearFace = selectSse(enter, face0, nearFace);
+        far      = selectSse(leave, t1, far);
+        farFace  = selectSse(leave, face1, farFace);
+    }
+
+    // The eye inside the cube sees the face it leaves through
+    __m128 front = _mm_cmpgt_ps(near, zero);
+    __m128 t     = selectSse(front, near, far);
+    __m128 valid = _mm_and_ps(_mm_cmple_ps(near, far),
+                              _mm_cmpgt_ps(t, zero));
+    faceIndex = selectSse(valid, selectSse(front, nearFace, farFace),
+                          _mm_set1_ps(-1.f));
+    return selectSse(valid, t, _mm_set1_ps(-1.f));
+}
+
+/**
+ * @brief intersectBoxSse: intersect 4 rays with the box of a child of a wide
+ *                         BVH node, like doIntersectRayBvhWideBoxSse()
+ * @param rays: the packet
+ * @param group: the group of rays
+ * @param node: the wide BVH node
+ * @param child: the child
+ * @param near: the 't' values entering the box, should be returned
+ * @return: bit l is set if lane l hits the box before its closest hit
+ */
+static inline int intersectBoxSse(const PacketSse& rays, int group,
+                                  const BvhWideNode& node, int child,
+                                  float* near)
+{
+
+    __m128 tNear = _mm_setzero_ps();
+    __m128 tFar  = rays.m_t[group];
+    for (int axis = 0; axis < 3; axis++)
+    {
+        __m128 negative = rays.m_negative[axis][group];
+        __m128 lower    = _mm_set1_ps(node.m_bounds[0][axis][child]);
+        __m128 upper    = _mm_set1_ps(node.m_bounds[1][axis][child]);
+        __m128 origin   = rays.m_origin[axis][group];
+        __m128 invD     = rays.m_invD[axis][group];
+
+        __m128 t0 = _mm_mul_ps(_mm_sub_ps(selectSse(negative, upper, lower),
+                                          origin), invD);
+        __m128 t1 = _mm_mul_ps(_mm_sub_ps(selectSse(negative, lower, upper),
+                                          origin), invD);
+
+        // NaN keeps the old range, like the scalar test
+        tNear = _mm_max_ps(t0, tNear);
+        tFar  = _mm_min_ps(t1, tFar);
+    }
+    _mm_storeu_ps(near, tNear);
+    return _mm_movemask_ps(_mm_cmple_ps(tNear, tFar));
+}
+
+/**
+ * @brief intersectGroupSse: intersect 4 rays with an object and keep the
+ *                           closer hits
+ * @param packet: the packet, the hits are updated
+ * @param rays: the packet in SSE registers, the hits are updated
+ * @param group: the group of rays
+ * @param lanes: bit l is set if lane l should be tested, the others may be
+ * @param view: the objects as seen by the intersection loops
+ * @param prim: index of the object in the view
+ */
+static inline void intersectGroupSse(RayPacket& packet, PacketSse& rays,
+                                     int group, int lanes,
+                                     const IntersectView& view,
+                                     int prim)
+{
+
+    const REAL* invTransform = view.getInvTransform(prim);
+    PrimitiveType type       = view.getType(prim);
+    __m128 one  = _mm_set1_ps(1.f);
+    __m128 zero = _mm_setzero_ps();
+
+    __m128 o[3], d[3];
+    for (int k = 0; k < 3; k++)
+    {
+        const REAL* row = invTransform + k * 4;
+        o[k] = transformSse(row, rays.m_origin[0][group],
+                            rays.m_origin[1][group],
+                            rays.m_origin[2][group], one);
+        d[k] = transformSse(row, rays.m_dir[0][group],
+                            rays.m_dir[1][group],
+                            rays.m_dir[2][group], zero);
+    }
+
+    __m128 t;
+    __m128 faceIndex = _mm_set1_ps(-1.f);
+    int objectLanes[RAY_PACKET_LANES];
+    for (int l = 0; l < RAY_PACKET_LANES; l++)
+        objectLanes[l] = view.getObjectId(prim);
+
+    switch (type)
+    {
+    case PRIMITIVE_SPHERE:
+    {
+        t = intersectSphereSse(o, d);
+        break;
+    }
+    case PRIMITIVE_CUBE:
+    {
+        t = intersectCubeSse(o, d, faceIndex);
+        break;
+    }
+    default:
+    {
+        // The other shapes go one ray at a time, the transforms are affine
+        // so w stays 1 for the starts and 0 for the directions
+        float eye[3][RAY_PACKET_LANES], dir[3][RAY_PACKET_LANES];
+        for (int k = 0; k < 3; k++)
+        {
+            _mm_storeu_ps(eye[k], o[k]);
+            _mm_storeu_ps(dir[k], d[k]);
+        }
+
+        float tLanes[RAY_PACKET_LANES];
+        float faceLanes[RAY_PACKET_LANES];
+        float maxT[RAY_PACKET_LANES];
+        _mm_storeu_ps(maxT, rays.m_t[group]);
+        for (int l = 0; l < RAY_PACKET_LANES; l++)
+        {
+            tLanes[l]    = -1;
+            faceLanes[l] = -1;
+            if (!(lanes & (1 << l)))
+                continue;
+
+            int face = -1;
+            Vector4 eyeLane(eye[0][l], eye[1][l], eye[2][l], 1);
+            Vector4 dirLane(dir[0][l], dir[1][l], dir[2][l], 0);
+            if (type == PRIMITIVE_GROUP)
+            {
+                // The ids of the group's objects count from the group's id
+                int groupObject = -1;
+                tLanes[l] = intersectGroup(view.getGroup(prim), eyeLane,
+                                           dirLane, maxT[l], groupObject,
+                                           face);
+                objectLanes[l] += groupObject;
+            }
+            else
+            {
+                tLanes[l] = doIntersect(type, view.getMesh(prim), eyeLane,
+                                        dirLane, face);
+            }
+            faceLanes[l] = face;
+        }
+        t         = _mm_loadu_ps(tLanes);
+        faceIndex = _mm_loadu_ps(faceLanes);
+        break;
+    }
+    }
+
+    __m128 closer = _mm_and_ps(_mm_cmpgt_ps(t, zero),
+                               _mm_cmplt_ps(t, rays.m_t[group]));
+    int closerLanes = _mm_movemask_ps(closer);
+    if (!closerLanes)
+        return;
+
+    rays.m_t[group] = selectSse(closer, t, rays.m_t[group]);
+
+    float faceLanes[RAY_PACKET_LANES];
+    _mm_storeu_ps(faceLanes, faceIndex);
+    for (int l = 0; l < RAY_PACKET_LANES; l++)
+    {
+        if (!(closerLanes & (1 << l)))
+            continue;
+
+        int ray = group * RAY_PACKET_LANES + l;
+        packet.m_object[ray] = objectLanes[l];
+        packet.m_face[ray]   = (int)faceLanes[l];
+    }
+}
+
+/**
+ * @brief intersectPacketBvh: traverse the BVH once for the whole packet
+ * @param packet: the packet, the hits are returned in it
+ * @param view: the objects as seen by the intersection loops
+ * @param bvh: pointer to the BVH
+ */
+static void intersectPacketBvh(RayPacket& packet,
+                               const IntersectView& view,
+                               Bvh* bvh)
+{
+
+    PacketSse rays;
+    for (int g = 0; g < RAY_PACKET_GROUPS; g++)
+    {
+        for (int axis = 0; axis < 3; axis++)
+        {
+            int first = g * RAY_PACKET_LANES;
+            rays.m_origin[axis][g] =
+                    _mm_loadu_ps(packet.m_origin[axis] + first);
+            rays.m_dir[axis][g] = _mm_loadu_ps(packet.m_dir[axis] + first);
+            rays.m_invD[axis][g] = _mm_div_ps(_mm_set1_ps(1.f),
+                                              rays.m_dir[axis][g]);
+            rays.m_negative[axis][g] = _mm_cmplt_ps(rays.m_invD[axis][g],
+                                                    _mm_setzero_ps());
+        }
+        rays.m_t[g] = _mm_set1_ps(POS_INF);
+    }
+    for (int i = 0; i < RAY_PACKET_SIZE; i++)
+    {
+        packet.m_object[i] = -1;
+        packet.m_face[i]   = -1;
+    }
+
+    const BvhWideNode* nodes = bvh->getNodes();
+    const int* prims         = bvh->getPrimitives();
+
+    PacketStackEntry nodeStack[BVH_STACK_SIZE];
+    int stackTop = 0;
+    PacketStackEntry current;
+    current.child = 0;
+    current.count = -1;
+    current.mask  = (1 << RAY_PACKET_SIZE) - 1;
+    current.near  = 0;
+
+    while (true)
+    {
+        if (current.count < 0)
+        {
+            const BvhWideNode& node = nodes[current.child];
+
+            // Test each child against the rays that reached the node, push
+            // the hit ones farthest first
+            int first = stackTop;
+            for (int c = 0; c < BVH_WIDTH; c++)
+            {
+                int childMask   = 0;
+                float childNear = POS_INF;
+                for (int g = 0; g < RAY_PACKET_GROUPS; g++)
+                {
+                    int lanes = (current.mask >> (g * RAY_PACKET_LANES)) &
+                            ((1 << RAY_PACKET_LANES) - 1);
+                    if (!lanes)
+                        continue;
+
+                    float near[RAY_PACKET_LANES];
+                    lanes &= intersectBoxSse(rays, g, node, c, near);
+                    for (int l = 0; l < RAY_PACKET_LANES; l++)
+                    {
+                        if (lanes & (1 << l))
+                            childNear = qMin(childNear, near[l]);
+                    }
+                    childMask |= lanes << (g * RAY_PACKET_LANES);
+                }
+                if (!childMask)
+                    continue;
+
+                int j = stackTop++;
+                assert(stackTop <= BVH_STACK_SIZE);
+                while (j > first && nodeStack[j - 1].near < childNear)
+                {
+                    nodeStack[j] = nodeStack[j - 1];
+                    j--;
+                }
+                nodeStack[j].child = node.m_child[c];
+                nodeStack[j].count = node.m_count[c];
+                nodeStack[j].mask  = childMask;
+                nodeStack[j].near  = childNear;
+            }
+        }
+        else
+        {
+            const int* leafPrims = prims + current.child;
+
+            for (int i = 0; i < current.count; i++)
+            {
+                for (int g = 0; g < RAY_PACKET_GROUPS; g++)
+                {
+                    int lanes = (current.mask >> (g * RAY_PACKET_LANES)) &
+                            ((1 << RAY_PACKET_LANES) - 1);
+                    if (lanes)
+                        intersectGroupSse(packet, rays, g, lanes, view,
+                                          leafPrims[i]);
+                }
+            }
+        }
+
+        // Skip the children beginning behind the hits of all of their rays
+        bool found = false;
+        while (stackTop > 0 && !found)
+        {
+            current = nodeStack[--stackTop];
+            __m128 near = _mm_set1_ps(current.near);
+            for (int g = 0; g < RAY_PACKET_GROUPS && !found; g++)
+            {
+                int lanes = (current.mask >> (g * RAY_PACKET_LANES)) &
+                        ((1 << RAY_PACKET_LANES) - 1);
+                found = (_mm_movemask_ps(_mm_cmple_ps(near, rays.m_t[g])) &
+                         lanes) != 0;
+            }
+        }
+        if (!found)
+            break;
+    }
+
+    for (int g = 0; g < RAY_PACKET_GROUPS; g++)
+    {
+        float t[RAY_PACKET_LANES];
+        _mm_storeu_ps(t, rays.m_t[g]);
+        for (int l = 0; l < RAY_PACKET_LANES; l++)
+        {
+            int ray = g * RAY_PACKET_LANES + l;
+            packet.m_t[ray] = t[l] != POS_INF ? t[l] : -1;
+        }
+    }
+}
+#endif
+
+void intersectPacket(RayPacket& packet,
+                     const IntersectView& view,
+                     KdTree* tree,
+                     Bvh* bvh,
+                     AABB extends)
+{
+
+#ifdef BVH_USE_SSE
+    if (settings.useKdTree && settings.accelStruct == BVH && bvh &&
+        checkBvhSse())
+    {
+        intersectPacketBvh(packet, view, bvh);
+        return;
+    }
+#endif
+
+    // The kdtree, the scalar BVH and brute force take one ray at a time
+    for (int i = 0; i < packet.m_count; i++)
+    {
+        Vector4 pos(packet.m_origin[0][i],
+                    packet.m_origin[1][i],
+                    packet.m_origin[2][i],
+                    1);
+        Vector4 d(packet.m_dir[0][i],
+                  packet.m_dir[1][i],
+                  packet.m_dir[2][i],
+                  0);
+
+        packet.m_object[i] = -1;
+        packet.m_face[i]   = -1;
+        packet.m_t[i]      = intersect(pos, view, d, packet.m_object[i],
+                                       packet.m_face[i], tree, bvh, extends);
+    }
+}
@@ -0,0 +1,58 @@
+/*!
+    @file packet_intersect.h
+    @desc: declarations of RayPacket struct and the functions intersecting
+           packets of rays
+    @author: yanli
+    @date: May 2013
+ */
+
+#ifndef PACKET_INTERSECT_H
+#define PACKET_INTERSECT_H
+
+#include "scene.h"
+#include "intersect_view.h"
+
+#define RAY_PACKET_WIDTH 4 // Side of the square block of pixels in a packet
+#define RAY_PACKET_SIZE (RAY_PACKET_WIDTH * RAY_PACKET_WIDTH) // Rays per packet
+#define RAY_PACKET_LANES 4 // Rays per SSE register
+#define RAY_PACKET_GROUPS (RAY_PACKET_SIZE / RAY_PACKET_LANES) // SSE registers
+                                                            // per component
+
+class KdTree;
+class Bvh;
+
+/**
+ * @struct: RayPacket
+ * @brief The RayPacket struct holds the rays of a block of pixels as
+ *        structure of arrays, so RAY_PACKET_LANES rays fit in one SSE
+ *        register. All of the lanes hold valid rays, the ones past m_count
+ *        repeat the last ray and are ignored
+ */
+struct RayPacket
+{
+    float m_origin[3][RAY_PACKET_SIZE]; // Starts of the rays, per axis
+    float m_dir[3][RAY_PACKET_SIZE]; // Directions of the rays, per axis
+    int m_count; // Number of rays in use
+
+    REAL m_t[RAY_PACKET_SIZE]; // 't' values of the closest hits, -1 for none
+    int m_object[RAY_PACKET_SIZE]; // Objects hit
+    int m_face[RAY_PACKET_SIZE]; // Faces hit
+};
+
+/**
+ * @brief intersectPacket: find the closest hits of all rays in a packet. The
+ *                         BVH is traversed once for the whole packet with
+ *                         SSE, otherwise each ray goes through intersect()
+ * @param packet: the packet, the hits are returned in it
+ * @param view: the objects as seen by the intersection loops
+ * @param tree: pointer to the kdtree
+ * @param bvh: pointer to the BVH
+ * @param extends: the bounding box of the scene
+ */
+void intersectPacket(RayPacket& packet,
+                     const IntersectView& view,
+                     KdTree* tree,
+                     Bvh* bvh,
+                     AABB extends);
+
+#endif // PACKET_INTERSECT_H
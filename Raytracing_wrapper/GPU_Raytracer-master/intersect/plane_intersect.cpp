@@ -6,6 +6,7 @@
  */
 
 #include "plane_intersect.h"
+#include "shape_math.h"
 
 REAL doIntersectPlane(const Vector3& point,
                       const Vector3& norm,
@@ -13,14 +14,8 @@ REAL doIntersectPlane(const Vector3& point,
                       const Vector4& d)
 {
 
-    REAL t = -1;
-    REAL denominator = norm.x * d.x + norm.y * d.y + norm.z * d.z;
-    if(fabs(denominator) > EPSILON)
-    {
-        t = ((norm.x * point.x + norm.y * point.y + norm.z * point.z) -
-             (norm.x * eyePos.x + norm.y * eyePos.y + norm.z * eyePos.z)) /
-                (denominator);
-    }
-
-    return t;
+    return shapeIntersectPlane(shapeVec(point.x, point.y, point.z),
+                               shapeVec(norm.x, norm.y, norm.z),
+                               shapeVec(eyePos.x, eyePos.y, eyePos.z),
+                               shapeVec(d.x, d.y, d.z));
 }
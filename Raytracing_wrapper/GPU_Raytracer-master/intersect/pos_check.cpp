@@ -7,102 +7,250 @@
  */
 
 #include "pos_check.h"
+#include "intersect.h"
+#include "global.h"
+#include "kdtree.h"
+#include "bvh.h"
+#include "scene_group.h"
+#include "shape_math.h"
 
-QVector<SceneObject> checkPos(const QVector<SceneObject>& objects,
-                              const Vector4& pos,
-                              QMap<int, int >& indexMap)
+static void intersectEnclosingBvh(const Vector4& pos,
+                                  const Vector4& d,
+                                  const IntersectView& view,
+                                  const Bvh& bvh,
+                                  REAL& minT,
+                                  int& objectIndex,
+                                  int& faceIndex);
+
+/**
+ * @brief testEnclosing: intersect a ray with an object if the start of the
+ *                       ray is inside of it and keep the closer hit, ties
+ *                       go to the lower object index
+ * @param pos: the start of the ray
+ * @param d: the direction of the ray
+ * @param view: the objects as seen by the intersection loops
+ * @param prim: index of the object in the view
+ * @param minT: the closest hit so far, updated
+ * @param objectIndex: the object index, updated
+ * @param faceIndex: the face index, updated
+ */
+static inline void testEnclosing(const Vector4& pos,
+                                 const Vector4& d,
+                                 const IntersectView& view,
+                                 int prim,
+                                 REAL& minT,
+                                 int& objectIndex,
+                                 int& faceIndex)
+{
+
+    Vector4 posInObjSpace, dInObjSpace;
+    view.transform(prim, pos, d, posInObjSpace, dInObjSpace);
+
+    int tempFaceIndex = -1;
+    int id = view.getObjectId(prim);
+    REAL t = -1;
+    if (view.getType(prim) == PRIMITIVE_GROUP)
+    {
+        // The closest of the group's objects, their ids count from the
+        // group's id
+        const SceneGroup* group = view.getGroup(prim);
+        int groupObject = -1;
+        t = POS_INF;
+        intersectEnclosingBvh(posInObjSpace, dInObjSpace,
+                              group->getIntersectView(), group->getBvh(),
+                              t, groupObject, tempFaceIndex);
+        if (groupObject < 0)
+            return;
+        id += groupObject;
+    }
+    else
+    {
+        if (!checkInside(view.getType(prim), posInObjSpace))
+            return;
+
+        t = doIntersect(view.getType(prim), view.getMesh(prim),
+                        posInObjSpace, dInObjSpace, tempFaceIndex);
+    }
+    if (t > 0 && (t < minT || (t == minT && id < objectIndex)))
+    {
+        minT        = t;
+        objectIndex = id;
+        faceIndex   = tempFaceIndex;
+    }
+}
+
+/**
+ * @brief intersectEnclosingBvh: find the closest hit of a ray among the
+ *                               objects of a view its start is inside of,
+ *                               visiting the BVH leaves holding the start
+ * @param pos: the start of the ray
+ * @param d: the direction of the ray
+ * @param view: the objects as seen by the intersection loops
+ * @param bvh: the BVH over the objects of the view
+ * @param minT: the closest hit so far, updated
+ * @param objectIndex: the object index, updated
+ * @param faceIndex: the face index, updated
+ */
+static void intersectEnclosingBvh(const Vector4& pos,
+                                  const Vector4& d,
+                                  const IntersectView& view,
+                                  const Bvh& bvh,
+                                  REAL& minT,
+                                  int& objectIndex,
+                                  int& faceIndex)
 {
 
-    QVector<SceneObject> result;
+    // Visit every leaf whose box holds the point, the boxes are padded
+    // so an object holding the point always is in one of them
+    const BvhWideNode* nodes = bvh.getNodes();
+    const int* prims         = bvh.getPrimitives();
 
-    for (int i = 0; i < objects.size(); i++)
+    int nodeStack[BVH_STACK_SIZE];
+    int stackTop = 0;
+    nodeStack[stackTop++] = 0;
+
+    while (stackTop > 0)
     {
-        Vector4 posInObjSpace = objects[i].m_invTransform*pos;
-        bool in = false;
-        switch (objects[i].m_primitive.type)
+        const BvhWideNode& node = nodes[nodeStack[--stackTop]];
+        for (int c = 0; c < BVH_WIDTH; c++)
         {
-        case PRIMITIVE_CUBE:
-            in  = checkCube(posInObjSpace);
-            break;
-        case PRIMITIVE_CONE:
-            in  = checkCone(posInObjSpace);
-            break;
-        case PRIMITIVE_CYLINDER:
-            in  = checkCylinder(posInObjSpace);
-            break;
-        case PRIMITIVE_SPHERE:
-            in  = checkSphere(posInObjSpace);
-            break;
-        case PRIMITIVE_TORUS:
-            break;
-        case PRIMITIVE_MESH:
-            break;
-        default:
-            assert(0);
-            break;
+            bool in = true;
+            for (int axis = 0; axis < 3 && in; axis++)
+                in = node.m_bounds[0][axis][c] <= pos.data[axis] &&
+                        pos.data[axis] <= node.m_bounds[1][axis][c];
+            if (!in)
+                continue;
+
+            if (node.m_count[c] < 0)
+            {
+                assert(stackTop < BVH_STACK_SIZE);
+                nodeStack[stackTop++] = node.m_child[c];
+                continue;
+            }
+
+            const int* leafPrims = prims + node.m_child[c];
+            for (int i = 0; i < node.m_count[c]; i++)
+                testEnclosing(pos, d, view, leafPrims[i], minT,
+                              objectIndex, faceIndex);
         }
-        if (in)
+    }
+}
+
+REAL intersectEnclosing(const Vector4& pos,
+                        const Vector4& d,
+                        const IntersectView& view,
+                        KdTree* tree,
+                        Bvh* bvh,
+                        int& objectIndex,
+                        int& faceIndex)
+{
+
+    REAL minT   = POS_INF;
+    objectIndex = -1;
+    faceIndex   = -1;
+
+    if (settings.useKdTree && settings.accelStruct == BVH && bvh)
+    {
+        intersectEnclosingBvh(pos, d, view, *bvh, minT, objectIndex,
+                              faceIndex);
+    }
+    else if (settings.useKdTree && tree)
+    {
+        // Walk down to the leaf holding the point, both sides are visited
+        // when it's within EPSILON of a split
+        const KdFlatNode* nodes = tree->getFlatNodes();
+        const int* prims        = tree->getFlatPrimitives();
+
+        const KdFlatNode* nodeStack[KD_STACK_SIZE];
+        int stackTop = 0;
+        nodeStack[stackTop++] = nodes;
+
+        while (stackTop > 0)
         {
-            result.push_back(objects[i]);
-            indexMap.insert(result.size() - 1, i);
+            const KdFlatNode* current = nodeStack[--stackTop];
+            while (!current->isLeaf())
+            {
+                REAL p     = pos.data[current->getAxis()];
+                bool left  = p <= current->m_split + EPSILON;
+                bool right = p >= current->m_split - EPSILON;
+                if (left && right)
+                {
+                    assert(stackTop < KD_STACK_SIZE);
+                    nodeStack[stackTop++] = nodes + current->getRight();
+                }
+                current = left ? current + 1 : nodes + current->getRight();
+            }
+
+            const int* leafPrims = prims + current->m_primOffset;
+            for (unsigned i = 0; i < current->getPrimCount(); i++)
+                testEnclosing(pos, d, view, leafPrims[i], minT,
+                              objectIndex, faceIndex);
         }
     }
+    else
+    {
+        for (int i = 0; i < view.getCount(); i++)
+            testEnclosing(pos, d, view, i, minT, objectIndex, faceIndex);
+    }
 
-    return result;
+    return minT != POS_INF ? minT : -1;
 }
 
-bool checkCube(const Vector4& posInObjSpace)
+bool checkInside(PrimitiveType type, const Vector4& posInObjSpace)
 {
 
-    Vector3 pos3 = Vector3(posInObjSpace.x / posInObjSpace.w,
-                           posInObjSpace.y / posInObjSpace.w,
-                           posInObjSpace.z / posInObjSpace.w);
-
-    return pos3.x < 0.5 &&
-            pos3.x > -0.5 &&
-            pos3.y < 0.5 &&
-            pos3.y > -0.5 &&
-            pos3.z < 0.5 &&
-            pos3.z > -0.5 ? true: false;
+    switch (type)
+    {
+    case PRIMITIVE_CUBE:
+        return checkCube(posInObjSpace);
+    case PRIMITIVE_CONE:
+        return checkCone(posInObjSpace);
+    case PRIMITIVE_CYLINDER:
+        return checkCylinder(posInObjSpace);
+    case PRIMITIVE_SPHERE:
+        return checkSphere(posInObjSpace);
+    case PRIMITIVE_TORUS:
+        break;
+    case PRIMITIVE_MESH:
+        break;
+    default:
+        assert(0);
+        break;
+    }
+    return false;
 }
 
-bool checkCylinder(const Vector4& posInObjSpace )
+/**
+ * @brief toShapePoint: unhomogenize a position for the shared tests
+ * @param pos: the position
+ * @return: the point
+ */
+static ShapeVec toShapePoint(const Vector4& pos)
 {
 
-    Vector3 pos3 = Vector3(posInObjSpace.x / posInObjSpace.w,
-                           posInObjSpace.y / posInObjSpace.w,
-                           posInObjSpace.z / posInObjSpace.w);
+    return shapeVec(pos.x / pos.w, pos.y / pos.w, pos.z / pos.w);
+}
 
-    Vector3 pos3H = Vector3(pos3.x, 0, pos3.z);
+bool checkCube(const Vector4& posInObjSpace)
+{
 
-    return pos3H.length() < 0.5 && pos3.y >-0.5 && pos3.y < 0.5 ? true : false;
+    return shapeInsideCube(toShapePoint(posInObjSpace));
 }
 
-bool checkCone(const Vector4& posInObjSpace)
+bool checkCylinder(const Vector4& posInObjSpace )
 {
 
-    Vector3 pos3 = Vector3(posInObjSpace.x / posInObjSpace.w,
-                           posInObjSpace.y / posInObjSpace.w,
-                           posInObjSpace.z / posInObjSpace.w);
-
+    return shapeInsideCylinder(toShapePoint(posInObjSpace));
+}
 
-    if (pos3.y > -0.5 && pos3.y < 0.5)
-    {
-        Vector3 pos3H = Vector3(pos3.x, 0, pos3.z);
-        float length = 0.25 - 0.5 * pos3.y;
-        return pos3H.length() < length ? true : false;
-    }
+bool checkCone(const Vector4& posInObjSpace)
+{
 
-   return false;
+    return shapeInsideCone(toShapePoint(posInObjSpace));
 }
 
 bool checkSphere(const Vector4& posInObjSpace)
 {
 
-    Vector3 pos3 = Vector3(posInObjSpace.x / posInObjSpace.w,
-                           posInObjSpace.y / posInObjSpace.w,
-                           posInObjSpace.z / posInObjSpace.w);
-
-    return pos3.length() < 0.5? true : false;
+    return shapeInsideSphere(toShapePoint(posInObjSpace));
 }
-
@@ -9,20 +9,42 @@
 #ifndef POS_CHECK_H
 #define POS_CHECK_H
 
-#include <QVector>
 #include "scene.h"
-#include <QMap>
+#include "intersect_view.h"
+
+class KdTree;
+class Bvh;
 
 /**
- * @brief checkPos: do check pos on the list of objects
- * @param objects: all of the objects
- * @param pos: the position
- * @param indexMap: index map, we need to insert the result into it
- * @return
+ * @brief intersectEnclosing: find the closest hit of a ray among the objects
+ *                            its start is inside of. Only the objects of
+ *                            the kdtree leaf or BVH leaves holding the
+ *                            start are tested, nothing is allocated
+ * @param pos: the start of the ray
+ * @param d: the direction of the ray
+ * @param view: the objects as seen by the intersection loops
+ * @param tree: pointer to the kdtree
+ * @param bvh: pointer to the BVH
+ * @param objectIndex: the object index in the scene, should be returned
+ * @param faceIndex: the face index, should be returned
+ * @return: the 't' value, -1 if the start isn't inside any object
  */
-QVector<SceneObject> checkPos(const QVector<SceneObject>& objects,
-                              const Vector4& pos,
-                              QMap<int, int>& indexMap );
+REAL intersectEnclosing(const Vector4& pos,
+                        const Vector4& d,
+                        const IntersectView& view,
+                        KdTree* tree,
+                        Bvh* bvh,
+                        int& objectIndex,
+                        int& faceIndex);
+
+/**
+ * @brief checkInside: check if the position is inside a unit primitive
+ * @param type: the primitive type
+ * @param posInObjSpace: the position
+ * @return: inside or not
+ */
+bool checkInside(PrimitiveType type, const Vector4& posInObjSpace);
+
 /**
  * @brief checkCube: check if the position is inside the cube
  * @param posInObjSpace: the position
@@ -0,0 +1,586 @@
+/*!
+    @file shape_math.h
+    @desc: the math both tracers share, written in the C subset OpenCL
+           shares with C++: the intersection and inside tests of the unit
+           primitives, the slab test of boxes, the sample offsets in a
+           pixel and the lighting terms of a light. The CPU tracer includes
+           the file and the OpenCL program is built with it in front of
+           raytraceGPU.cl, so both tracers run the same arithmetic
+    @author: yanli
+    @date: May 2013
+ */
+
+#ifndef SHAPE_MATH_H
+#define SHAPE_MATH_H
+
+#ifdef __OPENCL_VERSION__
+#define SHAPE_FUNC // Every function of a program is inlined by the compiler
+#else
+#include <math.h>
+#define SHAPE_FUNC static inline
+#endif
+
+#define SHAPE_EPSILON 1e-4 // The same as EPSILON of both tracers
+#define SHAPE_INF 0x7FFFFFFF // The same as POS_INF of both tracers
+#define SHAPE_NONE -1 // "t" value of a missed shape
+
+/**
+ * @struct: ShapeVec
+ * @brief The ShapeVec struct is a point or direction of the shared code,
+ *        the tracers convert their own vectors to it
+ */
+typedef struct
+{
+    float x;
+    float y;
+    float z;
+} ShapeVec;
+
+/**
+ * @brief shapeVec: make a vector
+ * @param x: x component
+ * @param y: y component
+ * @param z: z component
+ * @return: the vector
+ */
+SHAPE_FUNC ShapeVec shapeVec(float x, float y, float z)
+{
+
+    ShapeVec v;
+    v.x = x;
+    v.y = y;
+    v.z = z;
+    return v;
+}
+
+/**
+ * @brief shapeDot: the dot product of two vectors
+ * @param a: the first vector
+ * @param b: the second vector
+ * @return: the dot product
+ */
+SHAPE_FUNC float shapeDot(ShapeVec a, ShapeVec b)
+{
+
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+/**
+ * @brief shapeNormalize: scale a vector to unit length
+ * @param v: the vector
+ * @return: the unit vector
+ */
+SHAPE_FUNC ShapeVec shapeNormalize(ShapeVec v)
+{
+
+    float length = sqrt(shapeDot(v, v));
+    return shapeVec(v.x / length, v.y / length, v.z / length);
+}
+
+/**
+ * @brief shapeIntersectPlane: do the intersection detection on given plane
+ * @param point: one point on the plane
+ * @param norm: normal of the plane
+ * @param eyePos: the eye position
+ * @param d: the direction of the ray
+ * @return: "t" value, SHAPE_NONE if the ray is parallel to the plane
+ */
+SHAPE_FUNC float shapeIntersectPlane(ShapeVec point,
+                                     ShapeVec norm,
+                                     ShapeVec eyePos,
+                                     ShapeVec d)
+{
+
+    float t = SHAPE_NONE;
+    float denominator = shapeDot(norm, d);
+    if (fabs(denominator) > SHAPE_EPSILON)
+        t = (shapeDot(norm, point) - shapeDot(norm, eyePos)) / denominator;
+    return t;
+}
+
+/**
+ * @brief shapeIntersectCap: intersect the disc of radius 0.5 closing a unit
+ *                           cylinder or cone
+ * @param y: height of the disc
+ * @param eyePos: the eye position
+ * @param d: the direction of the ray
+ * @return: "t" value, SHAPE_NONE for none
+ */
+SHAPE_FUNC float shapeIntersectCap(float y, ShapeVec eyePos, ShapeVec d)
+{
+
+    float t = shapeIntersectPlane(shapeVec(0, y, 0),
+                                  shapeVec(0, y < 0 ? -1 : 1, 0), eyePos, d);
+    float x = eyePos.x + t * d.x;
+    float z = eyePos.z + t * d.z;
+    if (t != SHAPE_NONE && !(x * x + z * z <= 0.25))
+        t = SHAPE_NONE;
+    return t;
+}
+
+/**
+ * @brief shapeClipHeight: drop a root of a side outside the unit height
+ * @param t: the root
+ * @param eyePos: the eye position
+ * @param d: the direction of the ray
+ * @return: the root, SHAPE_NONE if it is clipped
+ */
+SHAPE_FUNC float shapeClipHeight(float t, ShapeVec eyePos, ShapeVec d)
+{
+
+    if (!(eyePos.y + t * d.y <= 0.5 + SHAPE_EPSILON &&
+          eyePos.y + t * d.y >= -0.5 - SHAPE_EPSILON))
+        return SHAPE_NONE;
+    return t;
+}
+
+/**
+ * @brief shapeNearestRoot: pick the nearest of two roots in front of the eye
+ * @param t1: the first root
+ * @param t2: the second root
+ * @return: the nearest positive root, SHAPE_NONE for none
+ */
+SHAPE_FUNC float shapeNearestRoot(float t1, float t2)
+{
+
+    if (t1 > 0 && t2 <= 0)
+        return t1;
+    if (t1 <= 0 && t2 > 0)
+        return t2;
+    if (t1 > 0 && t2 > 0)
+        return t1 < t2 ? t1 : t2;
+    return SHAPE_NONE;
+}
+
+/**
+ * @brief shapeIntersectUnitSphere: do the intersection detection on unit
+ *                                  sphere
+ * @param eyePos: eye position in object space
+ * @param d: the direction in object space
+ * @return: "t" value, SHAPE_NONE for none
+ */
+SHAPE_FUNC float shapeIntersectUnitSphere(ShapeVec eyePos, ShapeVec d)
+{
+
+    float A = d.x * d.x + d.y * d.y + d.z * d.z;
+    float B = 2 * eyePos.x * d.x + 2 * eyePos.y * d.y + 2 * eyePos.z * d.z;
+    float C = eyePos.x * eyePos.x + eyePos.y * eyePos.y +
+              eyePos.z * eyePos.z - 0.25;
+
+    float determinant = B * B - 4 * A * C;
+    if (determinant < 0)
+        return SHAPE_NONE;
+
+    float t1 = (-B + sqrt(determinant)) / (2 * A);
+    float t2 = (-B - sqrt(determinant)) / (2 * A);
+    return shapeNearestRoot(t1, t2);
+}
+
+/**
+ * @brief shapeIntersectUnitCylinder: do the intersection detection on unit
+ *                                    cylinder
+ * @param eyePos: eye position in object space
+ * @param d: the direction in object space
+ * @param faceIndex: face index, 0 bottom, 1 top and 2 side, only written
+ *                   on a hit
+ * @return: "t" value, SHAPE_NONE for none
+ */
+SHAPE_FUNC float shapeIntersectUnitCylinder(ShapeVec eyePos,
+                                            ShapeVec d,
+                                            int* faceIndex)
+{
+
+    // Cylinder has three parts: bottom, top and side
+    float t[3];
+    t[0] = shapeIntersectCap(-0.5, eyePos, d);
+    t[1] = shapeIntersectCap(0.5, eyePos, d);
+    t[2] = SHAPE_NONE;
+
+    float A = d.x * d.x + d.z * d.z;
+    float B = 2 * eyePos.x * d.x + 2 * eyePos.z * d.z;
+    float C = eyePos.x * eyePos.x + eyePos.z * eyePos.z - 0.25;
+    float determinant = B * B - 4 * A * C;
+
+    if (determinant >= 0)
+    {
+        float t1 = (-B + sqrt(determinant)) / (2 * A);
+        float t2 = (-B - sqrt(determinant)) / (2 * A);
+        t[2] = shapeNearestRoot(shapeClipHeight(t1, eyePos, d),
+                                shapeClipHeight(t2, eyePos, d));
+    }
+
+    float minT = SHAPE_INF;
+    for (int i = 0; i < 3; i++)
+    {
+        if (t[i] > 0 && t[i] < minT)
+        {
+            minT = t[i];
+            *faceIndex = i;
+        }
+    }
+    return minT != SHAPE_INF ? minT : SHAPE_NONE;
+}
+
+/**
+ * @brief shapeIntersectUnitCone: do the intersection detection on unit cone
+ * @param eyePos: eye position in object space
+ * @param d: the direction in object space
+ * @param faceIndex: face index, 0 bottom and 1 side, only written on a hit
+ * @return: "t" value, SHAPE_NONE for none
+ */
+SHAPE_FUNC float shapeIntersectUnitCone(ShapeVec eyePos,
+                                        ShapeVec d,
+                                        int* faceIndex)
+{
+
+    // Cone has two parts: bottom and side
+    float t[2];
+    t[0] = shapeIntersectCap(-0.5, eyePos, d);
+    t[1] = SHAPE_NONE;
+
+    float A = d.x * d.x + d.z * d.z - 0.25 * d.y * d.y;
+    float B = 2 * eyePos.x * d.x + 2 * eyePos.z * d.z -
+              0.5 * eyePos.y * d.y + 0.25 * d.y;
+    float C = eyePos.x * eyePos.x + eyePos.z * eyePos.z -
+              0.25 * eyePos.y * eyePos.y + 0.25 * eyePos.y - 0.0625;
+    float determinant = B * B - 4 * A * C;
+
+    if (determinant >= 0)
+    {
+        float t1 = (-B + sqrt(determinant)) / (2 * A);
+        float t2 = (-B - sqrt(determinant)) / (2 * A);
+        t[1] = shapeNearestRoot(shapeClipHeight(t1, eyePos, d),
+                                shapeClipHeight(t2, eyePos, d));
+    }
+
+    float minT = SHAPE_INF;
+    for (int i = 0; i < 2; i++)
+    {
+        if (t[i] > 0 && t[i] < minT)
+        {
+            minT = t[i];
+            *faceIndex = i;
+        }
+    }
+    return minT != SHAPE_INF ? minT : SHAPE_NONE;
+}
+
+/**
+ * @brief shapeSphereNorm: get the normal of a point on unit sphere
+ * @param point: the point in object space
+ * @return: the unit normal
+ */
+SHAPE_FUNC ShapeVec shapeSphereNorm(ShapeVec point)
+{
+
+    return shapeNormalize(point);
+}
+
+/**
+ * @brief shapeCylinderNorm: get the normal of a point on unit cylinder
+ * @param point: the point in object space
+ * @param faceIndex: the face index of the point
+ * @return: the unit normal
+ */
+SHAPE_FUNC ShapeVec shapeCylinderNorm(ShapeVec point, int faceIndex)
+{
+
+    if (faceIndex == 0)
+        return shapeVec(0, -1, 0);
+    if (faceIndex == 1)
+        return shapeVec(0, 1, 0);
+    return shapeNormalize(shapeVec(point.x, 0, point.z));
+}
+
+/**
+ * @brief shapeConeNorm: get the normal of a point on unit cone
+ * @param point: the point in object space
+ * @param faceIndex: the face index of the point
+ * @return: the unit normal
+ */
+SHAPE_FUNC ShapeVec shapeConeNorm(ShapeVec point, int faceIndex)
+{
+
+    if (faceIndex == 0)
+        return shapeVec(0, -1, 0);
+    return shapeNormalize(shapeVec(2 * point.x, 0.25 - 0.5 * point.y,
+                                   2 * point.z));
+}
+
+/**
+ * @brief shapeInsideCube: check if a point is inside unit cube
+ * @param p: the point in object space
+ * @return: inside or not
+ */
+SHAPE_FUNC bool shapeInsideCube(ShapeVec p)
+{
+
+    return p.x < 0.5 && p.x > -0.5 && p.y < 0.5 && p.y > -0.5 &&
+           p.z < 0.5 && p.z > -0.5;
+}
+
+/**
+ * @brief shapeInsideCylinder: check if a point is inside unit cylinder
+ * @param p: the point in object space
+ * @return: inside or not
+ */
+SHAPE_FUNC bool shapeInsideCylinder(ShapeVec p)
+{
+
+    return sqrt(p.x * p.x + p.z * p.z) < 0.5 && p.y > -0.5 && p.y < 0.5;
+}
+
+/**
+ * @brief shapeInsideCone: check if a point is inside unit cone
+ * @param p: the point in object space
+ * @return: inside or not
+ */
+SHAPE_FUNC bool shapeInsideCone(ShapeVec p)
+{
+
+    if (!(p.y > -0.5 && p.y < 0.5))
+        return false;
+    float radius = 0.25 - 0.5 * p.y;
+    return sqrt(p.x * p.x + p.z * p.z) < radius;
+}
+
+/**
+ * @brief shapeInsideSphere: check if a point is inside unit sphere
+ * @param p: the point in object space
+ * @return: inside or not
+ */
+SHAPE_FUNC bool shapeInsideSphere(ShapeVec p)
+{
+
+    return sqrt(shapeDot(p, p)) < 0.5;
+}
+
+/**
+ * @brief shapeIntersectSlabs: intersect the line of a ray with the three
+ *                             slabs of an axis aligned box. Each slab gives
+ *                             the 't' values of its two planes ordered by
+ *                             the sign of the reciprocal direction, the box
+ *                             is entered at the largest of the first ones
+ *                             and left at the smallest of the second ones,
+ *                             the first axis wins ties. A NaN from an eye on
+ *                             the plane of a slab parallel to the ray drops
+ *                             that slab
+ * @param eyePos: the eye position
+ * @param invD: the reciprocal of the direction
+ * @param lower: the lower corner of the box
+ * @param upper: the upper corner of the box
+ * @param near: the 't' value entering the box, should be returned
+ * @param far: the 't' value leaving the box, should be returned
+ * @param nearFace: the face entering the box, axis * 2 for the plane
+ *                  through the lower corner and axis * 2 + 1 for the upper
+ *                  one, should be returned
+ * @param farFace: the face leaving the box, should be returned
+ * @return: true if the line hits the box, the hits may be behind the eye
+ */
+SHAPE_FUNC bool shapeIntersectSlabs(ShapeVec eyePos,
+                                    ShapeVec invD,
+                                    ShapeVec lower,
+                                    ShapeVec upper,
+                                    float* near,
+                                    float* far,
+                                    int* nearFace,
+                                    int* farFace)
+{
+
+    float origin[3] = {eyePos.x, eyePos.y, eyePos.z};
+    float inv[3]    = {invD.x, invD.y, invD.z};
+    float low[3]    = {lower.x, lower.y, lower.z};
+    float high[3]   = {upper.x, upper.y, upper.z};
+
+    *near = -INFINITY;
+    *far  = INFINITY;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        int negative = inv[axis] < 0;
+        float first  = negative ? high[axis] : low[axis];
+        float second = negative ? low[axis] : high[axis];
+
+        float t0 = (first - origin[axis]) * inv[axis];
+        float t1 = (second - origin[axis]) * inv[axis];
+        t0 = t0 > -INFINITY ? t0 : -INFINITY;
+        t1 = t1 < INFINITY ? t1 : INFINITY;
+
+        if (axis == 0 || t0 > *near)
+        {
+            *near     = t0;
+            *nearFace = axis * 2 + negative;
+        }
+        if (axis == 0 || t1 < *far)
+        {
+            *far     = t1;
+            *farFace = axis * 2 + 1 - negative;
+        }
+    }
+    return *near <= *far;
+}
+
+/**
+ * @brief shapeHashSample: scramble the index of a pixel and a number into a
+ *                         random looking integer
+ * @param index: index of the pixel
+ * @param number: the number
+ * @return: the hash
+ */
+SHAPE_FUNC unsigned int shapeHashSample(unsigned int index,
+                                        unsigned int number)
+{
+
+    unsigned int h = index * 0x9e3779b9u ^ number * 0x85ebca6bu;
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    h *= 0x846ca68bu;
+    h ^= h >> 16;
+    return h;
+}
+
+/**
+ * @brief shapeSampleGridSize: get the cells per side of the grid the
+ *                             jittered samples of a pixel lie in
+ * @param maxSamples: most samples of a pixel
+ * @return: the cells per side
+ */
+SHAPE_FUNC int shapeSampleGridSize(int maxSamples)
+{
+
+    return (int)ceil(sqrt((float)(maxSamples > 1 ? maxSamples - 1 : 1)));
+}
+
+/**
+ * @brief shapeSampleOffset: get where a sample lies in its pixel. Sample 0
+ *                           is the center, the others are jittered in the
+ *                           cells of a grid over the pixel
+ * @param index: index of the pixel
+ * @param sample: index of the sample
+ * @param gridSize: cells per side of the grid, see shapeSampleGridSize()
+ * @param dx: horizontal offset from the center in [-0.5, 0.5), should be
+ *            returned
+ * @param dy: vertical offset from the center in [-0.5, 0.5), should be
+ *            returned
+ */
+SHAPE_FUNC void shapeSampleOffset(int index,
+                                  int sample,
+                                  int gridSize,
+                                  float* dx,
+                                  float* dy)
+{
+
+    if (sample == 0)
+    {
+        *dx = 0;
+        *dy = 0;
+        return;
+    }
+
+    // The cells are visited from a different one in every pixel, so that
+    // the pixels stopping before the grid is full don't all miss the same
+    // cells
+    int cells = gridSize * gridSize;
+    int cell  = (sample - 1 + shapeHashSample(index, 0) % cells) % cells;
+
+    unsigned int jitter = shapeHashSample(index, sample);
+    float u = (jitter & 0xffff) / 65536.f;
+    float v = (jitter >> 16) / 65536.f;
+
+    *dx = ((cell % gridSize) + u) / gridSize - 0.5f;
+    *dy = ((cell / gridSize) + v) / gridSize - 0.5f;
+}
+
+/**
+ * @brief shapeLightAttenuation: get the falloff of a point or spot light
+ *                               at a point
+ * @param lightPos: position of the light
+ * @param pos: the lit point
+ * @param function: constant, linear and quadratic falloff coefficients
+ * @param distance: the distance from the point to the light, should be
+ *                  returned
+ * @return: the attenuation, at most 1
+ */
+SHAPE_FUNC float shapeLightAttenuation(ShapeVec lightPos,
+                                       ShapeVec pos,
+                                       ShapeVec function,
+                                       float* distance)
+{
+
+    float dx = lightPos.x - pos.x;
+    float dy = lightPos.y - pos.y;
+    float dz = lightPos.z - pos.z;
+    float d  = sqrt(dx * dx + dy * dy + dz * dz);
+    *distance = d;
+
+    float attenuation = 1.0 / (function.x + function.y * d +
+                               function.z * (d * d));
+    return attenuation < 1 ? attenuation : 1;
+}
+
+/**
+ * @brief shapeSpotFactor: get the intensity of a spot light towards a point
+ * @param lightDir: unit direction from the point to the light
+ * @param majorDir: unit direction from the center of the cone to the light
+ * @param penumbra: the angle of the cone in degrees
+ * @return: the factor of the light's color, 0 outside of the cone
+ */
+SHAPE_FUNC float shapeSpotFactor(ShapeVec lightDir,
+                                 ShapeVec majorDir,
+                                 float penumbra)
+{
+
+    float radians       = penumbra / 180.0 * M_PI;
+    float spotIntensity = shapeDot(lightDir, majorDir);
+    if (spotIntensity < cos(radians))
+        return 0;
+    return pow(spotIntensity, 5);
+}
+
+/**
+ * @brief shapeDiffuseFactor: get the diffuse term of a light
+ * @param lightDir: unit direction from the point to the light
+ * @param norm: unit normal at the point
+ * @return: the cosine of the angle of incidence, 0 from behind
+ */
+SHAPE_FUNC float shapeDiffuseFactor(ShapeVec lightDir, ShapeVec norm)
+{
+
+    float dotLN = shapeDot(lightDir, norm);
+    return dotLN < 0 ? 0 : dotLN;
+}
+
+/**
+ * @brief shapeSpecularFactor: get the specular term of a light. The light
+ *                             is mirrored about the normal the way the CPU
+ *                             tracer's getReflectionDir() always did, only
+ *                             the part along the normal is normalized
+ * @param lightDir: unit direction from the point to the light
+ * @param norm: unit normal at the point
+ * @param sight: unit direction from the point to the eye
+ * @param shininess: the specular exponent
+ * @return: the specular term
+ */
+SHAPE_FUNC float shapeSpecularFactor(ShapeVec lightDir,
+                                     ShapeVec norm,
+                                     ShapeVec sight,
+                                     float shininess)
+{
+
+    ShapeVec incident = shapeVec(-lightDir.x, -lightDir.y, -lightDir.z);
+    float cosine = -incident.x * norm.x + incident.y * norm.y +
+            incident.z * norm.z;
+    ShapeVec mirror = shapeVec(2 * cosine * norm.x, 2 * cosine * norm.y,
+                               2 * cosine * norm.z);
+    float scale = 1.f / sqrt(shapeDot(mirror, mirror));
+    ShapeVec reflection = shapeVec(incident.x + mirror.x * scale,
+                                   incident.y + mirror.y * scale,
+                                   incident.z + mirror.z * scale);
+
+    float dotEN = shapeDot(sight, reflection);
+    if (dotEN < 0)
+        dotEN = 0;
+    return pow(dotEN, shininess);
+}
+
+#endif // SHAPE_MATH_H
@@ -0,0 +1,109 @@
+/*!
+    @file slab_intersect.h
+    @desc: declarations and inline definitions of the branchless slab test
+           shared by the kdtree box and the unit cube, an SSE form of
+           shapeIntersectSlabs() of shape_math.h, which the OpenCL kernel
+           and the builds without SSE use
+    @author: yanli
+    @date: May 2013
+ */
+
+#ifndef SLAB_INTERSECT_H
+#define SLAB_INTERSECT_H
+
+#include "CS123Algebra.h"
+#include "shape_math.h"
+#include <math.h>
+
+#if defined(__SSE__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define SLAB_USE_SSE
+#include <xmmintrin.h>
+#endif
+
+/**
+ * @brief doIntersectRaySlabs: intersect the line of a ray with the three
+ *                             slabs of an axis aligned box. Each slab gives
+ *                             the 't' values of its two planes ordered by
+ *                             the sign of the reciprocal direction, the box
+ *                             is entered at the largest of the first ones
+ *                             and left at the smallest of the second ones.
+ *                             A NaN from an eye on the plane of a slab
+ *                             parallel to the ray drops that slab. The SSE
+ *                             version gives the same results as the shared
+ *                             scalar one
+ * @param eyePos: the eye position
+ * @param invD: the reciprocal of the direction
+ * @param lower: the lower corner of the box
+ * @param upper: the upper corner of the box
+ * @param near: the 't' value entering the box, should be returned
+ * @param far: the 't' value leaving the box, should be returned
+ * @param nearFace: the face entering the box, axis * 2 for the plane
+ *                  through the lower corner and axis * 2 + 1 for the upper
+ *                  one, should be returned
+ * @param farFace: the face leaving the box, should be returned
+ * @return: true if the line hits the box, the hits may be behind the eye
+ */
+inline bool doIntersectRaySlabs(const Vector4& eyePos,
+                                const Vector4& invD,
+                                const Vector3& lower,
+                                const Vector3& upper,
+                                REAL& near,
+                                REAL& far,
+                                int& nearFace,
+                                int& farFace)
+{
+
+#ifdef SLAB_USE_SSE
+    // The first axis with the extreme value, for a mask of the axes having
+    // it, the fourth lane never has it
+    static const int firstAxis[8] = {0, 0, 1, 0, 2, 0, 1, 0};
+
+    // The fourth lane enters at -INFINITY and leaves at INFINITY
+    __m128 origin = _mm_set_ps(0.f, eyePos.z, eyePos.y, eyePos.x);
+    __m128 inv    = _mm_set_ps(INFINITY, invD.z, invD.y, invD.x);
+    __m128 low    = _mm_set_ps(-1.f, lower.z, lower.y, lower.x);
+    __m128 high   = _mm_set_ps(1.f, upper.z, upper.y, upper.x);
+    __m128 maxInf = _mm_set1_ps(INFINITY);
+    __m128 minInf = _mm_set1_ps(-INFINITY);
+
+    __m128 negative = _mm_cmplt_ps(inv, _mm_setzero_ps());
+    __m128 first    = _mm_or_ps(_mm_and_ps(negative, high),
+                                _mm_andnot_ps(negative, low));
+    __m128 second   = _mm_or_ps(_mm_and_ps(negative, low),
+                                _mm_andnot_ps(negative, high));
+
+    // max and min return their second argument for a NaN in the first
+    __m128 t0 = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(first, origin), inv),
+                           minInf);
+    __m128 t1 = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(second, origin), inv),
+                           maxInf);
+
+    __m128 tNear = _mm_max_ps(t0, _mm_shuffle_ps(t0, t0,
+                                                 _MM_SHUFFLE(2, 3, 0, 1)));
+    tNear = _mm_max_ps(tNear, _mm_shuffle_ps(tNear, tNear,
+                                             _MM_SHUFFLE(1, 0, 3, 2)));
+    __m128 tFar = _mm_min_ps(t1, _mm_shuffle_ps(t1, t1,
+                                                _MM_SHUFFLE(2, 3, 0, 1)));
+    tFar = _mm_min_ps(tFar, _mm_shuffle_ps(tFar, tFar,
+                                           _MM_SHUFFLE(1, 0, 3, 2)));
+
+    int signs    = _mm_movemask_ps(negative);
+    int nearAxis = firstAxis[_mm_movemask_ps(_mm_cmpeq_ps(t0, tNear)) & 7];
+    int farAxis  = firstAxis[_mm_movemask_ps(_mm_cmpeq_ps(t1, tFar)) & 7];
+    nearFace = nearAxis * 2 + ((signs >> nearAxis) & 1);
+    farFace  = farAxis * 2 + 1 - ((signs >> farAxis) & 1);
+
+    _mm_store_ss(&near, tNear);
+    _mm_store_ss(&far, tFar);
+    return near <= far;
+#else
+    return shapeIntersectSlabs(shapeVec(eyePos.x, eyePos.y, eyePos.z),
+                               shapeVec(invD.x, invD.y, invD.z),
+                               shapeVec(lower.x, lower.y, lower.z),
+                               shapeVec(upper.x, upper.y, upper.z),
+                               &near, &far, &nearFace, &farFace);
+#endif
+}
+
+#endif // SLAB_INTERSECT_H
@@ -28,13 +28,14 @@ REAL doIntersectUnitSphere(const Vector4& eyePos,
 Vector3 getSphereNorm(const Vector4& intersectPoint);
 
 /**
- * @brief getSphereIntersectTexColor: get the texture color from the
- *                                   intersection point
- * @param object: the scene object
- * @param intersect: the intersection point
- * @return: the color
+ * @brief getSphereIntersectTexCoord: get the texture coordinates of the
+ *                                    intersection point
+ * @param intersectPoint: the intersection point
+ * @param u: horizontal coordinate in [0, 1], should be returned
+ * @param v: vertical coordinate in [0, 1], should be returned
  */
-CS123SceneColor getSphereIntersectTexColor(const SceneObject& object,
-                                           const Vector4& intersectPoint);
+void getSphereIntersectTexCoord(const Vector4& intersectPoint,
+                                REAL& u,
+                                REAL& v);
 
 #endif
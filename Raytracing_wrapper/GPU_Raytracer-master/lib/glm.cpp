@@ -28,14 +28,17 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#ifndef NO_GL
 #define GL_GLEXT_PROTOTYPES
 #include <GL/gl.h>
 #include <GL/glu.h>
 #include <GL/glext.h>
+#endif
 #include "glm.h"
 #include "targa.h"
 
 
+#ifndef NO_GL
 #ifndef GL_BGR
 #define GL_BGR GL_BGR_EXT
 #endif
@@ -43,6 +46,7 @@
 #ifndef GL_BGRA
 #define GL_BGRA GL_BGRA_EXT
 #endif
+#endif
 
 
 
@@ -134,6 +138,18 @@ static GLboolean glmEqual(GLfloat* u, GLfloat* v, GLfloat epsilon) {
     return GL_FALSE;
 }
 
+#ifdef NO_GL
+/* glmLoadTexture: without GL there is nothing to load the texture into,
+ * the tracer reads the textures of the scene file instead.
+ */
+GLuint glmLoadTexture(char *filename, GLboolean alpha, GLboolean repeat,
+                      GLboolean filtering, GLboolean mipmaps, GLfloat *texcoordwidth, GLfloat *texcoordheight)
+{
+    *texcoordwidth = 1;
+    *texcoordheight = 1;
+    return 0;
+}
+#else
 static GLint gl_max_texture_size;
 
 GLuint glmLoadTexture(char *filename, GLboolean alpha, GLboolean repeat,
@@ -213,6 +229,7 @@ GLuint glmLoadTexture(char *filename, GLboolean alpha, GLboolean repeat,
     *texcoordheight = ySize2;
     return tex;
 }
+#endif
 
 
 /* glmWeldVectors: eliminate (weld) vectors that are within an
@@ -1342,7 +1359,9 @@ GLvoid glmDelete(GLMmodel* model){
     if (model->textures) {
         for (i = 0; i < model->numtextures; i++) {
             free(model->textures[i].name);
+#ifndef NO_GL
             glDeleteTextures(1,&model->textures[i].id);
+#endif
         }
         free(model->textures);
     }
@@ -1617,6 +1636,7 @@ GLvoid glmWriteOBJ(GLMmodel* model, char* filename, GLuint mode){
     fclose(file);
 }
 
+#ifndef NO_GL
 /* glmDraw: Renders the model to the current OpenGL context using the
  * mode specified.
  *
@@ -1784,6 +1804,7 @@ GLuint glmList(GLMmodel* model, GLuint mode){
     glEndList();
     return list;
 }
+#endif
 
 /* glmWeld: eliminate (weld) vectors that are within an epsilon of
  * each other.
@@ -11,6 +11,20 @@
 #define M_PI 3.14159265f
 #endif
 
+/* NO_GL: the headless build reads models without GL, it only needs the
+ * types of GL.
+ */
+#ifdef NO_GL
+typedef unsigned char GLboolean;
+typedef unsigned char GLubyte;
+typedef int GLint;
+typedef unsigned int GLuint;
+typedef float GLfloat;
+typedef void GLvoid;
+#define GL_TRUE 1
+#define GL_FALSE 0
+#endif
+
 #define GLM_NONE     (0)            /* render with only vertices */
 #define GLM_FLAT     (1 << 0)       /* render with facet normals */
 #define GLM_SMOOTH   (1 << 1)       /* render with vertex normals */
@@ -107,7 +121,9 @@ struct mycallback
     char *text;
 };
 
+#ifndef NO_GL
 GLvoid glmDraw(GLMmodel* model, GLuint mode,char *drawonly);
+#endif
 
 GLfloat glmDot(GLfloat* u, GLfloat* v);
 
@@ -219,6 +235,7 @@ GLMmodel* glmReadOBJ(const char* filename,mycallback *call);
  */
 GLvoid glmWriteOBJ(GLMmodel* model, char* filename, GLuint mode);
 
+#ifndef NO_GL
 /* glmDraw: Renders the model to the current OpenGL context using the
  * mode specified.
  *
@@ -244,6 +261,7 @@ GLvoid glmDraw(GLMmodel* model, GLuint mode);
  *            GLM_FLAT and GLM_SMOOTH should not both be specified.  
  */
 GLuint glmList(GLMmodel* model, GLuint mode);
+#endif
 
 /* glmWeld: eliminate (weld) vectors that are within an epsilon of
  * each other.
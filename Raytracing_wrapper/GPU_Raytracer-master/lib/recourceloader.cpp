@@ -1,7 +1,36 @@
 #include "resource_loader.h"
 #include <QFile>
+#include <QImage>
 #include <iostream>
 
+/**
+ * @brief convertToRGBA: convert an image to the layout
+ *                       QGLWidget::convertToGLFormat gives, RGBA bytes with
+ *                       the rows bottom up, without needing QtOpenGL
+ * @param image: the image
+ * @return: the converted image
+ */
+static QImage convertToRGBA(const QImage& image)
+{
+
+    QImage source = image.convertToFormat(QImage::Format_ARGB32);
+    QImage result(source.width(), source.height(), QImage::Format_ARGB32);
+    for (int y = 0; y < source.height(); y++)
+    {
+        uchar* row = result.scanLine(y);
+        for (int x = 0; x < source.width(); x++)
+        {
+            QRgb color = source.pixel(x, source.height() - 1 - y);
+            row[x * 4]     = qRed(color);
+            row[x * 4 + 1] = qGreen(color);
+            row[x * 4 + 2] = qBlue(color);
+            row[x * 4 + 3] = qAlpha(color);
+        }
+    }
+    return result;
+}
+
+#ifndef NO_GL
 /**
  * loadTexture: load the texture from a path
  * @param path: the path of the texture
@@ -39,6 +68,58 @@ GLuint loadTexture(const QString &path)
     glBindTexture(GL_TEXTURE_2D, 0);
     return result;
 }
+#endif
+
+unsigned* loadTexels(const QString &path, int& width, int& height)
+{
+
+    QFile file(path);
+    QImage image, texture;
+
+    width  = 0;
+    height = 0;
+
+    if(!file.exists())
+    {
+        std::cerr<<"The path: "<<path.toStdString()
+                 <<" does not exist"<<std::endl;
+        return NULL;
+    }
+
+    if(!image.load(file.fileName()))
+    {
+        std::cerr<<"Cannot load the image: "<<path.toStdString()<<std::endl;
+        return NULL;
+    }
+
+    texture = convertToRGBA(image);
+    width   = texture.width();
+    height  = texture.height();
+
+    unsigned* texels = new unsigned[width*height];
+    memcpy(texels, texture.bits(), width*height*sizeof(unsigned));
+    return texels;
+}
+
+#ifndef NO_GL
+GLuint createTextureFromTexels(const unsigned* texels,
+                               const int width,
+                               const int height)
+{
+
+    GLuint result = 0;
+    glEnable(GL_TEXTURE_2D);
+    glGenTextures(1,&result);
+    glBindTexture(GL_TEXTURE_2D,result);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexImage2D(GL_TEXTURE_2D,0,GL_RGBA, width, height,
+                 0, GL_RGBA, GL_UNSIGNED_BYTE, texels);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    return result;
+}
 
 void createTexture(GLuint *texName, const int sizeX, const int sizeY)
 {
@@ -144,4 +225,4 @@ bool loadBMPTexture(GLuint* texName, const char* filename)
     free(pixels);
     return true;
 }
-
+#endif
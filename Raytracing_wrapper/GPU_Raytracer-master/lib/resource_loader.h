@@ -9,14 +9,41 @@
 #define RESOURCELOADER_H
 
 #include <QString>
+#ifndef NO_GL
 #include <qgl.h>
+#endif
 
+#ifndef NO_GL
 /**
  * loadTexture: load the texture from a path
  * @param path: the path of the texture
  * @return: the texture handle
  */
 GLuint loadTexture(const QString &path);
+#endif
+
+/**
+ * @brief loadTexels: load the texels of a texture from a path without
+ *                    touching GL, the layout is the same as reading back a
+ *                    texture created by loadTexture with glGetTexImage
+ * @param path: the path of the texture
+ * @param width: the width of the texture (output)
+ * @param height: the height of the texture (output)
+ * @return: the texel array allocated by new[], NULL on failure
+ */
+unsigned* loadTexels(const QString &path, int& width, int& height);
+
+#ifndef NO_GL
+/**
+ * @brief createTextureFromTexels: create a GL texture from a texel array
+ * @param texels: the texel array in RGBA order
+ * @param width: the width of the texture
+ * @param height: the height of the texture
+ * @return: the texture handle
+ */
+GLuint createTextureFromTexels(const unsigned* texels,
+                               const int width,
+                               const int height);
 
 /**
  * @brief createTexture: create a texture
@@ -33,5 +60,6 @@ void createTexture(GLuint *texName, const int sizeX, const int sizeY);
  * @return: the status for loading, true for success and false for failure
  */
 bool loadBMPTexture(GLuint* texName, const char* filename);
+#endif
 
 #endif // RESOURCELOADER_H
@@ -6,31 +6,64 @@
  */
 
 #include "CPUrayscene.h"
+#include "global.h"
+#ifndef NO_GL
 #include "camera.h"
 #include "view2d.h"
+#endif
 #include "trace.h"
-#include "trace_thread.h"
+#include "trace_pool.h"
+#include <QElapsedTimer>
+#include <string.h>
 
 CPURayScene::CPURayScene()
 {
 
+    m_view          = NULL;
+    m_tree          = NULL;
+    m_bvh           = NULL;
+    m_pool          = NULL;
+    m_setupTime     = 0;
+    m_sampleNear    = 0;
+    m_previewStart  = settings.previewStep;
+    m_previewStep   = 0;
+    m_previewCoarse = false;
+    m_previewWidth  = 0;
+    m_previewHeight = 0;
+    m_previewNear   = 0;
 }
 
 CPURayScene::CPURayScene(Scene* scene)
 {
 
+    m_pool          = NULL;
+    m_setupTime     = 0;
+    m_sampleNear    = 0;
+    m_previewStart  = settings.previewStep;
+    m_previewStep   = 0;
+    m_previewCoarse = false;
+    m_previewWidth  = 0;
+    m_previewHeight = 0;
+    m_previewNear   = 0;
+
     m_globalData = scene->getGlobal();
     m_lightData  = scene->getLight();
     m_objects    = scene->getObjects();
+    m_view       = scene->getIntersectView();
     m_tree       = scene->getKdTree();
+    m_bvh        = scene->getBvh();
     m_extends    = scene->getExtends();
 }
 
 CPURayScene::~CPURayScene()
 {
 
+    // Stop the threads
+    if (m_pool)
+        delete m_pool;
 }
 
+#ifndef NO_GL
 void CPURayScene::traceScene(View2D* view2D,
                              OrbitCamera* camera,
                              int width,
@@ -54,65 +87,356 @@ void CPURayScene::traceScene(View2D* view2D,
 
     BGRA* pixels = view2D->data();
 
+    traceScene(pixels, width, height, eyePos, camera->getNear(),
+               invViewTransMat);
+}
+#endif
+
+void CPURayScene::traceScene(BGRA* pixels,
+                             int width,
+                             int height,
+                             const Vector4& eyePos,
+                             const float near,
+                             const Matrix4x4& invViewTransMat)
+{
+
+    assert(pixels);
+    assert(width > 0 && height > 0);
+
+    QElapsedTimer timer;
+    timer.start();
+
+    // Supersampled frames trace the centers first, the refine pass compares
+    // every pixel to its neighbours, so it can only start after them
+    SampleBuffer* samples = NULL;
+    int refineStep = 0;
+    if (settings.useSupersampling)
+    {
+        samples    = &m_samples;
+        refineStep = prepareSamples(width, height, eyePos, near,
+                                    invViewTransMat);
+    }
+    bool traceCenters = !samples || samples->isEmpty();
+
     if (settings.useMultithread)
     {
-        assert(settings.traceThreadNum > 0);
-        int unitLength = width * height / settings.traceThreadNum;
-        TraceThread* threads = new TraceThread[settings.traceThreadNum];
-
-        for (int i = 0; i < settings.traceThreadNum - 1; i++)
-            threads[i].pack(pixels,
-                            width,
-                            height,
-                            i*unitLength,
-                            (i + 1) * unitLength,
-                            m_globalData,
-                            m_objects,
-                            m_lightData,
-                            eyePos,
-                            camera->getNear(),
-                            invViewTransMat,
-                            m_tree,
-                            m_extends);
-
-        threads[settings.traceThreadNum-1].pack(pixels,
-                                                width,
-                                                height,
-                                                (settings.traceThreadNum - 1) *
-                                                unitLength,
-                                                width * height,
-                                                m_globalData,
-                                                m_objects,
-                                                m_lightData,
-                                                eyePos,
-                                                camera->getNear(),
-                                                invViewTransMat,
-                                                m_tree,
-                                                m_extends);
-
-        for (int i = 0; i < settings.traceThreadNum; i++)
-            threads[i].start();
-
-        for (int i = 0; i < settings.traceThreadNum; i++)
-            threads[i].wait();
-
-        delete []threads;
+        preparePool();
+
+        // Threads take tiles from the scheduler instead of fixed slabs, so
+        // that an expensive region doesn't leave the other threads idle
+        m_scheduler.init(width,
+                         height,
+                         settings.traceTileSize,
+                         settings.traceThreadNum);
+
+        TraceFrame frame;
+        initFrame(frame, pixels, width, height, eyePos, near,
+                  invViewTransMat);
+        frame.m_samples    = samples;
+        frame.m_refineStep = refineStep;
+
+        m_setupTime = timer.nsecsElapsed() / 1000000.f;
+        if (traceCenters)
+            m_pool->trace(frame);
+
+        if (samples)
+        {
+            m_scheduler.init(width,
+                             height,
+                             settings.traceTileSize,
+                             settings.traceThreadNum);
+            frame.m_refine = true;
+            m_pool->trace(frame);
+        }
     }
     else
     {
-        doRayTrace(pixels,
-                   width,
+        m_setupTime = timer.nsecsElapsed() / 1000000.f;
+        if (traceCenters && checkPacketTrace())
+        {
+            doPacketRayTrace(pixels,
+                             width,
+                             height,
+                             0,
+                             0,
+                             width,
+                             height,
+                             m_globalData,
+                             m_objects,
+                             *m_view,
+                             m_lightData,
+                             eyePos,
+                             near,
+                             invViewTransMat,
+                             m_tree,
+                             m_bvh,
+                             m_extends,
+                             samples);
+        }
+        else if (traceCenters)
+        {
+            doRayTrace(pixels,
+                       width,
+                       height,
+                       0,
+                       width*height,
+                       m_globalData,
+                       m_objects,
+                       *m_view,
+                       m_lightData,
+                       eyePos,
+                       near,
+                       invViewTransMat,
+                       m_tree,
+                       m_bvh,
+                       m_extends,
+                       samples);
+        }
+
+        if (samples)
+        {
+            doRefineTrace(pixels,
+                          width,
+                          height,
+                          0,
+                          0,
+                          width,
+                          height,
+                          m_globalData,
+                          m_objects,
+                          *m_view,
+                          m_lightData,
+                          eyePos,
+                          near,
+                          invViewTransMat,
+                          m_tree,
+                          m_bvh,
+                          m_extends,
+                          *samples,
+                          refineStep);
+        }
+    }
+
+    if (samples)
+    {
+        samples->setFilled();
+        samples->countSamples();
+    }
+}
+
+#ifndef NO_GL
+bool CPURayScene::tracePreview(View2D* view2D,
+                               OrbitCamera* camera,
+                               int width,
+                               int height,
+                               float budget)
+{
+
+    assert(view2D);
+    assert(camera);
+    assert(width > 0 && height > 0);
+
+    camera->updateMatrices();
+
+    // Resizing clears the canvas, only do it when the size changes, the
+    // preview draws over the last image
+    if (view2D->width() != width || view2D->height() != height)
+        view2D->resize(width, height);
+
+    return tracePreview(view2D->data(), width, height, camera->getEyePos(),
+                        camera->getNear(), camera->getInvViewTransMatrix(),
+                        budget);
+}
+#endif
+
+bool CPURayScene::tracePreview(BGRA* pixels,
+                               int width,
+                               int height,
+                               const Vector4& eyePos,
+                               const float near,
+                               const Matrix4x4& invViewTransMat,
+                               float budget)
+{
+
+    assert(pixels);
+    assert(width > 0 && height > 0);
+
+    QElapsedTimer timer;
+    timer.start();
+
+    // A moved camera makes the unfinished levels stale, start over from
+    // the coarsest one
+    bool moved = width != m_previewWidth || height != m_previewHeight ||
+            near != m_previewNear ||
+            memcmp(eyePos.data, m_previewEyePos.data,
+                   sizeof(eyePos.data)) != 0 ||
+            memcmp(invViewTransMat.data, m_previewInvView.data,
+                   sizeof(invViewTransMat.data)) != 0;
+    if (moved)
+    {
+        m_previewWidth   = width;
+        m_previewHeight  = height;
+        m_previewEyePos  = eyePos;
+        m_previewNear    = near;
+        m_previewInvView = invViewTransMat;
+        m_previewStep    = m_previewStart;
+        m_previewCoarse  = true;
+        m_previewTiles.clear();
+    }
+
+    if (m_previewStep == 0)
+        return true;
+
+    int threads = settings.useMultithread ? settings.traceThreadNum : 1;
+    if (settings.useMultithread)
+        preparePool();
+
+    TraceFrame frame;
+    initFrame(frame, pixels, width, height, eyePos, near, invViewTransMat);
+    frame.m_timer = &timer;
+
+    m_setupTime = timer.nsecsElapsed() / 1000000.f;
+    while (m_previewStep > 0)
+    {
+        m_scheduler.init(width, height, settings.traceTileSize, threads);
+        if (m_previewTiles.isEmpty())
+            m_previewTiles.fill(0, m_scheduler.getTileCount());
+
+        // The coarsest level is always finished, so that a whole image
+        // shows up however small the budget is
+        frame.m_previewStep   = m_previewStep;
+        frame.m_previewCoarse = m_previewCoarse;
+        frame.m_previewTiles  = m_previewTiles.data();
+        frame.m_budget        = m_previewCoarse ? -1 : budget;
+
+        if (settings.useMultithread)
+        {
+            m_pool->trace(frame);
+        }
+        else
+        {
+            Tile tile;
+            while (m_scheduler.next(0, tile))
+                tracePreviewTile(frame, tile);
+        }
+
+        if (m_previewTiles.contains(0))
+            return false;
+
+        if (m_previewCoarse)
+        {
+            // Aim the coarsest level of the next preview at the budget, a
+            // level of half the step traces four times as many pixels
+            float elapsed = timer.nsecsElapsed() / 1000000.f;
+            if (elapsed > budget && m_previewStart < PREVIEW_MAX_STEP)
+                m_previewStart *= 2;
+            else if (elapsed * 4 < budget && m_previewStart > 1)
+                m_previewStart /= 2;
+        }
+
+        m_previewStep  /= 2;
+        m_previewCoarse = false;
+        m_previewTiles.clear();
+
+        if (timer.nsecsElapsed() / 1000000.f >= budget)
+            break;
+    }
+    return m_previewStep == 0;
+}
+
+int CPURayScene::prepareSamples(int width,
+                                int height,
+                                const Vector4& eyePos,
+                                const float near,
+                                const Matrix4x4& invViewTransMat)
+{
+
+    m_samples.init(width,
                    height,
-                   0,
-                   width*height,
-                   m_globalData,
-                   m_objects,
-                   m_lightData,
-                   eyePos,
-                   camera->getNear(),
-                   invViewTransMat,
-                   m_tree,
-                   m_extends);
+                   qMax(settings.maxSamples, 1),
+                   settings.sampleContrast);
+
+    // Any move of the camera makes the old samples wrong
+    bool moved = near != m_sampleNear ||
+            memcmp(eyePos.data, m_sampleEyePos.data,
+                   sizeof(eyePos.data)) != 0 ||
+            memcmp(invViewTransMat.data, m_sampleInvView.data,
+                   sizeof(invViewTransMat.data)) != 0;
+    if (moved || !settings.useProgressive)
+        m_samples.reset();
+
+    m_sampleEyePos  = eyePos;
+    m_sampleNear    = near;
+    m_sampleInvView = invViewTransMat;
+
+    // A progressive frame adds one sample to a pixel, so the first frames
+    // show up quickly and later ones keep sharpening the edges
+    if (settings.useProgressive)
+        return 1;
+    return m_samples.getMaxSamples() - 1;
+}
+
+void CPURayScene::preparePool()
+{
+
+    assert(settings.traceThreadNum > 0);
+
+    // The threads are kept alive across frames, only restart them when
+    // the thread count changes
+    if (m_pool && m_pool->getThreadCount() != settings.traceThreadNum)
+    {
+        delete m_pool;
+        m_pool = NULL;
     }
+    if (!m_pool)
+        m_pool = new TracePool(settings.traceThreadNum);
+}
+
+void CPURayScene::initFrame(TraceFrame& frame,
+                            BGRA* pixels,
+                            int width,
+                            int height,
+                            const Vector4& eyePos,
+                            const float near,
+                            const Matrix4x4& invViewTransMat)
+{
+
+    // All of the threads read the same scene data, nothing is copied
+    frame.m_pixel           = pixels;
+    frame.m_width           = width;
+    frame.m_height          = height;
+    frame.m_global          = &m_globalData;
+    frame.m_objects         = &m_objects;
+    frame.m_view            = m_view;
+    frame.m_lights          = &m_lightData;
+    frame.m_eyePos          = eyePos;
+    frame.m_near            = near;
+    frame.m_invViewTransMat = invViewTransMat;
+    frame.m_tree            = m_tree;
+    frame.m_bvh             = m_bvh;
+    frame.m_extends         = m_extends;
+    frame.m_scheduler       = &m_scheduler;
+    frame.m_samples         = NULL;
+    frame.m_refine          = false;
+    frame.m_refineStep      = 0;
+    frame.m_previewStep     = 0;
+    frame.m_previewCoarse   = false;
+    frame.m_previewTiles    = NULL;
+    frame.m_timer           = NULL;
+    frame.m_budget          = -1;
 }
 
+void CPURayScene::updateObjects(Scene* scene, const QVector<int>& objects)
+{
+
+    // The view and the acceleration structures are updated in place
+    const QVector<SceneObject>& sceneObjects = scene->getObjects();
+    for (int i = 0; i < objects.size(); i++)
+        m_objects[objects[i]] = sceneObjects[objects[i]];
+    m_extends = scene->getExtends();
+
+    // The accumulated samples and the preview show the objects where they
+    // were, a preview of no size starts over
+    m_samples.reset();
+    m_previewWidth = 0;
+}
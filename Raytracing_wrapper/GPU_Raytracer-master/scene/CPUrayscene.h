@@ -10,13 +10,21 @@
 
 #include "scene.h"
 #include "aabb.h"
+#include "tile_scheduler.h"
+#include "sample_buffer.h"
+#include "defaults.h"
 
 #define THREAD_NUM 8 // Thread number
+#define PREVIEW_MAX_STEP 64 // Most pixels per side of the preview blocks
 
 class View2D;
 class OrbitCamera;
 class KdTree;
+class Bvh;
+class IntersectView;
 class Scene;
+class TracePool;
+struct TraceFrame;
 /**
  * @class: CPURayScene
  * @brief The CPURayScene class is used for tracing the scene using CPU
@@ -30,6 +38,7 @@ public:
 
     ~CPURayScene();
 
+#ifndef NO_GL
     /**
      * @brief traceScene: do ray tracing on the scene
      * @param view2D: pointer to the view structure
@@ -41,14 +50,154 @@ public:
                     OrbitCamera* camera,
                     int width,
                     int height);
+#endif
+
+    /**
+     * @brief traceScene: do ray tracing on the scene into a pixel buffer,
+     *                    doesn't need any view or GL context
+     * @param pixels: the pixel buffer of width * height
+     * @param width: width of the canvas
+     * @param height: height of the canvas
+     * @param eyePos: eye position
+     * @param near: near plane
+     * @param invViewTransMat: inverse of view transformation matrix
+     */
+    void traceScene(BGRA* pixels,
+                    int width,
+                    int height,
+                    const Vector4& eyePos,
+                    const float near,
+                    const Matrix4x4& invViewTransMat);
+
+#ifndef NO_GL
+    /**
+     * @brief tracePreview: trace the next part of an interactive preview.
+     *                      The preview first traces one pixel of every
+     *                      block of the coarsest step and fills the block
+     *                      with it, then halves the blocks until every pixel
+     *                      is traced. A call stops taking tiles once the
+     *                      budget is spent and the next call goes on where
+     *                      it stopped, unless the camera moved
+     * @param view2D: pointer to the view structure
+     * @param camera: pointer to the orbit camera
+     * @param width: width of the canvas
+     * @param height: height of the canvas
+     * @param budget: time to spend in ms
+     * @return: true if every pixel is traced
+     */
+    bool tracePreview(View2D* view2D,
+                      OrbitCamera* camera,
+                      int width,
+                      int height,
+                      float budget);
+#endif
+
+    /**
+     * @brief tracePreview: trace the next part of an interactive preview
+     *                      into a pixel buffer, doesn't need any view or GL
+     *                      context
+     * @param pixels: the pixel buffer of width * height
+     * @param width: width of the canvas
+     * @param height: height of the canvas
+     * @param eyePos: eye position
+     * @param near: near plane
+     * @param invViewTransMat: inverse of view transformation matrix
+     * @param budget: time to spend in ms
+     * @return: true if every pixel is traced
+     */
+    bool tracePreview(BGRA* pixels,
+                      int width,
+                      int height,
+                      const Vector4& eyePos,
+                      const float near,
+                      const Matrix4x4& invViewTransMat,
+                      float budget);
+
+    /**
+     * @brief updateObjects: copy the objects moved by
+     *                       Scene::updateTransforms again, between frames
+     * @param scene: the scene the objects were copied from
+     * @param objects: indices of the moved objects
+     */
+    void updateObjects(Scene* scene, const QVector<int>& objects);
+
+    /**
+     * Getters
+     */
+    const TileScheduler& getScheduler() { return m_scheduler; }
+    float getSetupTime() { return m_setupTime; }
+    const SampleBuffer& getSamples() { return m_samples; }
+    int getPreviewStep() { return m_previewStep; }
+    int getPreviewStart() { return m_previewStart; }
 
 protected:
 
+    /**
+     * @brief preparePool: start the trace threads, or restart them when the
+     *                     thread count changed
+     */
+    void preparePool();
+
+    /**
+     * @brief initFrame: point a frame at the scene data, nothing is sampled
+     *                   or previewed
+     * @param frame: the frame
+     * @param pixels: the pixel buffer of width * height
+     * @param width: width of the canvas
+     * @param height: height of the canvas
+     * @param eyePos: eye position
+     * @param near: near plane
+     * @param invViewTransMat: inverse of view transformation matrix
+     */
+    void initFrame(TraceFrame& frame,
+                   BGRA* pixels,
+                   int width,
+                   int height,
+                   const Vector4& eyePos,
+                   const float near,
+                   const Matrix4x4& invViewTransMat);
+
+    /**
+     * @brief prepareSamples: get the sample buffer ready for a supersampled
+     *                        frame, progressive frames keep the samples of
+     *                        the last frame while the camera stays still
+     * @param width: width of the canvas
+     * @param height: height of the canvas
+     * @param eyePos: eye position
+     * @param near: near plane
+     * @param invViewTransMat: inverse of view transformation matrix
+     * @return: most samples the refine pass adds to a pixel
+     */
+    int prepareSamples(int width,
+                       int height,
+                       const Vector4& eyePos,
+                       const float near,
+                       const Matrix4x4& invViewTransMat);
+
     CS123SceneGlobalData m_globalData; // Scene global data
     QList<CS123SceneLightData> m_lightData; // Light data
     QVector<SceneObject> m_objects; // Object list
+    const IntersectView* m_view; // Objects as seen by the intersection loops
     KdTree* m_tree; // Pointer to the kdtree
+    Bvh* m_bvh; // Pointer to the BVH
     AABB m_extends; // Bounding box for the whole scene
+    TileScheduler m_scheduler; // Tile scheduler for the trace threads
+    TracePool* m_pool; // Trace threads, reused for every frame
+    float m_setupTime; // Time spent before tracing in the last frame, in ms
+    SampleBuffer m_samples; // Samples of supersampling
+    Vector4 m_sampleEyePos; // Eye position of the samples
+    float m_sampleNear; // Near plane of the samples
+    Matrix4x4 m_sampleInvView; // Inverse view transformation of the samples
+    int m_previewStart; // Step of the coarsest level of a preview
+    int m_previewStep; // Step of the preview level in progress, 0 when
+                       // every pixel is traced
+    bool m_previewCoarse; // The level in progress is the coarsest
+    QVector<char> m_previewTiles; // Tiles of the level already traced
+    int m_previewWidth; // Width of the canvas of the preview
+    int m_previewHeight; // Height of the canvas of the preview
+    Vector4 m_previewEyePos; // Eye position of the preview
+    float m_previewNear; // Near plane of the preview
+    Matrix4x4 m_previewInvView; // Inverse view transformation of the preview
 };
 
 #endif // CPURayScene_H
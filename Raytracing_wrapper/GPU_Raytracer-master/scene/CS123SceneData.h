@@ -30,7 +30,8 @@ enum LightType {
 //! Enumeration for types of primitives that can be stored in a scene file.
 enum PrimitiveType {
    PRIMITIVE_NONE = 0,PRIMITIVE_CUBE = 1, PRIMITIVE_CONE = 2, PRIMITIVE_CYLINDER = 3,
-   PRIMITIVE_TORUS= 4, PRIMITIVE_SPHERE = 5,PRIMITIVE_MESH
+   PRIMITIVE_TORUS= 4, PRIMITIVE_SPHERE = 5,PRIMITIVE_MESH,
+   PRIMITIVE_GROUP // Instance of a group of objects, never read from a file
 };
 
 //! Enumeration for types of transformations that can be applied to objects, lights, and cameras.
@@ -6,10 +6,12 @@
  */
 
 #include "GPUrayscene.h"
-#include "view3d.h"
+#include "clPack.h"
 #include "global.h"
 #include "camera.h"
 #include "kdtree.h"
+#include "scene_group.h"
+#include "mip_texture.h"
 
 using std::endl;
 
@@ -33,9 +35,34 @@ GPURayScene::GPURayScene()
     m_cmOffsetBuffer   = NULL;
     m_cmTexPixelBuffer = NULL;
     m_cmKdNodes        = NULL;
-    m_cmObjNodes       = NULL;
+    m_cmKdPrims        = NULL;
     m_pixels           = NULL;
     m_pixelNum         = 0;
+    m_readEvent[0]     = NULL;
+    m_readEvent[1]     = NULL;
+    m_framesRendered   = 0;
+    m_framesRead       = 0;
+    m_frameDone        = NULL;
+    m_kdNodeCapacity   = 0;
+    m_kdPrimCapacity   = 0;
+    m_expandedTree     = NULL;
+    m_globalDirty      = false;
+    m_kdDirty          = false;
+    m_cmRays[0]        = NULL;
+    m_cmRays[1]        = NULL;
+    m_cmHits           = NULL;
+    m_cmShading        = NULL;
+    m_cmLightQueue     = NULL;
+    m_cmCounters       = NULL;
+    m_cmSampleColors   = NULL;
+    m_cmColorSums      = NULL;
+    m_cmSampleCounts   = NULL;
+    m_cmFirstObjects   = NULL;
+    m_cmRefineMask     = NULL;
+    m_queueCapacity    = 0;
+    m_droppedRays      = 0;
+    m_dropped[0]       = 0;
+    m_dropped[1]       = 0;
 }
 
 GPURayScene::GPURayScene(CLPack* cl,
@@ -52,9 +79,34 @@ GPURayScene::GPURayScene(CLPack* cl,
     m_cmOffsetBuffer   = NULL;
     m_cmTexPixelBuffer = NULL;
     m_cmKdNodes        = NULL;
-    m_cmObjNodes       = NULL;
+    m_cmKdPrims        = NULL;
     m_pixelNum         = 0;
     m_pixels           = NULL;
+    m_readEvent[0]     = NULL;
+    m_readEvent[1]     = NULL;
+    m_framesRendered   = 0;
+    m_framesRead       = 0;
+    m_frameDone        = NULL;
+    m_kdNodeCapacity   = 0;
+    m_kdPrimCapacity   = 0;
+    m_expandedTree     = NULL;
+    m_globalDirty      = false;
+    m_kdDirty          = false;
+    m_cmRays[0]        = NULL;
+    m_cmRays[1]        = NULL;
+    m_cmHits           = NULL;
+    m_cmShading        = NULL;
+    m_cmLightQueue     = NULL;
+    m_cmCounters       = NULL;
+    m_cmSampleColors   = NULL;
+    m_cmColorSums      = NULL;
+    m_cmSampleCounts   = NULL;
+    m_cmFirstObjects   = NULL;
+    m_cmRefineMask     = NULL;
+    m_queueCapacity    = 0;
+    m_droppedRays      = 0;
+    m_dropped[0]       = 0;
+    m_dropped[1]       = 0;
 
     pushSceneData(scene);
 
@@ -66,12 +118,26 @@ GPURayScene::GPURayScene(CLPack* cl,
     m_screenHeight = screenHeight;
 
     initCLBuffers();
+    initWavefrontBuffers();
     setKernelArgs();
     syncGlobalSettings();
 }
 
 GPURayScene::~GPURayScene()
 {
+    // The reads and the uploads in flight use the host copies
+    for (int i = 0; i < 2; i++)
+    {
+        if (m_readEvent[i])
+        {
+            clWaitForEvents(1, &m_readEvent[i]);
+            clReleaseEvent(m_readEvent[i]);
+        }
+    }
+    waitUploads();
+    if (m_frameDone)
+        clReleaseEvent(m_frameDone);
+
     if (m_cmGlobal)
         clReleaseMemObject(m_cmGlobal);
 
@@ -84,14 +150,30 @@ GPURayScene::~GPURayScene()
     if (m_cmTexPixelBuffer)
         clReleaseMemObject(m_cmTexPixelBuffer);
 
+    if (m_cmOffsetBuffer)
+        clReleaseMemObject(m_cmOffsetBuffer);
+
     if (m_cmKdNodes)
         clReleaseMemObject(m_cmKdNodes);
 
-    if (m_cmObjNodes)
-        clReleaseMemObject(m_cmObjNodes);
+    if (m_cmKdPrims)
+        clReleaseMemObject(m_cmKdPrims);
 
     if (m_pixels)
         delete []m_pixels;
+
+    if (m_expandedTree)
+        delete m_expandedTree;
+
+    cl_mem wavefront[] = {m_cmRays[0], m_cmRays[1], m_cmHits, m_cmShading,
+                          m_cmLightQueue, m_cmCounters, m_cmSampleColors,
+                          m_cmColorSums, m_cmSampleCounts, m_cmFirstObjects,
+                          m_cmRefineMask};
+    for (size_t i = 0; i < sizeof(wavefront) / sizeof(cl_mem); i++)
+    {
+        if (wavefront[i])
+            clReleaseMemObject(wavefront[i]);
+    }
 }
 
 void GPURayScene::render()
@@ -100,84 +182,486 @@ void GPURayScene::render()
     // Sync gl calls
     glFinish();
 
-    Vector4 eyePos   = m_camera->getEyePos();
-    Matrix4x4 invMat = m_camera->getInvViewTransMatrix();
+    if (!setCameraArgs(m_camera->getEyePos(), m_camera->getNear(),
+                       m_camera->getInvViewTransMatrix()) ||
+        !flushUploads())
+        return;
 
-    cl_float16 clInvMat = copyMatrix(invMat);
-    cl_float4 clEyePos  = copyVector4(eyePos);
-    cl_float clEyeNear  = m_camera->getNear();
+    // Before using GL object we need to acquire
+    ciErrNum =  clEnqueueAcquireGLObjects(m_cl->m_queue,
+                                          1,
+                                          &m_cl->m_cmPbo,
+                                          0,
+                                          NULL,
+                                          NULL);
+    if (ciErrNum != CL_SUCCESS)
+    {
+        cerr << "Acquire GL objects failed in line:" << __LINE__ << ", File:"
+             << __FILE__ << endl;
+        return ;
+    }
 
-    ciErrNum  = clSetKernelArg(m_cl->m_kernelRay, 9, sizeof(cl_float4),
-                               (void*)&clEyePos);
-    ciErrNum |= clSetKernelArg(m_cl->m_kernelRay, 10, sizeof(cl_float),
-                               (void*)&clEyeNear);
-    ciErrNum |= clSetKernelArg(m_cl->m_kernelRay, 11, sizeof(cl_float16),
-                               (void*)&clInvMat);
+    // The stages run one after another on the queue, the release follows
+    // them
+    cl_int dropped;
+    bool traced = traceFrame(m_cl->m_cmPbo, &dropped);
+    clEnqueueReleaseGLObjects(m_cl->m_queue, 1, &m_cl->m_cmPbo, 0, NULL, NULL);
+
+    // Sync, GL reads the pixel buffer next
+    clFinish(m_cl->m_queue);
+    if (!traced)
+        return;
+    noteDroppedRays(dropped);
+
+    // Now read back the buffer to texture
+    updateScreenTexFromPBO();
+    displayScreenTex();
+}
+
+bool GPURayScene::renderOffscreen(const Vector4& eyePos,
+                                  const float near,
+                                  const Matrix4x4& invViewTransMat)
+{
+
+    assert(m_cl->m_cmOut[0] && m_cl->m_cmOut[1]);
+
+    // The output and the host copy of the frame before the last are
+    // reused, its read has to be done
+    int slot = m_framesRendered % 2;
+    if (m_readEvent[slot])
+    {
+        clWaitForEvents(1, &m_readEvent[slot]);
+        clReleaseEvent(m_readEvent[slot]);
+        m_readEvent[slot] = NULL;
+        m_framesRead = m_framesRendered - 1;
+        noteDroppedRays(m_dropped[slot]);
+    }
+
+    if (!setCameraArgs(eyePos, near, invViewTransMat) ||
+        !flushUploads() ||
+        !traceFrame(m_cl->m_cmOut[slot], &m_dropped[slot]))
+        return false;
+
+    if (m_frameDone)
+        clReleaseEvent(m_frameDone);
+    cl_int ciErrNum = clEnqueueMarker(m_cl->m_queue, &m_frameDone);
+    if (ciErrNum != CL_SUCCESS)
+    {
+        cerr << "Enqueue marker failed in line:" << __LINE__ << ", File:"
+             << __FILE__ << endl;
+        m_frameDone = NULL;
+        return false;
+    }
+
+    // The read runs on the transfer queue when the stages are done, the
+    // stages of the next frame start beside it
+    ciErrNum = clEnqueueReadBuffer(m_cl->m_transferQueue,
+                                   m_cl->m_cmOut[slot],
+                                   CL_FALSE,
+                                   0,
+                                   m_output[slot].size() * sizeof(cl_uint),
+                                   m_output[slot].data(),
+                                   1,
+                                   &m_frameDone,
+                                   &m_readEvent[slot]);
+    if (ciErrNum != CL_SUCCESS)
+    {
+        cerr << "Read output failed in line:" << __LINE__ << ", File:"
+             << __FILE__ << endl;
+        m_readEvent[slot] = NULL;
+        return false;
+    }
+    clFlush(m_cl->m_queue);
+    clFlush(m_cl->m_transferQueue);
+    m_framesRendered++;
+    return true;
+}
+
+bool GPURayScene::readOffscreen(BGRA* image)
+{
+
+    int slot = m_framesRead % 2;
+    if (m_framesRead == m_framesRendered || !m_readEvent[slot])
+        return false;
+
+    cl_int ciErrNum = clWaitForEvents(1, &m_readEvent[slot]);
+    clReleaseEvent(m_readEvent[slot]);
+    m_readEvent[slot] = NULL;
+    m_framesRead++;
+    if (ciErrNum != CL_SUCCESS)
+    {
+        cerr << "Wait for output failed in line:" << __LINE__ << ", File:"
+             << __FILE__ << endl;
+        return false;
+    }
+
+    // The dropped rays were read before the output
+    noteDroppedRays(m_dropped[slot]);
+
+    // The kernel packs RGBA with red in the low byte
+    const QVector<unsigned int>& output = m_output[slot];
+    for (int i = 0; i < output.size(); i++)
+    {
+        cl_uint pixel = output[i];
+        image[i].r = pixel & 0xFF;
+        image[i].g = (pixel >> 8) & 0xFF;
+        image[i].b = (pixel >> 16) & 0xFF;
+        image[i].a = (pixel >> 24) & 0xFF;
+    }
+    return true;
+}
+
+bool GPURayScene::traceFrame(cl_mem output, cl_int* dropped)
+{
+
+    int pixelCount = m_screenWidth * m_screenHeight;
+    int samples    = 1;
+    if (m_globalSetting.useSupersampling && m_globalSetting.maxSamples > 1)
+        samples = m_globalSetting.maxSamples;
+
+    // A hit spawns a reflected and a refracted ray at most, the rays of a
+    // pixel double with every bounce. The waves are small enough for the
+    // queues to hold the rays of the last one
+    int bounces = m_globalSetting.useReflection ?
+                m_globalSetting.traceNum - 1 : 0;
+    int waveSize = qMax(m_queueCapacity >> qBound(0, bounces, 30), 1);
+
+    cl_int ciErrNum;
+    cl_int counters[WAVEFRONT_COUNTERS];
+    for (cl_int sample = 0; sample < samples; sample++)
+    {
+        // Only the pixels whose center differs from a neighbour's take the
+        // other samples. Their count is the only read back of a frame
+        if (sample == 1)
+        {
+            if (!resetCounters(WAVEFRONT_REFINED_COUNT, 1) ||
+                !enqueueKernel(m_cl->m_kernelRefine, pixelCount) ||
+                !readCounters(counters))
+                return false;
+            if (counters[WAVEFRONT_REFINED_COUNT] == 0)
+                break;
+        }
+
+        for (int first = 0; first < pixelCount; first += waveSize)
+        {
+            if (!traceWave(first, qMin(waveSize, pixelCount - first),
+                           sample))
+                return false;
+        }
 
+        ciErrNum = clSetKernelArg(m_cl->m_kernelAccumulate, 5,
+                                  sizeof(cl_int), (void*)&sample);
+        if (ciErrNum != CL_SUCCESS)
+        {
+            cerr << "Set kernel failed in line:" << __LINE__ << ", File:"
+                 << __FILE__ << endl;
+            return false;
+        }
+        if (!enqueueKernel(m_cl->m_kernelAccumulate, pixelCount))
+            return false;
+    }
+
+    ciErrNum = clSetKernelArg(m_cl->m_kernelResolve, 0, sizeof(cl_mem),
+                              (void*)&output);
     if (ciErrNum != CL_SUCCESS)
     {
         cerr << "Set kernel failed in line:" << __LINE__ << ", File:"
              << __FILE__ << endl;
+        return false;
+    }
+    if (!enqueueKernel(m_cl->m_kernelResolve, pixelCount))
+        return false;
+
+    ciErrNum = clEnqueueReadBuffer(m_cl->m_queue,
+                                   m_cmCounters,
+                                   CL_FALSE,
+                                   WAVEFRONT_DROPPED_COUNT * sizeof(cl_int),
+                                   sizeof(cl_int),
+                                   dropped,
+                                   0,
+                                   NULL,
+                                   NULL);
+    if (ciErrNum != CL_SUCCESS)
+    {
+        cerr << "Read counters failed in line:" << __LINE__ << ", File:"
+             << __FILE__ << endl;
+        return false;
+    }
+    return true;
+}
+
+bool GPURayScene::traceWave(int firstPixel, int pixelCount, int sample)
+{
+
+    cl_int ciErrNum;
+    cl_int first       = firstPixel;
+    cl_int count       = pixelCount;
+    cl_int sampleIndex = sample;
+    ciErrNum  = clSetKernelArg(m_cl->m_kernelGenerate, 0, sizeof(cl_mem),
+                               (void*)&m_cmRays[0]);
+    ciErrNum |= clSetKernelArg(m_cl->m_kernelGenerate, 5, sizeof(cl_int),
+                               (void*)&first);
+    ciErrNum |= clSetKernelArg(m_cl->m_kernelGenerate, 6, sizeof(cl_int),
+                               (void*)&count);
+    ciErrNum |= clSetKernelArg(m_cl->m_kernelGenerate, 7, sizeof(cl_int),
+                               (void*)&sampleIndex);
+    if (ciErrNum != CL_SUCCESS)
+    {
+        cerr << "Set kernel failed in line:" << __LINE__ << ", File:"
+             << __FILE__ << endl;
+        return false;
+    }
+
+    if (!resetCounters(WAVEFRONT_RAY_COUNT, 1) ||
+        !enqueueKernel(m_cl->m_kernelGenerate, pixelCount))
+        return false;
+
+    // The queues are compacted on the device, the stages read how many rays
+    // were pushed. The host only knows how many may have been, every pixel
+    // left at most doubles them
+    int depths   = m_globalSetting.useReflection ?
+                m_globalSetting.traceNum : 1;
+    int rayBound = pixelCount;
+    int current  = 0;
+    for (int depth = 0; depth < depths; depth++)
+    {
+        cl_int primary = sample == 0 && depth == 0;
+        cl_int spawn   = depth + 1 < depths;
+        cl_int queue   = current;
+        cl_mem rays    = m_cmRays[current];
+        cl_mem next    = m_cmRays[1 - current];
+
+        ciErrNum  = clSetKernelArg(m_cl->m_kernelIntersect, 0,
+                                   sizeof(cl_mem), (void*)&rays);
+        ciErrNum |= clSetKernelArg(m_cl->m_kernelIntersect, 3,
+                                   sizeof(cl_int), (void*)&queue);
+        ciErrNum |= clSetKernelArg(m_cl->m_kernelIntersect, 5,
+                                   sizeof(cl_int), (void*)&primary);
+        ciErrNum |= clSetKernelArg(m_cl->m_kernelShade, 0,
+                                   sizeof(cl_mem), (void*)&rays);
+        ciErrNum |= clSetKernelArg(m_cl->m_kernelShade, 2,
+                                   sizeof(cl_int), (void*)&queue);
+        ciErrNum |= clSetKernelArg(m_cl->m_kernelShade, 3,
+                                   sizeof(cl_mem), (void*)&next);
+        ciErrNum |= clSetKernelArg(m_cl->m_kernelShade, 8,
+                                   sizeof(cl_int), (void*)&spawn);
+        ciErrNum |= clSetKernelArg(m_cl->m_kernelShadow, 0,
+                                   sizeof(cl_mem), (void*)&rays);
+        if (ciErrNum != CL_SUCCESS)
+        {
+            cerr << "Set kernel failed in line:" << __LINE__ << ", File:"
+                 << __FILE__ << endl;
+            return false;
+        }
+
+        // The misses aren't queued for the lights
+        if (!enqueueKernel(m_cl->m_kernelIntersect, rayBound) ||
+            !resetCounters(WAVEFRONT_RAY_COUNT + 1 - current, 1) ||
+            !resetCounters(WAVEFRONT_RECORD_COUNT, 1) ||
+            !enqueueKernel(m_cl->m_kernelShade, rayBound) ||
+            !enqueueKernel(m_cl->m_kernelShadow, rayBound))
+            return false;
+
+        rayBound = qMin(rayBound * 2, (int)m_queueCapacity);
+        current  = 1 - current;
+    }
+    return true;
+}
+
+void GPURayScene::noteDroppedRays(cl_int dropped)
+{
+
+    if (dropped <= m_droppedRays)
         return;
+    cerr << "The ray queues overflowed, " << dropped - m_droppedRays
+         << " rays were dropped from the frame" << endl;
+    m_droppedRays = dropped;
+}
+
+bool GPURayScene::enqueueKernel(cl_kernel kernel, int count)
+{
+
+    size_t local  = m_cl->m_localWorkSize;
+    size_t global = (count + local - 1) / local * local;
+    cl_int ciErrNum = clEnqueueNDRangeKernel(m_cl->m_queue,
+                                             kernel,
+                                             1,
+                                             NULL,
+                                             &global,
+                                             &local,
+                                             0,
+                                             NULL,
+                                             NULL);
+    if (ciErrNum != CL_SUCCESS)
+    {
+        cerr << "Launch kernel failed in line:" << __LINE__ << ", File:"
+             << __FILE__ << endl;
+        return false;
     }
+    return true;
+}
 
-    cl_mem canvas_dev = clCreateFromGLTexture2D(m_cl->m_context,
-                                                CL_MEM_WRITE_ONLY,
-                                                GL_TEXTURE_2D,
-                                                0,
-                                                m_objects[0].texHandle,
-                                                &ciErrNum);
-    cl_image_format format;
+bool GPURayScene::resetCounters(int first, int count)
+{
 
-    clGetImageInfo(canvas_dev,
-                   CL_IMAGE_FORMAT,
-                   sizeof(cl_image_format),
-                   &format,
-                   NULL);
-    // Before using GL object we need to acquire
-    ciErrNum =  clEnqueueAcquireGLObjects(m_cl->m_queue,
-                                          1,
-                                          &m_cl->m_cmPbo,
+    // The write doesn't wait, the zeros outlive it
+    static const cl_int zeros[WAVEFRONT_COUNTERS] = {0};
+    assert(first >= 0 && first + count <= WAVEFRONT_COUNTERS);
+    cl_int ciErrNum = clEnqueueWriteBuffer(m_cl->m_queue,
+                                           m_cmCounters,
+                                           CL_FALSE,
+                                           first * sizeof(cl_int),
+                                           count * sizeof(cl_int),
+                                           zeros,
+                                           0,
+                                           NULL,
+                                           NULL);
+    if (ciErrNum != CL_SUCCESS)
+    {
+        cerr << "Reset counters failed in line:" << __LINE__ << ", File:"
+             << __FILE__ << endl;
+        return false;
+    }
+    return true;
+}
+
+bool GPURayScene::readCounters(cl_int* counters)
+{
+
+    cl_int ciErrNum = clEnqueueReadBuffer(m_cl->m_queue,
+                                          m_cmCounters,
+                                          CL_TRUE,
+                                          0,
+                                          WAVEFRONT_COUNTERS * sizeof(cl_int),
+                                          counters,
                                           0,
                                           NULL,
                                           NULL);
     if (ciErrNum != CL_SUCCESS)
     {
-        cerr << "Acquire GL objects failed in line:" << __LINE__ << ", File:"
+        cerr << "Read counters failed in line:" << __LINE__ << ", File:"
              << __FILE__ << endl;
-        return ;
+        return false;
     }
+    return true;
+}
+
+bool GPURayScene::growBuffer(cl_mem& buffer, int& capacity, int count,
+                             size_t recordSize)
+{
+
+    if (buffer && count <= capacity)
+        return true;
 
-    // Launch the kernel
-    ciErrNum  = clEnqueueNDRangeKernel(m_cl->m_queue,
-                                       m_cl->m_kernelRay,
-                                       2,
-                                       NULL,
-                                       m_cl->m_globalWorkSize,
-                                       m_cl->m_localWorkSize,
-                                       0,
-                                       NULL,
-                                       NULL);
+    // The kernels of a frame in flight keep the old buffer alive
+    if (buffer)
+        clReleaseMemObject(buffer);
 
+    cl_int ciErrNum;
+    buffer = clCreateBuffer(m_cl->m_context,
+                            CL_MEM_READ_ONLY,
+                            count * recordSize,
+                            NULL,
+                            &ciErrNum);
     if (ciErrNum != CL_SUCCESS)
     {
-        cerr << "Launch kernel failed in line:" << __LINE__ << ", File:"
+        cerr << "Create buffer failed in line " << __LINE__ << " File:"
              << __FILE__ << endl;
-        return ;
+        buffer   = NULL;
+        capacity = 0;
+        return false;
     }
+    capacity = count;
+    return true;
+}
 
-    clFinish(m_cl->m_queue);
-    // Release buffer then GL can use
-    clEnqueueReleaseGLObjects(m_cl->m_queue, 1, &m_cl->m_cmPbo, 0, NULL, NULL);
+bool GPURayScene::enqueueUpload(cl_mem buffer, int first, int count,
+                                size_t recordSize, const void* data)
+{
 
-    // Sync
-    clFinish(m_cl->m_queue);
-    QVector<LightDataHost> test;
-    test.resize(m_lightData.size());
+    cl_event upload;
+    cl_int ciErrNum = clEnqueueWriteBuffer(m_cl->m_transferQueue,
+                                           buffer,
+                                           CL_FALSE,
+                                           first * recordSize,
+                                           count * recordSize,
+                                           (const char*)data +
+                                           first * recordSize,
+                                           m_frameDone ? 1 : 0,
+                                           m_frameDone ? &m_frameDone : NULL,
+                                           &upload);
+    if (ciErrNum != CL_SUCCESS)
+    {
+        cerr << "Upload failed in line:" << __LINE__ << ", File:"
+             << __FILE__ << endl;
+        return false;
+    }
+    m_uploads.append(upload);
+    return true;
+}
 
-    // Now read back the buffer to texture
-    updateScreenTexFromPBO();
-    displayScreenTex();
+bool GPURayScene::flushUploads()
+{
+
+    waitUploads();
+
+    bool success = true;
+    if (m_globalDirty)
+    {
+        success &= enqueueUpload(m_cmGlobal, 0, 1, sizeof(GlobalSettingHost),
+                                 &m_globalSetting);
+        m_globalDirty = false;
+    }
+
+    // The moved objects are written in runs of adjacent records
+    for (int i = 0; i < m_objectDirty.size(); i++)
+    {
+        if (!m_objectDirty[i])
+            continue;
+
+        int first = i;
+        while (i < m_objectDirty.size() && m_objectDirty[i])
+            m_objectDirty[i++] = 0;
+        success &= enqueueUpload(m_cmObject, first, i - first,
+                                 sizeof(ObjectDataHost), m_objects.data());
+    }
+
+    if (m_kdDirty)
+    {
+        success &= enqueueUpload(m_cmKdNodes, 0, m_kdNodes.size(),
+                                 sizeof(KdFlatNode), m_kdNodes.data());
+        success &= enqueueUpload(m_cmKdPrims, 0, m_kdPrims.size(),
+                                 sizeof(cl_int), m_kdPrims.data());
+        m_kdDirty = false;
+    }
+
+    if (m_uploads.isEmpty())
+        return success;
+
+    // The kernels of the frame wait for the writes, the transfer queue
+    // runs them while the frame before finishes
+    clFlush(m_cl->m_transferQueue);
+    cl_int ciErrNum = clEnqueueWaitForEvents(m_cl->m_queue, m_uploads.size(),
+                                             m_uploads.data());
+    if (!success || ciErrNum != CL_SUCCESS)
+    {
+        cerr << "Flush uploads failed in line:" << __LINE__ << ", File:"
+             << __FILE__ << endl;
+        return false;
+    }
+    return true;
+}
+
+void GPURayScene::waitUploads()
+{
+
+    if (m_uploads.isEmpty())
+        return;
+
+    clWaitForEvents(m_uploads.size(), m_uploads.data());
+    for (int i = 0; i < m_uploads.size(); i++)
+        clReleaseEvent(m_uploads[i]);
+    m_uploads.clear();
 }
 
 void GPURayScene::pushSceneData(Scene* scene)
@@ -211,39 +695,17 @@ void GPURayScene::pushSceneData(Scene* scene)
     }
     assert(m_lightData.size() == lights.size());
 
-    const QVector<SceneObject> objects = scene->getObjects();
-    m_objects.resize(objects.size());
+    expandObjects(scene);
+    m_objects.resize(m_expandedObjects.size());
 
-    for (int i = 0; i < objects.size(); i++)
-    {
-        SceneObject curObj = objects[i];
-        ObjectDataHost& newObj = m_objects[i];
-
-        newObj.transform        = copyMatrix(curObj.m_transform);
-        newObj.invTransform     = copyMatrix(curObj.m_invTransform);
-        newObj.invTWithoutTrans = copyMatrix(curObj.m_invTTransformWithoutTrans);
-        newObj.type             = (cl_int)curObj.m_primitive.type;
-        newObj.texHandle        = (cl_int)curObj.m_texture.m_textureHandle;
-        newObj.texMapID         = (cl_int)curObj.m_texture.m_mapIndex;
-        newObj.texWidth         = (cl_int)curObj.m_texture.m_texWidth;
-        newObj.texHeight        = (cl_int)curObj.m_texture.m_texHeight;
-        newObj.texBlend         = curObj.m_primitive.material.blend;
-        newObj.texRepeat.s0     = curObj.m_primitive.material.textureMap->repeatU;
-        newObj.texRepeat.s1     = curObj.m_primitive.material.textureMap->repeatV ;
-        newObj.texIsUsed        = (cl_int)curObj.m_primitive.material.textureMap->isUsed;
-        newObj.diffuse          = copyColor(curObj.m_primitive.material.cDiffuse);
-        newObj.ambient          = copyColor(curObj.m_primitive.material.cAmbient);
-        newObj.reflective       = copyColor(curObj.m_primitive.material.cReflective);
-        newObj.specular         = copyColor(curObj.m_primitive.material.cSpecular);
-        newObj.transparent      = copyColor(curObj.m_primitive.material.cTransparent);
-        newObj.emmisive         = copyColor(curObj.m_primitive.material.cEmissive);
-        newObj.shininess        = curObj.m_primitive.material.shininess;
-        newObj.ior              = curObj.m_primitive.material.ior;
-    }
-
-    assert(m_objects.size() == objects.size());
-
-    copyKdTree(scene->getKdTree());
+    for (int i = 0; i < m_expandedObjects.size(); i++)
+        copyObject(m_expandedObjects[i], m_objects[i]);
+
+    assert(m_objects.size() == m_expandedObjects.size());
+
+    // Dumped once at load, not for the rebuilt trees of the animation
+    copyKdTree(getExpandedKdTree(scene));
+    dumpCLKdTree("./output/clkdtree.txt");
 
     QMap<int, TexInfo> texMap = scene->getTexMap();
 
@@ -257,11 +719,14 @@ void GPURayScene::pushSceneData(Scene* scene)
 
     cl_uint offsetBegin = 0;
 
+    // The whole mip chain of every texture is uploaded in its tiled layout,
+    // the kernel finds the levels from the size of the texture
     for (int i = 0 ; iter != texMap.end(); iter++, i++)
     {
         m_textureHandles[i] = (*iter).m_textureHandle;
         m_textureOffsets[i] = offsetBegin;
-        offsetBegin += (*iter).m_texWidth * (*iter).m_texHeight;
+        if ((*iter).m_mipmap)
+            offsetBegin += (*iter).m_mipmap->getSize();
     }
     m_pixelNum = offsetBegin;
     if (m_pixelNum != 0)
@@ -270,58 +735,254 @@ void GPURayScene::pushSceneData(Scene* scene)
     iter = texMap.begin();
     for (int i = 0 ; iter != texMap.end(); iter++, i++)
     {
-        memcpy(m_pixels+m_textureOffsets[i],
-               (*iter).m_texPointer,
-               sizeof(unsigned)*(*iter).m_texWidth*(*iter).m_texHeight);
+        const MipTexture* mipmap = (*iter).m_mipmap;
+        if (mipmap)
+            memcpy(m_pixels + m_textureOffsets[i],
+                   mipmap->getData(),
+                   sizeof(unsigned) * mipmap->getSize());
     }
 }
 
+void GPURayScene::expandObjects(Scene* scene)
+{
+
+    // The kernel has no groups, it gets them expanded and a kdtree of its
+    // own over the expanded objects
+    m_expandedObjects = scene->getObjects();
+    if (scene->hasGroups())
+        scene->expandGroups(m_expandedObjects);
+}
+
+KdTree* GPURayScene::getExpandedKdTree(Scene* scene)
+{
+
+    KdTree* tree = scene->getKdTree();
+    if (!tree || !scene->hasGroups())
+        return tree;
+
+    // Built like Scene::updateTransforms builds the tree of the scene, the
+    // pointers stay valid as the expanded objects are updated in place
+    QVector<SceneObject*> pointers;
+    for (int i = 0; i < m_expandedObjects.size(); i++)
+        pointers.append(&m_expandedObjects[i]);
+    if (!m_expandedTree)
+        m_expandedTree = new KdTree();
+    m_expandedTree->build(pointers, scene->getExtends());
+    return m_expandedTree;
+}
+
+void GPURayScene::updateObjects(Scene* scene, const QVector<int>& objects)
+{
+    // The host copies can't change under the writes of the last frame
+    waitUploads();
+
+    // Only the moved objects are expanded again and their records marked,
+    // a moved group marks all of its objects
+    const QVector<SceneObject>& sceneObjects = scene->getObjects();
+    for (int i = 0; i < objects.size(); i++)
+    {
+        const SceneObject& object = sceneObjects[objects[i]];
+        scene->expandObject(objects[i], m_expandedObjects);
+        int first = object.m_flatID;
+        int count = object.m_group ? object.m_group->getObjectCount() : 1;
+        for (int j = first; j < first + count; j++)
+        {
+            copyObject(m_expandedObjects[j], m_objects[j]);
+            m_objectDirty[j] = 1;
+        }
+    }
+
+    // The kdtree was rebuilt and may have grown, its buffers are only
+    // recreated then
+    copyKdTree(getExpandedKdTree(scene));
+    if (!growBuffer(m_cmKdNodes, m_kdNodeCapacity, m_kdNodes.size(),
+                    sizeof(KdFlatNode)) ||
+        !growBuffer(m_cmKdPrims, m_kdPrimCapacity, m_kdPrims.size(),
+                    sizeof(cl_int)))
+    {
+        cerr << "Update objects failed in line " << __LINE__ << " File:"
+             << __FILE__ << endl;
+        return;
+    }
+
+    // The node counts are kernel arguments
+    setKernelArgs();
+}
+
+void GPURayScene::copyObject(const SceneObject& object,
+                             ObjectDataHost& newObj)
+{
+
+    newObj.transform        = copyMatrix(object.m_transform);
+    newObj.invTransform     = copyMatrix(object.m_invTransform);
+    newObj.invTWithoutTrans = copyMatrix(object.m_invTTransformWithoutTrans);
+    newObj.type             = (cl_int)object.m_primitive.type;
+    newObj.texHandle        = (cl_int)object.m_texture.m_textureHandle;
+    newObj.texMapID         = (cl_int)object.m_texture.m_mapIndex;
+    newObj.texWidth         = (cl_int)object.m_texture.m_texWidth;
+    newObj.texHeight        = (cl_int)object.m_texture.m_texHeight;
+    newObj.texBlend         = object.m_primitive.material.blend;
+    newObj.texRepeat.s0     = object.m_primitive.material.textureMap->repeatU;
+    newObj.texRepeat.s1     = object.m_primitive.material.textureMap->repeatV ;
+    newObj.texIsUsed        = (cl_int)object.m_primitive.material.textureMap->isUsed;
+    newObj.diffuse          = copyColor(object.m_primitive.material.cDiffuse);
+    newObj.ambient          = copyColor(object.m_primitive.material.cAmbient);
+    newObj.reflective       = copyColor(object.m_primitive.material.cReflective);
+    newObj.specular         = copyColor(object.m_primitive.material.cSpecular);
+    newObj.transparent      = copyColor(object.m_primitive.material.cTransparent);
+    newObj.emmisive         = copyColor(object.m_primitive.material.cEmissive);
+    newObj.shininess        = object.m_primitive.material.shininess;
+    newObj.ior              = object.m_primitive.material.ior;
+}
+
 void GPURayScene::setKernelArgs()
 {
-    assert(m_cl->m_kernelRay);
+    assert(m_cl->m_kernelGenerate);
 
     cl_int ciErrNum;
     cl_uint width       = m_screenWidth;
     cl_uint height      = m_screenHeight;
+    cl_int pixelCount   = m_screenWidth * m_screenHeight;
     cl_int lightCount   = m_lightData.size();
     cl_int objectCount  = m_objects.size();
     cl_int offsetCount  = m_textureOffsets.size();
     cl_int kdnodeCount  = m_kdNodes.size();
-    cl_int objnodeCount = m_objNodes.size();
-
-    ciErrNum  = clSetKernelArg(m_cl->m_kernelRay, 0, sizeof(cl_mem),
-                               (void*)&m_cl->m_cmPbo);
-    ciErrNum |= clSetKernelArg(m_cl->m_kernelRay, 1,  sizeof(cl_uint),
-                               (void*)&width);
-    ciErrNum |= clSetKernelArg(m_cl->m_kernelRay, 2,  sizeof(cl_uint),
-                               (void*)&height);
-    ciErrNum |= clSetKernelArg(m_cl->m_kernelRay, 4, sizeof(cl_mem),
-                               (void*)&m_cmLight);
-    ciErrNum |= clSetKernelArg(m_cl->m_kernelRay, 5, sizeof(cl_int),
-                               (void*)&lightCount);
-    ciErrNum |= clSetKernelArg(m_cl->m_kernelRay, 6, sizeof(cl_mem),
+    cl_int kdprimCount  = m_kdPrims.size();
+
+    // Ray generation
+    cl_kernel kernel = m_cl->m_kernelGenerate;
+    ciErrNum  = clSetKernelArg(kernel, 1, sizeof(cl_mem),
+                               (void*)&m_cmCounters);
+    ciErrNum |= clSetKernelArg(kernel, 2, sizeof(cl_int),
+                               (void*)&m_queueCapacity);
+    ciErrNum |= clSetKernelArg(kernel, 3, sizeof(cl_uint), (void*)&width);
+    ciErrNum |= clSetKernelArg(kernel, 4, sizeof(cl_uint), (void*)&height);
+    ciErrNum |= clSetKernelArg(kernel, 9, sizeof(cl_mem),
+                               (void*)&m_cmRefineMask);
+
+    // Intersection
+    kernel = m_cl->m_kernelIntersect;
+    ciErrNum |= clSetKernelArg(kernel, 1, sizeof(cl_mem), (void*)&m_cmHits);
+    ciErrNum |= clSetKernelArg(kernel, 2, sizeof(cl_mem),
+                               (void*)&m_cmCounters);
+    ciErrNum |= clSetKernelArg(kernel, 4, sizeof(cl_int),
+                               (void*)&m_queueCapacity);
+    ciErrNum |= clSetKernelArg(kernel, 6, sizeof(cl_mem),
+                               (void*)&m_cmFirstObjects);
+    ciErrNum |= clSetKernelArg(kernel, 8, sizeof(cl_mem),
                                (void*)&m_cmObject);
-    ciErrNum |= clSetKernelArg(m_cl->m_kernelRay, 7, sizeof(cl_int),
+    ciErrNum |= clSetKernelArg(kernel, 9, sizeof(cl_int),
                                (void*)&objectCount);
-    ciErrNum |= clSetKernelArg(m_cl->m_kernelRay, 8, sizeof(cl_float4),
+    ciErrNum |= clSetKernelArg(kernel, 10, sizeof(cl_mem),
+                               (void*)&m_cmKdNodes);
+    ciErrNum |= clSetKernelArg(kernel, 11, sizeof(cl_int),
+                               (void*)&kdnodeCount);
+    ciErrNum |= clSetKernelArg(kernel, 12, sizeof(cl_mem),
+                               (void*)&m_cmKdPrims);
+    ciErrNum |= clSetKernelArg(kernel, 13, sizeof(cl_int),
+                               (void*)&kdprimCount);
+
+    // Shading
+    kernel = m_cl->m_kernelShade;
+    ciErrNum |= clSetKernelArg(kernel, 1, sizeof(cl_mem), (void*)&m_cmHits);
+    ciErrNum |= clSetKernelArg(kernel, 4, sizeof(cl_mem),
+                               (void*)&m_cmShading);
+    ciErrNum |= clSetKernelArg(kernel, 5, sizeof(cl_mem),
+                               (void*)&m_cmLightQueue);
+    ciErrNum |= clSetKernelArg(kernel, 6, sizeof(cl_mem),
+                               (void*)&m_cmCounters);
+    ciErrNum |= clSetKernelArg(kernel, 7, sizeof(cl_int),
+                               (void*)&m_queueCapacity);
+    ciErrNum |= clSetKernelArg(kernel, 10, sizeof(cl_mem),
+                               (void*)&m_cmObject);
+    ciErrNum |= clSetKernelArg(kernel, 11, sizeof(cl_int),
+                               (void*)&objectCount);
+    ciErrNum |= clSetKernelArg(kernel, 12, sizeof(cl_float4),
                                (void*)&m_global);
-
-    ciErrNum |= clSetKernelArg(m_cl->m_kernelRay, 12, sizeof(cl_mem),
+    ciErrNum |= clSetKernelArg(kernel, 13, sizeof(cl_mem),
                                (void*)&m_cmTexPixelBuffer);
-    ciErrNum |= clSetKernelArg(m_cl->m_kernelRay, 13,sizeof(cl_int),
+    ciErrNum |= clSetKernelArg(kernel, 14, sizeof(cl_int),
                                (void*)&m_pixelNum);
-    ciErrNum |= clSetKernelArg(m_cl->m_kernelRay, 14, sizeof(cl_mem),
+    ciErrNum |= clSetKernelArg(kernel, 15, sizeof(cl_mem),
                                (void*)&m_cmOffsetBuffer);
-    ciErrNum |= clSetKernelArg(m_cl->m_kernelRay, 15, sizeof(cl_uint),
+    ciErrNum |= clSetKernelArg(kernel, 16, sizeof(cl_int),
                                (void*)&offsetCount);
-    ciErrNum |= clSetKernelArg(m_cl->m_kernelRay, 16, sizeof(cl_mem),
+
+    // Shadows and lights
+    kernel = m_cl->m_kernelShadow;
+    ciErrNum |= clSetKernelArg(kernel, 1, sizeof(cl_mem), (void*)&m_cmHits);
+    ciErrNum |= clSetKernelArg(kernel, 2, sizeof(cl_mem),
+                               (void*)&m_cmShading);
+    ciErrNum |= clSetKernelArg(kernel, 3, sizeof(cl_mem),
+                               (void*)&m_cmLightQueue);
+    ciErrNum |= clSetKernelArg(kernel, 4, sizeof(cl_mem),
+                               (void*)&m_cmCounters);
+    ciErrNum |= clSetKernelArg(kernel, 5, sizeof(cl_mem),
+                               (void*)&m_cmSampleColors);
+    ciErrNum |= clSetKernelArg(kernel, 7, sizeof(cl_mem), (void*)&m_cmLight);
+    ciErrNum |= clSetKernelArg(kernel, 8, sizeof(cl_int),
+                               (void*)&lightCount);
+    ciErrNum |= clSetKernelArg(kernel, 9, sizeof(cl_mem),
+                               (void*)&m_cmObject);
+    ciErrNum |= clSetKernelArg(kernel, 10, sizeof(cl_int),
+                               (void*)&objectCount);
+    ciErrNum |= clSetKernelArg(kernel, 11, sizeof(cl_float4),
+                               (void*)&m_global);
+    ciErrNum |= clSetKernelArg(kernel, 12, sizeof(cl_mem),
                                (void*)&m_cmKdNodes);
-    ciErrNum |= clSetKernelArg(m_cl->m_kernelRay, 17, sizeof(cl_uint),
+    ciErrNum |= clSetKernelArg(kernel, 13, sizeof(cl_int),
                                (void*)&kdnodeCount);
-    ciErrNum |= clSetKernelArg(m_cl->m_kernelRay, 18, sizeof(cl_mem),
-                               (void*)&m_cmObjNodes);
-    ciErrNum |= clSetKernelArg(m_cl->m_kernelRay, 19, sizeof(cl_uint),
-                               (void*)&objnodeCount);
+    ciErrNum |= clSetKernelArg(kernel, 14, sizeof(cl_mem),
+                               (void*)&m_cmKdPrims);
+    ciErrNum |= clSetKernelArg(kernel, 15, sizeof(cl_int),
+                               (void*)&kdprimCount);
+
+    // Accumulation
+    kernel = m_cl->m_kernelAccumulate;
+    ciErrNum |= clSetKernelArg(kernel, 0, sizeof(cl_mem),
+                               (void*)&m_cmSampleColors);
+    ciErrNum |= clSetKernelArg(kernel, 1, sizeof(cl_mem),
+                               (void*)&m_cmColorSums);
+    ciErrNum |= clSetKernelArg(kernel, 2, sizeof(cl_mem),
+                               (void*)&m_cmSampleCounts);
+    ciErrNum |= clSetKernelArg(kernel, 3, sizeof(cl_mem),
+                               (void*)&m_cmRefineMask);
+    ciErrNum |= clSetKernelArg(kernel, 4, sizeof(cl_int),
+                               (void*)&pixelCount);
+
+    // Refinement
+    kernel = m_cl->m_kernelRefine;
+    ciErrNum |= clSetKernelArg(kernel, 0, sizeof(cl_mem),
+                               (void*)&m_cmColorSums);
+    ciErrNum |= clSetKernelArg(kernel, 1, sizeof(cl_mem),
+                               (void*)&m_cmFirstObjects);
+    ciErrNum |= clSetKernelArg(kernel, 2, sizeof(cl_mem),
+                               (void*)&m_cmRefineMask);
+    ciErrNum |= clSetKernelArg(kernel, 3, sizeof(cl_mem),
+                               (void*)&m_cmCounters);
+    ciErrNum |= clSetKernelArg(kernel, 4, sizeof(cl_uint), (void*)&width);
+    ciErrNum |= clSetKernelArg(kernel, 5, sizeof(cl_uint), (void*)&height);
+
+    // Every stage that reads the settings
+    ciErrNum |= clSetKernelArg(m_cl->m_kernelGenerate, 8, sizeof(cl_mem),
+                               (void*)&m_cmGlobal);
+    ciErrNum |= clSetKernelArg(m_cl->m_kernelIntersect, 7, sizeof(cl_mem),
+                               (void*)&m_cmGlobal);
+    ciErrNum |= clSetKernelArg(m_cl->m_kernelShade, 9, sizeof(cl_mem),
+                               (void*)&m_cmGlobal);
+    ciErrNum |= clSetKernelArg(m_cl->m_kernelShadow, 6, sizeof(cl_mem),
+                               (void*)&m_cmGlobal);
+    ciErrNum |= clSetKernelArg(m_cl->m_kernelRefine, 6, sizeof(cl_mem),
+                               (void*)&m_cmGlobal);
+
+    // Resolution, the output is set by traceFrame()
+    kernel = m_cl->m_kernelResolve;
+    ciErrNum |= clSetKernelArg(kernel, 1, sizeof(cl_mem),
+                               (void*)&m_cmColorSums);
+    ciErrNum |= clSetKernelArg(kernel, 2, sizeof(cl_mem),
+                               (void*)&m_cmSampleCounts);
+    ciErrNum |= clSetKernelArg(kernel, 3, sizeof(cl_int),
+                               (void*)&pixelCount);
 
     if (ciErrNum != CL_SUCCESS)
     {
@@ -331,6 +992,31 @@ void GPURayScene::setKernelArgs()
     }
 }
 
+bool GPURayScene::setCameraArgs(const Vector4& eyePos,
+                                const float near,
+                                const Matrix4x4& invViewTransMat)
+{
+    cl_int ciErrNum;
+    cl_float16 clInvMat = copyMatrix(invViewTransMat);
+    cl_float4 clEyePos  = copyVector4(eyePos);
+    cl_float clEyeNear  = near;
+
+    ciErrNum  = clSetKernelArg(m_cl->m_kernelGenerate, 10, sizeof(cl_float4),
+                               (void*)&clEyePos);
+    ciErrNum |= clSetKernelArg(m_cl->m_kernelGenerate, 11, sizeof(cl_float),
+                               (void*)&clEyeNear);
+    ciErrNum |= clSetKernelArg(m_cl->m_kernelGenerate, 12, sizeof(cl_float16),
+                               (void*)&clInvMat);
+
+    if (ciErrNum != CL_SUCCESS)
+    {
+        cerr << "Set kernel failed in line:" << __LINE__ << ", File:"
+             << __FILE__ << endl;
+        return false;
+    }
+    return true;
+}
+
 void GPURayScene::displayScreenTex()
 {
     glDisable(GL_DEPTH_TEST);
@@ -438,54 +1124,40 @@ cl_float3 GPURayScene::copyVector3(Vector3 v)
 
 void GPURayScene::copyKdTree(KdTree* tree)
 {
-    m_kdNodes.resize(KDTREE_ARRAY_SIZE);
-    m_objNodes.resize(KDTREE_ARRAY_SIZE);
-
-    KdTreeNode* kdNodeArray = tree->getKdTreeNodeArray();
-    ObjectNode* objNodeArray = tree->getObjectNodeArray();
-
-    for (int i = 0; i < KDTREE_ARRAY_SIZE; i++)
+    if (!tree)
     {
-        m_kdNodes[i].axis     = kdNodeArray[i].getAxis();
-        m_kdNodes[i].boxBegin = copyVector3(kdNodeArray[i].getAABB().getPos());
-        m_kdNodes[i].boxSize  = copyVector3(kdNodeArray[i].getAABB().getSize());
-        m_kdNodes[i].leaf     = kdNodeArray[i].isLeaf();
-        m_kdNodes[i].split    = kdNodeArray[i].getSplitPos();
-
-        if (kdNodeArray[i].getLeft())
-            m_kdNodes[i].leftIndex = kdNodeArray[i].getLeft() - kdNodeArray;
-        else
-            m_kdNodes[i].leftIndex = -1;
-
-        if (kdNodeArray[i].getRight())
-            m_kdNodes[i].rightIndex = kdNodeArray[i].getRight() - kdNodeArray;
-        else
-            m_kdNodes[i].rightIndex = -1;
-
-        if (kdNodeArray[i].getObjectList())
-            m_kdNodes[i].objIndex = kdNodeArray[i].getObjectList() - objNodeArray;
-        else
-            m_kdNodes[i].objIndex = -1;
-
-        if (objNodeArray[i].getObject())
-            m_objNodes[i].objectIndex = objNodeArray[i].getObject()->m_arrayID;
-        else
-            m_objNodes[i].objectIndex = -1;
-
-        if (objNodeArray[i].getNext())
-            m_objNodes[i].nextNodeIndex = objNodeArray[i].getNext() - objNodeArray;
-        else
-            m_objNodes[i].nextNodeIndex = -1;
+        // No tree, upload a single empty leaf so the buffers are valid
+        m_kdNodes.resize(1);
+        m_kdNodes[0].initLeaf(0, 0);
+        m_kdPrims.fill(-1, 1);
+        m_globalSetting.kdBoxBegin = copyVector4(Vector4(0, 0, 0, 0));
+        m_globalSetting.kdBoxSize  = copyVector4(Vector4(0, 0, 0, 0));
+        m_globalDirty = true;
+        m_kdDirty     = true;
+        return;
     }
 
-    kdnode_test  = m_kdNodes;
-    objnode_test = m_objNodes;
-    dumpCLKdTree("./output/clkdtree.txt");
+    // The compiled tree is already in the device layout
+    m_kdNodes.resize(tree->getFlatNodeCount());
+    memcpy(m_kdNodes.data(), tree->getFlatNodes(),
+           m_kdNodes.size() * sizeof(KdFlatNode));
+
+    m_kdPrims.fill(-1, qMax(tree->getFlatPrimitiveCount(), 1));
+    memcpy(m_kdPrims.data(), tree->getFlatPrimitives(),
+           tree->getFlatPrimitiveCount() * sizeof(cl_int));
+
+    AABB extends = tree->getExtends();
+    Vector3 pos  = extends.getPos();
+    Vector3 size = extends.getSize();
+    m_globalSetting.kdBoxBegin = copyVector4(Vector4(pos.x, pos.y, pos.z, 0));
+    m_globalSetting.kdBoxSize  = copyVector4(Vector4(size.x, size.y, size.z, 0));
+    m_globalDirty = true;
+    m_kdDirty     = true;
 }
 
 void GPURayScene::dumpCLKdTree(std::string fileName)
 {
-    assert(m_kdNodes.size() > 0 && m_objNodes.size() > 0);
+    assert(m_kdNodes.size() > 0 && m_kdPrims.size() > 0);
     std::ofstream out(fileName.c_str());
 
     if (!out.is_open())
@@ -494,12 +1166,13 @@ void GPURayScene::dumpCLKdTree(std::string fileName)
         return;
     }
     // The first one is the root
-    KdTreeNodeHost root = m_kdNodes[0];
-    out << "Extends: " << endl << (float)root.boxBegin.x << " "
-        << (float)root.boxBegin.y << " " << (float)root.boxBegin.z << endl;
-    out << (float)(root.boxBegin.x + root.boxSize.x) << " "
-        << (float)(root.boxBegin.y + root.boxSize.y) << " "
-        << (float)(root.boxBegin.z + root.boxSize.z) << endl;
+    cl_float4 begin = m_globalSetting.kdBoxBegin;
+    cl_float4 size  = m_globalSetting.kdBoxSize;
+    out << "Extends: " << endl << (float)begin.s[0] << " "
+        << (float)begin.s[1] << " " << (float)begin.s[2] << endl;
+    out << (float)(begin.s[0] + size.s[0]) << " "
+        << (float)(begin.s[1] + size.s[1]) << " "
+        << (float)(begin.s[2] + size.s[2]) << endl;
 
     dumpCLKdTreeInfoLeaf(0, out, 0);
 }
@@ -512,71 +1185,54 @@ void GPURayScene::dumpCLKdTreeInfoLeaf(int curIndex,
     {
         ofile << "    ";
     }
-    KdTreeNodeHost cur = m_kdNodes[curIndex];
+    KdFlatNode cur = m_kdNodes[curIndex];
     ofile << "Node:   " << " depth " << depth
-          <<" Leaf " << (cur.leaf ? "true ":"false ")
-          <<" axis " << cur.axis << " splitpos " << cur.split
+          <<" Leaf " << (cur.isLeaf() ? "true ":"false ")
+          <<" axis " << (cur.isLeaf() ? 0 : cur.getAxis())
+          << " splitpos " << (cur.isLeaf() ? 0 : cur.m_split)
           << endl << endl;
 
-    if (cur.leaf)
+    if (cur.isLeaf())
     {
         // If it is a leaf, dump the objects
-        int objIndex = cur.objIndex;
-
         ofile<<" obj list: ";
-        while (objIndex != -1)
+        for (unsigned i = 0; i < cur.getPrimCount(); i++)
         {
-            ObjectNodeHost obj = m_objNodes[objIndex];
-            ofile << "(" << m_objects[obj.objectIndex].type << ") ";
-            objIndex = obj.nextNodeIndex;
+            int objIndex = m_kdPrims[cur.m_primOffset + i];
+            ofile << "(" << m_objects[objIndex].type << ") ";
         }
 
         return;
     }
-    if (cur.leftIndex != -1)
-    {
-        dumpCLKdTreeInfoLeaf(cur.leftIndex, ofile, depth + 1);
-    }
-    if (cur.rightIndex != -1)
-    {
-        dumpCLKdTreeInfoLeaf(cur.rightIndex, ofile, depth + 1);
-    }
+    dumpCLKdTreeInfoLeaf(curIndex + 1, ofile, depth + 1);
+    dumpCLKdTreeInfoLeaf(cur.getRight(), ofile, depth + 1);
 }
 
 
 void GPURayScene::syncGlobalSettings()
 {
-    m_globalSetting.useShadow           = (cl_int)settings.useShadow;
-    m_globalSetting.usePointLight       = (cl_int)settings.usePointLights;
-    m_globalSetting.useDirectionalLight = (cl_int)settings.useDirectionalLights;
-    m_globalSetting.useSpotLight        = (cl_int)settings.useSpotLights;
-    m_globalSetting.showTexture         = (cl_int)settings.showTexture;
-    m_globalSetting.useSupersampling    = (cl_int)settings.useSupersampling;
-    m_globalSetting.traceNum            = (cl_int)settings.traceRaycursion;
-    m_globalSetting.useReflection       = (cl_int)settings.useReflection;
-    m_globalSetting.useKdTree           = (cl_int)settings.useKdTree;
-
-    if (m_cmGlobal)
-    {
-        clReleaseMemObject(m_cmGlobal);
-    }
-    cl_int ciErrNum;
-    m_cmGlobal = clCreateBuffer(m_cl->m_context,
-                                CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-                                sizeof(GlobalSettingHost),
-                                &m_globalSetting,
-                                &ciErrNum);
-
-    ciErrNum |= clSetKernelArg(m_cl->m_kernelRay,
-                               3,
-                               sizeof(cl_mem),
-                               (void*)&m_cmGlobal);
-
-    if (ciErrNum != CL_SUCCESS)
+    // The host copy can't change under the write of the last frame
+    waitUploads();
+
+    GlobalSettingHost setting = m_globalSetting;
+    setting.useShadow           = (cl_int)settings.useShadow;
+    setting.usePointLight       = (cl_int)settings.usePointLights;
+    setting.useDirectionalLight = (cl_int)settings.useDirectionalLights;
+    setting.useSpotLight        = (cl_int)settings.useSpotLights;
+    setting.showTexture         = (cl_int)settings.showTexture;
+    setting.useSupersampling    = (cl_int)settings.useSupersampling;
+    setting.traceNum            = (cl_int)settings.traceRaycursion;
+    setting.useReflection       = (cl_int)settings.useReflection;
+    setting.useKdTree           = (cl_int)settings.useKdTree;
+    setting.maxSamples          = (cl_int)settings.maxSamples;
+    setting.sampleContrast      = (cl_float)settings.sampleContrast;
+    setting.useMipmaps          = (cl_int)settings.useMipmaps;
+
+    // The buffer stays, it's only written when a setting changed
+    if (memcmp(&setting, &m_globalSetting, sizeof(GlobalSettingHost)) != 0)
     {
-        cerr << "Set global setting failed in line:" << __LINE__ << ", File:"
-             << __FILE__ << endl;
-        return;
+        m_globalSetting = setting;
+        m_globalDirty   = true;
     }
 }
 
@@ -585,6 +1241,16 @@ void GPURayScene::initCLBuffers()
     assert(m_cl->m_context);
 
     cl_int ciErrNum1, ciErrNum2, ciErrNum3,ciErrNum4, ciErrNum5, ciErrNum6;
+    cl_int ciErrNum7;
+
+    // The buffers are persistent, the changed records are uploaded before
+    // a frame. The global setting is filled by syncGlobalSettings()
+    m_cmGlobal = clCreateBuffer(m_cl->m_context,
+                                CL_MEM_READ_ONLY,
+                                sizeof(GlobalSettingHost),
+                                NULL,
+                                &ciErrNum7);
+    m_globalDirty = true;
 
     m_cmLight  = clCreateBuffer(m_cl->m_context,
                                 CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
@@ -626,14 +1292,18 @@ void GPURayScene::initCLBuffers()
 
     m_cmKdNodes = clCreateBuffer(m_cl->m_context,
                                  CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-                                 m_kdNodes.size() * sizeof(KdTreeNodeHost),
+                                 m_kdNodes.size() * sizeof(KdFlatNode),
                                  m_kdNodes.data(),
                                  &ciErrNum5);
-    m_cmObjNodes = clCreateBuffer(m_cl->m_context,
-                                  CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-                                  m_objNodes.size() * sizeof(ObjectNodeHost),
-                                  m_objNodes.data(),
-                                  &ciErrNum6);
+    m_cmKdPrims = clCreateBuffer(m_cl->m_context,
+                                 CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                 m_kdPrims.size() * sizeof(cl_int),
+                                 m_kdPrims.data(),
+                                 &ciErrNum6);
+    m_kdNodeCapacity = m_kdNodes.size();
+    m_kdPrimCapacity = m_kdPrims.size();
+    m_kdDirty        = false;
+    m_objectDirty.fill(0, m_objects.size());
 
     if (m_pixels)
     {
@@ -646,10 +1316,97 @@ void GPURayScene::initCLBuffers()
             ciErrNum3 |
             ciErrNum4 |
             ciErrNum5 |
-            (ciErrNum6 != CL_SUCCESS))
+            ciErrNum6 |
+            (ciErrNum7 != CL_SUCCESS))
     {
         cerr << "Create buffer failed in line " << __LINE__ << " File:"
              << __FILE__ << endl;
         return;
     }
 }
+
+void GPURayScene::initWavefrontBuffers()
+{
+    assert(m_cl->m_context);
+
+    // The queues hold the rays of the whole image for a shallow recursion,
+    // a deeper one is traced in waves
+    int pixelCount  = m_screenWidth * m_screenHeight;
+    m_queueCapacity = qMin(pixelCount * 2, GPU_QUEUE_SIZE);
+
+    // The shadow stage adds into the sample colors, they start cleared and
+    // the accumulation stage clears them after every sample. The counters
+    // start cleared too, the dropped rays are never reset
+    QVector<int> zeros(qMax(pixelCount * 4, WAVEFRONT_COUNTERS), 0);
+
+    // The host copies of the headless outputs are allocated once
+    if (m_cl->m_cmOut[0])
+    {
+        m_output[0].resize(pixelCount);
+        m_output[1].resize(pixelCount);
+    }
+
+    cl_int ciErrNum[11];
+    for (int i = 0; i < 2; i++)
+    {
+        m_cmRays[i] = clCreateBuffer(m_cl->m_context,
+                                     CL_MEM_READ_WRITE,
+                                     m_queueCapacity * sizeof(RayHost),
+                                     NULL,
+                                     &ciErrNum[i]);
+    }
+    m_cmHits         = clCreateBuffer(m_cl->m_context,
+                                      CL_MEM_READ_WRITE,
+                                      m_queueCapacity * sizeof(RayHitHost),
+                                      NULL,
+                                      &ciErrNum[2]);
+    m_cmShading      = clCreateBuffer(m_cl->m_context,
+                                      CL_MEM_READ_WRITE,
+                                      m_queueCapacity * 2 * sizeof(cl_float4),
+                                      NULL,
+                                      &ciErrNum[3]);
+    m_cmLightQueue   = clCreateBuffer(m_cl->m_context,
+                                      CL_MEM_READ_WRITE,
+                                      m_queueCapacity * sizeof(cl_int),
+                                      NULL,
+                                      &ciErrNum[4]);
+    m_cmCounters     = clCreateBuffer(m_cl->m_context,
+                                      CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                                      WAVEFRONT_COUNTERS * sizeof(cl_int),
+                                      zeros.data(),
+                                      &ciErrNum[5]);
+    m_cmSampleColors = clCreateBuffer(m_cl->m_context,
+                                      CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                                      pixelCount * 4 * sizeof(cl_int),
+                                      zeros.data(),
+                                      &ciErrNum[6]);
+    m_cmColorSums    = clCreateBuffer(m_cl->m_context,
+                                      CL_MEM_READ_WRITE,
+                                      pixelCount * sizeof(cl_float4),
+                                      NULL,
+                                      &ciErrNum[7]);
+    m_cmSampleCounts = clCreateBuffer(m_cl->m_context,
+                                      CL_MEM_READ_WRITE,
+                                      pixelCount * sizeof(cl_int),
+                                      NULL,
+                                      &ciErrNum[8]);
+    m_cmFirstObjects = clCreateBuffer(m_cl->m_context,
+                                      CL_MEM_READ_WRITE,
+                                      pixelCount * sizeof(cl_int),
+                                      NULL,
+                                      &ciErrNum[9]);
+    m_cmRefineMask   = clCreateBuffer(m_cl->m_context,
+                                      CL_MEM_READ_WRITE,
+                                      pixelCount * sizeof(cl_int),
+                                      NULL,
+                                      &ciErrNum[10]);
+    for (int i = 0; i < 11; i++)
+    {
+        if (ciErrNum[i] != CL_SUCCESS)
+        {
+            cerr << "Create wavefront buffer failed in line " << __LINE__
+                 << " File:" << __FILE__ << endl;
+            return;
+        }
+    }
+}
@@ -17,6 +17,19 @@
 #include "CL/cl.h"
 #include "oclUtils.h"
 #include "scene.h"
+#include "kdtreecommon.h"
+
+#define GPU_QUEUE_SIZE (1 << 18) // Most rays a queue holds, a wave has as
+                                 // few pixels as it takes for their rays of
+                                 // the last bounce to fit
+
+#define WAVEFRONT_RAY_COUNT 0 // Counters of the rays pushed to the two
+                              // queues, one each
+#define WAVEFRONT_RECORD_COUNT 2 // Counter of the hits queued for the lights
+#define WAVEFRONT_REFINED_COUNT 3 // Counter of the pixels to supersample
+#define WAVEFRONT_DROPPED_COUNT 4 // Counter of the rays dropped from full
+                                  // queues, never reset
+#define WAVEFRONT_COUNTERS 5 // Number of counters of the wavefront
 
 
 class Scene;
@@ -24,32 +37,6 @@ struct CLPack;
 class OrbitCamera;
 class KdTree;
 
-/**
- * @struct: KdTreeNodeHost
- * @brief The KdTreeNodeHost struct: host side structure for storing kdtree node
- */
-struct KdTreeNodeHost
-{
-    cl_float3 boxBegin;
-    cl_float3 boxSize;
-    cl_float split;
-    cl_int leaf;
-    cl_int axis;
-    cl_int leftIndex;
-    cl_int rightIndex;
-    cl_int objIndex;
-};
-
-/**
- * @struct: ObjectNodeHost
- * @brief The ObjectNodeHost struct: host side structure for storing obj node
- */
-struct ObjectNodeHost
-{
-    cl_int objectIndex;
-    cl_int nextNodeIndex;
-};
-
 /**
  * @class GPURayScene
  * @brief The GPURayScene class is used for managing everything used for OpenCL
@@ -123,6 +110,37 @@ public:
         cl_int traceNum;
         cl_int useReflection;
         cl_int useKdTree;
+        cl_int maxSamples;
+        cl_float sampleContrast;
+        cl_int useMipmaps;
+        cl_float4 kdBoxBegin;
+        cl_float4 kdBoxSize;
+    };
+
+    /**
+     * @class: RayHost
+     * @brief The RayHost struct mirrors a ray of the queues of the wavefront
+     */
+    struct RayHost
+    {
+        cl_float4 nextPos;
+        cl_float4 nextDir;
+        cl_float4 attenuation;
+        cl_int pixel;
+        cl_int curIndex;
+        cl_float coneWidth;
+        cl_float coneSpread;
+    };
+
+    /**
+     * @class: RayHitHost
+     * @brief The RayHitHost struct mirrors the closest hit of a queued ray
+     */
+    struct RayHitHost
+    {
+        cl_float t;
+        cl_int object;
+        cl_int face;
     };
 
     GPURayScene();
@@ -141,10 +159,55 @@ public:
     void render();
 
     /**
-     * @brief syncGlobalSettings: copy the current global setting to CL structure
+     * @brief renderOffscreen: trace the wavefront into a plain output buffer
+     *                         of a headless package and start reading it
+     *                         back on the transfer queue, without waiting for
+     *                         the read. Two frames are in flight at most, the
+     *                         oldest is dropped if it hasn't been read
+     * @param eyePos: the eye position
+     * @param near: the near plane
+     * @param invViewTransMat: inverse view transformation matrix
+     * @return: true for success and false for failure
+     */
+    bool renderOffscreen(const Vector4& eyePos,
+                         const float near,
+                         const Matrix4x4& invViewTransMat);
+
+    /**
+     * @brief readOffscreen: wait for the read back of the oldest frame of
+     *                       renderOffscreen() and copy it into an image
+     * @param image: the image, screen width x screen height
+     * @return: true for success and false for failure
+     */
+    bool readOffscreen(BGRA* image);
+
+    /**
+     * @brief getDroppedRays: get the rays pushed beyond the capacity of a
+     *                        queue and lost, the image is incomplete if any
+     *                        were. The wave is sized to avoid them, a
+     *                        recursion too deep for one pixel a wave can
+     *                        still overflow
+     * @return: the rays dropped in the frames read back so far
+     */
+    long long getDroppedRays() const { return m_droppedRays; }
+
+    /**
+     * @brief syncGlobalSettings: copy the current global setting to CL
+     *                            structure, it's uploaded before the next
+     *                            frame if it changed
      */
     void syncGlobalSettings();
 
+    /**
+     * @brief updateObjects: mark the objects moved by
+     *                       Scene::updateTransforms and the rebuilt kdtree
+     *                       for the upload before the next frame, the other
+     *                       object records stay on the device
+     * @param scene: the scene
+     * @param objects: indices of the moved objects in the scene
+     */
+    void updateObjects(Scene* scene, const QVector<int>& objects);
+
 
 private:
 
@@ -154,11 +217,102 @@ private:
      */
     void pushSceneData(Scene* scene);
 
+    /**
+     * @brief expandObjects: get the objects as the kernel sees them, with
+     *                       the groups expanded, into m_expandedObjects
+     * @param scene: the pointer to the scene
+     */
+    void expandObjects(Scene* scene);
+
+    /**
+     * @brief getExpandedKdTree: get the kdtree over the expanded objects,
+     *                           the one of the scene if it has no groups,
+     *                           else m_expandedTree rebuilt
+     * @param scene: the pointer to the scene
+     * @return: the kdtree to upload, NULL if there is none
+     */
+    KdTree* getExpandedKdTree(Scene* scene);
+
+    /**
+     * @brief copyObject: copy an object into its host side record
+     * @param object: the object
+     * @param newObj: the record, should be returned
+     */
+    void copyObject(const SceneObject& object, ObjectDataHost& newObj);
+
     /**
      * @brief setKernelArgs: set kernel arguments
      */
     void setKernelArgs();
 
+    /**
+     * @brief setCameraArgs: set the kernel arguments of the camera
+     * @param eyePos: the eye position
+     * @param near: the near plane
+     * @param invViewTransMat: inverse view transformation matrix
+     * @return: true for success and false for failure
+     */
+    bool setCameraArgs(const Vector4& eyePos,
+                       const float near,
+                       const Matrix4x4& invViewTransMat);
+
+    /**
+     * @brief traceFrame: enqueue the stages of the wavefront for every
+     *                    sample of every pixel and resolve them
+     * @param output: the buffer of the image
+     * @param dropped: the rays dropped since the buffers were made, read
+     *                 back without waiting, valid once the frame is done
+     * @return: true for success and false for failure
+     */
+    bool traceFrame(cl_mem output, cl_int* dropped);
+
+    /**
+     * @brief traceWave: generate the rays of a wave of pixels and bounce
+     *                   them through the intersect, shade and shadow stages
+     *                   up to the last bounce. Nothing is read back, the
+     *                   stages are launched for the most rays a queue may
+     *                   hold and the items beyond the rays pushed return
+     * @param firstPixel: index of the first pixel of the wave
+     * @param pixelCount: number of pixels of the wave
+     * @param sample: index of the sample
+     * @return: true for success and false for failure
+     */
+    bool traceWave(int firstPixel, int pixelCount, int sample);
+
+    /**
+     * @brief noteDroppedRays: take the count of the dropped rays read back
+     *                         with a frame, and warn if the frame dropped
+     *                         any
+     * @param dropped: the rays dropped since the buffers were made
+     */
+    void noteDroppedRays(cl_int dropped);
+
+    /**
+     * @brief enqueueKernel: launch a stage over a number of items, the
+     *                       global size is rounded up to the work groups
+     * @param kernel: the kernel
+     * @param count: number of items
+     * @return: true for success and false for failure
+     */
+    bool enqueueKernel(cl_kernel kernel, int count);
+
+    /**
+     * @brief resetCounters: zero some counters of the wavefront, in order
+     *                       with the stages and without waiting
+     * @param first: the first counter
+     * @param count: number of counters
+     * @return: true for success and false for failure
+     */
+    bool resetCounters(int first, int count);
+
+    /**
+     * @brief readCounters: wait for the stages and read the counters back,
+     *                      only the refinement does, once per frame
+     * @param counters: WAVEFRONT_COUNTERS counters, should be returned
+     * @return: true for success and false for failure
+     */
+    bool readCounters(cl_int* counters);
+
     /**
      * @brief displayScreenTex: display screen texture
      */
@@ -198,7 +352,8 @@ private:
     cl_float3 copyVector3(Vector3 v);
 
     /**
-     * @brief copyKdTree: copy the kdtree into host side structure
+     * @brief copyKdTree: copy the compiled kdtree into host side structure,
+     *                    the nodes keep the layout of KdFlatNode
      * @param tree: the CPU side tree
      */
     void copyKdTree(KdTree* tree);
@@ -222,14 +377,60 @@ private:
      */
     void initCLBuffers();
 
+    /**
+     * @brief initWavefrontBuffers: initialize the queues and the per pixel
+     *                              buffers of the wavefront
+     */
+    void initWavefrontBuffers();
+
+    /**
+     * @brief growBuffer: recreate a buffer if its records outgrow it
+     * @param buffer: the buffer, should be returned
+     * @param capacity: number of records it holds, should be returned
+     * @param count: number of records
+     * @param recordSize: size of a record
+     * @return: true for success and false for failure
+     */
+    bool growBuffer(cl_mem& buffer, int& capacity, int count,
+                    size_t recordSize);
+
+    /**
+     * @brief enqueueUpload: write records of a host copy to its buffer on the
+     *                       transfer queue, after the kernels of the frame
+     *                       before are done with it
+     * @param buffer: the buffer
+     * @param first: index of the first record
+     * @param count: number of records
+     * @param recordSize: size of a record
+     * @param data: the host copy of the records
+     * @return: true for success and false for failure
+     */
+    bool enqueueUpload(cl_mem buffer, int first, int count,
+                       size_t recordSize, const void* data);
+
+    /**
+     * @brief flushUploads: upload the dirty records and make the kernels of
+     *                      the next frame wait for them
+     * @return: true for success and false for failure
+     */
+    bool flushUploads();
+
+    /**
+     * @brief waitUploads: wait for the uploads in flight, the host copies
+     *                     can't change before they're done
+     */
+    void waitUploads();
+
     OrbitCamera* m_camera; // Orbit camera
     CLPack* m_cl; // Opencl Package (general stuff: work size, platform id, etc)
     cl_float4 m_global; // Global data
     QVector<LightDataHost> m_lightData; // Host side light data in the scene
     QVector<ObjectDataHost> m_objects; // Host side object list in the scene
+    QVector<SceneObject> m_expandedObjects; // The objects, groups expanded
+    KdTree* m_expandedTree; // Kdtree over m_expandedObjects, for groups
 
-    QVector<KdTreeNodeHost> m_kdNodes; // Host side kd tree nodes
-    QVector<ObjectNodeHost> m_objNodes; // Host side object nodes
+    QVector<KdFlatNode> m_kdNodes; // Host side kd tree nodes
+    QVector<int> m_kdPrims; // Host side object indices of the leaves
 
     GLuint m_screenTex; // Screen texture handle
     GLuint m_screenPbo; // Screen pixel buffer handle
@@ -244,17 +445,46 @@ private:
     cl_mem m_cmObject; // CL buffer for object list
 
     cl_mem m_cmKdNodes; // CL buffer for kdtree nodes
-    cl_mem m_cmObjNodes; // CL buffer for object nodes
+    cl_mem m_cmKdPrims; // CL buffer for object indices of the leaves
+    int m_kdNodeCapacity; // Nodes m_cmKdNodes holds
+    int m_kdPrimCapacity; // Indices m_cmKdPrims holds
+
+    bool m_globalDirty; // The global setting changed since its upload
+    bool m_kdDirty; // The kdtree changed since its upload
+    QVector<cl_char> m_objectDirty; // Objects changed since their upload
+    QVector<cl_event> m_uploads; // Uploads in flight
+    cl_event m_frameDone; // Marker after the kernels of the last frame
 
     cl_mem m_cmTexPixelBuffer; // CL buffer for pixel buffer
     cl_mem m_cmOffsetBuffer; // CL buffer for offset
 
-    QVector<cl_uint> m_textureOffsets; // CL buffer for textures' offset
+    QVector<unsigned int> m_textureOffsets; // CL buffer for textures' offset
 
     cl_int m_pixelNum; // CL buffer for pixel number
     cl_uint* m_pixels; // CL buffer for all pixels (texture)
 
     QVector<cl_GLuint> m_textureHandles; // CL buffer for texture handles
+
+    cl_mem m_cmRays[2]; // Ray queues, the current bounce and the next
+    cl_mem m_cmHits; // Closest hits of the current queue
+    cl_mem m_cmShading; // Normals and texture colors of the hits
+    cl_mem m_cmLightQueue; // Indices of the hits queued for the lights
+    cl_mem m_cmCounters; // Counters of the wavefront
+    cl_mem m_cmSampleColors; // Fixed point color of the sample of a pixel
+    cl_mem m_cmColorSums; // Sum of the samples of a pixel
+    cl_mem m_cmSampleCounts; // Number of samples of a pixel
+    cl_mem m_cmFirstObjects; // Object hit by the center of a pixel
+    cl_mem m_cmRefineMask; // Pixels to supersample
+
+    cl_int m_queueCapacity; // Rays a queue holds
+    long long m_droppedRays; // Rays dropped from full queues
+    cl_int m_dropped[2]; // Dropped rays read back with the headless outputs
+
+    QVector<unsigned int> m_output[2]; // Host copies of the headless outputs
+    cl_event m_readEvent[2]; // Read backs of the headless outputs, NULL if
+                             // none
+    int m_framesRendered; // Frames traced by renderOffscreen()
+    int m_framesRead; // Frames copied by readOffscreen()
 };
 
 #endif // GPURayScene_H
@@ -0,0 +1,776 @@
+/*!
+    @file bvh.cpp
+    @desc: definitions of Bvh class
+    @author: yanli
+    @date: May 2013
+ */
+
+#include "bvh.h"
+#include <QElapsedTimer>
+#include <algorithm>
+#include <float.h>
+
+/**
+ * @brief calculateArea: calculate the surface area of a box
+ * @param boxMin: lower corner of the box
+ * @param boxMax: upper corner of the box
+ * @return: the surface area
+ */
+static inline float calculateArea(const float* boxMin, const float* boxMax)
+{
+
+    float w = boxMax[0] - boxMin[0];
+    float h = boxMax[1] - boxMin[1];
+    float d = boxMax[2] - boxMin[2];
+    return 2 * (w * h + w * d + h * d);
+}
+
+/**
+ * @brief growBox: grow a box to contain another one
+ * @param boxMin: lower corner of the box, updated
+ * @param boxMax: upper corner of the box, updated
+ * @param otherMin: lower corner of the other box
+ * @param otherMax: upper corner of the other box
+ */
+static inline void growBox(float* boxMin, float* boxMax,
+                           const float* otherMin, const float* otherMax)
+{
+
+    for (int k = 0; k < 3; k++)
+    {
+        boxMin[k] = qMin(boxMin[k], otherMin[k]);
+        boxMax[k] = qMax(boxMax[k], otherMax[k]);
+    }
+}
+
+/**
+ * @brief getObjectBox: get the bounding box of an object, padded since the
+ *                      intersection tests accept hits up to EPSILON outside
+ *                      of the unit objects
+ * @param object: the object
+ * @param box: min and max corners, should be returned
+ */
+static inline void getObjectBox(const SceneObject& object, float* box)
+{
+
+    AABB aabb = object.m_boundingBox;
+    float pad = EPSILON * qMax(1.f, qMax(aabb.w(), qMax(aabb.h(), aabb.d())));
+    for (int k = 0; k < 3; k++)
+    {
+        float start = aabb.getPos().xyz[k];
+        float end   = start + aabb.getSize().xyz[k];
+        box[k]     = start - pad;
+        box[k + 3] = end + pad;
+    }
+}
+
+/**
+ * @brief getSlotCost: get the SAH cost of a child of a wide node, not divided
+ *                     by the area of the root
+ * @param node: the node
+ * @param slot: the child
+ * @return: the cost, 0 for an unused slot
+ */
+static inline float getSlotCost(const BvhWideNode& node, int slot)
+{
+
+    int count = node.m_count[slot];
+    if (!count)
+        return 0;
+
+    float lower[3];
+    float upper[3];
+    for (int k = 0; k < 3; k++)
+    {
+        lower[k] = node.m_bounds[0][k][slot];
+        upper[k] = node.m_bounds[1][k][slot];
+    }
+    float area = calculateArea(lower, upper);
+    return count < 0 ? area * BVH_TRAVERSAL_COST :
+                       area * count * BVH_INTERSECT_COST;
+}
+
+/**
+ * @brief getBin: get the SAH bin of a centroid
+ * @param centroid: the centroid on the binned axis
+ * @param centroidMin: the lowest centroid on the axis
+ * @param scale: BVH_BIN_COUNT over the extent of the centroids
+ * @return: the bin
+ */
+static inline int getBin(float centroid, float centroidMin, float scale)
+{
+
+    int bin = (int)((centroid - centroidMin) * scale);
+    return qMax(0, qMin(bin, BVH_BIN_COUNT - 1));
+}
+
+/**
+ * @struct: BvhLeftOfBin
+ * @brief The BvhLeftOfBin struct tells whether an object falls into the bins
+ *        left of a split
+ */
+struct BvhLeftOfBin
+{
+    const float* m_centroids; // Centroids, 3 floats per object
+    int m_axis; // Binned axis
+    float m_centroidMin; // The lowest centroid on the axis
+    float m_scale; // BVH_BIN_COUNT over the extent of the centroids
+    int m_bin; // First bin on the right
+
+    bool operator()(int object) const
+    {
+        return getBin(m_centroids[object * 3 + m_axis],
+                      m_centroidMin, m_scale) < m_bin;
+    }
+};
+
+/**
+ * @struct: BvhCentroidLess
+ * @brief The BvhCentroidLess struct orders objects by their centroids
+ */
+struct BvhCentroidLess
+{
+    const float* m_centroids; // Centroids, 3 floats per object
+    int m_axis; // Compared axis
+
+    bool operator()(int a, int b) const
+    {
+        return m_centroids[a * 3 + m_axis] < m_centroids[b * 3 + m_axis];
+    }
+};
+
+Bvh::Bvh()
+{
+    m_nodes      = NULL;
+    m_nodeCount  = 0;
+    m_flatNodes  = NULL;
+    m_flatNodeCount = 0;
+    m_prims      = NULL;
+    m_primCount  = 0;
+    m_leafCount  = 0;
+    m_buildTime  = 0;
+    m_refitStamp = 0;
+    m_cost       = 0;
+    m_buildCost  = 0;
+    m_refitTime  = 0;
+}
+
+Bvh::~Bvh()
+{
+    // Free everything
+    freeMem();
+}
+
+void Bvh::build(Scene* scene)
+{
+
+    build(scene->getObjectPointers());
+}
+
+void Bvh::build(const QVector<SceneObject*>& objects)
+{
+
+    int objectCount = objects.size();
+
+    QVector<float> boxes(objectCount * 6);
+    for (int i = 0; i < objectCount; i++)
+        getObjectBox(*objects[i], boxes.data() + objects[i]->m_arrayID * 6);
+
+    build(boxes.constData(), objectCount);
+}
+
+void Bvh::build(const float* boxes, int count)
+{
+
+    QElapsedTimer timer;
+    timer.start();
+
+    // Keep the boxes and centroids as plain floats, the builder reads them
+    // over and over
+    m_boxes.resize(count * 6);
+    m_centroids.resize(count * 3);
+    m_order.resize(count);
+    if (count)
+        memcpy(m_boxes.data(), boxes, count * 6 * sizeof(float));
+    for (int i = 0; i < count; i++)
+    {
+        for (int k = 0; k < 3; k++)
+            m_centroids[i * 3 + k] =
+                    (boxes[i * 6 + k] + boxes[i * 6 + k + 3]) * 0.5f;
+        m_order[i] = i;
+    }
+
+    QVector<BvhFlatNode> nodes;
+    nodes.reserve(qMax(count * 2, 1));
+    m_leafCount = 0;
+    buildNode(nodes, 0, count, 0);
+
+    QVector<BvhWideNode> wideNodes;
+    wideNodes.reserve(nodes.size() / 2 + 1);
+    collapseNode(nodes, 0, wideNodes);
+
+    freeMem();
+
+    // The leaves refer to ranges of the final primitive order
+    m_nodeCount     = wideNodes.size();
+    m_flatNodeCount = nodes.size();
+    m_primCount     = count;
+    m_nodes = (BvhWideNode*)qMallocAligned(
+                m_nodeCount * sizeof(BvhWideNode), BVH_ALIGNMENT);
+    m_flatNodes = (BvhFlatNode*)qMallocAligned(
+                m_flatNodeCount * sizeof(BvhFlatNode), BVH_ALIGNMENT);
+    m_prims = (int*)qMallocAligned(
+                qMax(m_primCount, 1) * sizeof(int), BVH_ALIGNMENT);
+
+    memcpy(m_nodes, wideNodes.constData(),
+           m_nodeCount * sizeof(BvhWideNode));
+    memcpy(m_flatNodes, nodes.constData(),
+           m_flatNodeCount * sizeof(BvhFlatNode));
+    memcpy(m_prims, m_order.constData(), m_primCount * sizeof(int));
+
+    // Release the building memory
+    m_boxes.clear();
+    m_centroids.clear();
+    m_order.clear();
+
+    // The refit links belong to the old tree
+    m_parents.clear();
+    m_primSlots.clear();
+    m_slotStamps.clear();
+    m_flatParents.clear();
+    m_primLeaves.clear();
+    m_flatStamps.clear();
+
+    m_buildTime = timer.nsecsElapsed() / 1000000.0;
+}
+
+void Bvh::refit(const QVector<SceneObject>& objects,
+                const QVector<int>& changed)
+{
+
+    QElapsedTimer timer;
+    timer.start();
+
+    if (m_parents.isEmpty())
+        initRefit();
+
+    // A slot is updated once per refit, however many of its objects moved
+    m_refitStamp++;
+    QVector<int> heap;
+    for (int i = 0; i < changed.size(); i++)
+    {
+        assert(changed[i] >= 0 && changed[i] < m_primCount);
+        int slot = m_primSlots[changed[i]];
+        if (m_slotStamps[slot] == m_refitStamp)
+            continue;
+        m_slotStamps[slot] = m_refitStamp;
+
+        int index = slot / BVH_WIDTH;
+        int c     = slot % BVH_WIDTH;
+        const BvhWideNode& node = m_nodes[index];
+        float lower[3] = {FLT_MAX, FLT_MAX, FLT_MAX};
+        float upper[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+        for (int j = node.m_child[c]; j < node.m_child[c] + node.m_count[c];
+             j++)
+        {
+            float box[6];
+            getObjectBox(objects[m_prims[j]], box);
+            growBox(lower, upper, box, box + 3);
+        }
+        if (setSlotBox(index, c, lower, upper))
+            queueNode(heap, index);
+    }
+
+    // Children come after their parents in the node array, so taking the
+    // largest index first refits every node after all of its children
+    while (!heap.isEmpty())
+    {
+        std::pop_heap(heap.begin(), heap.end());
+        int index = heap.last();
+        heap.removeLast();
+
+        const BvhWideNode& node = m_nodes[index];
+        float lower[3] = {FLT_MAX, FLT_MAX, FLT_MAX};
+        float upper[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+        for (int c = 0; c < BVH_WIDTH; c++)
+        {
+            if (!node.m_count[c])
+                continue;
+            for (int k = 0; k < 3; k++)
+            {
+                lower[k] = qMin(lower[k], node.m_bounds[0][k][c]);
+                upper[k] = qMax(upper[k], node.m_bounds[1][k][c]);
+            }
+        }
+
+        int slot = m_parents[index];
+        if (setSlotBox(slot / BVH_WIDTH, slot % BVH_WIDTH, lower, upper))
+            queueNode(heap, slot / BVH_WIDTH);
+    }
+
+    refitFlat(objects, changed);
+
+    m_refitTime = timer.nsecsElapsed() / 1000000.0;
+}
+
+float Bvh::getRefitCost() const
+{
+
+    if (m_parents.isEmpty() || m_buildCost <= 0)
+        return 1;
+
+    float area = getRootArea();
+    return area > 0 ? m_cost / area / m_buildCost : 1;
+}
+
+void Bvh::initRefit()
+{
+
+    m_parents.fill(-1, m_nodeCount);
+    m_primSlots.fill(-1, m_primCount);
+    m_slotStamps.fill(0, m_nodeCount * BVH_WIDTH);
+    m_refitStamp = 0;
+    m_cost       = 0;
+
+    for (int i = 0; i < m_nodeCount; i++)
+    {
+        const BvhWideNode& node = m_nodes[i];
+        for (int c = 0; c < BVH_WIDTH; c++)
+        {
+            int slot = i * BVH_WIDTH + c;
+            if (node.m_count[c] < 0)
+                m_parents[node.m_child[c]] = slot;
+            for (int j = node.m_child[c];
+                 j < node.m_child[c] + node.m_count[c]; j++)
+                m_primSlots[m_prims[j]] = slot;
+            m_cost += getSlotCost(node, c);
+        }
+    }
+
+    float area  = getRootArea();
+    m_buildCost = area > 0 ? m_cost / area : 0;
+
+    m_flatParents.fill(-1, m_flatNodeCount);
+    m_primLeaves.fill(-1, m_primCount);
+    m_flatStamps.fill(0, m_flatNodeCount);
+    for (int i = 0; i < m_flatNodeCount; i++)
+    {
+        const BvhFlatNode& node = m_flatNodes[i];
+        if (!node.isLeaf())
+        {
+            m_flatParents[i + 1]           = i;
+            m_flatParents[node.getRight()] = i;
+            continue;
+        }
+        for (unsigned j = node.getPrimOffset();
+             j < node.getPrimOffset() + node.getPrimCount(); j++)
+            m_primLeaves[m_prims[j]] = i;
+    }
+}
+
+void Bvh::refitFlat(const QVector<SceneObject>& objects,
+                    const QVector<int>& changed)
+{
+
+    QVector<int> heap;
+    for (int i = 0; i < changed.size(); i++)
+    {
+        int index = m_primLeaves[changed[i]];
+        if (m_flatStamps[index] == m_refitStamp)
+            continue;
+        m_flatStamps[index] = m_refitStamp;
+
+        const BvhFlatNode& node = m_flatNodes[index];
+        float lower[3] = {FLT_MAX, FLT_MAX, FLT_MAX};
+        float upper[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+        for (unsigned j = node.getPrimOffset();
+             j < node.getPrimOffset() + node.getPrimCount(); j++)
+        {
+            float box[6];
+            getObjectBox(objects[m_prims[j]], box);
+            growBox(lower, upper, box, box + 3);
+        }
+        if (setFlatBox(index, lower, upper))
+            queueFlatParent(heap, index);
+    }
+
+    // A parent comes before its children as in the wide nodes
+    while (!heap.isEmpty())
+    {
+        std::pop_heap(heap.begin(), heap.end());
+        int index = heap.last();
+        heap.removeLast();
+
+        const BvhFlatNode& left  = m_flatNodes[index + 1];
+        const BvhFlatNode& right = m_flatNodes[m_flatNodes[index].getRight()];
+        float lower[3];
+        float upper[3];
+        for (int k = 0; k < 3; k++)
+        {
+            lower[k] = qMin(left.m_min[k], right.m_min[k]);
+            upper[k] = qMax(left.m_max[k], right.m_max[k]);
+        }
+        if (setFlatBox(index, lower, upper))
+            queueFlatParent(heap, index);
+    }
+}
+
+bool Bvh::setFlatBox(int index, const float* lower, const float* upper)
+{
+
+    BvhFlatNode& node = m_flatNodes[index];
+    bool changed = false;
+    for (int k = 0; k < 3; k++)
+    {
+        changed = changed || node.m_min[k] != lower[k] ||
+                node.m_max[k] != upper[k];
+        node.m_min[k] = lower[k];
+        node.m_max[k] = upper[k];
+    }
+    return changed;
+}
+
+void Bvh::queueFlatParent(QVector<int>& heap, int index)
+{
+
+    int parent = m_flatParents[index];
+    if (parent < 0 || m_flatStamps[parent] == m_refitStamp)
+        return;
+    m_flatStamps[parent] = m_refitStamp;
+
+    heap.append(parent);
+    std::push_heap(heap.begin(), heap.end());
+}
+
+bool Bvh::setSlotBox(int index, int slot, const float* lower,
+                     const float* upper)
+{
+
+    BvhWideNode& node = m_nodes[index];
+    bool changed = false;
+    for (int k = 0; k < 3; k++)
+    {
+        changed = changed || node.m_bounds[0][k][slot] != lower[k] ||
+                node.m_bounds[1][k][slot] != upper[k];
+    }
+    if (!changed)
+        return false;
+
+    m_cost -= getSlotCost(node, slot);
+    for (int k = 0; k < 3; k++)
+    {
+        node.m_bounds[0][k][slot] = lower[k];
+        node.m_bounds[1][k][slot] = upper[k];
+    }
+    m_cost += getSlotCost(node, slot);
+    return true;
+}
+
+void Bvh::queueNode(QVector<int>& heap, int index)
+{
+
+    // The root's box isn't stored anywhere
+    int slot = m_parents[index];
+    if (slot < 0 || m_slotStamps[slot] == m_refitStamp)
+        return;
+    m_slotStamps[slot] = m_refitStamp;
+
+    heap.append(index);
+    std::push_heap(heap.begin(), heap.end());
+}
+
+float Bvh::getRootArea() const
+{
+
+    if (!m_nodeCount)
+        return 0;
+
+    const BvhWideNode& root = m_nodes[0];
+    float lower[3] = {FLT_MAX, FLT_MAX, FLT_MAX};
+    float upper[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+    bool empty = true;
+    for (int c = 0; c < BVH_WIDTH; c++)
+    {
+        if (!root.m_count[c])
+            continue;
+        empty = false;
+        for (int k = 0; k < 3; k++)
+        {
+            lower[k] = qMin(lower[k], root.m_bounds[0][k][c]);
+            upper[k] = qMax(upper[k], root.m_bounds[1][k][c]);
+        }
+    }
+    return empty ? 0 : calculateArea(lower, upper);
+}
+
+void Bvh::buildNode(QVector<BvhFlatNode>& nodes, int begin, int end,
+                    int depth)
+{
+
+    int index = nodes.size();
+    nodes.resize(index + 1);
+
+    // Bound the objects and their centroids
+    float boxMin[3]      = {FLT_MAX, FLT_MAX, FLT_MAX};
+    float boxMax[3]      = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+    float centroidMin[3] = {FLT_MAX, FLT_MAX, FLT_MAX};
+    float centroidMax[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+    for (int i = begin; i < end; i++)
+    {
+        int object = m_order[i];
+        const float* box      = m_boxes.constData() + object * 6;
+        const float* centroid = m_centroids.constData() + object * 3;
+        growBox(boxMin, boxMax, box, box + 3);
+        growBox(centroidMin, centroidMax, centroid, centroid);
+    }
+    for (int k = 0; k < 3; k++)
+    {
+        nodes[index].m_min[k] = boxMin[k];
+        nodes[index].m_max[k] = boxMax[k];
+    }
+
+    int count = end - begin;
+    int axis  = 0;
+    int bin   = 0;
+    float cost = POS_INF;
+    if (count > 1 && depth < BVH_SAH_DEPTH)
+        cost = findSplit(begin, end, centroidMin, centroidMax,
+                         calculateArea(boxMin, boxMax), axis, bin);
+
+    // Intersecting all of the objects is cheaper
+    if (count <= 1 ||
+        (count <= BVH_MAX_LEAF_OBJECTS && cost >= BVH_INTERSECT_COST * count))
+    {
+        nodes[index].initLeaf(begin, count);
+        m_leafCount++;
+        return;
+    }
+
+    int* order = m_order.data();
+    int mid    = begin;
+    if (cost < POS_INF)
+    {
+        BvhLeftOfBin leftOfBin;
+        leftOfBin.m_centroids   = m_centroids.constData();
+        leftOfBin.m_axis        = axis;
+        leftOfBin.m_centroidMin = centroidMin[axis];
+        leftOfBin.m_scale       = BVH_BIN_COUNT /
+                (centroidMax[axis] - centroidMin[axis]);
+        leftOfBin.m_bin         = bin;
+        mid = std::partition(order + begin, order + end, leftOfBin) - order;
+    }
+
+    if (mid == begin || mid == end)
+    {
+        // No SAH split, halve the objects along the widest centroid extent
+        axis = 0;
+        for (int k = 1; k < 3; k++)
+        {
+            if (centroidMax[k] - centroidMin[k] >
+                    centroidMax[axis] - centroidMin[axis])
+                axis = k;
+        }
+
+        // All of the centroids are the same, splitting won't separate them
+        if (centroidMax[axis] == centroidMin[axis] &&
+            count <= BVH_MAX_LEAF_OBJECTS)
+        {
+            nodes[index].initLeaf(begin, count);
+            m_leafCount++;
+            return;
+        }
+
+        BvhCentroidLess centroidLess;
+        centroidLess.m_centroids = m_centroids.constData();
+        centroidLess.m_axis      = axis;
+        mid = (begin + end) / 2;
+        std::nth_element(order + begin, order + mid, order + end,
+                         centroidLess);
+    }
+
+    // The left child follows its parent, the right one comes after the
+    // whole left subtree
+    buildNode(nodes, begin, mid, depth + 1);
+    nodes[index].initInterior(axis, nodes.size());
+    buildNode(nodes, mid, end, depth + 1);
+}
+
+int Bvh::collapseNode(const QVector<BvhFlatNode>& nodes, int index,
+                      QVector<BvhWideNode>& wideNodes)
+{
+
+    int wideIndex = wideNodes.size();
+    wideNodes.resize(wideIndex + 1);
+
+    // Open the interior child of the largest area until the node is full,
+    // a leaf root just becomes the only child
+    int children[BVH_WIDTH];
+    int childCount = 0;
+    if (nodes[index].isLeaf())
+    {
+        children[childCount++] = index;
+    }
+    else
+    {
+        children[childCount++] = index + 1;
+        children[childCount++] = nodes[index].getRight();
+    }
+    while (childCount < BVH_WIDTH)
+    {
+        int best = -1;
+        float bestArea = -1;
+        for (int c = 0; c < childCount; c++)
+        {
+            const BvhFlatNode& child = nodes[children[c]];
+            float area = calculateArea(child.m_min, child.m_max);
+            if (!child.isLeaf() && area > bestArea)
+            {
+                best     = c;
+                bestArea = area;
+            }
+        }
+        if (best < 0)
+            break;
+
+        int opened = children[best];
+        children[best]         = opened + 1;
+        children[childCount++] = nodes[opened].getRight();
+    }
+
+    for (int c = 0; c < BVH_WIDTH; c++)
+    {
+        // Unused slots are empty leaves with an inverted box
+        int child      = 0;
+        int count      = 0;
+        float lower[3] = {FLT_MAX, FLT_MAX, FLT_MAX};
+        float upper[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+        if (c < childCount)
+        {
+            const BvhFlatNode& node = nodes[children[c]];
+            for (int k = 0; k < 3; k++)
+            {
+                lower[k] = node.m_min[k];
+                upper[k] = node.m_max[k];
+            }
+            if (node.isLeaf())
+            {
+                child = node.getPrimOffset();
+                count = node.getPrimCount();
+            }
+            else
+            {
+                // May grow the array, wideNodes is indexed again below
+                child = collapseNode(nodes, children[c], wideNodes);
+                count = -1;
+            }
+        }
+
+        BvhWideNode& wideNode = wideNodes[wideIndex];
+        for (int k = 0; k < 3; k++)
+        {
+            wideNode.m_bounds[0][k][c] = lower[k];
+            wideNode.m_bounds[1][k][c] = upper[k];
+        }
+        wideNode.m_child[c] = child;
+        wideNode.m_count[c] = count;
+    }
+
+    return wideIndex;
+}
+
+float Bvh::findSplit(int begin, int end, const float* centroidMin,
+                     const float* centroidMax, float area,
+                     int& axis, int& bin)
+{
+
+    if (area <= 0)
+        return POS_INF;
+
+    float invArea = 1.f / area;
+    float best    = POS_INF;
+
+    for (int k = 0; k < 3; k++)
+    {
+        float extent = centroidMax[k] - centroidMin[k];
+        if (extent <= 0)
+            continue;
+        float scale = BVH_BIN_COUNT / extent;
+
+        // Put the objects into bins
+        int binCount[BVH_BIN_COUNT];
+        float binMin[BVH_BIN_COUNT][3];
+        float binMax[BVH_BIN_COUNT][3];
+        for (int b = 0; b < BVH_BIN_COUNT; b++)
+        {
+            binCount[b] = 0;
+            for (int j = 0; j < 3; j++)
+            {
+                binMin[b][j] = FLT_MAX;
+                binMax[b][j] = -FLT_MAX;
+            }
+        }
+        for (int i = begin; i < end; i++)
+        {
+            int object = m_order[i];
+            const float* box = m_boxes.constData() + object * 6;
+            int b = getBin(m_centroids[object * 3 + k], centroidMin[k], scale);
+            binCount[b]++;
+            growBox(binMin[b], binMax[b], box, box + 3);
+        }
+
+        // Sweep from the right for the objects right of each plane
+        float rightArea[BVH_BIN_COUNT];
+        int rightCount[BVH_BIN_COUNT];
+        float accMin[3] = {FLT_MAX, FLT_MAX, FLT_MAX};
+        float accMax[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+        int accCount    = 0;
+        for (int b = BVH_BIN_COUNT - 1; b > 0; b--)
+        {
+            growBox(accMin, accMax, binMin[b], binMax[b]);
+            accCount     += binCount[b];
+            rightCount[b] = accCount;
+            rightArea[b]  = accCount ? calculateArea(accMin, accMax) : 0;
+        }
+
+        // Then from the left, plane b is between bin b - 1 and bin b
+        for (int j = 0; j < 3; j++)
+        {
+            accMin[j] = FLT_MAX;
+            accMax[j] = -FLT_MAX;
+        }
+        accCount = 0;
+        for (int b = 1; b < BVH_BIN_COUNT; b++)
+        {
+            growBox(accMin, accMax, binMin[b - 1], binMax[b - 1]);
+            accCount += binCount[b - 1];
+            if (accCount == 0 || rightCount[b] == 0)
+                continue;
+
+            float cost = BVH_TRAVERSAL_COST + BVH_INTERSECT_COST * invArea *
+                    (calculateArea(accMin, accMax) * accCount +
+                     rightArea[b] * rightCount[b]);
+            if (cost < best)
+            {
+                best = cost;
+                axis = k;
+                bin  = b;
+            }
+        }
+    }
+
+    return best;
+}
+
+void Bvh::freeMem()
+{
+
+    if (m_nodes)
+        qFreeAligned(m_nodes);
+    if (m_flatNodes)
+        qFreeAligned(m_flatNodes);
+    if (m_prims)
+        qFreeAligned(m_prims);
+    m_nodes     = NULL;
+    m_flatNodes = NULL;
+    m_prims     = NULL;
+}
@@ -0,0 +1,291 @@
+/*!
+    @file bvh.h
+    @desc: declarations of BvhFlatNode struct and Bvh class
+    @author: yanli
+    @date: May 2013
+ */
+
+#ifndef BVH_H
+#define BVH_H
+
+#include "scene.h"
+
+#define BVH_LEAF 3 // Axis value of a leaf in BvhFlatNode
+#define BVH_BIN_COUNT 16 // Number of SAH bins per axis
+#define BVH_MAX_LEAF_OBJECTS 8 // Nodes with more objects are always split
+#define BVH_SAH_DEPTH 32 // Deeper nodes are split at the median, so the
+                         // depth stays below BVH_SAH_DEPTH + 32
+#define BVH_WIDTH 4 // Children per node of the traversed BVH, one SSE lane
+                    // each
+#define BVH_STACK_SIZE (64 * BVH_WIDTH) // Traversal stack, the postponed
+                                        // children of each level
+#define BVH_FLAT_STACK_SIZE 64 // Traversal stack of the binary tree
+#define BVH_ALIGNMENT 64 // Alignment of the node array in bytes
+
+#define BVH_TRAVERSAL_COST 0.3f // SAH cost of traversing an interior node
+#define BVH_INTERSECT_COST 1.0f // SAH cost of intersecting an object
+#define BVH_REFIT_DEGRADATION 1.5f // A refit tree whose SAH cost grew by
+                                   // this factor is rebuilt instead
+
+/**
+ * @struct: BvhFlatNode
+ * @brief The BvhFlatNode struct is the 32 byte binary BVH node the builder
+ *        works on and the scalar traversal walks, one box test per node is
+ *        cheaper than BVH_WIDTH without SSE. Nodes are stored depth first,
+ *        so the left child of an interior node is always the next node.
+ *        The low 2 bits of m_flags hold the axis the node was split on
+ *        (BVH_LEAF for leaves) and the upper 30 bits hold the primitive
+ *        count of a leaf
+ */
+struct BvhFlatNode
+{
+    float m_min[3]; // Lower corner of the bounding box
+    unsigned m_offset; // Right child, or the first primitive of a leaf
+    float m_max[3]; // Upper corner of the bounding box
+    unsigned m_flags; // Axis or BVH_LEAF, primitive count of a leaf
+
+    void initInterior(int axis, unsigned right)
+    {
+        m_offset = right;
+        m_flags  = axis;
+    }
+    void initLeaf(unsigned primOffset, unsigned primCount)
+    {
+        m_offset = primOffset;
+        m_flags  = (primCount << 2) | BVH_LEAF;
+    }
+
+    bool isLeaf() const { return (m_flags & 3) == BVH_LEAF; }
+    int getAxis() const { return m_flags & 3; }
+    unsigned getRight() const { return m_offset; }
+    unsigned getPrimOffset() const { return m_offset; }
+    unsigned getPrimCount() const { return m_flags >> 2; }
+};
+
+/**
+ * @struct: BvhWideNode
+ * @brief The BvhWideNode struct is the 128 byte node used for traversal, it
+ *        holds the boxes of up to BVH_WIDTH children as structure of arrays
+ *        so one SSE test covers all of them. Unused slots have an inverted
+ *        box that no ray hits
+ */
+struct BvhWideNode
+{
+    float m_bounds[2][3][BVH_WIDTH]; // Lower and upper corners of the
+                                     // children's boxes, per axis
+    int m_child[BVH_WIDTH]; // Child node, or first primitive of a leaf
+    int m_count[BVH_WIDTH]; // Primitive count of a leaf, -1 for a node
+};
+
+/**
+ * @class: Bvh
+ * @brief The Bvh class is a bounding volume hierarchy over the scene objects,
+ *        the alternative of KdTree, or over the triangles of a Mesh. Every
+ *        object is referenced by exactly one leaf. It's built top down as a
+ *        binary tree with a binned SAH on the centroids of the objects'
+ *        bounding boxes, then collapsed into BVH_WIDTH wide nodes for the
+ *        SSE traversal. The binary nodes are kept for the scalar one, both
+ *        share the primitive array. When objects move, the boxes above them
+ *        can be refit instead of building again
+ */
+class Bvh
+{
+public:
+
+    Bvh();
+    ~Bvh();
+
+    /**
+     * @brief build: build a BVH from the scene
+     * @param scene: the pointer to the scene
+     */
+    void build(Scene* scene);
+
+    /**
+     * @brief build: build a BVH over a list of objects, the primitives of
+     *               the leaves are the objects' m_arrayID
+     * @param objects: the objects, their ids have to be 0 to count - 1
+     */
+    void build(const QVector<SceneObject*>& objects);
+
+    /**
+     * @brief build: build a BVH over any set of boxes, the primitives of
+     *               the leaves are indices of the boxes
+     * @param boxes: min and max corners of each primitive, 6 floats each
+     * @param count: number of primitives
+     */
+    void build(const float* boxes, int count);
+
+    /**
+     * @brief refit: update the boxes of the leaves holding objects that
+     *               moved and of the nodes above them, bottom up, in both
+     *               the wide and the binary nodes. The tree keeps its
+     *               shape, so its quality degrades as the objects move away
+     *               from where it was built for
+     * @param objects: the objects the BVH was built over, in the order of
+     *                 their ids
+     * @param changed: ids of the objects whose bounding box changed
+     */
+    void refit(const QVector<SceneObject>& objects,
+               const QVector<int>& changed);
+
+    /**
+     * @brief getRefitCost: get the SAH cost of the tree relative to its cost
+     *                      when it was built, rebuild it once this exceeds
+     *                      BVH_REFIT_DEGRADATION
+     * @return: the relative cost, 1 for a tree that was never refit
+     */
+    float getRefitCost() const;
+
+    /**
+     * Getters
+     */
+    const BvhWideNode* getNodes() const { return m_nodes; }
+    int getNodeCount() const { return m_nodeCount; }
+    const BvhFlatNode* getFlatNodes() const { return m_flatNodes; }
+    int getFlatNodeCount() const { return m_flatNodeCount; }
+    const int* getPrimitives() const { return m_prims; }
+    int getPrimitiveCount() const { return m_primCount; }
+    int getLeafCount() const { return m_leafCount; }
+    double getBuildTime() const { return m_buildTime; }
+    double getRefitTime() const { return m_refitTime; }
+
+private:
+
+    /**
+     * @brief buildNode: append a node and its subtree to the node array
+     * @param nodes: the node array
+     * @param begin: the first object of the node in m_order
+     * @param end: one past the last object of the node in m_order
+     * @param depth: the current depth
+     */
+    void buildNode(QVector<BvhFlatNode>& nodes, int begin, int end,
+                   int depth);
+
+    /**
+     * @brief collapseNode: append the wide node replacing a binary node and
+     *                      its descendants up to BVH_WIDTH children
+     * @param nodes: the binary nodes
+     * @param index: the binary node
+     * @param wideNodes: the wide node array
+     * @return: index of the wide node
+     */
+    int collapseNode(const QVector<BvhFlatNode>& nodes, int index,
+                     QVector<BvhWideNode>& wideNodes);
+
+    /**
+     * @brief findSplit: bin the centroids on all three axes and find the
+     *                   split of minimal SAH cost
+     * @param begin: the first object of the node in m_order
+     * @param end: one past the last object of the node in m_order
+     * @param centroidMin: lower corner of the centroids' bounding box
+     * @param centroidMax: upper corner of the centroids' bounding box
+     * @param area: surface area of the node
+     * @param axis: the best axis, should be returned
+     * @param bin: the first bin on the right side, should be returned
+     * @return: the SAH cost of the best split, POS_INF if there is none
+     */
+    float findSplit(int begin, int end, const float* centroidMin,
+                    const float* centroidMax, float area,
+                    int& axis, int& bin);
+
+    /**
+     * @brief initRefit: link the nodes and the objects to the slots they are
+     *                   in and sum the SAH cost, before the first refit
+     */
+    void initRefit();
+
+    /**
+     * @brief refitFlat: update the boxes of the binary leaves holding
+     *                   objects that moved and of the nodes above them,
+     *                   after initRefit() and with the stamp of the refit
+     * @param objects: the objects the BVH was built over, in the order of
+     *                 their ids
+     * @param changed: ids of the objects whose bounding box changed
+     */
+    void refitFlat(const QVector<SceneObject>& objects,
+                   const QVector<int>& changed);
+
+    /**
+     * @brief setFlatBox: set the box of a binary node
+     * @param index: the node
+     * @param lower: lower corner of the box
+     * @param upper: upper corner of the box
+     * @return: true if the box changed
+     */
+    bool setFlatBox(int index, const float* lower, const float* upper);
+
+    /**
+     * @brief queueFlatParent: queue the parent of a binary node whose box
+     *                         changed, deepest node first
+     * @param heap: the queued nodes, a max heap of their indices
+     * @param index: the node
+     */
+    void queueFlatParent(QVector<int>& heap, int index);
+
+    /**
+     * @brief setSlotBox: set the box of a child of a node and update the
+     *                    SAH cost
+     * @param index: the node
+     * @param slot: the child
+     * @param lower: lower corner of the box
+     * @param upper: upper corner of the box
+     * @return: true if the box changed
+     */
+    bool setSlotBox(int index, int slot, const float* lower,
+                    const float* upper);
+
+    /**
+     * @brief queueNode: queue a node whose box changed for refitting the
+     *                   slot its parent holds it in, deepest node first
+     * @param heap: the queued nodes, a max heap of their indices
+     * @param index: the node
+     */
+    void queueNode(QVector<int>& heap, int index);
+
+    /**
+     * @brief getRootArea: get the surface area of the box of the root
+     * @return: the surface area
+     */
+    float getRootArea() const;
+
+    /**
+     * @brief freeMem: free all
+     */
+    void freeMem();
+
+private:
+
+    QVector<float> m_boxes; // Min and max corners of each object while
+                            // building, 6 floats per object
+    QVector<float> m_centroids; // Box centers of each object while
+                                // building, 3 floats per object
+    QVector<int> m_order; // Objects in leaf order while building
+
+    BvhWideNode* m_nodes; // Wide nodes, aligned to BVH_ALIGNMENT
+    int m_nodeCount; // Number of wide nodes
+    BvhFlatNode* m_flatNodes; // Binary nodes, aligned to BVH_ALIGNMENT
+    int m_flatNodeCount; // Number of binary nodes
+    int* m_prims; // Object indices referenced by the leaves
+    int m_primCount; // Number of object indices
+    int m_leafCount; // Number of leaves
+    double m_buildTime; // Time to build the BVH in ms
+
+    QVector<int> m_parents; // Slot holding each node in its parent, node
+                            // index times BVH_WIDTH plus the child, -1 for
+                            // the root. Empty until the first refit
+    QVector<int> m_primSlots; // Slot of the leaf holding each object
+    QVector<unsigned> m_slotStamps; // Refit that last updated each slot
+    QVector<int> m_flatParents; // Parent of each binary node, -1 for the
+                                // root. Empty until the first refit
+    QVector<int> m_primLeaves; // Binary leaf holding each object
+    QVector<unsigned> m_flatStamps; // Refit that last updated each binary
+                                    // node
+    unsigned m_refitStamp; // Number of refits so far
+    float m_cost; // SAH cost of the tree, not divided by the root's area
+    float m_buildCost; // SAH cost of the tree as built, divided by the
+                       // root's area
+    double m_refitTime; // Time of the last refit in ms
+};
+
+#endif // BVH_H
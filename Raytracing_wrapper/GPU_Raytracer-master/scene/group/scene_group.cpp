@@ -0,0 +1,72 @@
+/*!
+    @file scene_group.cpp
+    @desc: definitions of SceneGroup class
+    @author: yanli
+    @date: May 2013
+ */
+
+#include "scene_group.h"
+
+SceneGroup::SceneGroup()
+{
+}
+
+SceneGroup::~SceneGroup()
+{
+}
+
+void SceneGroup::addObject(SceneObject& obj)
+{
+
+    obj.m_arrayID = m_objects.size();
+    obj.m_flatID  = m_objects.size();
+    m_objects.append(obj);
+}
+
+void SceneGroup::build()
+{
+
+    Vector3 min = Vector3(POS_INF, POS_INF, POS_INF),
+            max = Vector3(-POS_INF, -POS_INF, -POS_INF);
+
+    QVector<SceneObject*> objects;
+    for (int i = 0; i < m_objects.size(); i++)
+    {
+        AABB box = m_objects[i].m_boundingBox;
+        for (int k = 0; k < 3; k++)
+        {
+            min.xyz[k] = qMin(min.xyz[k], box.getPos().xyz[k]);
+            max.xyz[k] = qMax(max.xyz[k], box.getPos().xyz[k] +
+                              box.getSize().xyz[k]);
+        }
+        objects.append(&m_objects[i]);
+    }
+    m_boundingBox = AABB(min, max - min);
+
+    m_bvh.build(objects);
+    m_view.build(m_objects);
+}
+
+AABB SceneGroup::computeAABB(const Matrix4x4& transform) const
+{
+
+    AABB box = m_boundingBox;
+    Vector3 min = Vector3(POS_INF, POS_INF, POS_INF),
+            max = Vector3(-POS_INF, -POS_INF, -POS_INF);
+
+    for (int i = 0; i < 8; i++)
+    {
+        Vector4 corner(box.x() + (i & 1 ? box.w() : 0),
+                       box.y() + (i & 2 ? box.h() : 0),
+                       box.z() + (i & 4 ? box.d() : 0), 1);
+        Vector4 tmp = transform * corner;
+        tmp = Vector4(tmp.x / tmp.w, tmp.y / tmp.w, tmp.z / tmp.w, 1);
+        for (int k = 0; k < 3; k++)
+        {
+            min.xyz[k] = qMin(min.xyz[k], tmp.data[k]);
+            max.xyz[k] = qMax(max.xyz[k], tmp.data[k]);
+        }
+    }
+
+    return AABB(min, max - min);
+}
@@ -0,0 +1,78 @@
+/*!
+    @file scene_group.h
+    @desc: declarations of SceneGroup class
+    @author: yanli
+    @date: May 2013
+ */
+
+#ifndef SCENE_GROUP_H
+#define SCENE_GROUP_H
+
+#include "scene.h"
+#include "bvh.h"
+#include "intersect_view.h"
+
+#define GROUP_MIN_OBJECTS 2 // Fewest primitives a node needs to become a
+                            // group, a single object gains nothing from it
+
+/**
+ * @class: SceneGroup
+ * @brief The SceneGroup class holds the objects of a scene node used more
+ *        than once, such as a master object, in the space of the node. It
+ *        is the lower level of the acceleration structure: every use of the
+ *        node is one object of the scene holding its transform and the
+ *        group, the scene's kdtree or BVH is built over these and the BVH of
+ *        the group over its objects. Only the scene's structure depends on
+ *        where the uses are. Groups don't nest, a group used inside of
+ *        another one is expanded into it
+ */
+class SceneGroup
+{
+public:
+
+    SceneGroup();
+    ~SceneGroup();
+
+    /**
+     * @brief addObject: append an object, its ids are its index in the group
+     * @param obj: the object in the space of the group
+     */
+    void addObject(SceneObject& obj);
+
+    /**
+     * @brief build: build the BVH and the intersection view, once all of the
+     *               objects are added
+     */
+    void build();
+
+    /**
+     * @brief computeAABB: compute the bounding box of the group's box
+     *                     transformed
+     * @param transform: the transformation matrix
+     * @return: the result bounding box
+     */
+    AABB computeAABB(const Matrix4x4& transform) const;
+
+    /**
+     * Getters
+     */
+    int getObjectCount() const { return m_objects.size(); }
+    const QVector<SceneObject>& getObjects() const { return m_objects; }
+    const Bvh& getBvh() const { return m_bvh; }
+    const IntersectView& getIntersectView() const { return m_view; }
+
+private:
+
+    // The BVH and the view own their arrays, a group is never copied
+    SceneGroup(const SceneGroup&);
+    SceneGroup& operator=(const SceneGroup&);
+
+private:
+
+    QVector<SceneObject> m_objects; // Objects in the space of the group
+    Bvh m_bvh; // BVH over the objects
+    IntersectView m_view; // The objects as seen by the intersection loops
+    AABB m_boundingBox; // Bounding box of the objects
+};
+
+#endif // SCENE_GROUP_H
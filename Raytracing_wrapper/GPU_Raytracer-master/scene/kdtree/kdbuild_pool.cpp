@@ -0,0 +1,112 @@
+/*!
+    @file kdbuild_pool.cpp
+    @desc: definitions of KdBuildThread and KdBuildPool classes
+    @author: yanli
+    @date: May 2013
+ */
+
+#include "kdbuild_pool.h"
+#include <assert.h>
+
+KdBuildThread::KdBuildThread(KdBuildPool* pool, const int workerId)
+{
+
+    m_pool     = pool;
+    m_workerId = workerId;
+}
+
+void KdBuildThread::run()
+{
+
+    m_pool->work(m_workerId);
+}
+
+KdBuildPool::KdBuildPool(const int threadCount)
+{
+
+    assert(threadCount > 0);
+
+    m_pending = 0;
+    m_quit    = false;
+
+    // The thread calling wait() is worker 0
+    m_threads.resize(threadCount - 1);
+    for (int i = 0; i < m_threads.size(); i++)
+    {
+        m_threads[i] = new KdBuildThread(this, i + 1);
+        m_threads[i]->start();
+    }
+}
+
+KdBuildPool::~KdBuildPool()
+{
+
+    m_lock.lock();
+    m_quit = true;
+    m_changed.wakeAll();
+    m_lock.unlock();
+
+    for (int i = 0; i < m_threads.size(); i++)
+    {
+        m_threads[i]->wait();
+        delete m_threads[i];
+    }
+}
+
+void KdBuildPool::add(KdBuildJob* job)
+{
+
+    m_lock.lock();
+    m_jobs.append(job);
+    m_pending++;
+    m_changed.wakeOne();
+    m_lock.unlock();
+}
+
+void KdBuildPool::wait()
+{
+
+    KdBuildJob* job;
+    while ((job = take(false)))
+        runJob(job, 0);
+}
+
+void KdBuildPool::work(int workerId)
+{
+
+    KdBuildJob* job;
+    while ((job = take(true)))
+        runJob(job, workerId);
+}
+
+KdBuildJob* KdBuildPool::take(bool waitForQuit)
+{
+
+    m_lock.lock();
+    while (m_jobs.isEmpty() && !m_quit && (waitForQuit || m_pending > 0))
+        m_changed.wait(&m_lock);
+
+    // Depth first, the newest job has the smallest working set
+    KdBuildJob* job = NULL;
+    if (!m_jobs.isEmpty())
+    {
+        job = m_jobs.last();
+        m_jobs.pop_back();
+    }
+    m_lock.unlock();
+
+    return job;
+}
+
+void KdBuildPool::runJob(KdBuildJob* job, int workerId)
+{
+
+    job->run(workerId);
+    delete job;
+
+    m_lock.lock();
+    m_pending--;
+    if (m_pending == 0)
+        m_changed.wakeAll();
+    m_lock.unlock();
+}
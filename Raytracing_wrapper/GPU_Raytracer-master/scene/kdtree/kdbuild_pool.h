@@ -0,0 +1,124 @@
+/*!
+    @file kdbuild_pool.h
+    @desc: declarations of KdBuildJob, KdBuildThread and KdBuildPool classes
+    @author: yanli
+    @date: May 2013
+ */
+
+#ifndef KDBUILD_POOL_H
+#define KDBUILD_POOL_H
+
+#include <QMutex>
+#include <QThread>
+#include <QVector>
+#include <QWaitCondition>
+
+class KdBuildPool;
+
+/**
+ * @class: KdBuildJob
+ * @brief The KdBuildJob class is a piece of work of the kdtree builder, such
+ *        as sorting a range of events or building a subtree
+ */
+class KdBuildJob
+{
+public:
+
+    virtual ~KdBuildJob() {}
+
+    /**
+     * @brief run: do the job
+     * @param workerId: index of the worker running the job, 0 is the thread
+     *                  waiting on the pool
+     */
+    virtual void run(int workerId) = 0;
+};
+
+/**
+ * @class: KdBuildThread
+ * @brief The KdBuildThread class is a worker of KdBuildPool, it runs jobs
+ *        until the pool is deleted
+ */
+class KdBuildThread :
+        public QThread
+{
+public:
+
+    KdBuildThread(KdBuildPool* pool, const int workerId);
+
+    /**
+     * @brief run: start the thread
+     */
+    void run();
+
+private:
+
+    KdBuildPool* m_pool; // The pool owning this thread
+    int m_workerId; // Index of this thread in the pool
+};
+
+/**
+ * @class: KdBuildPool
+ * @brief The KdBuildPool class runs the jobs of the kdtree builder on a
+ *        fixed set of threads. Jobs may add more jobs, the thread calling
+ *        wait() works along until all of them are done
+ */
+class KdBuildPool
+{
+public:
+
+    KdBuildPool(const int threadCount);
+    ~KdBuildPool();
+
+    /**
+     * @brief add: queue a job, the pool deletes it after running it
+     * @param job: the job
+     */
+    void add(KdBuildJob* job);
+
+    /**
+     * @brief wait: run jobs on the calling thread as worker 0 until there
+     *              are none queued or running
+     */
+    void wait();
+
+    /**
+     * @brief work: called by the threads, run jobs until the pool quits
+     * @param workerId: index of the worker
+     */
+    void work(int workerId);
+
+    /**
+     * Getters
+     */
+    int getThreadCount() { return m_threads.size() + 1; }
+
+private:
+
+    /**
+     * @brief take: get the next job, block while there is none but some are
+     *              still running
+     * @param waitForQuit: keep blocking when all of the jobs are done, until
+     *                     the pool quits
+     * @return: the job, NULL if there is no more work
+     */
+    KdBuildJob* take(bool waitForQuit);
+
+    /**
+     * @brief runJob: run a job, delete it and mark it done
+     * @param job: the job
+     * @param workerId: index of the worker
+     */
+    void runJob(KdBuildJob* job, int workerId);
+
+private:
+
+    QVector<KdBuildThread*> m_threads; // The threads besides the caller
+    QVector<KdBuildJob*> m_jobs; // Queued jobs, the newest runs first
+    QMutex m_lock; // Lock for the queue
+    QWaitCondition m_changed; // Wakes the workers for new jobs or the end
+    int m_pending; // Jobs queued or running
+    bool m_quit; // Threads should quit
+};
+
+#endif // KDBUILD_POOL_H
@@ -6,402 +6,545 @@
  */
 
 #include "kdtree.h"
-#include "kdtreenode.h"
+#include "global.h"
+#include <QElapsedTimer>
+#include <algorithm>
 #include <fstream>
 
-KdTree::KdTree()
+/**
+ * @brief calculateCost: the SAH cost of a split
+ * @param leftProb: probability of a ray through the node hitting the left
+ * @param rightProb: probability of a ray through the node hitting the right
+ * @param leftCount: objects on the left
+ * @param rightCount: objects on the right
+ * @return: the cost
+ */
+static inline float calculateCost(float leftProb, float rightProb,
+                                  int leftCount, int rightCount)
 {
-    m_allocated  = false;
-    m_root       = NULL;
-    m_splitList  = NULL;
-    m_splitPool  = NULL;
-    m_kdPtr      = NULL;
-    m_objPtr     = NULL;
-    m_kdMem      = NULL;
-    m_objMem     = NULL;
-    m_root       = NULL;
+
+    float cost = KD_TRAVERSAL_COST +
+            KD_INTERSECT_COST * (leftProb * leftCount +
+                                 rightProb * rightCount);
+
+    // Prefer cutting off empty space
+    if (leftCount == 0 || rightCount == 0)
+        cost *= KD_EMPTY_BONUS;
+    return cost;
 }
 
-KdTree::~KdTree()
+/**
+ * @brief chunkBegin: get the first element of a chunk of an array
+ * @param size: the size of the array
+ * @param chunk: the index of the chunk
+ * @param chunkCount: the number of chunks
+ * @return: the index of the first element
+ */
+static inline int chunkBegin(int size, int chunk, int chunkCount)
 {
-    // Free everything
-    freeMem();
+
+    return (int)((qint64)size * chunk / chunkCount);
 }
 
-void KdTree::init()
+/**
+ * @class: KdSortJob
+ * @brief The KdSortJob class sorts a range of events
+ */
+class KdSortJob :
+        public KdBuildJob
 {
-    allocateMem();
-    m_root = newKdTreeNode();
-}
+public:
 
-void KdTree::build(Scene *scene)
+    KdSortJob(KdEvent* begin, KdEvent* end) : m_begin(begin), m_end(end) {}
+
+    void run(int) { std::sort(m_begin, m_end); }
+
+private:
+
+    KdEvent* m_begin; // First event
+    KdEvent* m_end; // One past the last event
+};
+
+/**
+ * @class: KdMergeJob
+ * @brief The KdMergeJob class merges two neighbouring sorted ranges of events
+ */
+class KdMergeJob :
+        public KdBuildJob
 {
-    if (!m_allocated)
-        assert(0);
+public:
 
-    QVector<SceneObject*> objects = scene->getObjectPointers();
-    int objectCount = objects.size();
-    AABB extends = scene->getExtends();
+    KdMergeJob(KdEvent* begin, KdEvent* middle, KdEvent* end)
+        : m_begin(begin), m_middle(middle), m_end(end) {}
 
-    QVector<SceneObject*>::Iterator iter;
-    for (iter = objects.begin(); iter != objects.end(); iter++)
-        m_root->add((*iter), this);
+    void run(int) { std::inplace_merge(m_begin, m_middle, m_end); }
 
-    // Set the root's AABB bounding box
-    m_root->setAABB(scene->getExtends());
+private:
 
-    // Build the list, for temporary use
-    SplitNode* header;
-    header = new SplitNode[objectCount*2+1];
-    m_splitPool = header;
+    KdEvent* m_begin; // First event of the first range
+    KdEvent* m_middle; // First event of the second range
+    KdEvent* m_end; // One past the last event of the second range
+};
 
-    int i = 0;
-    for (;i < objectCount * 2; i++)
-        m_splitPool[i].next = &m_splitPool[i+1];
-    m_splitPool[i].next = 0;
+/**
+ * @class: KdSubtreeJob
+ * @brief The KdSubtreeJob class builds the subtree of a task
+ */
+class KdSubtreeJob :
+        public KdBuildJob
+{
+public:
 
-    // Init an empty split list
-    m_splitList = 0;
-    if (objectCount > 2)
-    {
-        m_root->setLeaf(false);
-        // Do subdivision
-        subdivide(m_root, extends, 0, objectCount);
-    }
-    // Release the memory
-    if (header)
-        delete []header;
+    KdSubtreeJob(KdTree* tree, KdBuildTask* task)
+        : m_tree(tree), m_task(task) {}
+
+    void run(int workerId) { m_tree->buildTask(m_task, workerId); }
+
+private:
+
+    KdTree* m_tree; // The tree being built
+    KdBuildTask* m_task; // The subtree
+};
+
+KdTree::KdTree()
+{
+    m_pool          = NULL;
+    m_flatNodes     = NULL;
+    m_flatNodeCount = 0;
+    m_flatPrims     = NULL;
+    m_flatPrimCount = 0;
+    m_leafCount     = 0;
+    m_buildTime     = 0;
+}
+
+KdTree::~KdTree()
+{
+    // Free everything
+    freeMem();
+    if (m_pool)
+        delete m_pool;
+}
+
+void KdTree::build(Scene *scene)
+{
+
+    build(scene->getObjectPointers(), scene->getExtends());
 }
 
-void KdTree::insertSplitPos(float splitPos)
+void KdTree::build(const QVector<SceneObject*>& objects, AABB extends)
 {
-    SplitNode* newNode = m_splitPool; // Pointer to an unused split node
-    m_splitPool = m_splitPool->next;
-    newNode->next       = 0;
-    newNode->splitPos   = splitPos;
-    newNode->leftCount  = 0;
-    newNode->rightCount = 0;
-
-    if (!m_splitList)
+
+    QElapsedTimer timer;
+    timer.start();
+
+    int objectCount = objects.size();
+    m_extends = extends;
+
+    // The pool outlives the build, an animated scene rebuilds every frame
+    // and shouldn't start the threads again each time
+    int threadCount = qMax(settings.kdBuildThreadNum, 1);
+    if (m_pool && m_pool->getThreadCount() != threadCount)
     {
-        m_splitList = newNode;
+        delete m_pool;
+        m_pool = NULL;
     }
-    else
+    if (!m_pool)
+        m_pool = new KdBuildPool(threadCount);
+
+    // Make the events of each axis and sort them, this is the only sort.
+    // A flat object gets a planar event instead of a start and an end
+    QVector<KdEvent> events[3];
+    for (int axis = 0; axis < 3; axis++)
     {
-        // splitList is a sorted list whose node stores the split position
-        // Sort
-        if (splitPos < m_splitList->splitPos) // Add to the front
+        events[axis].reserve(objectCount * 2);
+        for (int i = 0; i < objectCount; i++)
         {
-            newNode->next = m_splitList;
-            m_splitList = newNode;
-        }
-        else if (splitPos == m_splitList->splitPos)
-        {
-            // Recycle this node
-            newNode->next = m_splitPool;
-            m_splitPool = newNode;
-        }
-        else
-        {
-            SplitNode* list = m_splitList;
-            // Find the appropriate pos to insert
-            while ((list->next) && (splitPos  >= list->next->splitPos))
+            AABB box    = objects[i]->m_boundingBox;
+            float start = box.getPos().xyz[axis];
+            float end   = start + box.getSize().xyz[axis];
+
+            KdEvent event;
+            event.m_object = objects[i]->m_arrayID;
+            if (start == end)
             {
-                if (splitPos == list->next->splitPos)
-                {
-                    // Recycle this node
-                    newNode->next = m_splitPool;
-                    m_splitPool = newNode;
-                    return;
-                }
-                list = list->next;
+                event.m_pos  = start;
+                event.m_type = KD_EVENT_PLANAR;
+                events[axis].append(event);
+                continue;
             }
-            // Still works when list->next is NULL
-            newNode->next = list->next;
-            list->next = newNode;
+            event.m_pos  = start;
+            event.m_type = KD_EVENT_START;
+            events[axis].append(event);
+            event.m_pos  = end;
+            event.m_type = KD_EVENT_END;
+            events[axis].append(event);
         }
     }
+    sortEvents(events);
+
+    // Every worker classifies objects in its own array
+    m_sides.resize(m_pool->getThreadCount());
+    for (int i = 0; i < m_sides.size(); i++)
+        m_sides[i].fill(KD_SIDE_BOTH, objectCount);
+
+    KdBuildTask* root = newTask(events, m_extends, 0, objectCount);
+    m_pool->add(new KdSubtreeJob(this, root));
+    m_pool->wait();
+
+    QVector<KdFlatNode> nodes;
+    QVector<int> prims;
+    m_leafCount = 0;
+    stitch(root, nodes, prims);
+
+    freeMem();
+
+    // Copy into aligned memory so that a node never straddles a cache line
+    m_flatNodeCount = nodes.size();
+    m_flatPrimCount = prims.size();
+    m_flatNodes = (KdFlatNode*)qMallocAligned(
+                m_flatNodeCount * sizeof(KdFlatNode), KDTREE_ALIGNMENT);
+    m_flatPrims = (int*)qMallocAligned(
+                qMax(m_flatPrimCount, 1) * sizeof(int), KDTREE_ALIGNMENT);
+
+    memcpy(m_flatNodes, nodes.constData(),
+           m_flatNodeCount * sizeof(KdFlatNode));
+    memcpy(m_flatPrims, prims.constData(), m_flatPrimCount * sizeof(int));
+
+    // Release the building memory
+    for (int i = 0; i < m_tasks.size(); i++)
+        delete m_tasks[i];
+    m_tasks.clear();
+    m_sides.clear();
+
+    m_buildTime = timer.nsecsElapsed() / 1000000.0;
 }
 
-void KdTree::subdivide(KdTreeNode *node, AABB aabb, int depth, int objCount)
+void KdTree::buildTask(KdBuildTask* task, int workerId)
 {
-    // Recycle used split nodes
-    if (m_splitList)
-    {
-        SplitNode* list = m_splitList;
-        while (list->next)
-            list = list->next;
 
-        list->next = m_splitPool;
-        m_splitPool = m_splitList;
+    buildNode(task, task->m_events, task->m_box, task->m_depth,
+              task->m_objCount, m_sides[workerId].data());
+}
 
-        // Reset the split list
-        m_splitList = 0;
-    }
+void KdTree::sortEvents(QVector<KdEvent>* events)
+{
 
-    // Find the split axis, we split the aixs of maximum size
-    Vector3 s = aabb.getSize(); // Get the size
-    int axis;
-    if ((s.x >= s.y) && (s.x >= s.z)) // Split x
-        axis = 0;
-    else if ((s.y >= s.x) && (s.y >= s.z)) // Split y
-        axis = 1; // y axis
-    else // Split z
-        axis = 2;  // z axis
-    node->setAxis(axis);
-
-    // make a list of the split position candidates
-    ObjectNode* objNodes = node->getObjectList();
-    float posStart       = aabb.getPos().xyz[axis];
-    float posEnd         = aabb.getPos().xyz[axis] + aabb.getSize().xyz[axis];
-    float* eleft         = new float[objCount];
-    float* eright        = new float[objCount];
-    SceneObject** parray = new SceneObject*[objCount];
-
-    int id = 0;
-    while (objNodes)
+    int chunkCount = m_pool->getThreadCount();
+    for (int axis = 0; axis < 3; axis++)
     {
-        SceneObject* p = parray[id] = objNodes->getObject();
-        calculateAABBRange(p->m_boundingBox, eleft[id], eright[id], axis);
-
-        // Insert all of the split positions
-        if (eleft[id] >= posStart && eleft[id] <= posEnd)
-            insertSplitPos(eleft[id]);
-        if (eright[id] >= posStart && eright[id] <= posEnd)
-            insertSplitPos(eright[id]);
-        id++;
-        // Get next one
-        objNodes = objNodes->getNext();
+        KdEvent* data = events[axis].data();
+        int size      = events[axis].size();
+        for (int c = 0; c < chunkCount; c++)
+            m_pool->add(new KdSortJob(
+                            data + chunkBegin(size, c, chunkCount),
+                            data + chunkBegin(size, c + 1, chunkCount)));
     }
-    // Calculate left count and right count for each split choice
-    AABB leftAABB, rightAABB;
-    AABB leftAABBTmp = aabb, rightAABBTmp = aabb;
-    SplitNode* splist = m_splitList;
-
-    float leftAABBStartTmp = aabb.getPos().xyz[axis];
-    float rightAABBEndTmp  = aabb.getPos().xyz[axis] + aabb.getSize().xyz[axis];
+    m_pool->wait();
 
-    while (splist)
+    // Merge neighbouring chunks until every axis is a single run
+    for (int width = 1; width < chunkCount; width *= 2)
     {
-        rightAABBTmp.getPos().xyz[axis]  = splist->splitPos;
-        rightAABBTmp.getSize().xyz[axis] = posEnd - splist->splitPos;
-        leftAABBTmp.getSize().xyz[axis]  = splist->splitPos - posStart;
-
-        float leftAABBEndTmp    =
-                leftAABBTmp.getPos().xyz[axis] +
-                leftAABBTmp.getSize().xyz[axis];
-        float rightAABBStartTmp = rightAABBTmp.getPos().xyz[axis];
-
-        for (int i = 0; i < objCount; i++)
+        for (int axis = 0; axis < 3; axis++)
         {
-            SceneObject* p = parray[i];
-            // SUB
-            if ((eleft[i] <= leftAABBEndTmp) && (eright[i] >= leftAABBStartTmp))
+            KdEvent* data = events[axis].data();
+            int size      = events[axis].size();
+            for (int c = 0; c + width < chunkCount; c += 2 * width)
             {
-                if (p->m_boundingBox.intersectAABB( leftAABBTmp ))
-                    splist->leftCount++;
-            }
-            // SUB
-            if ((eleft[i] <= rightAABBEndTmp) &&
-                (eright[i] >= rightAABBStartTmp))
-            {
-                if (p->m_boundingBox.intersectAABB(rightAABBTmp))
-                    splist->rightCount++;
+                int end = qMin(c + 2 * width, chunkCount);
+                m_pool->add(new KdMergeJob(
+                                data + chunkBegin(size, c, chunkCount),
+                                data + chunkBegin(size, c + width, chunkCount),
+                                data + chunkBegin(size, end, chunkCount)));
             }
         }
-        splist = splist->next;
+        m_pool->wait();
     }
-    // Calculate surface area for current node
-    float SAV = 1.f / calculateSA(aabb);
-    // Calculate cost for not splitting
-    float costNoSplit = objCount;
-    // Determine optimal split plane position
-    splist = m_splitList;
-    float min = POS_INF;
-    float bestpos = 0;
-
-    leftAABBTmp = rightAABBTmp = aabb;
-    while (splist)
-    {
-        // Calculate child node extends
-        rightAABBTmp.getPos().xyz[axis]  = splist->splitPos;
-        rightAABBTmp.getSize().xyz[axis] = posEnd - splist->splitPos;
-        leftAABBTmp.getSize().xyz[axis]  = splist->splitPos - posStart;
-        // Calculate child node cost
-        float SA1 = calculateSA(leftAABBTmp);
-        float SA2 = calculateSA(rightAABBTmp);
-        float splitcost =
-                0.3f + 1.0f * (SA1 * SAV * splist->leftCount +
-                               SA2 * SAV * splist->rightCount);
-        // Update best cost tracking variables
-        if (splitcost < min)
-        {
-            min = splitcost;
-            bestpos = splist->splitPos;
+}
 
-            // Record the best left AABB and right AABB
-            leftAABB = leftAABBTmp;
-            rightAABB =  rightAABBTmp;
-        }
-        splist = splist->next;
-    }
+KdBuildTask* KdTree::newTask(QVector<KdEvent>* events, AABB aabb,
+                             int depth, int objCount)
+{
 
-    if (min > costNoSplit)
-    {
-        node->setLeaf(true);
-        return;
-    }
+    KdBuildTask* task = new KdBuildTask;
+    for (int k = 0; k < 3; k++)
+        task->m_events[k].swap(events[k]);
+    task->m_box       = aabb;
+    task->m_depth     = depth;
+    task->m_objCount  = objCount;
+    task->m_leafCount = 0;
 
-    node->setSplitPos(bestpos);
-    // Construct child nodes
-    KdTreeNode* left  = newKdTreeNodePair();
-    KdTreeNode* right = left + 1;
+    m_taskLock.lock();
+    m_tasks.append(task);
+    m_taskLock.unlock();
 
-    int leftCount, rightCount, totalCount;
-    leftCount = rightCount = totalCount = 0;
-    // Assign primitives to both sides
-    float leftAABBStart  = leftAABB.getPos().xyz[axis];
+    return task;
+}
 
-    float leftAABBEnd    =
-            leftAABB.getPos().xyz[axis] +
-            leftAABB.getSize().xyz[axis];
+void KdTree::buildNode(KdBuildTask* task, QVector<KdEvent>* events,
+                       AABB aabb, int depth, int objCount,
+                       unsigned char* side)
+{
 
-    float rightAABBStart = rightAABB.getPos().xyz[axis];
+    QVector<KdFlatNode>& nodes = task->m_nodes;
+    int index = nodes.size();
+    nodes.resize(index + 1);
 
-    float rightAABBEnd   =
-            rightAABB.getPos().xyz[axis] +
-            rightAABB.getSize().xyz[axis];
+    int axis        = 0;
+    float split     = 0;
+    bool planarLeft = false;
+    float cost      = POS_INF;
+    if (objCount > KD_MIN_OBJECTS && depth < MAX_TREE_DEPTH)
+        cost = findSplit(events, aabb, objCount, axis, split, planarLeft);
 
-    for (int i = 0; i < objCount; i++)
+    if (cost >= KD_INTERSECT_COST * objCount)
     {
-        SceneObject* p = parray[i];
-        totalCount++;
-        if ((eleft[i] <= leftAABBEnd) && (eright[i] >= leftAABBStart))
+        // Not splitting is cheaper. Every object has exactly one start or
+        // planar event on an axis
+        QVector<int>& prims = task->m_prims;
+        int offset = prims.size();
+        const QVector<KdEvent>& objEvents = events[0];
+        for (int i = 0; i < objEvents.size(); i++)
         {
-            if (p->m_boundingBox.intersectAABB(leftAABB))
-            {
-                left->add(p, this);
-                leftCount++;
-            }
+            if (objEvents[i].m_type != KD_EVENT_END)
+                prims.push_back(objEvents[i].m_object);
         }
-        if ((eleft[i] <=  rightAABBEnd) && (eright[i] >= rightAABBStart))
+        nodes[index].initLeaf(offset, prims.size() - offset);
+        task->m_leafCount++;
+        return;
+    }
+
+    // Classify the objects, the ones left alone straddle the plane
+    const QVector<KdEvent>& splitEvents = events[axis];
+    for (int i = 0; i < splitEvents.size(); i++)
+    {
+        const KdEvent& event = splitEvents[i];
+        if (event.m_type == KD_EVENT_END && event.m_pos <= split)
+            side[event.m_object] = KD_SIDE_LEFT;
+        else if (event.m_type == KD_EVENT_START && event.m_pos >= split)
+            side[event.m_object] = KD_SIDE_RIGHT;
+        else if (event.m_type == KD_EVENT_PLANAR)
         {
-            if (p->m_boundingBox.intersectAABB(rightAABB))
-            {
-                right->add(p, this);
-                rightCount++;
-            }
+            if (event.m_pos < split || (event.m_pos == split && planarLeft))
+                side[event.m_object] = KD_SIDE_LEFT;
+            else
+                side[event.m_object] = KD_SIDE_RIGHT;
         }
     }
 
-    // Release
-    if (eleft)
-        delete []eleft;
-    if (eright)
-        delete []eright;
-    if (parray)
-        delete []parray;
-
-    left->setAABB(leftAABB);
-    right->setAABB(rightAABB);
-    node->setLeft(left);
-    node->setRight(right);
-    node->setLeaf(false);
-
-    if (depth < MAX_TREE_DEPTH)
+    // Split the events, they stay sorted. The parent's events are released
+    // before going down
+    QVector<KdEvent> leftEvents[3];
+    QVector<KdEvent> rightEvents[3];
+    for (int k = 0; k < 3; k++)
     {
-        if (leftCount > 2)
-            subdivide(left, leftAABB, depth + 1, leftCount);
-        if (rightCount > 2)
-            subdivide(right, rightAABB, depth + 1, rightCount);
+        for (int i = 0; i < events[k].size(); i++)
+        {
+            const KdEvent& event = events[k][i];
+            int objSide = side[event.m_object];
+            if (objSide != KD_SIDE_RIGHT)
+                leftEvents[k].append(event);
+            if (objSide != KD_SIDE_LEFT)
+                rightEvents[k].append(event);
+        }
+        events[k].clear();
     }
-}
 
-ObjectNode* KdTree::newObjectNode()
-{
-
-    ObjectNode* retval;
-    retval   = m_objPtr;
-    m_objPtr = m_objPtr->getNext();
-    retval->setNext(NULL);
-    retval->setObject(NULL);
-    return retval;
-}
+    // Count the objects and reset their sides for the children
+    int leftCount  = 0;
+    int rightCount = 0;
+    for (int i = 0; i < leftEvents[0].size(); i++)
+    {
+        if (leftEvents[0][i].m_type == KD_EVENT_END)
+            continue;
+        side[leftEvents[0][i].m_object] = KD_SIDE_BOTH;
+        leftCount++;
+    }
+    for (int i = 0; i < rightEvents[0].size(); i++)
+    {
+        if (rightEvents[0][i].m_type == KD_EVENT_END)
+            continue;
+        side[rightEvents[0][i].m_object] = KD_SIDE_BOTH;
+        rightCount++;
+    }
 
-KdTreeNode* KdTree::newKdTreeNodePair()
-{
+    AABB leftAABB, rightAABB;
+    splitAABB(aabb, axis, split, leftAABB, rightAABB);
 
-    *m_kdPtr         = KdTreeNode();
-    *(m_kdPtr + 1)   = KdTreeNode();
-    KdTreeNode* node = m_kdPtr;
-    m_kdPtr += 2;
-    return node;
-}
+    // A big right child goes to another worker, its root is linked in when
+    // the tasks are stitched
+    if (m_pool->getThreadCount() > 1 && rightCount >= KD_FORK_OBJECTS)
+    {
+        KdBuildTask* child = newTask(rightEvents, rightAABB,
+                                     depth + 1, rightCount);
+        task->m_forks.append(qMakePair(index, child));
+        m_pool->add(new KdSubtreeJob(this, child));
 
-KdTreeNode* KdTree::newKdTreeNode()
-{
+        buildNode(task, leftEvents, leftAABB, depth + 1, leftCount, side);
+        nodes[index].initInterior(axis, split, 0);
+        return;
+    }
 
-    *m_kdPtr         = KdTreeNode();
-    KdTreeNode* node = m_kdPtr;
-    m_kdPtr += 1;
-    return node;
+    // The left child follows its parent, the right one comes after the
+    // whole left subtree
+    buildNode(task, leftEvents, leftAABB, depth + 1, leftCount, side);
+    nodes[index].initInterior(axis, split, nodes.size());
+    buildNode(task, rightEvents, rightAABB, depth + 1, rightCount, side);
 }
 
-void KdTree::allocateMem()
+void KdTree::stitch(KdBuildTask* task, QVector<KdFlatNode>& nodes,
+                    QVector<int>& prims)
 {
-    // m_kdMem is used to hold all of the child nodes
-    m_kdMem  = new KdTreeNode[KDTREE_ARRAY_SIZE];
-    m_objMem = new ObjectNode[KDTREE_ARRAY_SIZE];
-
-    m_kdPtr  = m_kdMem;
-    m_objPtr = m_objMem;
 
-    ObjectNode* ptr = m_objPtr;
+    int nodeBase = nodes.size();
+    int primBase = prims.size();
 
-    for (int i = 0; i < KDTREE_ARRAY_SIZE; i++)
+    // Move the local indices behind what is already there
+    nodes += task->m_nodes;
+    for (int i = nodeBase; i < nodes.size(); i++)
     {
-        ptr->setNext(ptr + 1);
-        ptr++;
+        KdFlatNode& node = nodes[i];
+        if (node.isLeaf())
+            node.initLeaf(node.m_primOffset + primBase, node.getPrimCount());
+        else
+            node.initInterior(node.getAxis(), node.m_split,
+                              node.getRight() + nodeBase);
     }
-    ptr->setNext(NULL);
+    prims += task->m_prims;
+    m_leafCount += task->m_leafCount;
+
+    task->m_nodes.clear();
+    task->m_prims.clear();
 
-    m_allocated = true;
+    // The forked subtrees follow in the order they were forked
+    for (int i = 0; i < task->m_forks.size(); i++)
+    {
+        KdFlatNode& node = nodes[nodeBase + task->m_forks[i].first];
+        node.initInterior(node.getAxis(), node.m_split, nodes.size());
+        stitch(task->m_forks[i].second, nodes, prims);
+    }
 }
 
-void KdTree::freeObjectNode(ObjectNode* node)
+float KdTree::findSplit(const QVector<KdEvent>* events, AABB aabb,
+                        int objCount, int& axis, float& split,
+                        bool& planarLeft)
 {
 
-    ObjectNode* nodeToFree = node;
+    float area = calculateSA(aabb);
+    if (area <= 0)
+        return POS_INF;
+
+    float invArea = 1.f / area;
+    float best    = POS_INF;
+
+    for (int k = 0; k < 3; k++)
+    {
+        float start = aabb.getPos().xyz[k];
+        float end   = start + aabb.getSize().xyz[k];
+
+        // The area of a child is its two caps plus its side faces, which
+        // grow linearly with the position of the plane
+        float a         = aabb.getSize().xyz[(k + 1) % 3];
+        float b         = aabb.getSize().xyz[(k + 2) % 3];
+        float capArea   = 2 * a * b;
+        float perimeter = 2 * (a + b);
+
+        const QVector<KdEvent>& axisEvents = events[k];
+        int eventCount = axisEvents.size();
+        int leftCount  = 0;
+        int rightCount = objCount;
+
+        int i = 0;
+        while (i < eventCount)
+        {
+            // Gather all of the events in this plane
+            float pos    = axisEvents[i].m_pos;
+            int ending   = 0;
+            int planar   = 0;
+            int starting = 0;
+            while (i < eventCount && axisEvents[i].m_pos == pos &&
+                   axisEvents[i].m_type == KD_EVENT_END)
+            {
+                ending++;
+                i++;
+            }
+            while (i < eventCount && axisEvents[i].m_pos == pos &&
+                   axisEvents[i].m_type == KD_EVENT_PLANAR)
+            {
+                planar++;
+                i++;
+            }
+            while (i < eventCount && axisEvents[i].m_pos == pos &&
+                   axisEvents[i].m_type == KD_EVENT_START)
+            {
+                starting++;
+                i++;
+            }
 
-    while (nodeToFree->getNext())
-        nodeToFree= nodeToFree->getNext();
+            // Objects ending or lying in the plane are not on the right
+            rightCount -= ending + planar;
 
-    nodeToFree->setNext(m_objPtr);
-    m_objPtr = node;
+            // Planes outside of the node split nothing
+            if (pos > start && pos < end)
+            {
+                float leftProb  = (capArea + perimeter * (pos - start)) *
+                        invArea;
+                float rightProb = (capArea + perimeter * (end - pos)) *
+                        invArea;
+
+                // Try the flat objects on both sides
+                float cost = calculateCost(leftProb, rightProb,
+                                           leftCount + planar, rightCount);
+                if (cost < best)
+                {
+                    best       = cost;
+                    axis       = k;
+                    split      = pos;
+                    planarLeft = true;
+                }
+                cost = calculateCost(leftProb, rightProb,
+                                     leftCount, rightCount + planar);
+                if (cost < best)
+                {
+                    best       = cost;
+                    axis       = k;
+                    split      = pos;
+                    planarLeft = false;
+                }
+            }
+
+            leftCount += starting + planar;
+        }
+    }
+
+    return best;
 }
 
-void KdTree::freeMem()
+void KdTree::splitAABB(AABB box, int axis, float split,
+                       AABB& left, AABB& right)
 {
 
-    if (m_kdMem)
-        delete []m_kdMem;
-    if (m_objMem)
-        delete []m_objMem;
+    float start = box.getPos().xyz[axis];
+    float end   = start + box.getSize().xyz[axis];
+
+    left  = box;
+    right = box;
+    left.getSize().xyz[axis]  = split - start;
+    right.getPos().xyz[axis]  = split;
+    right.getSize().xyz[axis] = end - split;
 }
 
-void KdTree::calculateAABBRange(AABB aabb, float& left,
-                                float& right, const int axis)
+void KdTree::freeMem()
 {
 
-    // Invalid axis
-    if (axis > 2 || axis < 0)
-        assert(0);
-
-    left  = aabb.getPos().xyz[axis];
-    right = aabb.getPos().xyz[axis] + aabb.getSize().xyz[axis];
+    if (m_flatNodes)
+        qFreeAligned(m_flatNodes);
+    if (m_flatPrims)
+        qFreeAligned(m_flatPrims);
+    m_flatNodes = NULL;
+    m_flatPrims = NULL;
 }
 
-void dumpKdTreeInfo(KdTree* tree)
+void dumpKdTreeInfo(KdTree* tree, const QVector<SceneObject>& objects)
 {
 
     /* Hard coded path */
@@ -417,8 +560,7 @@ void dumpKdTreeInfo(KdTree* tree)
         return;
     }
 
-    KdTreeNode* root = tree->getRoot();
-    AABB extends = root->getAABB();
+    AABB extends = tree->getExtends();
 
     // Dump tree's info
     out<< "Extends: " << endl << extends.getPos().x << " " << extends.getPos().y
@@ -428,14 +570,14 @@ void dumpKdTreeInfo(KdTree* tree)
        << (extends.getPos() + extends.getSize()).y << " "
        << (extends.getPos() + extends.getSize()).z << endl;
     // Do recursion
-    dumpKdTreeInfoLeaf(root, out, 0);
+    dumpKdTreeInfoLeaf(tree, objects, 0, out, 0);
 }
 
-void dumpKdTreeInfoLeaf(KdTreeNode* node, std::ofstream& ofile, int depth)
+void dumpKdTreeInfoLeaf(KdTree* tree, const QVector<SceneObject>& objects,
+                        int index, std::ofstream& ofile, int depth)
 {
 
-    if (!node)
-        return;
+    const KdFlatNode& node = tree->getFlatNodes()[index];
 
     for (int i = 0; i < depth; i++)
     {
@@ -443,31 +585,22 @@ void dumpKdTreeInfoLeaf(KdTreeNode* node, std::ofstream& ofile, int depth)
     }
     // Output current level's info
     ofile<< "Node:   " << " depth " << depth
-         << " Leaf " << (node->isLeaf() ? "true " : "false ")
-         << " axis " << node->getAxis()
-         << " splitpos " << node->getSplitPos()
+         << " Leaf " << (node.isLeaf() ? "true " : "false ")
+         << " axis " << node.getAxis()
+         << " splitpos " << (node.isLeaf() ? 0 : node.m_split)
          << endl << endl;
 
-    if (node->isLeaf())
+    if (node.isLeaf())
     {
         // If it is a leaf, dump the objects
-        ObjectNode* obj = node->getObjectList();
+        const int* prims = tree->getFlatPrimitives() + node.m_primOffset;
         ofile << " obj list: ";
-        while (obj)
-        {
-            ofile << "(" << obj->getObject()->m_primitive.type << ") ";
-            obj = obj->getNext();
-        }
+        for (unsigned i = 0; i < node.getPrimCount(); i++)
+            ofile << "(" << objects[prims[i]].m_primitive.type << ") ";
         return;
     }
 
     // Recursive dump
-    if (node->getLeft())
-    {
-        dumpKdTreeInfoLeaf(node->getLeft(), ofile, depth + 1);
-    }
-    if (node->getRight())
-    {
-        dumpKdTreeInfoLeaf(node->getRight(), ofile, depth + 1);
-    }
+    dumpKdTreeInfoLeaf(tree, objects, index + 1, ofile, depth + 1);
+    dumpKdTreeInfoLeaf(tree, objects, node.getRight(), ofile, depth + 1);
 }
@@ -9,14 +9,54 @@
 #define KDTREE_H
 
 #include "kdtreecommon.h"
-#include "kdtreenode.h"
+#include "kdbuild_pool.h"
+#include <QPair>
 
 #define MAX_TREE_DEPTH 32 // Maximum depth of the tree
-#define KDTREE_ARRAY_SIZE 100000 // We use an array to store the kd tree
+#define KD_STACK_SIZE (MAX_TREE_DEPTH + 2) // Traversal stack, one postponed
+                                           // node per level at most
+#define KDTREE_ALIGNMENT 64 // Alignment of the compiled node array in bytes
+
+#define KD_TRAVERSAL_COST 0.3f // SAH cost of traversing an interior node
+#define KD_INTERSECT_COST 1.0f // SAH cost of intersecting an object
+#define KD_EMPTY_BONUS 0.8f // Scales the cost of splits cutting off empty
+                            // space
+#define KD_MIN_OBJECTS 2 // Nodes with no more objects are always leaves
+#define KD_FORK_OBJECTS 1024 // Right children with at least this many
+                             // objects are built by another job
+
+#define KD_SIDE_BOTH 0 // The object straddles the split plane
+#define KD_SIDE_LEFT 1 // The object is on the left of the split plane
+#define KD_SIDE_RIGHT 2 // The object is on the right of the split plane
+
+/**
+ * @struct: KdBuildTask
+ * @brief The KdBuildTask struct is a subtree built by one job. Its nodes and
+ *        primitives are indexed locally and stitched into the tree once all
+ *        of the jobs are done
+ */
+struct KdBuildTask
+{
+    QVector<KdEvent> m_events[3]; // Sorted events of the subtree's objects
+    AABB m_box; // Bounding box of the subtree
+    int m_depth; // Depth of the subtree's root
+    int m_objCount; // Object numbers
+
+    QVector<KdFlatNode> m_nodes; // Nodes of the subtree
+    QVector<int> m_prims; // Object indices of the leaves
+    QVector<QPair<int, KdBuildTask*> > m_forks; // Interior nodes whose right
+                                               // child is another task
+    int m_leafCount; // Number of leaves
+};
 
 /**
  * @class: KdTree
- * @brief The KdTree class is the wrapper class of all kdtree operations
+ * @brief The KdTree class is the wrapper class of all kdtree operations. The
+ *        tree is built with the O(N log N) SAH builder: the bounds of the
+ *        objects are sorted once per axis and every node sweeps its events
+ *        to find the cheapest plane on all three axes, then splits the
+ *        sorted events between its children without sorting again. The
+ *        sort and the big subtrees run as jobs of a KdBuildPool
  */
 class KdTree
 {
@@ -25,10 +65,6 @@ public:
     KdTree();
     ~KdTree();
 
-    /**
-     * @brief init: initialize memory
-     */
-    void init();
     /**
      * @brief build: build a kdtree from the scene
      * @param scene: the pointe to the scene
@@ -36,78 +72,105 @@ public:
     void build(Scene* scene);
 
     /**
-     * @brief insertSplitPos: insert a split plane at split pos
-     * @param splitPos: the split position (1D)
+     * @brief build: build a kdtree over a list of objects
+     * @param objects: the objects, their m_arrayID have to be 0 to
+     *                 count - 1
+     * @param extends: the bounding box of the objects
      */
-    void insertSplitPos(float splitPos);
+    void build(const QVector<SceneObject*>& objects, AABB extends);
 
     /**
-     * @brief subdivide: subdivide the kdtree node based on bounding box,
-     *                   depth, object numbers
-     * @param node: the pointer to the node
-     * @param aabb: the bounding box
-     * @param depth: the current depth
-     * @param objCount: the object numbers
+     * @brief buildTask: called by the build jobs, build a subtree
+     * @param task: the subtree
+     * @param workerId: index of the worker running the job
      */
-    void subdivide(KdTreeNode* node, AABB aabb, int depth, int objCount);
+    void buildTask(KdBuildTask* task, int workerId);
 
     /**
-     * @brief newObjectNode: new an object node
-     * @return: the pointe to the new object node
+     * @brief splitAABB: cut a bounding box in two at a split plane
+     * @param box: the bounding box
+     * @param axis: the split axis
+     * @param split: the split position
+     * @param left: the box below the plane, should be returned
+     * @param right: the box above the plane, should be returned
      */
-    ObjectNode* newObjectNode();
+    static void splitAABB(AABB box, int axis, float split,
+                          AABB& left, AABB& right);
 
     /**
-     * @brief newKdTreeNodePair: new a pair of kdTreeNode
-     * @return: the pointer to the pair
+     * Getters
      */
-    KdTreeNode* newKdTreeNodePair();
+    const KdFlatNode* getFlatNodes() const { return m_flatNodes; }
+    int getFlatNodeCount() const { return m_flatNodeCount; }
+    const int* getFlatPrimitives() const { return m_flatPrims; }
+    int getFlatPrimitiveCount() const { return m_flatPrimCount; }
+    AABB getExtends() { return m_extends; }
+    int getLeafCount() const { return m_leafCount; }
+    double getBuildTime() const { return m_buildTime; }
+
+private:
 
     /**
-     * @brief newKdTreeNode
-     * @return
+     * @brief sortEvents: sort the events of each axis, chunks are sorted in
+     *                    parallel and then merged pairwise
+     * @param events: the events on each axis
      */
-    KdTreeNode* newKdTreeNode();
+    void sortEvents(QVector<KdEvent>* events);
 
     /**
-     * setters
+     * @brief newTask: make a subtree task, the events are moved into it
+     * @param events: the sorted events on each axis
+     * @param aabb: the bounding box of the subtree
+     * @param depth: the depth of the subtree's root
+     * @param objCount: the object numbers
+     * @return: the task
      */
-    void setRoot(KdTreeNode* root) { m_root = root; }
+    KdBuildTask* newTask(QVector<KdEvent>* events, AABB aabb,
+                         int depth, int objCount);
+
     /**
-     * Getters
+     * @brief buildNode: append a node and its subtree to the task
+     * @param task: the task building the node
+     * @param events: the sorted events of the node's objects on each axis,
+     *                released before the children are built
+     * @param aabb: the bounding box of the node
+     * @param depth: the current depth
+     * @param objCount: the object numbers
+     * @param side: the worker's side array, all KD_SIDE_BOTH in between
      */
-    KdTreeNode* getRoot() { return m_root; }
-    KdTreeNode* getKdTreeNodeArray() { return m_kdMem; }
-    ObjectNode* getObjectNodeArray() { return m_objMem; }
-
-private:
+    void buildNode(KdBuildTask* task, QVector<KdEvent>* events, AABB aabb,
+                   int depth, int objCount, unsigned char* side);
 
     /**
-     * @brief allocateMem: allocate fixed amount of memory
+     * @brief stitch: append a task and the tasks it forked to the tree,
+     *                depth first so the layout doesn't depend on timing
+     * @param task: the task
+     * @param nodes: the node array of the tree
+     * @param prims: the primitive index array of the tree
      */
-    void allocateMem();
+    void stitch(KdBuildTask* task, QVector<KdFlatNode>& nodes,
+                QVector<int>& prims);
 
     /**
-     * @brief freeObjectNode: free the memory for an object node
-     * @param node: the pointer to the object node
+     * @brief findSplit: sweep the events of all three axes for the split
+     *                   plane of minimal SAH cost
+     * @param events: the sorted events on each axis
+     * @param aabb: the bounding box of the node
+     * @param objCount: the object numbers
+     * @param axis: the best axis, should be returned
+     * @param split: the best split position, should be returned
+     * @param planarLeft: whether flat objects in the plane go left, should
+     *                    be returned
+     * @return: the SAH cost of the best split, POS_INF if there is none
      */
-    void freeObjectNode(ObjectNode* node);
+    float findSplit(const QVector<KdEvent>* events, AABB aabb, int objCount,
+                    int& axis, float& split, bool& planarLeft);
 
     /**
      * @brief freeMem: free all
      */
     void freeMem();
 
-    /**
-     * @brief calculateAABBRange: calculate AABB's range
-     * @param aabb: the parent bounding box
-     * @param left: the left boundary
-     * @param right: the right bounday
-     * @param axis: current axis
-     */
-    void calculateAABBRange(AABB aabb, float& left,
-                             float& right, const int axis);
-
     /**
      * @brief calculateSA: calculate the surface area
      * @param aabb: the bounding box
@@ -118,34 +181,38 @@ private:
                                                        aabb.d() * aabb.h()); }
 private:
 
-    bool m_allocated; // Allocated?
-
-    KdTreeNode* m_root; // Pointer to the root node
-    SplitNode* m_splitList; // Pointer to the split list
-    SplitNode*m_splitPool; // Pointer to the empty split node
-
-    KdTreeNode* m_kdPtr; // Just a pointer to the current end of memory for
-                         // kdtree
-    ObjectNode* m_objPtr; // Just a pointer to the current end of memory for obj
-
-    KdTreeNode* m_kdMem; // Pointer to the memory of all the nodes in byte
-    ObjectNode* m_objMem; // Pointer to the memory of
-                          // all the object nodes in byte
+    KdBuildPool* m_pool; // The job pool, kept for the next build
+    QVector<KdBuildTask*> m_tasks; // All of the subtree tasks
+    QMutex m_taskLock; // Lock for the task list
+    QVector<QVector<unsigned char> > m_sides; // Side of each object to the
+                                              // split plane, per worker
+
+    AABB m_extends; // Bounding box of the root
+    KdFlatNode* m_flatNodes; // Compiled nodes, aligned to KDTREE_ALIGNMENT
+    int m_flatNodeCount; // Number of compiled nodes
+    int* m_flatPrims; // Object indices referenced by the compiled leaves
+    int m_flatPrimCount; // Number of object indices
+    int m_leafCount; // Number of leaves
+    double m_buildTime; // Time to build the tree in ms
 };
 
 /**
  * @brief dumpKdTreeInfo: helper function for debugging. Dump the information
  *                        of kdtree
  * @param tree: the pointer to the tree
+ * @param objects: the objects of the scene
  */
-void dumpKdTreeInfo(KdTree* tree);
+void dumpKdTreeInfo(KdTree* tree, const QVector<SceneObject>& objects);
 
 /**
  * @brief dumpKdTreeInfoLeaf: dump the leaf information
- * @param node: the kdtree node
+ * @param tree: the pointer to the tree
+ * @param objects: the objects of the scene
+ * @param index: the index of the node
  * @param ofile: output stream
  * @param depth: the specified depth
  */
-void dumpKdTreeInfoLeaf(KdTreeNode* node, std::ofstream& ofile, int depth);
+void dumpKdTreeInfoLeaf(KdTree* tree, const QVector<SceneObject>& objects,
+                        int index, std::ofstream& ofile, int depth);
 
 #endif
@@ -10,48 +10,73 @@
 
 #include "scene.h"
 
-/**
- * @struct: SplitNode
- * @brief The SplitNode struct is used for splitting kdtree node when building
- *        kdtree
- */
-struct SplitNode
-{
-    float splitPos; // Split position
-    int leftCount; // Objects count in the left side
-    int rightCount; // Objects count in the right side
-    SplitNode* next; // Next splitPos
-};
+#define KD_LEAF 3 // Axis value of a leaf in KdFlatNode
+
+#define KD_EVENT_END 0 // An object ends at the event
+#define KD_EVENT_PLANAR 1 // An object is flat and lies in the event plane
+#define KD_EVENT_START 2 // An object starts at the event
 
-class SceneObject;
 /**
- * @class: ObjectNode
- * @brief The ObjectNode class is used for holding scene objects
- *        It's only useful when creating kdtree
+ * @struct: KdEvent
+ * @brief The KdEvent struct is the bound of an object on one axis. The
+ *        builder sorts the events of every axis once and sweeps them to
+ *        count the objects on both sides of each candidate plane
  */
-class ObjectNode
+struct KdEvent
 {
-public:
-
-    ObjectNode() : m_object(NULL), m_next(NULL) {}
-    ~ObjectNode() {}
+    float m_pos; // Position on the axis
+    int m_object; // Index of the object in the scene
+    int m_type; // KD_EVENT_END, KD_EVENT_PLANAR or KD_EVENT_START
 
     /**
-     * Setters
+     * @brief operator <: order by position, ends before planar objects
+     *                    before starts at the same position. The object
+     *                    breaks ties so that the order doesn't depend on
+     *                    how the events were sorted
      */
-    void setObject(SceneObject* obj) { m_object = obj; }
-    void setNext(ObjectNode* next) { m_next = next; }
+    bool operator<(const KdEvent& e) const
+    {
+        if (m_pos != e.m_pos)
+            return m_pos < e.m_pos;
+        if (m_type != e.m_type)
+            return m_type < e.m_type;
+        return m_object < e.m_object;
+    }
+};
 
-    /**
-     * Getters
-     */
-    SceneObject* getObject() { return m_object; }
-    ObjectNode* getNext() { return m_next; }
+/**
+ * @struct: KdFlatNode
+ * @brief The KdFlatNode struct is the compiled 8 byte kdtree node used for
+ *        traversal. Nodes are stored depth first, so the left child of an
+ *        interior node is always the next node. The low 2 bits of m_flags
+ *        hold the split axis (KD_LEAF for leaves) and the upper 30 bits hold
+ *        the index of the right child, or the primitive count of a leaf.
+ *        The OpenCL kernel reads the same layout as KdTreeNodeDevice
+ */
+struct KdFlatNode
+{
+    union
+    {
+        float m_split; // Split position of an interior node
+        unsigned m_primOffset; // Offset of a leaf in the primitive array
+    };
+    unsigned m_flags; // Axis or KD_LEAF, right child or primitive count
 
-private:
+    void initInterior(int axis, float split, unsigned right)
+    {
+        m_split = split;
+        m_flags = (right << 2) | axis;
+    }
+    void initLeaf(unsigned primOffset, unsigned primCount)
+    {
+        m_primOffset = primOffset;
+        m_flags      = (primCount << 2) | KD_LEAF;
+    }
 
-    SceneObject* m_object; // The scene objects in this node
-    ObjectNode* m_next; // the pointer to the next object node
+    bool isLeaf() const { return (m_flags & 3) == KD_LEAF; }
+    int getAxis() const { return m_flags & 3; }
+    unsigned getRight() const { return m_flags >> 2; }
+    unsigned getPrimCount() const { return m_flags >> 2; }
 };
 
 #endif // KDTREECOMMON_H
@@ -0,0 +1,173 @@
+/*!
+    @file mesh.cpp
+    @desc: definitions of Mesh class
+    @author: yanli
+    @date: May 2013
+ */
+
+#include "mesh.h"
+#include "glm.h"
+#include <QFile>
+#include <QPair>
+#include <float.h>
+
+typedef QPair<GLuint, QPair<GLuint, GLuint> > MeshVertexKey; // Position,
+                                                             // normal and
+                                                             // texcoord
+
+Mesh::Mesh()
+{
+}
+
+Mesh::~Mesh()
+{
+}
+
+bool Mesh::load(const QString& path)
+{
+
+    if (!QFile::exists(path))
+    {
+        std::cerr << "The path: " << path.toStdString()
+                  << " does not exist" << std::endl;
+        return false;
+    }
+
+    // glm indices start at 1
+    GLMmodel* model = glmReadOBJ(path.toStdString().c_str());
+    assert(model);
+    if (!model->numnormals)
+    {
+        glmFacetNormals(model);
+        glmVertexNormals(model, MESH_SMOOTH_ANGLE);
+    }
+    bool hasTexCoords = model->numtexcoords > 0;
+
+    m_positions.clear();
+    m_normals.clear();
+    m_texCoords.clear();
+    m_triangles.resize(model->numtriangles * 3);
+
+    // Corners sharing position, normal and texcoord share a vertex
+    QHash<MeshVertexKey, int> vertices;
+    for (GLuint i = 0; i < model->numtriangles; i++)
+    {
+        const GLMtriangle& triangle = model->triangles[i];
+        for (int j = 0; j < 3; j++)
+        {
+            GLuint v = triangle.vindices[j];
+            GLuint n = triangle.nindices[j];
+            GLuint t = hasTexCoords ? triangle.tindices[j] : 0;
+            MeshVertexKey key(v, qMakePair(n, t));
+
+            QHash<MeshVertexKey, int>::iterator iter = vertices.find(key);
+            if (iter != vertices.end())
+            {
+                m_triangles[i * 3 + j] = *iter;
+                continue;
+            }
+
+            int index = m_positions.size() / 3;
+            Vector3 normal(model->normals[n * 3],
+                           model->normals[n * 3 + 1],
+                           model->normals[n * 3 + 2]);
+            if (normal.lengthSquared() > 0)
+                normal.normalize();
+            for (int k = 0; k < 3; k++)
+            {
+                m_positions.append(model->vertices[v * 3 + k]);
+                m_normals.append(normal.xyz[k]);
+            }
+            if (hasTexCoords)
+            {
+                m_texCoords.append(model->texcoords[t * 2]);
+                m_texCoords.append(model->texcoords[t * 2 + 1]);
+            }
+
+            vertices.insert(key, index);
+            m_triangles[i * 3 + j] = index;
+        }
+    }
+    glmDelete(model);
+
+    if (m_triangles.isEmpty())
+    {
+        std::cerr << "[Mesh::load] No triangle in " << path.toStdString()
+                  << std::endl;
+        return false;
+    }
+
+    buildBvh();
+    return true;
+}
+
+AABB Mesh::computeAABB(const Matrix4x4& transform) const
+{
+
+    Vector3 min = Vector3(POS_INF, POS_INF, POS_INF),
+            max = Vector3(-POS_INF, -POS_INF, -POS_INF);
+
+    for (int i = 0; i < getVertexCount(); i++)
+    {
+        const float* p = m_positions.constData() + i * 3;
+        Vector4 tmp = transform * Vector4(p[0], p[1], p[2], 1);
+        tmp = Vector4(tmp.x / tmp.w, tmp.y / tmp.w, tmp.z / tmp.w, 1);
+        for (int k = 0; k < 3; k++)
+        {
+            min.xyz[k] = qMin(min.xyz[k], tmp.data[k]);
+            max.xyz[k] = qMax(max.xyz[k], tmp.data[k]);
+        }
+    }
+
+    return AABB(min, max - min);
+}
+
+void Mesh::buildBvh()
+{
+
+    int triangleCount = getTriangleCount();
+
+    // Bound the mesh first, the padding is relative to its size
+    float lower[3] = {FLT_MAX, FLT_MAX, FLT_MAX};
+    float upper[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+    for (int i = 0; i < m_positions.size(); i++)
+    {
+        lower[i % 3] = qMin(lower[i % 3], m_positions[i]);
+        upper[i % 3] = qMax(upper[i % 3], m_positions[i]);
+    }
+    float pad = MESH_BOX_PAD * qMax(upper[0] - lower[0],
+                                    qMax(upper[1] - lower[1],
+                                         upper[2] - lower[2]));
+
+    QVector<float> boxes(triangleCount * 6);
+    for (int i = 0; i < triangleCount; i++)
+    {
+        float* box = boxes.data() + i * 6;
+        for (int k = 0; k < 3; k++)
+        {
+            box[k]     = FLT_MAX;
+            box[k + 3] = -FLT_MAX;
+        }
+        for (int j = 0; j < 3; j++)
+        {
+            const float* p = m_positions.constData() +
+                    m_triangles[i * 3 + j] * 3;
+            for (int k = 0; k < 3; k++)
+            {
+                box[k]     = qMin(box[k], p[k] - pad);
+                box[k + 3] = qMax(box[k + 3], p[k] + pad);
+            }
+        }
+    }
+    m_bvh.build(boxes.constData(), triangleCount);
+
+    // Put the triangles in leaf order, so the leaves index them directly
+    const int* order = m_bvh.getPrimitives();
+    QVector<int> triangles(m_triangles.size());
+    for (int i = 0; i < triangleCount; i++)
+    {
+        for (int j = 0; j < 3; j++)
+            triangles[i * 3 + j] = m_triangles[order[i] * 3 + j];
+    }
+    m_triangles = triangles;
+}
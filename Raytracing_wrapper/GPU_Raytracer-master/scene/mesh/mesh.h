@@ -0,0 +1,87 @@
+/*!
+    @file mesh.h
+    @desc: declarations of Mesh class
+    @author: yanli
+    @date: May 2013
+ */
+
+#ifndef MESH_H
+#define MESH_H
+
+#include "bvh.h"
+
+#define MESH_SMOOTH_ANGLE 90.f // Largest angle between faces in degrees
+                               // smoothed over by the generated normals
+#define MESH_BOX_PAD 1e-5f // Padding of the triangles' boxes, relative to
+                           // the size of the mesh
+
+/**
+ * @class: Mesh
+ * @brief The Mesh class is a triangle mesh read from an OBJ file. The
+ *        vertices are stored once per distinct position, normal and
+ *        texture coordinate, the triangles index them. A BVH over the
+ *        triangles in object space is the lower level of the acceleration
+ *        structure, the scene's kdtree or BVH holds the objects using the
+ *        mesh, so one mesh is shared by all of its instances. The triangles
+ *        are stored in the order of the BVH's leaves
+ */
+class Mesh
+{
+public:
+
+    Mesh();
+    ~Mesh();
+
+    /**
+     * @brief load: read an OBJ file and build the BVH over its triangles,
+     *              vertex normals are generated if the file has none
+     * @param path: path of the OBJ file
+     * @return: false if the file doesn't exist or holds no triangle
+     */
+    bool load(const QString& path);
+
+    /**
+     * @brief computeAABB: compute the bounding box of the transformed
+     *                     vertices
+     * @param transform: the transformation matrix
+     * @return: the result bounding box
+     */
+    AABB computeAABB(const Matrix4x4& transform) const;
+
+    /**
+     * Getters
+     */
+    int getVertexCount() const { return m_positions.size() / 3; }
+    const float* getPositions() const { return m_positions.constData(); }
+    const float* getNormals() const { return m_normals.constData(); }
+    const float* getTexCoords() const
+    {
+        return m_texCoords.size() ? m_texCoords.constData() : NULL;
+    }
+    int getTriangleCount() const { return m_triangles.size() / 3; }
+    const int* getTriangles() const { return m_triangles.constData(); }
+    const Bvh& getBvh() const { return m_bvh; }
+
+private:
+
+    // The BVH owns its nodes, a mesh is never copied
+    Mesh(const Mesh&);
+    Mesh& operator=(const Mesh&);
+
+    /**
+     * @brief buildBvh: build the BVH over the triangles and put them in the
+     *                  order of its leaves
+     */
+    void buildBvh();
+
+private:
+
+    QVector<float> m_positions; // Positions, 3 floats per vertex
+    QVector<float> m_normals; // Unit normals, 3 floats per vertex
+    QVector<float> m_texCoords; // Texture coordinates, 2 floats per vertex,
+                                // empty if the file has none
+    QVector<int> m_triangles; // Vertex indices, 3 per triangle
+    Bvh m_bvh; // BVH over the triangles in object space
+};
+
+#endif // MESH_H
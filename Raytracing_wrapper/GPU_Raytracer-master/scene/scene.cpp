@@ -6,12 +6,34 @@
  */
 
 #include "scene.h"
+#include "global.h"
+#ifndef NO_GL
 #include "camera.h"
 #include "view3d.h"
 #include "shape_draw.h"
+#endif
 #include "CS123ISceneParser.h"
 #include "resource_loader.h"
 #include "kdtree.h"
+#include "bvh.h"
+#include "intersect_view.h"
+#include "mesh.h"
+#include "scene_group.h"
+#include "mip_texture.h"
+#include <algorithm>
+
+/**
+ * @struct: FlatIDLess
+ * @brief The FlatIDLess struct orders an id before the objects whose first
+ *        id is greater, for searching the object holding an id
+ */
+struct FlatIDLess
+{
+    bool operator()(int flatID, const SceneObject& object) const
+    {
+        return flatID < object.m_flatID;
+    }
+};
 
 SceneObject::SceneObject()
 {
@@ -19,10 +41,17 @@ SceneObject::SceneObject()
     m_primitive.type                = PRIMITIVE_NONE;
     m_primitive.material.textureMap = NULL;
     m_primitive.material.bumpMap    = NULL;
+#ifndef NO_GL
     m_texture.m_textureHandle       = 0;
+#endif
     m_texture.m_texPointer          = NULL;
+    m_texture.m_mipmap              = NULL;
     m_texture.m_texWidth            = 0;
     m_texture.m_texHeight           = 0;
+    m_mesh                          = NULL;
+    m_group                         = NULL;
+    m_arrayID                       = 0;
+    m_flatID                        = 0;
 }
 
 SceneObject::~SceneObject()
@@ -31,11 +60,86 @@ SceneObject::~SceneObject()
     // will be freed by XML parser
 }
 
-Scene::Scene()
+void SceneObject::setTransform(const Matrix4x4& transform)
+{
+
+    m_transform    = transform;
+    m_invTransform = m_transform.getInverse();
+
+    Matrix4x4 compMat = m_transform;
+    compMat.data[3]   = 0;
+    compMat.data[7]   = 0;
+    compMat.data[11]  = 0;
+    m_invTTransformWithoutTrans = compMat.getInverse().getTranspose();
+
+    // Compute the bounding box
+    switch(m_primitive.type)
+    {
+    case PRIMITIVE_CUBE:
+        m_boundingBox = computeCubeAABB(m_transform);
+        break;
+    case PRIMITIVE_CONE:
+        m_boundingBox = computeConeAABB(m_transform);
+        break;
+    case PRIMITIVE_CYLINDER:
+        m_boundingBox = computeCylinderAABB(m_transform);
+        break;
+    case PRIMITIVE_SPHERE:
+        m_boundingBox = computeSphereAABB(m_transform);
+        break;
+    case PRIMITIVE_MESH:
+        m_boundingBox = m_mesh->computeAABB(m_transform);
+        break;
+    case PRIMITIVE_GROUP:
+        m_boundingBox = m_group->computeAABB(m_transform);
+        break;
+    case PRIMITIVE_TORUS:
+    default:
+        assert(0);
+        break;
+    }
+}
+
+const SceneObject& getFlatObject(const QVector<SceneObject>& objects,
+                                 int flatID,
+                                 const SceneObject** instance)
+{
+
+    if (instance)
+        *instance = NULL;
+
+    // Without groups the ids are the indices
+    if (flatID < objects.size() && objects[flatID].m_flatID == flatID &&
+        objects[flatID].m_primitive.type != PRIMITIVE_GROUP)
+        return objects[flatID];
+
+    // The objects are in the order of their ids, find the last one starting
+    // at or before the id
+    const SceneObject* begin  = objects.constData();
+    const SceneObject* object = std::upper_bound(begin,
+                                                 begin + objects.size(),
+                                                 flatID,
+                                                 FlatIDLess()) - 1;
+    assert(object >= begin);
+    if (object->m_primitive.type != PRIMITIVE_GROUP)
+        return *object;
+
+    if (instance)
+        *instance = object;
+    return object->m_group->getObjects()[flatID - object->m_flatID];
+}
+
+Scene::Scene(bool useGL)
 {
 
     m_mapEnd = 0;
     m_tree   = NULL;
+    m_bvh    = NULL;
+    m_useGL  = useGL;
+
+    m_intersectView = NULL;
+    m_parseGroup    = NULL;
+    m_flatCount     = 0;
 }
 
 Scene::Scene(Scene& s)
@@ -46,17 +150,38 @@ Scene::Scene(Scene& s)
     m_objects    = s.m_objects;
     m_mapEnd     = 0;
     m_tree       = NULL;
+    m_bvh        = NULL;
+    m_useGL      = s.m_useGL;
+
+    m_intersectView = NULL;
+    m_parseGroup    = NULL;
+    m_flatCount     = s.m_flatCount;
+    buildIntersectView();
 }
 
 Scene::~Scene()
 {
 
+    QHash<CS123SceneNode*, SceneGroup*>::iterator groupIter;
+#ifndef NO_GL
     // Release gl textures
     for (int i = 0; i < m_objects.size(); i++)
     {
         if (m_objects[i].m_texture.m_textureHandle)
             glDeleteTextures(1, &m_objects[i].m_texture.m_textureHandle);
     }
+    for (groupIter = m_groups.begin(); groupIter != m_groups.end();
+         groupIter++)
+    {
+        const QVector<SceneObject>& objects = (*groupIter)->getObjects();
+        for (int i = 0; i < objects.size(); i++)
+        {
+            GLuint handle = objects[i].m_texture.m_textureHandle;
+            if (handle)
+                glDeleteTextures(1, &handle);
+        }
+    }
+#endif
 
     QMap<int, TexInfo>::iterator iter = m_textureMap.begin();
 
@@ -65,13 +190,30 @@ Scene::~Scene()
     {
         if ((*iter).m_texPointer)
             delete []((*iter).m_texPointer);
+        if ((*iter).m_mipmap)
+            delete (*iter).m_mipmap;
     }
 
    // Release the kdtree
    if (m_tree)
        delete m_tree;
+   if (m_bvh)
+       delete m_bvh;
+   if (m_intersectView)
+       delete m_intersectView;
+
+   // Release the meshes, a copied scene doesn't own the ones it uses
+   QHash<QString, Mesh*>::iterator meshIter = m_meshes.begin();
+   for (; meshIter != m_meshes.end(); meshIter++)
+       delete *meshIter;
+
+   // The same for the groups
+   for (groupIter = m_groups.begin(); groupIter != m_groups.end();
+        groupIter++)
+       delete *groupIter;
 }
 
+#ifndef NO_GL
 void Scene::render(View3D *context)
 {
 
@@ -131,6 +273,7 @@ void Scene::render(View3D *context)
         renderNormals(vbos);
     }
 }
+#endif
 
 void Scene::parse(Scene *sceneToFill, CS123ISceneParser *parser)
 {
@@ -139,8 +282,13 @@ void Scene::parse(Scene *sceneToFill, CS123ISceneParser *parser)
     CS123SceneNode* node = parser->getRootNode();
     Matrix4x4 transform = Matrix4x4::identity();
 
+    // The nodes used more than once are parsed into groups
+    if (settings.useInstancing)
+        sceneToFill->findGroupNodes(node);
+
     // Do recursive parsing
     recursiveParseNode(sceneToFill, node, transform);
+    sceneToFill->m_groupNodes.clear();
 
     CS123SceneGlobalData tempGlobalData;
     parser->getGlobalData(tempGlobalData);
@@ -152,6 +300,9 @@ void Scene::parse(Scene *sceneToFill, CS123ISceneParser *parser)
         parser->getLightData(i, tempLightData);
         sceneToFill->addLight(tempLightData);
     }
+
+    // The objects don't change after parsing
+    sceneToFill->buildIntersectView();
 }
 
 void Scene::recursiveParseNode(Scene *sceneToFill,
@@ -200,13 +351,142 @@ void Scene::recursiveParseNode(Scene *sceneToFill,
 
     for (unsigned int i = 0; i < node->children.size(); i++)
     {
-        recursiveParseNode(sceneToFill, node->children[i], compositTrans);
+        // Inside of a group the nodes are expanded, groups don't nest
+        CS123SceneNode* child = node->children[i];
+        if (!sceneToFill->m_parseGroup &&
+            sceneToFill->m_groupNodes.contains(child))
+            sceneToFill->addGroup(child, compositTrans);
+        else
+            recursiveParseNode(sceneToFill, child, compositTrans);
     }
 }
 
+/**
+ * @brief countPrimitives: count the primitives under a node, each node is
+ *                         counted once
+ * @param node: the scene node
+ * @param counts: the counts of the nodes counted so far, updated
+ * @return: the number of primitives
+ */
+static int countPrimitives(CS123SceneNode* node,
+                           QHash<CS123SceneNode*, int>& counts)
+{
+
+    QHash<CS123SceneNode*, int>::iterator iter = counts.find(node);
+    if (iter != counts.end())
+        return *iter;
+
+    int count = node->primitives.size();
+    for (unsigned int i = 0; i < node->children.size(); i++)
+        count += countPrimitives(node->children[i], counts);
+    counts.insert(node, count);
+    return count;
+}
+
+void Scene::findGroupNodes(CS123SceneNode* root)
+{
+
+    // Count the uses of every node, the masters are the nodes shared by
+    // several parents or used several times by one
+    QHash<CS123SceneNode*, int> uses;
+    QList<CS123SceneNode*> nodes;
+    nodes.append(root);
+    uses.insert(root, 1);
+    for (int i = 0; i < nodes.size(); i++)
+    {
+        CS123SceneNode* node = nodes[i];
+        for (unsigned int j = 0; j < node->children.size(); j++)
+        {
+            CS123SceneNode* child = node->children[j];
+            QHash<CS123SceneNode*, int>::iterator iter = uses.find(child);
+            if (iter != uses.end())
+            {
+                (*iter)++;
+                continue;
+            }
+            uses.insert(child, 1);
+            nodes.append(child);
+        }
+    }
+
+    QHash<CS123SceneNode*, int> counts;
+    m_groupNodes.clear();
+    for (int i = 0; i < nodes.size(); i++)
+    {
+        if (uses.value(nodes[i]) > 1 &&
+            countPrimitives(nodes[i], counts) >= GROUP_MIN_OBJECTS)
+            m_groupNodes.insert(nodes[i]);
+    }
+}
+
+void Scene::addGroup(CS123SceneNode* node, const Matrix4x4 matrix)
+{
+
+    QHash<CS123SceneNode*, SceneGroup*>::iterator iter = m_groups.find(node);
+    SceneGroup* group = NULL;
+    if (iter != m_groups.end())
+    {
+        group = *iter;
+    }
+    else
+    {
+        // The objects are parsed once, in the space of the node's parent
+        group = new SceneGroup();
+        m_parseGroup = group;
+        recursiveParseNode(this, node, Matrix4x4::identity());
+        m_parseGroup = NULL;
+        group->build();
+        m_groups.insert(node, group);
+    }
+
+    // All of its meshes may have failed to load
+    if (!group->getObjectCount())
+        return;
+
+    SceneObject obj;
+    obj.m_primitive.type = PRIMITIVE_GROUP;
+    obj.m_group          = group;
+    obj.setTransform(matrix);
+    addObject(obj);
+}
+
+void Scene::expandGroups(QVector<SceneObject>& objects) const
+{
+
+    objects.resize(m_flatCount);
+    for (int i = 0; i < m_objects.size(); i++)
+        expandObject(i, objects);
+}
+
+void Scene::expandObject(int index, QVector<SceneObject>& objects) const
+{
+
+    assert(objects.size() == m_flatCount);
+    const SceneObject& object = m_objects[index];
+    int flatID = object.m_flatID;
+    if (object.m_primitive.type != PRIMITIVE_GROUP)
+    {
+        objects[flatID] = object;
+        objects[flatID].m_arrayID = flatID;
+        return;
+    }
+
+    const QVector<SceneObject>& groupObjects = object.m_group->getObjects();
+    for (int j = 0; j < groupObjects.size(); j++)
+    {
+        SceneObject& copy = objects[flatID + j];
+        copy = groupObjects[j];
+        copy.setTransform(object.m_transform * copy.m_transform);
+        copy.m_arrayID = flatID + j;
+        copy.m_flatID  = flatID + j;
+    }
+}
+
+#ifndef NO_GL
 void Scene::drawPrimitive(PrimitiveType type,
                           const VboHandles* vbos,
-                          GLuint texHandle)
+                          GLuint texHandle,
+                          const Mesh* mesh)
 {
 
     switch(type)
@@ -224,6 +504,7 @@ void Scene::drawPrimitive(PrimitiveType type,
             drawCone(vbos->coneVBO, vbos->coneElementVBO, texHandle);
         break;
     case PRIMITIVE_MESH:
+            drawMesh(mesh, texHandle);
         break;
     case PRIMITIVE_TORUS:
         break;
@@ -251,6 +532,8 @@ void Scene::drawPrimitiveNormals(PrimitiveType type, const VboHandles* vbos)
     case PRIMITIVE_CONE:
             drawNormals(vbos->coneVBO, (coneTess+1)*3);
         break;
+    case PRIMITIVE_MESH:
+        break;
     default:
         cerr<<"[Scene::drawPrimitive] Invalid type"<<endl;
         assert(0);
@@ -263,50 +546,71 @@ void Scene::renderGeometry(const bool useMaterials, const VboHandles* vbos)
 
     for (int i = 0; i < m_objects.size(); i++)
     {
-        CS123ScenePrimitive primitive = m_objects[i].m_primitive;
-        GLuint texHandle              = m_objects[i].m_texture.m_textureHandle;
-        Matrix4x4 transform           = m_objects[i].m_transform;
-        AABB boundingBox              = m_objects[i].m_boundingBox;
+        const SceneObject& object = m_objects[i];
+        AABB boundingBox          = object.m_boundingBox;
 
         float white[3] = {1,1,1};
         if (settings.showBoundingBox)
             drawAABB(boundingBox, white);
 
-        transform = Matrix4x4::transpose(transform);
-        glMatrixMode(GL_MODELVIEW);
-        glEnable(GL_NORMALIZE);
-
-        // Transform the object
-        glPushMatrix();
-        glMultMatrixf(transform.data);
-
-        if (useMaterials)
+        if (object.m_primitive.type != PRIMITIVE_GROUP)
         {
-            CS123SceneMaterial tempMaterial = primitive.material;
-            tempMaterial.cAmbient.b *= m_globalData.ka;
-            tempMaterial.cAmbient.g *= m_globalData.ka;
-            tempMaterial.cAmbient.r *= m_globalData.ka;
-            tempMaterial.cDiffuse.b *= m_globalData.kd;
-            tempMaterial.cDiffuse.g *= m_globalData.kd;
-            tempMaterial.cDiffuse.r *= m_globalData.kd;
-            tempMaterial.cSpecular.b *= m_globalData.ks;
-            tempMaterial.cSpecular.g *= m_globalData.ks;
-            tempMaterial.cSpecular.r *= m_globalData.ks;
-            tempMaterial.cTransparent.b *= m_globalData.kt;
-            tempMaterial.cTransparent.g *= m_globalData.kt;
-            tempMaterial.cTransparent.r *= m_globalData.kt;
-
-            applyMaterial(tempMaterial);
+            renderObject(object, object.m_transform, useMaterials, vbos);
+            continue;
         }
-        drawPrimitive(primitive.type, vbos, texHandle);
 
-        if (settings.useLighting)
-            glLightModeli(GL_LIGHT_MODEL_COLOR_CONTROL, GL_SINGLE_COLOR);
-        // primitive is a shape
+        // Draw the objects of a group where this instance puts them
+        const QVector<SceneObject>& objects = object.m_group->getObjects();
+        for (int j = 0; j < objects.size(); j++)
+            renderObject(objects[j],
+                         object.m_transform * objects[j].m_transform,
+                         useMaterials, vbos);
+    }
+}
 
-        glPopMatrix();
-        glDisable(GL_NORMALIZE);
+void Scene::renderObject(const SceneObject& object,
+                         Matrix4x4 transform,
+                         const bool useMaterials,
+                         const VboHandles* vbos)
+{
+
+    CS123ScenePrimitive primitive = object.m_primitive;
+    GLuint texHandle              = object.m_texture.m_textureHandle;
+
+    transform = Matrix4x4::transpose(transform);
+    glMatrixMode(GL_MODELVIEW);
+    glEnable(GL_NORMALIZE);
+
+    // Transform the object
+    glPushMatrix();
+    glMultMatrixf(transform.data);
+
+    if (useMaterials)
+    {
+        CS123SceneMaterial tempMaterial = primitive.material;
+        tempMaterial.cAmbient.b *= m_globalData.ka;
+        tempMaterial.cAmbient.g *= m_globalData.ka;
+        tempMaterial.cAmbient.r *= m_globalData.ka;
+        tempMaterial.cDiffuse.b *= m_globalData.kd;
+        tempMaterial.cDiffuse.g *= m_globalData.kd;
+        tempMaterial.cDiffuse.r *= m_globalData.kd;
+        tempMaterial.cSpecular.b *= m_globalData.ks;
+        tempMaterial.cSpecular.g *= m_globalData.ks;
+        tempMaterial.cSpecular.r *= m_globalData.ks;
+        tempMaterial.cTransparent.b *= m_globalData.kt;
+        tempMaterial.cTransparent.g *= m_globalData.kt;
+        tempMaterial.cTransparent.r *= m_globalData.kt;
+
+        applyMaterial(tempMaterial);
     }
+    drawPrimitive(primitive.type, vbos, texHandle, object.m_mesh);
+
+    if (settings.useLighting)
+        glLightModeli(GL_LIGHT_MODEL_COLOR_CONTROL, GL_SINGLE_COLOR);
+    // primitive is a shape
+
+    glPopMatrix();
+    glDisable(GL_NORMALIZE);
 }
 
 void Scene::applyMaterial(const CS123SceneMaterial &material)
@@ -346,6 +650,7 @@ void Scene::setLights()
         setLight(m_lightData[i]);
     }
 }
+#endif
 
 void Scene::initExtends()
 {
@@ -359,19 +664,68 @@ void Scene::buildKdTree()
 {
 
     m_tree = new KdTree();
-    m_tree->init();
     m_tree->build(this);
+}
+
+void Scene::buildBvh()
+{
+
+    m_bvh = new Bvh();
+    m_bvh->build(this);
+}
+
+void Scene::buildIntersectView()
+{
+
+    if (!m_intersectView)
+        m_intersectView = new IntersectView();
+    m_intersectView->build(m_objects);
+}
+
+bool Scene::updateTransforms(const QVector<int>& objects,
+                             const QVector<Matrix4x4>& transforms)
+{
+
+    assert(objects.size() == transforms.size());
+    for (int i = 0; i < objects.size(); i++)
+    {
+        assert(objects[i] >= 0 && objects[i] < m_objects.size());
+        SceneObject& object = m_objects[objects[i]];
+        object.setTransform(transforms[i]);
+
+        // The extends only grow, they bound the kdtree
+        growExtends(object.m_boundingBox);
+        if (m_intersectView)
+            m_intersectView->update(object);
+    }
+
+    // Rebuilt in place, whoever holds the pointers keeps them
+    bool rebuilt = false;
+    if (m_bvh)
+    {
+        m_bvh->refit(m_objects, objects);
+        if (m_bvh->getRefitCost() > BVH_REFIT_DEGRADATION)
+        {
+            m_bvh->build(this);
+            rebuilt = true;
+        }
+    }
+    if (m_tree)
+    {
+        m_tree->build(this);
+        rebuilt = true;
+    }
 
-    // Dump the kdtree info
-    dumpKdTree();
+    return rebuilt;
 }
 
 void Scene::dumpKdTree()
 {
     // Wrapper
-    dumpKdTreeInfo(m_tree);
+    dumpKdTreeInfo(m_tree, m_objects);
 }
 
+#ifndef NO_GL
 void Scene::setLight(const CS123SceneLightData &light)
 {
 
@@ -466,7 +820,25 @@ void Scene::renderNormals(const VboHandles* vbos)
         // Transform the object
         glPushMatrix();
         glMultMatrixf(transform.data);
-        drawPrimitiveNormals(m_objects[i].m_primitive.type, vbos);
+        if (m_objects[i].m_primitive.type == PRIMITIVE_GROUP)
+        {
+            // The objects of a group are in the instance's space
+            const QVector<SceneObject>& objects =
+                    m_objects[i].m_group->getObjects();
+            for (int j = 0; j < objects.size(); j++)
+            {
+                Matrix4x4 objectTransform =
+                        Matrix4x4::transpose(objects[j].m_transform);
+                glPushMatrix();
+                glMultMatrixf(objectTransform.data);
+                drawPrimitiveNormals(objects[j].m_primitive.type, vbos);
+                glPopMatrix();
+            }
+        }
+        else
+        {
+            drawPrimitiveNormals(m_objects[i].m_primitive.type, vbos);
+        }
 
         glPopMatrix();
         glDisable(GL_NORMALIZE);
@@ -479,99 +851,60 @@ void Scene::renderKdTree()
     if (!m_tree)
         return;
 
-    KdTreeNode* root = m_tree->getRoot();
-    renderKdTreeLeaf(root);
+    renderKdTreeLeaf(0, m_tree->getExtends());
 }
 
-void Scene::renderKdTreeLeaf(KdTreeNode* node)
+void Scene::renderKdTreeLeaf(int index, AABB box)
 {
 
-    if (!node)
-        return;
+    const KdFlatNode& node = m_tree->getFlatNodes()[index];
 
     // Recursive render
-    if (!node->isLeaf())
+    if (!node.isLeaf())
     {
         float color[3] = {0.f, 1.f, 0.f};
 
-        if (node->getLeft())
-        {
-            KdTreeNode* left = node->getLeft();
-            AABB leftAABB = left->getAABB();
-            drawAABB(leftAABB, color);
-            renderKdTreeLeaf(left);
-        }
+        // The children's boxes are cut from the parent's
+        AABB leftAABB, rightAABB;
+        KdTree::splitAABB(box, node.getAxis(), node.m_split,
+                          leftAABB, rightAABB);
 
-        if (node->getRight())
-        {
-            KdTreeNode* right = node->getRight();
-            AABB rightAABB = right->getAABB();
-            drawAABB(rightAABB, color);
-            renderKdTreeLeaf( right);
-        }
+        drawAABB(leftAABB, color);
+        renderKdTreeLeaf(index + 1, leftAABB);
+
+        drawAABB(rightAABB, color);
+        renderKdTreeLeaf(node.getRight(), rightAABB);
     }
 }
+#endif
 
 void Scene::addPrimitive(const CS123ScenePrimitive &scenePrimitive,
                          const Matrix4x4 matrix)
 {
 
     SceneObject obj;
-    obj.m_primitive    = scenePrimitive;
-    obj.m_transform    = matrix;
-    obj.m_invTransform = obj.m_transform.getInverse();
-
-    Matrix4x4 compMat = obj.m_transform;
-    compMat.data[3]   = 0;
-    compMat.data[7]   = 0;
-    compMat.data[11]  = 0;
-    obj.m_invTTransformWithoutTrans = compMat.getInverse().getTranspose();
+    obj.m_primitive = scenePrimitive;
 
-    // Compute the bounding box
-    switch(obj.m_primitive.type)
+    if (obj.m_primitive.type == PRIMITIVE_MESH)
     {
-    case PRIMITIVE_CUBE:
-        obj.m_boundingBox = computeCubeAABB(obj.m_transform);
-        break;
-    case PRIMITIVE_CONE:
-        obj.m_boundingBox = computeConeAABB(obj.m_transform);
-        break;
-    case PRIMITIVE_CYLINDER:
-        obj.m_boundingBox = computeCylinderAABB(obj.m_transform);
-        break;
-    case PRIMITIVE_SPHERE:
-        obj.m_boundingBox = computeSphereAABB(obj.m_transform);
-        break;
-    case PRIMITIVE_TORUS:
-    case PRIMITIVE_MESH:
-    default:
-        assert(0);
-        break;
+        // Every object using the same file instances the same mesh, a file
+        // failing to load is kept as NULL and its objects are dropped
+        QString meshPath = scenePrimitive.meshfile.c_str();
+        if (!m_meshes.contains(meshPath))
+        {
+            Mesh* mesh = new Mesh();
+            if (!mesh->load(meshPath))
+            {
+                delete mesh;
+                mesh = NULL;
+            }
+            m_meshes.insert(meshPath, mesh);
+        }
+        obj.m_mesh = m_meshes.value(meshPath);
+        if (!obj.m_mesh)
+            return;
     }
-
-    Vector3 bakPos =  m_extends.getPos() ;
-
-    if (m_extends.getPos().x > obj.m_boundingBox.x())
-        m_extends.getPos().x = obj.m_boundingBox.x();
-    if (m_extends.getPos().y > obj.m_boundingBox.y())
-        m_extends.getPos().y = obj.m_boundingBox.y();
-    if (m_extends.getPos().z > obj.m_boundingBox.z())
-        m_extends.getPos().z = obj.m_boundingBox.z();
-
- if (bakPos == Vector3(POS_INF, POS_INF, POS_INF))
-     bakPos = m_extends.getPos();
-
-    Vector3 max = obj.m_boundingBox.getPos() + obj.m_boundingBox.getSize();
-    Vector3 extMax = bakPos + m_extends.getSize();
-
-    if (extMax.x < max.x)
-        extMax.x = max.x;
-    if (extMax.y < max.y)
-        extMax.y = max.y;
-    if (extMax.z < max.z)
-        extMax.z = max.z;
-
-    m_extends.getSize() = extMax - m_extends.getPos();
+    obj.setTransform(matrix);
 
     QString path = scenePrimitive.material.textureMap->filename.c_str();
     if (path.size() && scenePrimitive.material.textureMap->isUsed)
@@ -583,21 +916,28 @@ void Scene::addPrimitive(const CS123ScenePrimitive &scenePrimitive,
         }
         else
         {
-            obj.m_texture.m_textureHandle = loadTexture(path);
-
+            // Texels are read on the CPU so that no GL context is needed,
+            // the GL texture is only created for the interactive views
             int width = 0;
             int height = 0;
-            glBindTexture(GL_TEXTURE_2D, obj.m_texture.m_textureHandle);
-            glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &width);
-            glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &height);
-            unsigned* tex = new unsigned[width*height];
-            glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, tex);
-            glBindTexture(GL_TEXTURE_2D, 0);
-            assert(width != 0 && height != 0);
-
-            obj.m_texture.m_texPointer = tex;
-            obj.m_texture.m_texHeight  = height;
-            obj.m_texture.m_texWidth   = width;
+            unsigned* tex = loadTexels(path, width, height);
+
+            if (tex)
+            {
+#ifndef NO_GL
+                if (m_useGL)
+                    obj.m_texture.m_textureHandle =
+                            createTextureFromTexels(tex, width, height);
+#endif
+
+                // The mip chain is built once per texture, the objects
+                // using it share it
+                obj.m_texture.m_texPointer = tex;
+                obj.m_texture.m_mipmap     = new MipTexture(tex, width,
+                                                            height);
+                obj.m_texture.m_texHeight  = height;
+                obj.m_texture.m_texWidth   = width;
+            }
             obj.m_texture.m_mapIndex   = m_mapEnd;
 
             m_textureMap.insert(obj.m_texture.m_mapIndex, obj.m_texture);
@@ -606,10 +946,53 @@ void Scene::addPrimitive(const CS123ScenePrimitive &scenePrimitive,
             m_mapEnd++;
         }
     }
+
+    if (m_parseGroup)
+        m_parseGroup->addObject(obj);
+    else
+        addObject(obj);
+}
+
+void Scene::addObject(SceneObject& obj)
+{
+
+    growExtends(obj.m_boundingBox);
+
+    // A group takes the ids of all of its objects
     obj.m_arrayID = m_objects.size();
+    obj.m_flatID  = m_flatCount;
+    m_flatCount  += obj.m_group ? obj.m_group->getObjectCount() : 1;
     m_objects.append(obj);
 }
 
+void Scene::growExtends(AABB box)
+{
+
+    Vector3 bakPos =  m_extends.getPos() ;
+
+    if (m_extends.getPos().x > box.x())
+        m_extends.getPos().x = box.x();
+    if (m_extends.getPos().y > box.y())
+        m_extends.getPos().y = box.y();
+    if (m_extends.getPos().z > box.z())
+        m_extends.getPos().z = box.z();
+
+    if (bakPos == Vector3(POS_INF, POS_INF, POS_INF))
+        bakPos = m_extends.getPos();
+
+    Vector3 max = box.getPos() + box.getSize();
+    Vector3 extMax = bakPos + m_extends.getSize();
+
+    if (extMax.x < max.x)
+        extMax.x = max.x;
+    if (extMax.y < max.y)
+        extMax.y = max.y;
+    if (extMax.z < max.z)
+        extMax.z = max.z;
+
+    m_extends.getSize() = extMax - m_extends.getPos();
+}
+
 void Scene::addLight(const CS123SceneLightData &sceneLight)
 {
 
@@ -10,11 +10,18 @@
 
 #include "CS123SceneData.h"
 #include "aabb.h"
+#ifndef NO_GL
 #include <qgl.h>
+#endif
 #include <QHash>
+#include <QSet>
 
 class KdTree;
-class KdTreeNode;
+class Bvh;
+class IntersectView;
+class Mesh;
+class MipTexture;
+class SceneGroup;
 class View3D;
 class Camera;
 class CS123ISceneParser;
@@ -28,8 +35,11 @@ struct TexInfo
 {
 
     int m_mapIndex; // Map index
+#ifndef NO_GL
     GLuint m_textureHandle; // GL handle
+#endif
     unsigned *m_texPointer; // Point to the actual data of texture
+    MipTexture* m_mipmap; // Mip chain of the texture, traced instead
     int m_texWidth; // The width of texture;
     int m_texHeight; // The height of texture
 };
@@ -45,6 +55,14 @@ public:
     SceneObject();
     ~SceneObject();
 
+    /**
+     * @brief setTransform: set the transformation matrix, its inverses and
+     *                      the bounding box. The mesh or the group has to
+     *                      be set first
+     * @param transform: the transformation matrix, affine
+     */
+    void setTransform(const Matrix4x4& transform);
+
     Matrix4x4 m_transform; // Transformation matrix
     Matrix4x4 m_invTransform; // Inverse of transformation matrix
     Matrix4x4 m_invTTransformWithoutTrans; // Inverse of transformation
@@ -53,9 +71,27 @@ public:
     AABB m_boundingBox; // Bounding box
     int m_textureMapID; // Texture map ID
     int m_arrayID; // Id in array
+    int m_flatID; // Id in the scene with its groups expanded, the id of the
+                  // first object for a group
     TexInfo m_texture; // Texture info
+    const Mesh* m_mesh; // Triangles of a mesh, owned by the scene
+    const SceneGroup* m_group; // Objects of a group, owned by the scene
 };
 
+/**
+ * @brief getFlatObject: get an object by its id in the scene with its groups
+ *                       expanded, which is the object index the
+ *                       intersection functions return
+ * @param objects: object list
+ * @param flatID: the id of the object
+ * @param instance: the group object the object is in, NULL if it's not in
+ *                  a group, should be returned if not NULL
+ * @return: the object, in the space of the group if it's in one
+ */
+const SceneObject& getFlatObject(const QVector<SceneObject>& objects,
+                                 int flatID,
+                                 const SceneObject** instance = NULL);
+
 /**
  * @class: Scene
  * @brief The Scene class is the holder for all kinds of data in the scene
@@ -64,15 +100,17 @@ class Scene
 {
 public:
 
-    Scene();
+    Scene(bool useGL = true);
     Scene(Scene& s);
     virtual ~Scene();
 
+#ifndef NO_GL
     /**
      * @brief render: render the scene using info from context
      * @param context: the pointer to View3D
      */
     void render(View3D* context);
+#endif
 
     /**
      * @brief parse: parse a scene using parser
@@ -107,16 +145,45 @@ public:
         return result;
     }
 
+    int getFlatObjectCount() const { return m_flatCount; }
+    bool hasGroups() const { return m_flatCount != m_objects.size(); }
+    const QHash<CS123SceneNode*, SceneGroup*>& getGroups() const
+    {
+        return m_groups;
+    }
+
+    /**
+     * @brief expandGroups: copy the objects with every group replaced by
+     *                      its objects in world space, for what can't
+     *                      traverse the groups. The copies are in the order
+     *                      of their ids
+     * @param objects: the copied objects, should be returned
+     */
+    void expandGroups(QVector<SceneObject>& objects) const;
+
+    /**
+     * @brief expandObject: copy one object into its place among the
+     *                      expanded objects, a group as its objects in world
+     *                      space, for updating the copies after it moved
+     * @param index: index of the object in the scene
+     * @param objects: the expanded objects, should be returned
+     */
+    void expandObject(int index, QVector<SceneObject>& objects) const;
+
     QMap<int, TexInfo> getTexMap(){return m_textureMap; }
 
     AABB getExtends(){ return m_extends; }
 
     KdTree* getKdTree(){ return m_tree; }
+    Bvh* getBvh(){ return m_bvh; }
+    const IntersectView* getIntersectView(){ return m_intersectView; }
 
+#ifndef NO_GL
     /**
      * @brief setLights: wrapper for setting lights
      */
     void setLights();
+#endif
 
     /**
      * @brief initExtends
@@ -129,7 +196,36 @@ public:
     void buildKdTree();
 
     /**
-     * @brief dumpKdTree: wrapper for dumping kdtree information
+     * @brief buildBvh: wrapper for building BVH
+     */
+    void buildBvh();
+
+    /**
+     * @brief buildIntersectView: wrapper for building the compact copy of the
+     *                            objects read by the intersection loops
+     */
+    void buildIntersectView();
+
+    /**
+     * @brief updateTransforms: move some of the objects, for animation. The
+     *                          intersection view is updated in place and
+     *                          the BVH is refit above the moved objects,
+     *                          then rebuilt once refitting has made it
+     *                          BVH_REFIT_DEGRADATION times slower. Only the
+     *                          BVH is refit, a kdtree is rebuilt in full on
+     *                          every call, over the top level objects only
+     *                          since groups move as one. Animate with the
+     *                          BVH where the rebuilds cost too much
+     * @param objects: indices of the objects in getObjects()
+     * @param transforms: the new transformation matrix of each object
+     * @return: true if the BVH or the kdtree was rebuilt
+     */
+    bool updateTransforms(const QVector<int>& objects,
+                          const QVector<Matrix4x4>& transforms);
+
+    /**
+     * @brief dumpKdTree: wrapper for dumping kdtree information into
+     *                    ./output/kdtree.txt, buildKdTree doesn't
      */
     void dumpKdTree();
 
@@ -143,6 +239,35 @@ protected:
     virtual void addPrimitive(const CS123ScenePrimitive &scenePrimitive,
                               const Matrix4x4 matrix);
 
+    /**
+     * @brief addObject: append an object to the scene and grow the extends
+     * @param obj: the object with its bounding box set
+     */
+    void addObject(SceneObject& obj);
+
+    /**
+     * @brief growExtends: grow the bounding box of the scene
+     * @param box: the bounding box to contain
+     */
+    void growExtends(AABB box);
+
+    /**
+     * @brief addGroup: add an object instancing the objects parsed from a
+     *                  node, they're parsed into a group the first time the
+     *                  node is added
+     * @param node: the scene node
+     * @param matrix: the transformation matrix of the instance
+     */
+    void addGroup(CS123SceneNode* node, const Matrix4x4 matrix);
+
+    /**
+     * @brief findGroupNodes: find the nodes worth parsing into groups, the
+     *                        ones used more than once holding at least
+     *                        GROUP_MIN_OBJECTS primitives
+     * @param root: the root node
+     */
+    void findGroupNodes(CS123SceneNode* root);
+
     /**
      * @brief addLight
      * @param sceneLight
@@ -163,7 +288,20 @@ protected:
     int m_mapEnd; // The number of items of map
     AABB m_extends; // Bounding box for the scene
     KdTree* m_tree; // Pointer to the kdtree
-
+    Bvh* m_bvh; // Pointer to the BVH
+    IntersectView* m_intersectView; // Objects as seen by the intersection
+    QHash<QString, Mesh*> m_meshes; // Loaded meshes by path, shared by the
+                                    // objects using them
+    QHash<CS123SceneNode*, SceneGroup*> m_groups; // Groups by the node they
+                                                  // are parsed from, shared
+                                                  // by their instances
+    QSet<CS123SceneNode*> m_groupNodes; // Nodes to parse into groups
+    SceneGroup* m_parseGroup; // The group being parsed, NULL when parsing
+                              // the scene's own objects
+    int m_flatCount; // Number of objects with the groups expanded
+    bool m_useGL; // Create GL textures? False when there is no GL context
+
+#ifndef NO_GL
 private:
 
     /**
@@ -171,9 +309,10 @@ private:
      * @param type: primitive type
      * @param vbos: pointer to the vbo handles
      * @param texHandle: pointer to the texture handle
+     * @param mesh: the triangles of a mesh, NULL for the other types
      */
     void drawPrimitive(PrimitiveType type, const VboHandles* vbos,
-                       GLuint texHandle);
+                       GLuint texHandle, const Mesh* mesh);
 
     /**
      * @brief drawPrimitiveNormals: draw primitive normals
@@ -189,6 +328,16 @@ private:
      */
     void renderGeometry(const bool useMaterials, const VboHandles* vbos);
 
+    /**
+     * @brief renderObject: render an object that isn't a group
+     * @param object: the object
+     * @param transform: the transformation matrix to world space
+     * @param useMaterials: use materials or not
+     * @param vbos: the pointer to the vbo handles
+     */
+    void renderObject(const SceneObject& object, Matrix4x4 transform,
+                      const bool useMaterials, const VboHandles* vbos);
+
     /**
      * @brief applyMaterial: apply material to current rendering pipeline
      * @param material: material
@@ -215,9 +364,11 @@ private:
 
     /**
      * @brief renderKdTreeLeaf: render the kdtree's leaf
-     * @param node: the pointer to the kdtree node
+     * @param index: the index of the kdtree node
+     * @param box: the bounding box of the node
      */
-    void renderKdTreeLeaf(KdTreeNode* node);
+    void renderKdTreeLeaf(int index, AABB box);
+#endif
 };
 
 #endif // SCENE_H
@@ -0,0 +1,173 @@
+/*!
+    @file mip_texture.cpp
+    @desc: definitions of MipTexture class
+    @author: yanli
+    @date: May 2013
+ */
+
+#include "mip_texture.h"
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+
+MipTexture::MipTexture(const unsigned* texels, int width, int height)
+{
+
+    assert(texels);
+    assert(width > 0 && height > 0);
+
+    // Lay out the levels first, every level is a whole number of tiles
+    int size = 0;
+    int levelWidth  = width;
+    int levelHeight = height;
+    while (true)
+    {
+        MipLevel level;
+        level.width       = levelWidth;
+        level.height      = levelHeight;
+        level.tilesPerRow = (levelWidth + MIP_TILE_WIDTH - 1) >>
+                MIP_TILE_SHIFT;
+        level.offset      = size;
+        m_levels.push_back(level);
+
+        int tilesPerColumn = (levelHeight + MIP_TILE_WIDTH - 1) >>
+                MIP_TILE_SHIFT;
+        size += level.tilesPerRow * tilesPerColumn * MIP_TILE_SIZE;
+        if (levelWidth == 1 && levelHeight == 1)
+            break;
+        levelWidth  = qMax(levelWidth >> 1, 1);
+        levelHeight = qMax(levelHeight >> 1, 1);
+    }
+    m_size   = size;
+    m_texels = (unsigned*)qMallocAligned(size * sizeof(unsigned),
+                                         MIP_ALIGNMENT);
+    memset(m_texels, 0, size * sizeof(unsigned));
+
+    const MipLevel& first = m_levels[0];
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+            setTexel(first, x, y, texels[y * width + x]);
+    }
+
+    for (int i = 1; i < m_levels.size(); i++)
+        downsample(i);
+}
+
+MipTexture::~MipTexture()
+{
+
+    qFreeAligned(m_texels);
+}
+
+void MipTexture::downsample(int index)
+{
+
+    assert(index > 0 && index < m_levels.size());
+
+    const MipLevel& source = m_levels[index - 1];
+    const MipLevel& level  = m_levels[index];
+    for (int y = 0; y < level.height; y++)
+    {
+        // An odd row or column of the source is dropped at the edge, the
+        // clamp only matters for a side that's already 1 texel
+        int y0 = qMin(2 * y, source.height - 1);
+        int y1 = qMin(2 * y + 1, source.height - 1);
+        for (int x = 0; x < level.width; x++)
+        {
+            int x0 = qMin(2 * x, source.width - 1);
+            int x1 = qMin(2 * x + 1, source.width - 1);
+            unsigned e1 = getTexel(source, x0, y0);
+            unsigned e2 = getTexel(source, x1, y0);
+            unsigned e3 = getTexel(source, x0, y1);
+            unsigned e4 = getTexel(source, x1, y1);
+
+            // Average the 4 channels one byte at a time, rounded
+            unsigned texel = 0;
+            for (int shift = 0; shift < 32; shift += 8)
+            {
+                unsigned sum = ((e1 >> shift) & 0xFF) +
+                        ((e2 >> shift) & 0xFF) +
+                        ((e3 >> shift) & 0xFF) +
+                        ((e4 >> shift) & 0xFF);
+                texel |= ((sum + 2) >> 2) << shift;
+            }
+            setTexel(level, x, y, texel);
+        }
+    }
+}
+
+RGBA MipTexture::sampleLevel(int index, REAL u, REAL v) const
+{
+
+    assert(index >= 0 && index < m_levels.size());
+
+    const MipLevel& level = m_levels[index];
+    float x = (level.width - 1) * u;
+    float y = (level.height - 1) * v;
+    if (x < 0)
+        x = 0.f;
+    if (y < 0)
+        y = 0.f;
+    if (x > level.width - 1)
+        x = level.width - 1;
+    if (y > level.height - 1)
+        y = level.height - 1;
+
+    const int X    = (int)x;
+    const int Y    = (int)y;
+    const int X1   = qMin(X + 1, level.width - 1);
+    const int Y1   = qMin(Y + 1, level.height - 1);
+    const float s1 = x - X;
+    const float s0 = 1.f - s1;
+    const float t1 = y - Y;
+    const float t0 = 1.f - t1;
+
+    // The weights are applied to the bytes and scaled once, instead of
+    // converting every texel to floats
+    const float w1 = s0 * t0 / 255.f;
+    const float w2 = s0 * t1 / 255.f;
+    const float w3 = s1 * t0 / 255.f;
+    const float w4 = s1 * t1 / 255.f;
+    unsigned e1 = getTexel(level, X, Y);
+    unsigned e2 = getTexel(level, X, Y1);
+    unsigned e3 = getTexel(level, X1, Y);
+    unsigned e4 = getTexel(level, X1, Y1);
+
+    float channels[4];
+    for (int k = 0; k < 4; k++)
+    {
+        int shift = k * 8;
+        channels[k] = w1 * ((e1 >> shift) & 0xFF) +
+                w2 * ((e2 >> shift) & 0xFF) +
+                w3 * ((e3 >> shift) & 0xFF) +
+                w4 * ((e4 >> shift) & 0xFF);
+    }
+
+    RGBA result;
+    result.r = channels[0];
+    result.g = channels[1];
+    result.b = channels[2];
+    result.a = channels[3];
+    return result;
+}
+
+RGBA MipTexture::sample(REAL u, REAL v, REAL lod) const
+{
+
+    // Magnified textures and the last level need a single lookup
+    int last = m_levels.size() - 1;
+    if (lod <= 0)
+        return sampleLevel(0, u, v);
+    if (lod >= last)
+        return sampleLevel(last, u, v);
+
+    int level    = (int)lod;
+    float weight = lod - level;
+    RGBA fine    = sampleLevel(level, u, v);
+    if (weight == 0)
+        return fine;
+
+    RGBA coarse = sampleLevel(level + 1, u, v);
+    return fine * (1.f - weight) + coarse * weight;
+}
@@ -0,0 +1,137 @@
+/*!
+    @file mip_texture.h
+    @desc: declarations of MipTexture class
+    @author: yanli
+    @date: May 2013
+ */
+
+#ifndef MIP_TEXTURE_H
+#define MIP_TEXTURE_H
+
+#include "CS123SceneData.h"
+#include <QVector>
+
+#define MIP_TILE_SHIFT 2 // A tile is 1 << MIP_TILE_SHIFT texels per side
+#define MIP_TILE_WIDTH (1 << MIP_TILE_SHIFT) // Texels per side of a tile
+#define MIP_TILE_SIZE (MIP_TILE_WIDTH * MIP_TILE_WIDTH) // Texels of a tile
+#define MIP_ALIGNMENT 64 // Alignment of the texels in bytes, a tile is a
+                         // cache line
+
+/**
+ * @class: MipTexture
+ * @brief The MipTexture class is the mip chain of a texture. Every level
+ *        halves the one before with a box filter, down to a single texel.
+ *        The levels are stored in tiles of 4 x 4 texels, one cache line of
+ *        RGBA texels, row by row in a level and row by row in a tile, so
+ *        the four texels of a bilinear lookup are mostly in the same line.
+ *        The kernel of the GPU path addresses the same layout
+ */
+class MipTexture
+{
+public:
+
+    /**
+     * @brief MipTexture: build the chain of a texture
+     * @param texels: the texels row by row, RGBA with red in the low byte
+     * @param width: width of the texture
+     * @param height: height of the texture
+     */
+    MipTexture(const unsigned* texels, int width, int height);
+
+    ~MipTexture();
+
+    /**
+     * @brief sample: trilinear lookup, the two levels around the level of
+     *                detail are interpolated. The coordinates are clamped
+     *                to the texture
+     * @param u: horizontal coordinate in [0, 1]
+     * @param v: vertical coordinate in [0, 1]
+     * @param lod: level of detail, 0 is the full resolution
+     * @return: the color
+     */
+    RGBA sample(REAL u, REAL v, REAL lod) const;
+
+    /**
+     * @brief sampleLevel: bilinear lookup in a level, on level 0 it's the
+     *                     same as bilinearInterpTexel()
+     * @param level: the level
+     * @param u: horizontal coordinate in [0, 1]
+     * @param v: vertical coordinate in [0, 1]
+     * @return: the color
+     */
+    RGBA sampleLevel(int level, REAL u, REAL v) const;
+
+    /**
+     * Getters
+     */
+    int getLevelCount() const { return m_levels.size(); }
+    int getWidth() const { return m_levels[0].width; }
+    int getHeight() const { return m_levels[0].height; }
+    const unsigned* getData() const { return m_texels; }
+    int getSize() const { return m_size; }
+
+private:
+
+    // The texels are owned, a MipTexture is not copied
+    MipTexture(const MipTexture&);
+    MipTexture& operator=(const MipTexture&);
+
+    /**
+     * @struct: MipLevel
+     * @brief The MipLevel struct is where a level lies in the texels
+     */
+    struct MipLevel
+    {
+        int width; // Width in texels
+        int height; // Height in texels
+        int tilesPerRow; // Tiles per row of the level
+        int offset; // Index of the first texel of the level
+    };
+
+    /**
+     * @brief getTexel: get a texel of a level
+     * @param level: the level
+     * @param x: column of the texel
+     * @param y: row of the texel
+     * @return: the texel
+     */
+    inline unsigned getTexel(const MipLevel& level, int x, int y) const
+    {
+
+        int tile = (y >> MIP_TILE_SHIFT) * level.tilesPerRow +
+                (x >> MIP_TILE_SHIFT);
+        return m_texels[level.offset + tile * MIP_TILE_SIZE +
+                ((y & (MIP_TILE_WIDTH - 1)) << MIP_TILE_SHIFT) +
+                (x & (MIP_TILE_WIDTH - 1))];
+    }
+
+    /**
+     * @brief setTexel: set a texel of a level
+     * @param level: the level
+     * @param x: column of the texel
+     * @param y: row of the texel
+     * @param texel: the texel
+     */
+    inline void setTexel(const MipLevel& level, int x, int y, unsigned texel)
+    {
+
+        int tile = (y >> MIP_TILE_SHIFT) * level.tilesPerRow +
+                (x >> MIP_TILE_SHIFT);
+        m_texels[level.offset + tile * MIP_TILE_SIZE +
+                ((y & (MIP_TILE_WIDTH - 1)) << MIP_TILE_SHIFT) +
+                (x & (MIP_TILE_WIDTH - 1))] = texel;
+    }
+
+    /**
+     * @brief downsample: fill a level from the one before it
+     * @param index: index of the level, at least 1
+     */
+    void downsample(int index);
+
+    QVector<MipLevel> m_levels; // The levels, the full resolution first
+    unsigned* m_texels; // Texels of all of the levels, aligned to
+                        // MIP_ALIGNMENT
+    int m_size; // Number of texels of all of the levels
+};
+
+#endif // MIP_TEXTURE_H
@@ -15,6 +15,132 @@
 #include "cube_intersect.h"
 #include "sphere_intersect.h"
 #include "cylinder_intersect.h"
+#include "mesh_intersect.h"
+#include "mip_texture.h"
+#include "shape_math.h"
+
+/**
+ * @brief storePixel: clamp a color and write it to a pixel
+ * @param pixel: the pixel
+ * @param sumColor: the color, components in [0, 1]
+ */
+static inline void storePixel(BGRA& pixel, Vector3 sumColor)
+{
+
+    sumColor = sumColor * 255;
+
+    mclamp(sumColor.x, 0.f, 255.f);pixel.r = sumColor.x;
+    mclamp(sumColor.y, 0.f, 255.f);pixel.g = sumColor.y;
+    mclamp(sumColor.z, 0.f, 255.f);pixel.b = sumColor.z;
+}
+
+/**
+ * @brief getIntersectTexCoord: get the texture coordinates of a point of an
+ *                              object
+ * @param object: the object
+ * @param faceIndex: the face the point is on
+ * @param point: the point in object space
+ * @param u: horizontal coordinate in [0, 1], should be returned
+ * @param v: vertical coordinate in [0, 1], should be returned
+ * @return: false if the object has no texture coordinates
+ */
+static bool getIntersectTexCoord(const SceneObject& object,
+                                 const int faceIndex,
+                                 const Vector4& point,
+                                 REAL& u,
+                                 REAL& v)
+{
+
+    switch (object.m_primitive.type)
+    {
+    case PRIMITIVE_CUBE:
+        getCubeIntersectTexCoord(faceIndex, point, u, v);
+        return true;
+    case PRIMITIVE_CYLINDER:
+        getCylinderIntersectTexCoord(faceIndex, point, u, v);
+        return true;
+    case PRIMITIVE_CONE:
+        getConeIntersectTexCoord(faceIndex, point, u, v);
+        return true;
+    case PRIMITIVE_SPHERE:
+        getSphereIntersectTexCoord(point, u, v);
+        return true;
+    case PRIMITIVE_MESH:
+        return getMeshIntersectTexCoord(object.m_mesh, faceIndex, point,
+                                        u, v);
+    case PRIMITIVE_TORUS:
+        return false;
+    default:
+        assert(0);
+        return false;
+    }
+}
+
+/**
+ * @brief getTextureLod: get the level of detail of a texture from the
+ *                       footprint of a ray. The footprint is a disk across
+ *                       the ray, on the surface it's stretched along the
+ *                       ray by the incident angle. Its two axes are the ray
+ *                       differentials, the texture coordinates one axis away
+ *                       from the hit give the texels covered
+ * @param object: the object hit
+ * @param faceIndex: the face hit
+ * @param point: the hit in object space
+ * @param u: horizontal texture coordinate of the hit
+ * @param v: vertical texture coordinate of the hit
+ * @param d: direction of the ray
+ * @param norm: normal at the hit in world space
+ * @param footprint: width of the footprint at the hit
+ * @param invTransform: world to object transform of the object
+ * @return: the level of detail, 0 for the full resolution
+ */
+static REAL getTextureLod(const SceneObject& object,
+                          const int faceIndex,
+                          const Vector4& point,
+                          const REAL u,
+                          const REAL v,
+                          const Vector4& d,
+                          const Vector3& norm,
+                          const REAL footprint,
+                          const Matrix4x4& invTransform)
+{
+
+    Vector3 dir(d.x, d.y, d.z);
+    REAL cosine = dir.dot(norm);
+    Vector3 along = dir - norm * cosine;
+    if (along.lengthSquared() < EPSILON * EPSILON)
+    {
+        // A ray head on stretches no axis, any tangent will do
+        along = fabs(norm.x) < 0.5f ? Vector3(1, 0, 0).cross(norm) :
+                                      Vector3(0, 1, 0).cross(norm);
+    }
+    along = along.unit();
+    Vector3 across = norm.cross(along);
+    along  = along * (footprint / qMax((REAL)fabs(cosine),
+                                       (REAL)LOD_MIN_COSINE));
+    across = across * footprint;
+
+    const MipTexture* mipmap = object.m_texture.m_mipmap;
+    const Vector3* axes[2] = {&along, &across};
+    REAL texels = 0;
+    for (int i = 0; i < 2; i++)
+    {
+        Vector4 axis = invTransform * Vector4(axes[i]->x, axes[i]->y,
+                                              axes[i]->z, 0);
+        REAL u2 = u, v2 = v;
+        getIntersectTexCoord(object, faceIndex, point + axis, u2, v2);
+
+        // The coordinates wrap around at the seams of the round objects
+        REAL du = u2 - u;
+        REAL dv = v2 - v;
+        du = (du - floorf(du + 0.5f)) * (mipmap->getWidth() - 1);
+        dv = (dv - floorf(dv + 0.5f)) * (mipmap->getHeight() - 1);
+        texels = qMax(texels, (REAL)sqrtf(du * du + dv * dv));
+    }
+
+    // Magnified textures are read at the full resolution
+    return texels > 1 ? log2f(texels) : 0;
+}
 
 void doRayTrace(BGRA* data,
                 const int width,
@@ -22,86 +148,385 @@ void doRayTrace(BGRA* data,
                 const int beginIndex,
                 const int endIndex,
                 const CS123SceneGlobalData& global,
-                QVector<SceneObject>& objects,
+                const QVector<SceneObject>& objects,
+                const IntersectView& view,
                 const QList<CS123SceneLightData>& lights,
                 const Vector4& eyePos,
                 const float near,
                 const Matrix4x4& invViewTransMat,
                 KdTree* tree,
-                AABB extends)
+                Bvh* bvh,
+                AABB extends,
+                SampleBuffer* samples)
 {
 
     assert(beginIndex >= 0 && beginIndex <= endIndex);
     assert(endIndex <= width*height);
 
+    RayCone cone = getPrimaryCone(width, height, eyePos, near,
+                                  invViewTransMat);
     for (int i = beginIndex; i < endIndex; i++)
     {
         int row = i / width;
         int col = i - row * width;
 
-        Vector3 sumColor(0.f, 0.f, 0.f);
+        Vector4 eyePosNear, d;
+        generatePrimaryRay(col, row, width, height, eyePos, near,
+                           invViewTransMat, eyePosNear, d);
 
-        REAL weight = 1.f;
-        Vector2 poses[5];
-        poses[0] = Vector2(col, row);
-        int size = 1;
-        if (settings.useSupersampling)
+        // Same as recursiveTrace(), but the first hit is kept for the
+        // refine pass, it compares the objects of neighbouring pixels
+        CS123SceneColor color;
+        int objectIndex = -1;
+        if (settings.traceRaycursion > 0)
         {
-            poses[1] = Vector2(col - 0.5, row - 0.5);
-            poses[2] = Vector2(col - 0.5, row + 0.5);
-            poses[3] = Vector2(col + 0.5, row - 0.5);
-            poses[4] = Vector2(col + 0.5, row + 0.5);
-            weight = 1.f/5;
-            size = 5;
+            int faceIndex = -1;
+            REAL t = intersect(eyePosNear, view, d, objectIndex, faceIndex,
+                               tree, bvh, extends);
+            color = shadeIntersection(eyePosNear,
+                                      d,
+                                      cone,
+                                      t,
+                                      objectIndex,
+                                      faceIndex,
+                                      global,
+                                      objects,
+                                      view,
+                                      lights,
+                                      tree,
+                                      bvh,
+                                      extends,
+                                      -1,
+                                      settings.traceRaycursion - 1);
+            if (t <= 0)
+                objectIndex = -1;
         }
 
-        int k = 0;
-        do
+        if (samples)
+            samples->setCenter(i, color, objectIndex);
+        storePixel(data[i], Vector3(color.r, color.g, color.b));
+    }
+}
+
+void doPacketRayTrace(BGRA* data,
+                      const int width,
+                      const int height,
+                      const int x,
+                      const int y,
+                      const int tileWidth,
+                      const int tileHeight,
+                      const CS123SceneGlobalData& global,
+                      const QVector<SceneObject>& objects,
+                      const IntersectView& view,
+                      const QList<CS123SceneLightData>& lights,
+                      const Vector4& eyePos,
+                      const float near,
+                      const Matrix4x4& invViewTransMat,
+                      KdTree* tree,
+                      Bvh* bvh,
+                      AABB extends,
+                      SampleBuffer* samples)
+{
+
+    assert(x >= 0 && y >= 0);
+    assert(x + tileWidth <= width && y + tileHeight <= height);
+
+    RayCone cone = getPrimaryCone(width, height, eyePos, near,
+                                  invViewTransMat);
+    RayPacket packet;
+    for (int row = y; row < y + tileHeight; row += RAY_PACKET_WIDTH)
+    {
+        for (int col = x; col < x + tileWidth; col += RAY_PACKET_WIDTH)
         {
-            Vector4 pFilmCam(((REAL)(2 * poses[k].x)) / width - 1,
-                             1 - ((REAL)(2 * poses[k].y)) / height,
-                             -1,
-                             1);
-            CS123SceneColor color;
+            int packetWidth  = qMin(RAY_PACKET_WIDTH, x + tileWidth - col);
+            int packetHeight = qMin(RAY_PACKET_WIDTH, y + tileHeight - row);
 
-            Vector4 pFilmWorld = invViewTransMat*pFilmCam;
-            Vector4 d          = pFilmWorld - eyePos;
+            // Find the first hits of the whole packet at once, then shade
+            // each ray on its own, the secondary rays aren't coherent
+            generatePrimaryPacket(packet, col, row, packetWidth, packetHeight,
+                                  width, height, eyePos, near,
+                                  invViewTransMat);
+            intersectPacket(packet, view, tree, bvh, extends);
 
-            d = d.getNormalized();
-            Vector4 eyePosNear = eyePos + d * near;
+            for (int i = 0; i < packet.m_count; i++)
+            {
+                Vector4 pos(packet.m_origin[0][i],
+                            packet.m_origin[1][i],
+                            packet.m_origin[2][i],
+                            1);
+                Vector4 d(packet.m_dir[0][i],
+                          packet.m_dir[1][i],
+                          packet.m_dir[2][i],
+                          0);
+
+                CS123SceneColor color;
+                if (settings.traceRaycursion > 0)
+                    color = shadeIntersection(pos,
+                                              d,
+                                              cone,
+                                              packet.m_t[i],
+                                              packet.m_object[i],
+                                              packet.m_face[i],
+                                              global,
+                                              objects,
+                                              view,
+                                              lights,
+                                              tree,
+                                              bvh,
+                                              extends,
+                                              -1,
+                                              settings.traceRaycursion - 1);
+
+                int index = (row + i / packetWidth) * width +
+                        col + i % packetWidth;
+                if (samples)
+                {
+                    bool hit = settings.traceRaycursion > 0 &&
+                            packet.m_t[i] > 0;
+                    samples->setCenter(index, color,
+                                       hit ? packet.m_object[i] : -1);
+                }
+                storePixel(data[index], Vector3(color.r, color.g, color.b));
+            }
+        }
+    }
+}
+
+void doRefineTrace(BGRA* data,
+                   const int width,
+                   const int height,
+                   const int x,
+                   const int y,
+                   const int tileWidth,
+                   const int tileHeight,
+                   const CS123SceneGlobalData& global,
+                   const QVector<SceneObject>& objects,
+                   const IntersectView& view,
+                   const QList<CS123SceneLightData>& lights,
+                   const Vector4& eyePos,
+                   const float near,
+                   const Matrix4x4& invViewTransMat,
+                   KdTree* tree,
+                   Bvh* bvh,
+                   AABB extends,
+                   SampleBuffer& samples,
+                   const int step)
+{
+
+    assert(x >= 0 && y >= 0);
+    assert(x + tileWidth <= width && y + tileHeight <= height);
+    assert(step >= 0);
+
+    RayCone cone = getPrimaryCone(width, height, eyePos, near,
+                                  invViewTransMat);
+    for (int row = y; row < y + tileHeight; row++)
+    {
+        for (int col = x; col < x + tileWidth; col++)
+        {
+            int index = row * width + col;
+            int count = samples.getCount(index);
+
+            // Flat regions keep their center, only the edges and the
+            // contrasted pixels pay for more rays
+            int last = count;
+            if (count < samples.getMaxSamples() &&
+                    samples.checkRefine(col, row))
+                last = qMin(count + step, samples.getMaxSamples());
+
+            for (int k = count; k < last; k++)
+            {
+                float dx, dy;
+                samples.getSampleOffset(index, k, dx, dy);
+
+                Vector4 eyePosNear, d;
+                generatePrimaryRay(col + dx, row + dy, width, height, eyePos,
+                                   near, invViewTransMat, eyePosNear, d);
+
+                CS123SceneColor color;
+                color = recursiveTrace(eyePosNear,
+                                       d,
+                                       cone,
+                                       global,
+                                       objects,
+                                       view,
+                                       lights,
+                                       tree,
+                                       bvh,
+                                       extends,
+                                       -1,
+                                       settings.traceRaycursion);
+                samples.addSample(index, color);
+            }
+
+            storePixel(data[index], samples.getColor(index));
+        }
+    }
+}
+
+void doPreviewTrace(BGRA* data,
+                    const int width,
+                    const int height,
+                    const int x,
+                    const int y,
+                    const int tileWidth,
+                    const int tileHeight,
+                    const int step,
+                    const bool coarse,
+                    const CS123SceneGlobalData& global,
+                    const QVector<SceneObject>& objects,
+                    const IntersectView& view,
+                    const QList<CS123SceneLightData>& lights,
+                    const Vector4& eyePos,
+                    const float near,
+                    const Matrix4x4& invViewTransMat,
+                    KdTree* tree,
+                    Bvh* bvh,
+                    AABB extends)
+{
+
+    assert(x >= 0 && y >= 0);
+    assert(x + tileWidth <= width && y + tileHeight <= height);
+    assert(step > 0);
+
+    // The first block corner in the tile, the tiles needn't be a multiple
+    // of the step
+    int beginX = (x + step - 1) / step * step;
+    int beginY = (y + step - 1) / step * step;
+
+    RayCone cone = getPrimaryCone(width, height, eyePos, near,
+                                  invViewTransMat);
+
+    for (int row = beginY; row < y + tileHeight; row += step)
+    {
+        for (int col = beginX; col < x + tileWidth; col += step)
+        {
+            // A quarter of the corners were traced by the coarser level,
+            // their blocks cover this one already
+            if (!coarse && row % (2 * step) == 0 && col % (2 * step) == 0)
+                continue;
+
+            Vector4 eyePosNear, d;
+            generatePrimaryRay(col, row, width, height, eyePos, near,
+                               invViewTransMat, eyePosNear, d);
 
+            CS123SceneColor color;
             color = recursiveTrace(eyePosNear,
                                    d,
+                                   cone,
                                    global,
                                    objects,
+                                   view,
                                    lights,
                                    tree,
+                                   bvh,
                                    extends,
                                    -1,
                                    settings.traceRaycursion);
 
-            sumColor.x += weight * color.r;
-            sumColor.y += weight * color.g;
-            sumColor.z += weight * color.b;
+            BGRA pixel = data[row * width + col];
+            storePixel(pixel, Vector3(color.r, color.g, color.b));
 
-            k++;
+            int endX = qMin(col + step, width);
+            int endY = qMin(row + step, height);
+            for (int j = row; j < endY; j++)
+            {
+                for (int i = col; i < endX; i++)
+                    data[j * width + i] = pixel;
+            }
+        }
+    }
+}
+
+bool checkPacketTrace()
+{
+
+    return settings.usePacketTracing;
+}
+
+void generatePrimaryRay(const REAL x,
+                        const REAL y,
+                        const int width,
+                        const int height,
+                        const Vector4& eyePos,
+                        const float near,
+                        const Matrix4x4& invViewTransMat,
+                        Vector4& pos,
+                        Vector4& d)
+{
+
+    Vector4 pFilmCam(((REAL)(2 * x)) / width - 1,
+                     1 - ((REAL)(2 * y)) / height,
+                     -1,
+                     1);
+
+    Vector4 pFilmWorld = invViewTransMat*pFilmCam;
+    d                  = pFilmWorld - eyePos;
+
+    d   = d.getNormalized();
+    pos = eyePos + d * near;
+}
+
+RayCone getPrimaryCone(const int width,
+                       const int height,
+                       const Vector4& eyePos,
+                       const float near,
+                       const Matrix4x4& invViewTransMat)
+{
+
+    Vector4 pos, d, nextPos, nextD;
+    generatePrimaryRay(width / 2, height / 2, width, height, eyePos, near,
+                       invViewTransMat, pos, d);
+    generatePrimaryRay(width / 2 + 1, height / 2, width, height, eyePos,
+                       near, invViewTransMat, nextPos, nextD);
+
+    // The directions are normalized, their distance is the angle
+    RayCone cone;
+    cone.spread = (nextD - d).getMagnitude();
+    cone.width  = cone.spread * near;
+    return cone;
+}
 
-        }while (k < size);
+void generatePrimaryPacket(RayPacket& packet,
+                           const int x,
+                           const int y,
+                           const int packetWidth,
+                           const int packetHeight,
+                           const int width,
+                           const int height,
+                           const Vector4& eyePos,
+                           const float near,
+                           const Matrix4x4& invViewTransMat)
+{
 
-        sumColor = sumColor * 255;
+    assert(packetWidth > 0 && packetWidth <= RAY_PACKET_WIDTH);
+    assert(packetHeight > 0 && packetHeight <= RAY_PACKET_WIDTH);
 
-        mclamp(sumColor.x, 0.f, 255.f);data[i].r = sumColor.x;
-        mclamp(sumColor.y, 0.f, 255.f);data[i].g = sumColor.y;
-        mclamp(sumColor.z, 0.f, 255.f);data[i].b = sumColor.z;
+    packet.m_count = packetWidth * packetHeight;
+    for (int i = 0; i < RAY_PACKET_SIZE; i++)
+    {
+        // Unused rays repeat the last one, so every lane holds a valid ray
+        int ray = qMin(i, packet.m_count - 1);
+        Vector4 pos, d;
+        generatePrimaryRay(x + ray % packetWidth, y + ray / packetWidth,
+                           width, height, eyePos, near, invViewTransMat,
+                           pos, d);
+        for (int k = 0; k < 3; k++)
+        {
+            packet.m_origin[k][i] = pos.data[k];
+            packet.m_dir[k][i]    = d.data[k];
+        }
     }
 }
 
 CS123SceneColor recursiveTrace(const Vector4& pos,
                                const Vector4& d,
+                               const RayCone& cone,
                                const CS123SceneGlobalData& global,
-                               QVector<SceneObject>& objects,
+                               const QVector<SceneObject>& objects,
+                               const IntersectView& view,
                                const QList<CS123SceneLightData>& lights,
                                KdTree* tree,
+                               Bvh* bvh,
                                AABB extends,
                                int curIndex,
                                int count)
@@ -114,11 +539,35 @@ CS123SceneColor recursiveTrace(const Vector4& pos,
 
     count--;
 
-    Vector3 norm;
     int objectIndex = -1;
     int faceIndex = -1;
+    REAL t = intersect(pos, view, d, objectIndex, faceIndex, tree, bvh,
+                       extends);
+    return shadeIntersection(pos, d, cone, t, objectIndex, faceIndex, global,
+                             objects, view, lights, tree, bvh, extends,
+                             curIndex, count);
+}
+
+CS123SceneColor shadeIntersection(const Vector4& pos,
+                                  const Vector4& d,
+                                  const RayCone& cone,
+                                  const REAL t,
+                                  const int objectIndex,
+                                  const int faceIndex,
+                                  const CS123SceneGlobalData& global,
+                                  const QVector<SceneObject>& objects,
+                                  const IntersectView& view,
+                                  const QList<CS123SceneLightData>& lights,
+                                  KdTree* tree,
+                                  Bvh* bvh,
+                                  AABB extends,
+                                  int curIndex,
+                                  int count)
+{
+
+    CS123SceneColor result;
+    Vector3 norm;
     CS123SceneColor texColor;
-    REAL t = intersect(pos, objects, d, objectIndex, faceIndex, tree, extends);
     // if t > 0, then compute the intersect point and blend the color
     if (t > 0)
     {
@@ -128,12 +577,24 @@ CS123SceneColor recursiveTrace(const Vector4& pos,
             return r;
         }
 
+        // An object of a group is placed by the group's transform too
+        const SceneObject* instance = NULL;
+        const SceneObject& object   = getFlatObject(objects, objectIndex,
+                                                    &instance);
+        Matrix4x4 invTransform  = object.m_invTransform;
+        Matrix4x4 invTTransform = object.m_invTTransformWithoutTrans;
+        if (instance)
+        {
+            invTransform  = object.m_invTransform * instance->m_invTransform;
+            invTTransform = instance->m_invTTransformWithoutTrans *
+                    object.m_invTTransformWithoutTrans;
+        }
+
         Vector4 intersectPoint = pos + t * d;
         Vector4 eyeSpaceIntersectPoint =
-                objects[objectIndex].m_invTransform*pos +
-                t*objects[objectIndex].m_invTransform*d;
+                invTransform*pos + t*invTransform*d;
 
-        switch (objects[objectIndex].m_primitive.type)
+        switch (object.m_primitive.type)
         {
         case PRIMITIVE_CUBE:
             norm = getCubeNorm(faceIndex);
@@ -148,6 +609,8 @@ CS123SceneColor recursiveTrace(const Vector4& pos,
             norm = getSphereNorm(eyeSpaceIntersectPoint);
             break;
         case PRIMITIVE_MESH:
+            norm = getMeshNorm(object.m_mesh, faceIndex,
+                               eyeSpaceIntersectPoint);
             break;
         case PRIMITIVE_TORUS:
             break;
@@ -156,54 +619,38 @@ CS123SceneColor recursiveTrace(const Vector4& pos,
             break;
         }
 
-        if (objects[objectIndex].m_texture.m_textureHandle &&
-           settings.showTexture &&
-           objects[objectIndex].m_texture.m_texPointer)
+        Vector4 tempNorm = Vector4(norm.x, norm.y, norm.z, 0);
+        tempNorm = invTTransform * tempNorm;
+
+        // nomalize the new norm
+        norm = Vector3(tempNorm.x, tempNorm.y, tempNorm.z).unit();
+
+        REAL u, v;
+        if (settings.showTexture &&
+           object.m_texture.m_mipmap &&
+           getIntersectTexCoord(object, faceIndex, eyeSpaceIntersectPoint,
+                                u, v))
         {
-            switch (objects[objectIndex].m_primitive.type)
-            {
-            case PRIMITIVE_CUBE:
-                texColor = getCubeIntersectTexColor(objects[objectIndex],
-                                                    faceIndex,
-                                                    eyeSpaceIntersectPoint);
-                        break;
-            case PRIMITIVE_CYLINDER:
-                texColor = getCylinderIntersectTexColor(objects[objectIndex],
-                                                        faceIndex,
-                                                        eyeSpaceIntersectPoint);
-                        break;
-            case PRIMITIVE_CONE:
-                texColor = getConeIntersectTexColor(objects[objectIndex],
-                                                    faceIndex,
-                                                    eyeSpaceIntersectPoint);
-                        break;
-            case PRIMITIVE_SPHERE:
-                texColor = getSphereIntersectTexColor(objects[objectIndex],
-                                                      eyeSpaceIntersectPoint);
-                        break;
-            case PRIMITIVE_MESH:
-                        break;
-            case PRIMITIVE_TORUS:
-                        break;
-            default:assert(0);
-                        break;
-            }
+            // The footprint has grown along the ray up to the hit
+            REAL lod = 0;
+            if (settings.useMipmaps)
+                lod = getTextureLod(object, faceIndex, eyeSpaceIntersectPoint,
+                                    u, v, d, norm, cone.width + cone.spread * t,
+                                    invTransform);
+            texColor   = object.m_texture.m_mipmap->sample(u, v, lod);
+            texColor.a = 0;
         }
 
         CS123SceneColor colorNormal;
         CS123SceneColor colorReflection;
         CS123SceneColor colorRefraction;
 
-        Vector4 tempNorm = Vector4(norm.x, norm.y, norm.z, 0);
-        tempNorm = objects[objectIndex].m_invTTransformWithoutTrans * tempNorm;
-
-        // nomalize the new norm
-        norm = Vector3(tempNorm.x, tempNorm.y, tempNorm.z).unit();
-
         colorNormal = computeObjectColor(objectIndex,objects,
+                                         view,
                                          global,
                                          lights,
                                          tree,
+                                         bvh,
                                          extends,
                                          intersectPoint,
                                          norm,
@@ -213,12 +660,16 @@ CS123SceneColor recursiveTrace(const Vector4& pos,
         // if refecltion is enabled then do recursive retracing
         if (settings.useReflection )
         {
+            RayCone next;
+            next.width  = cone.width + cone.spread * t;
+            next.spread = cone.spread;
+
             REAL projection = -(d.x * norm.x + d.y * norm.y + d.z * norm.z);
             bool zeroReflection =
-                    EQ4(objects[objectIndex].m_primitive.material.cReflective.a,
-                        objects[objectIndex].m_primitive.material.cReflective.r,
-                        objects[objectIndex].m_primitive.material.cReflective.g,
-                        objects[objectIndex].m_primitive.material.cReflective.b,
+                    EQ4(object.m_primitive.material.cReflective.a,
+                        object.m_primitive.material.cReflective.r,
+                        object.m_primitive.material.cReflective.g,
+                        object.m_primitive.material.cReflective.b,
                         0);
 
             if (projection > 0 && global.ks > 0 && !zeroReflection)
@@ -231,24 +682,27 @@ CS123SceneColor recursiveTrace(const Vector4& pos,
 
                 colorReflection = recursiveTrace(intersectPoint,
                                                  reflection,
+                                                 next,
                                                  global,
                                                  objects,
+                                                 view,
                                                  lights,
                                                  tree,
+                                                 bvh,
                                                  extends,
                                                  curIndex,
                                                  count);
                 colorReflection *=
-                        objects[objectIndex].m_primitive.material.cReflective *
+                        object.m_primitive.material.cReflective *
                         global.ks;
             }
 
 
             bool zeroRefraction =
-                    EQ4(objects[objectIndex].m_primitive.material.cTransparent.a,
-                        objects[objectIndex].m_primitive.material.cTransparent.r,
-                        objects[objectIndex].m_primitive.material.cTransparent.g,
-                        objects[objectIndex].m_primitive.material.cTransparent.b,
+                    EQ4(object.m_primitive.material.cTransparent.a,
+                        object.m_primitive.material.cTransparent.r,
+                        object.m_primitive.material.cTransparent.g,
+                        object.m_primitive.material.cTransparent.b,
                         0);
 
             if (!zeroRefraction)
@@ -258,7 +712,8 @@ CS123SceneColor recursiveTrace(const Vector4& pos,
                 if (curIndex != -1)
                 {
                     // The ray may be inside an object
-                    n1 = objects[curIndex].m_primitive.material.ior;
+                    n1 = getFlatObject(objects,
+                                       curIndex).m_primitive.material.ior;
                     Vector3 normFace;
                     // bump the start point to be a little bit
                     if (d.x*norm.x + d.y*norm.y + d.z*norm.z > 0)
@@ -270,22 +725,21 @@ CS123SceneColor recursiveTrace(const Vector4& pos,
                             intersectPoint + Vector4(-normFace.x, -normFace.y,
                                                      -normFace.z, 0) * EPSILON * 2;
 
-                    QMap<int, int> indexMap;
-                    QVector<SceneObject> list = checkPos(objects, bumpPos,
-                                                         indexMap);
-                    int dummyObjectIndex = -1, dummyFaceindex = -1;
-
-                    REAL t2 = -1;
-                    if (list.size() != 0)
-                        t2 = intersect(bumpPos, list,
-                                       Vector4(-normFace.x, -normFace.y,
-                                               -normFace.z, 0),
-                                       dummyObjectIndex, dummyFaceindex,
-                                       tree, extends, true);
+                    // Find the object the ray goes into, if any
+                    int enclosingIndex = -1, dummyFaceIndex = -1;
+                    REAL t2 = intersectEnclosing(bumpPos,
+                                                 Vector4(-normFace.x,
+                                                         -normFace.y,
+                                                         -normFace.z, 0),
+                                                 view, tree, bvh,
+                                                 enclosingIndex,
+                                                 dummyFaceIndex);
                     if (t2 > 0)
                     {
-                        n2 = list[dummyObjectIndex].m_primitive.material.ior;
-                        curIndex = indexMap[dummyObjectIndex];
+                        const SceneObject& enclosing =
+                                getFlatObject(objects, enclosingIndex);
+                        n2 = enclosing.m_primitive.material.ior;
+                        curIndex = enclosingIndex;
                     }
                     else
                     {
@@ -298,7 +752,7 @@ CS123SceneColor recursiveTrace(const Vector4& pos,
                 {
                     // If curIndex == -1, then the ray is from air
                     n1 = 1;
-                    n2 = objects[objectIndex].m_primitive.material.ior;
+                    n2 = object.m_primitive.material.ior;
                     curIndex = objectIndex;
                 }
 
@@ -314,16 +768,19 @@ CS123SceneColor recursiveTrace(const Vector4& pos,
                     intersectPoint.w = 1;
                     colorRefraction = recursiveTrace(intersectPoint,
                                                       refraction,
+                                                      next,
                                                       global,
                                                       objects,
+                                                      view,
                                                       lights,
                                                       tree,
+                                                      bvh,
                                                       extends,
                                                       curIndex,
                                                       count
                                                      );
                     colorRefraction *=
-                         objects[objectIndex].m_primitive.material.cTransparent*
+                         object.m_primitive.material.cTransparent*
                          global.ks;
                 }
             }
@@ -334,10 +791,12 @@ CS123SceneColor recursiveTrace(const Vector4& pos,
 }
 
 CS123SceneColor computeObjectColor(const int& objectIndex,
-                                   QVector<SceneObject>& objects,
+                                   const QVector<SceneObject>& objects,
+                                   const IntersectView& view,
                                    const CS123SceneGlobalData& global,
                                    const QList<CS123SceneLightData>& lights,
                                    KdTree* tree,
+                                   Bvh* bvh,
                                    AABB extends,
                                    const Vector4& pos,
                                    const Vector3& norm,
@@ -345,7 +804,7 @@ CS123SceneColor computeObjectColor(const int& objectIndex,
                                    const CS123SceneColor& texture)
 {
 
-    SceneObject object = objects[objectIndex];
+    const SceneObject& object = getFlatObject(objects, objectIndex);
     CS123SceneColor ambient = object.m_primitive.material.cAmbient;
     ambient *= global.ka;
     ambient.a = 0;
@@ -354,23 +813,29 @@ CS123SceneColor computeObjectColor(const int& objectIndex,
     // specular color, and reflective color(recursive)
     CS123SceneColor lightSum;
 
+    Vector4 sight = (eyePos - pos).getNormalized();
+    ShapeVec shapeNorm  = shapeVec(norm.x, norm.y, norm.z);
+    ShapeVec shapeSight = shapeVec(sight.x, sight.y, sight.z);
+
     for (int i = 0; i < lights.size(); i++)
     {
-        CS123SceneLightData currentLight = lights[i];
+        const CS123SceneLightData& currentLight = lights[i];
         Vector4 lightDir = Vector4(0, 1, 0, 0);
 
         bool unapplicable = false;
 
         REAL attenuation = 1;
+        REAL dLight      = POS_INF;
         if (currentLight.type != LIGHT_DIRECTIONAL)
         {
             // compute the attenuation
-            REAL dLight = sqrt(SQ(currentLight.pos.x - pos.x) +
-                               SQ(currentLight.pos.y - pos.y) +
-                               SQ(currentLight.pos.z - pos.z));
-            attenuation = MIN(1.0 / (currentLight.function.x +
-                                     currentLight.function.y * dLight +
-                                     currentLight.function.z * SQ(dLight)), 1);
+            attenuation = shapeLightAttenuation(
+                        shapeVec(currentLight.pos.x, currentLight.pos.y,
+                                 currentLight.pos.z),
+                        shapeVec(pos.x, pos.y, pos.z),
+                        shapeVec(currentLight.function.x,
+                                 currentLight.function.y,
+                                 currentLight.function.z), &dLight);
         }
 
         CS123SceneColor lightIntensity = currentLight.color;
@@ -407,20 +872,12 @@ CS123SceneColor computeObjectColor(const int& objectIndex,
                 lightDir = (currentLight.pos - pos).getNormalized();
                 Vector4 majorDir = -currentLight.dir.getNormalized();
 
-                REAL lightRadians  = currentLight.penumbra / 180.0 * M_PI;
-                REAL spotIntensity = lightDir.dot(majorDir);
-
-                // the object is not in the cone
-                if (spotIntensity < cos(lightRadians))
-                {
-                    lightIntensity = CS123SceneColor(0);
-                }
-                else
-                {
-                    REAL temp = pow(spotIntensity, 5);
-                    lightIntensity *= temp;
-                    lightIntensity.a = 0;
-                }
+                // 0 when the object is not in the cone
+                lightIntensity *= shapeSpotFactor(
+                            shapeVec(lightDir.x, lightDir.y, lightDir.z),
+                            shapeVec(majorDir.x, majorDir.y, majorDir.z),
+                            currentLight.penumbra);
+                lightIntensity.a = 0;
             }
             else
             {
@@ -443,42 +900,19 @@ CS123SceneColor computeObjectColor(const int& objectIndex,
         if (unapplicable)
             continue;
 
-        REAL dotLN =
-                lightDir.x * norm.x + lightDir.y * norm.y + lightDir.z * norm.z;
-        // in intersect assignment, this is used for checking if the object is
-        // in shadow
-        if (dotLN < 0.0)
-            dotLN = 0.0;
-
-       // Check if the object is in shadow of light
-        if (settings.useShadow)
-        {
-            int objectIndex2 = -1;
-            int faceIndex    = -1;
-            Vector4 lightPos;
-
-            if (currentLight.type != LIGHT_DIRECTIONAL)
-            {
-                lightPos = currentLight.pos;
-                intersect(lightPos, objects, -lightDir, objectIndex2, faceIndex,
-                          tree, extends);
-            }
-            else
-            {
-                // For directional light we use a dummy position
-                intersect(pos + Vector4(norm.x, norm.y, norm.z, 0) * EPSILON,
-                          objects, (lightDir), objectIndex2, faceIndex, tree,
-                          extends);
-            }
+        ShapeVec shapeLightDir = shapeVec(lightDir.x, lightDir.y, lightDir.z);
+        REAL dotLN = shapeDiffuseFactor(shapeLightDir, shapeNorm);
 
-            if (objectIndex2 != objectIndex && objectIndex2 != -1)
-                continue;
-        }
+        // Check if the object is in shadow of light, any other object
+        // between the point and the light will do
+        if (settings.useShadow &&
+            occlude(pos, view, lightDir, EPSILON, dLight, objectIndex,
+                    settings.useTransparentShadows, tree, bvh, extends))
+            continue;
 
         // compute diffuse light color
         // if using texture mapping, then blend the diffuse with diffuse color
-        if (settings.showTexture && object.m_texture.m_textureHandle &&
-            object.m_texture.m_texPointer)
+        if (settings.showTexture && object.m_texture.m_texPointer)
         {
             lightSum +=
                     attenuation * lightIntensity * dotLN *
@@ -491,18 +925,8 @@ CS123SceneColor computeObjectColor(const int& objectIndex,
                     (global.kd *((object.m_primitive.material.cDiffuse)));
         }
 
-        Vector4 reflection = getReflectionDir(norm, -lightDir);
-        Vector4 sight = eyePos - pos;
-        sight = sight.getNormalized();
-
-        REAL dotEN  =
-                sight.x * reflection.x + sight.y * reflection.y +
-                sight.z * reflection.z;
-
-        if (dotEN < 0.0)
-            dotEN = 0.0;
-
-        dotEN = pow(dotEN, object.m_primitive.material.shininess);
+        REAL dotEN = shapeSpecularFactor(shapeLightDir, shapeNorm, shapeSight,
+                                         object.m_primitive.material.shininess);
 
         lightSum +=
                 attenuation * lightIntensity * dotEN * global.ks *
@@ -10,6 +10,24 @@
 
 #include "CS123SceneData.h"
 #include "scene.h"
+#include "packet_intersect.h"
+#include "sample_buffer.h"
+
+#define LOD_MIN_COSINE 0.01f // Smallest cosine of the incident angle a
+                             // texture footprint is stretched by
+
+/**
+ * @struct: RayCone
+ * @brief The RayCone struct is the footprint of a ray, its ray differentials
+ *        approximated by a cone around it. The cone of a primary ray spans
+ *        a pixel, the secondary rays carry on from the width at their
+ *        start, as if every surface was flat
+ */
+struct RayCone
+{
+    REAL width; // Width of the footprint at the start of the ray
+    REAL spread; // Growth of the width per unit of distance
+};
 
 /**
  * @brief doRayTrace: do ray tracing, inner wrapper function.
@@ -20,12 +38,16 @@
  * @param endIndex: endIndex of pixels
  * @param global: global scene data
  * @param objects: object list
+ * @param view: the objects as seen by the intersection loops
  * @param lights: light data
  * @param eyePos: eye position
  * @param near: near plane
  * @param invViewTransMat: inverse of view transformation matrix
  * @param tree: pointer to the kdtree
+ * @param bvh: pointer to the BVH
  * @param extends: the bounding box of the scene
+ * @param samples: the buffer the centers are stored in for supersampling,
+ *                 NULL for none
  */
 void doRayTrace(BGRA* data,
                 const int width,
@@ -33,22 +55,232 @@ void doRayTrace(BGRA* data,
                 const int beginIndex,
                 const int endIndex,
                 const CS123SceneGlobalData& global,
-                QVector<SceneObject>& objects,
+                const QVector<SceneObject>& objects,
+                const IntersectView& view,
                 const QList<CS123SceneLightData>& lights,
                 const Vector4& eyePos,
                 const float near,
                 const Matrix4x4& invViewTransMat,
                 KdTree* tree,
-                AABB extends);
+                Bvh* bvh,
+                AABB extends,
+                SampleBuffer* samples);
+
+/**
+ * @brief doPacketRayTrace: do ray tracing of a tile, the primary rays are
+ *                          intersected in packets of RAY_PACKET_WIDTH x
+ *                          RAY_PACKET_WIDTH pixels
+ * @param data: pixels
+ * @param width: width of canvas
+ * @param height: height of canvas
+ * @param x: left column of the tile
+ * @param y: top row of the tile
+ * @param tileWidth: width of the tile
+ * @param tileHeight: height of the tile
+ * @param global: global scene data
+ * @param objects: object list
+ * @param view: the objects as seen by the intersection loops
+ * @param lights: light data
+ * @param eyePos: eye position
+ * @param near: near plane
+ * @param invViewTransMat: inverse of view transformation matrix
+ * @param tree: pointer to the kdtree
+ * @param bvh: pointer to the BVH
+ * @param extends: the bounding box of the scene
+ * @param samples: the buffer the centers are stored in for supersampling,
+ *                 NULL for none
+ */
+void doPacketRayTrace(BGRA* data,
+                      const int width,
+                      const int height,
+                      const int x,
+                      const int y,
+                      const int tileWidth,
+                      const int tileHeight,
+                      const CS123SceneGlobalData& global,
+                      const QVector<SceneObject>& objects,
+                      const IntersectView& view,
+                      const QList<CS123SceneLightData>& lights,
+                      const Vector4& eyePos,
+                      const float near,
+                      const Matrix4x4& invViewTransMat,
+                      KdTree* tree,
+                      Bvh* bvh,
+                      AABB extends,
+                      SampleBuffer* samples);
+
+/**
+ * @brief doRefineTrace: add samples to the pixels of a tile whose center
+ *                       differs from a neighbour's and write the mean of
+ *                       the samples of every pixel. The centers of the
+ *                       whole canvas have to be traced before
+ * @param data: pixels
+ * @param width: width of canvas
+ * @param height: height of canvas
+ * @param x: left column of the tile
+ * @param y: top row of the tile
+ * @param tileWidth: width of the tile
+ * @param tileHeight: height of the tile
+ * @param global: global scene data
+ * @param objects: object list
+ * @param view: the objects as seen by the intersection loops
+ * @param lights: light data
+ * @param eyePos: eye position
+ * @param near: near plane
+ * @param invViewTransMat: inverse of view transformation matrix
+ * @param tree: pointer to the kdtree
+ * @param bvh: pointer to the BVH
+ * @param extends: the bounding box of the scene
+ * @param samples: the samples of the canvas
+ * @param step: most samples added to a pixel
+ */
+void doRefineTrace(BGRA* data,
+                   const int width,
+                   const int height,
+                   const int x,
+                   const int y,
+                   const int tileWidth,
+                   const int tileHeight,
+                   const CS123SceneGlobalData& global,
+                   const QVector<SceneObject>& objects,
+                   const IntersectView& view,
+                   const QList<CS123SceneLightData>& lights,
+                   const Vector4& eyePos,
+                   const float near,
+                   const Matrix4x4& invViewTransMat,
+                   KdTree* tree,
+                   Bvh* bvh,
+                   AABB extends,
+                   SampleBuffer& samples,
+                   const int step);
+
+/**
+ * @brief doPreviewTrace: trace a preview level of a tile, one pixel of every
+ *                        step x step block is traced and fills its block.
+ *                        The blocks are aligned to the canvas
+ * @param data: pixels
+ * @param width: width of canvas
+ * @param height: height of canvas
+ * @param x: left column of the tile
+ * @param y: top row of the tile
+ * @param tileWidth: width of the tile
+ * @param tileHeight: height of the tile
+ * @param step: pixels per side of the blocks
+ * @param coarse: true for the coarsest level, the other levels skip the
+ *                pixels traced by the level of twice the step
+ * @param global: global scene data
+ * @param objects: object list
+ * @param view: the objects as seen by the intersection loops
+ * @param lights: light data
+ * @param eyePos: eye position
+ * @param near: near plane
+ * @param invViewTransMat: inverse of view transformation matrix
+ * @param tree: pointer to the kdtree
+ * @param bvh: pointer to the BVH
+ * @param extends: the bounding box of the scene
+ */
+void doPreviewTrace(BGRA* data,
+                    const int width,
+                    const int height,
+                    const int x,
+                    const int y,
+                    const int tileWidth,
+                    const int tileHeight,
+                    const int step,
+                    const bool coarse,
+                    const CS123SceneGlobalData& global,
+                    const QVector<SceneObject>& objects,
+                    const IntersectView& view,
+                    const QList<CS123SceneLightData>& lights,
+                    const Vector4& eyePos,
+                    const float near,
+                    const Matrix4x4& invViewTransMat,
+                    KdTree* tree,
+                    Bvh* bvh,
+                    AABB extends);
+
+/**
+ * @brief checkPacketTrace: check whether frames should be traced with
+ *                          doPacketRayTrace()
+ * @return: true for packets and false for single rays
+ */
+bool checkPacketTrace();
+
+/**
+ * @brief generatePrimaryRay: generate the ray through a point of the film
+ * @param x: column of the point
+ * @param y: row of the point
+ * @param width: width of canvas
+ * @param height: height of canvas
+ * @param eyePos: eye position
+ * @param near: near plane
+ * @param invViewTransMat: inverse of view transformation matrix
+ * @param pos: start of the ray on the near plane, should be returned
+ * @param d: normalized direction, should be returned
+ */
+void generatePrimaryRay(const REAL x,
+                        const REAL y,
+                        const int width,
+                        const int height,
+                        const Vector4& eyePos,
+                        const float near,
+                        const Matrix4x4& invViewTransMat,
+                        Vector4& pos,
+                        Vector4& d);
+
+/**
+ * @brief getPrimaryCone: get the cone of the primary rays, the angle between
+ *                        the rays of two neighbouring pixels at the center
+ *                        of the film
+ * @param width: width of canvas
+ * @param height: height of canvas
+ * @param eyePos: eye position
+ * @param near: near plane
+ * @param invViewTransMat: inverse of view transformation matrix
+ * @return: the cone at the start of the rays, on the near plane
+ */
+RayCone getPrimaryCone(const int width,
+                       const int height,
+                       const Vector4& eyePos,
+                       const float near,
+                       const Matrix4x4& invViewTransMat);
+
+/**
+ * @brief generatePrimaryPacket: generate the rays of a block of pixels, row
+ *                               by row
+ * @param packet: the packet, should be returned
+ * @param x: left column of the block
+ * @param y: top row of the block
+ * @param packetWidth: width of the block, at most RAY_PACKET_WIDTH
+ * @param packetHeight: height of the block, at most RAY_PACKET_WIDTH
+ * @param width: width of canvas
+ * @param height: height of canvas
+ * @param eyePos: eye position
+ * @param near: near plane
+ * @param invViewTransMat: inverse of view transformation matrix
+ */
+void generatePrimaryPacket(RayPacket& packet,
+                           const int x,
+                           const int y,
+                           const int packetWidth,
+                           const int packetHeight,
+                           const int width,
+                           const int height,
+                           const Vector4& eyePos,
+                           const float near,
+                           const Matrix4x4& invViewTransMat);
 
 /**
  * @brief recursiveTrace: recursive function calls
  * @param pos: position or eye or next start point
  * @param d: direction vector
+ * @param cone: the footprint of the ray
  * @param global: global scene data
  * @param objects: object list
+ * @param view: the objects as seen by the intersection loops
  * @param lights: light data
  * @param tree: pointer to the tree
+ * @param bvh: pointer to the BVH
  * @param extends: bounding box of the scene
  * @param curIndex: current index of pixels
  * @param count: recursive depth count;
@@ -56,21 +288,62 @@ void doRayTrace(BGRA* data,
  */
 CS123SceneColor recursiveTrace(const Vector4& pos,
                                const Vector4& d,
+                               const RayCone& cone,
                                const CS123SceneGlobalData& global,
-                               QVector<SceneObject>& objects,
+                               const QVector<SceneObject>& objects,
+                               const IntersectView& view,
                                const QList<CS123SceneLightData>& lights,
                                KdTree* tree,
+                               Bvh* bvh,
                                AABB extends,
                                int curIndex,
                                int count);
 
+/**
+ * @brief shadeIntersection: compute the color of a ray from its closest hit,
+ *                           the second half of recursiveTrace()
+ * @param pos: position or eye or next start point
+ * @param d: direction vector
+ * @param cone: the footprint of the ray
+ * @param t: 't' value of the hit, not positive for a miss
+ * @param objectIndex: index of the hit object
+ * @param faceIndex: index of the hit face
+ * @param global: global scene data
+ * @param objects: object list
+ * @param view: the objects as seen by the intersection loops
+ * @param lights: light data
+ * @param tree: pointer to the tree
+ * @param bvh: pointer to the BVH
+ * @param extends: bounding box of the scene
+ * @param curIndex: current index of pixels
+ * @param count: recursive depth count left for the secondary rays
+ * @return: result color
+ */
+CS123SceneColor shadeIntersection(const Vector4& pos,
+                                  const Vector4& d,
+                                  const RayCone& cone,
+                                  const REAL t,
+                                  const int objectIndex,
+                                  const int faceIndex,
+                                  const CS123SceneGlobalData& global,
+                                  const QVector<SceneObject>& objects,
+                                  const IntersectView& view,
+                                  const QList<CS123SceneLightData>& lights,
+                                  KdTree* tree,
+                                  Bvh* bvh,
+                                  AABB extends,
+                                  int curIndex,
+                                  int count);
+
 /**
  * @brief computeObjectColor: compute the color at specific position
  * @param objectIndex: object index in the object list
  * @param objects: object list
+ * @param view: the objects as seen by the intersection loops
  * @param global: global scene data
  * @param lights: light data
  * @param tree: pointer to the tree
+ * @param bvh: pointer to the BVH
  * @param extends: bounding box of the scene
  * @param pos: position of intersection
  * @param norm: normal at that position
@@ -79,10 +352,12 @@ CS123SceneColor recursiveTrace(const Vector4& pos,
  * @return: result color
  */
 CS123SceneColor computeObjectColor(const int& objectIndex,
-                                   QVector<SceneObject>& objects,
+                                   const QVector<SceneObject>& objects,
+                                   const IntersectView& view,
                                    const CS123SceneGlobalData& global,
                                    const QList<CS123SceneLightData>& lights,
                                    KdTree* tree,
+                                   Bvh* bvh,
                                    AABB extends,
                                    const Vector4& pos,
                                    const Vector3& norm,
@@ -0,0 +1,137 @@
+/*!
+    @file sample_buffer.cpp
+    @desc: definitions of SampleBuffer class
+    @author: yanli
+    @date: May 2013
+ */
+
+#include "sample_buffer.h"
+#include "shape_math.h"
+#include <assert.h>
+#include <math.h>
+
+SampleBuffer::SampleBuffer()
+{
+
+    m_centers         = NULL;
+    m_objects         = NULL;
+    m_sums            = NULL;
+    m_counts          = NULL;
+    m_width           = 0;
+    m_height          = 0;
+    m_maxSamples      = 0;
+    m_gridSize        = 1;
+    m_contrast        = 0;
+    m_empty           = true;
+    m_totalSamples    = 0;
+    m_samplesPerPixel = 0;
+    m_refinedRatio    = 0;
+    m_maxCount        = 0;
+}
+
+void SampleBuffer::init(int width, int height, int maxSamples, float contrast)
+{
+
+    assert(width > 0 && height > 0);
+    assert(maxSamples > 0);
+
+    if (width != m_width || height != m_height)
+    {
+        m_width  = width;
+        m_height = height;
+
+        // Allocate only when the canvas changes, a frame like the last
+        // reuses the buffers
+        int size = width * height;
+        m_centerData.resize(size * 3);
+        m_objectData.resize(size);
+        m_sumData.resize(size * 3);
+        m_countData.resize(size);
+        m_centers = m_centerData.data();
+        m_objects = m_objectData.data();
+        m_sums    = m_sumData.data();
+        m_counts  = m_countData.data();
+        reset();
+    }
+
+    if (maxSamples != m_maxSamples || contrast != m_contrast)
+    {
+        m_maxSamples = maxSamples;
+        m_contrast   = contrast;
+        m_gridSize   = shapeSampleGridSize(maxSamples);
+        reset();
+    }
+}
+
+void SampleBuffer::reset()
+{
+
+    m_empty        = true;
+    m_totalSamples = 0;
+}
+
+bool SampleBuffer::checkRefine(int x, int y) const
+{
+
+    assert(x >= 0 && x < m_width && y >= 0 && y < m_height);
+
+    int index = y * m_width + x;
+    int neighbours[4];
+    int count = 0;
+    if (x > 0)
+        neighbours[count++] = index - 1;
+    if (x < m_width - 1)
+        neighbours[count++] = index + 1;
+    if (y > 0)
+        neighbours[count++] = index - m_width;
+    if (y < m_height - 1)
+        neighbours[count++] = index + m_width;
+
+    const float* center = m_centers + index * 3;
+    for (int i = 0; i < count; i++)
+    {
+        // An edge between objects is refined even when both sides have the
+        // same color, the color of the edge pixel is a mix of the two
+        if (m_objects[neighbours[i]] != m_objects[index])
+            return true;
+
+        const float* other = m_centers + neighbours[i] * 3;
+        for (int k = 0; k < 3; k++)
+        {
+            if (fabsf(other[k] - center[k]) > m_contrast)
+                return true;
+        }
+    }
+    return false;
+}
+
+void SampleBuffer::getSampleOffset(int index, int sample,
+                                   float& dx, float& dy) const
+{
+
+    assert(sample >= 0 && sample < m_maxSamples);
+    shapeSampleOffset(index, sample, m_gridSize, &dx, &dy);
+}
+
+void SampleBuffer::countSamples()
+{
+
+    long long total = 0;
+    int refined = 0;
+    int maxCount = 0;
+    int size = m_width * m_height;
+    for (int i = 0; i < size; i++)
+    {
+        total += m_counts[i];
+        if (m_counts[i] > 1)
+            refined++;
+        maxCount = qMax(maxCount, m_counts[i]);
+    }
+
+    // The total is cleared by reset(), so this counts the centers too
+    long long traced = total - m_totalSamples;
+    m_totalSamples    = total;
+    m_samplesPerPixel = size > 0 ? (float)traced / size : 0;
+    m_refinedRatio    = size > 0 ? (float)refined / size : 0;
+    m_maxCount        = maxCount;
+}
@@ -0,0 +1,162 @@
+/*!
+    @file sample_buffer.h
+    @desc: declarations of SampleBuffer class
+    @author: yanli
+    @date: May 2013
+ */
+
+#ifndef SAMPLE_BUFFER_H
+#define SAMPLE_BUFFER_H
+
+#include "CS123SceneData.h"
+#include "vector.h"
+#include <QVector>
+#include "defaults.h"
+
+/**
+ * @class: SampleBuffer
+ * @brief The SampleBuffer class holds the samples of adaptive supersampling.
+ *        A frame first traces the center of every pixel, then refines only
+ *        the pixels whose center differs from a neighbour's, in object or
+ *        in color. The sums are kept in floats so that progressive frames
+ *        can keep adding jittered samples to them
+ */
+class SampleBuffer
+{
+public:
+
+    SampleBuffer();
+
+    /**
+     * @brief init: size the buffers for the canvas, the samples are dropped
+     *              when the canvas or the sampling settings change
+     * @param width: width of the canvas
+     * @param height: height of the canvas
+     * @param maxSamples: most samples of a pixel
+     * @param contrast: color difference to a neighbour that refines a pixel
+     */
+    void init(int width, int height, int maxSamples, float contrast);
+
+    /**
+     * @brief reset: drop the samples, the next frame traces the centers again
+     */
+    void reset();
+
+    /**
+     * @brief setCenter: store the center sample of a pixel
+     * @param index: index of the pixel
+     * @param color: the color of the sample
+     * @param objectIndex: the object hit first, -1 for none
+     */
+    inline void setCenter(int index, const CS123SceneColor& color,
+                          int objectIndex)
+    {
+
+        float* center = m_centers + index * 3;
+        center[0] = color.r;
+        center[1] = color.g;
+        center[2] = color.b;
+        m_objects[index] = objectIndex;
+
+        float* sum = m_sums + index * 3;
+        sum[0] = color.r;
+        sum[1] = color.g;
+        sum[2] = color.b;
+        m_counts[index] = 1;
+    }
+
+    /**
+     * @brief addSample: add a sample to the sum of a pixel
+     * @param index: index of the pixel
+     * @param color: the color of the sample
+     */
+    inline void addSample(int index, const CS123SceneColor& color)
+    {
+
+        float* sum = m_sums + index * 3;
+        sum[0] += color.r;
+        sum[1] += color.g;
+        sum[2] += color.b;
+        m_counts[index]++;
+    }
+
+    /**
+     * @brief getColor: get the mean of the samples of a pixel
+     * @param index: index of the pixel
+     * @return: the color
+     */
+    inline Vector3 getColor(int index) const
+    {
+
+        const float* sum = m_sums + index * 3;
+        float weight = 1.f / m_counts[index];
+        return Vector3(sum[0] * weight, sum[1] * weight, sum[2] * weight);
+    }
+
+    /**
+     * @brief checkRefine: check whether a pixel needs more samples than its
+     *                     center, the centers of all of the pixels have to
+     *                     be traced
+     * @param x: column of the pixel
+     * @param y: row of the pixel
+     * @return: true if the pixel lies on an edge or in a contrasted region
+     */
+    bool checkRefine(int x, int y) const;
+
+    /**
+     * @brief getSampleOffset: get where a sample lies in its pixel. Sample 0
+     *                         is the center, the others are jittered in the
+     *                         cells of a grid over the pixel, so the same
+     *                         sample is traced whether it's added in one
+     *                         frame or over several
+     * @param index: index of the pixel
+     * @param sample: index of the sample
+     * @param dx: offset from the center in [-0.5, 0.5), should be returned
+     * @param dy: offset from the center in [-0.5, 0.5), should be returned
+     */
+    void getSampleOffset(int index, int sample, float& dx, float& dy) const;
+
+    /**
+     * @brief countSamples: update the statistics after a frame
+     */
+    void countSamples();
+
+    /**
+     * Getters
+     */
+    bool isEmpty() const { return m_empty; }
+    int getCount(int index) const { return m_counts[index]; }
+    int getMaxSamples() const { return m_maxSamples; }
+    float getSamplesPerPixel() const { return m_samplesPerPixel; }
+    float getRefinedRatio() const { return m_refinedRatio; }
+    int getMaxCount() const { return m_maxCount; }
+
+    /**
+     * Setters
+     */
+    void setFilled() { m_empty = false; }
+    void setCount(int index, int count) { m_counts[index] = count; }
+
+private:
+
+    QVector<float> m_centerData; // Colors of the center samples
+    QVector<int> m_objectData; // Objects hit by the center samples
+    QVector<float> m_sumData; // Sums of the colors of the samples
+    QVector<int> m_countData; // Number of samples of the pixels
+    float* m_centers; // Data of m_centerData, 3 floats per pixel
+    int* m_objects; // Data of m_objectData
+    float* m_sums; // Data of m_sumData, 3 floats per pixel
+    int* m_counts; // Data of m_countData
+    int m_width; // Width of the canvas
+    int m_height; // Height of the canvas
+    int m_maxSamples; // Most samples of a pixel
+    int m_gridSize; // Cells per side of the grid of the jittered samples
+    float m_contrast; // Color difference refining a pixel
+    bool m_empty; // The centers have to be traced again
+    long long m_totalSamples; // Samples summed up to the last frame
+    float m_samplesPerPixel; // Samples traced per pixel in the last frame
+    float m_refinedRatio; // Ratio of the pixels with more than one sample
+    int m_maxCount; // Most samples of a pixel up to the last frame
+};
+
+#endif // SAMPLE_BUFFER_H
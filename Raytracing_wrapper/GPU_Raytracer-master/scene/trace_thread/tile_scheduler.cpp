@@ -0,0 +1,141 @@
+/*!
+    @file tile_scheduler.cpp
+    @desc: definitions of TileScheduler class
+    @author: yanli
+    @date: May 2013
+ */
+
+#include "tile_scheduler.h"
+#include <QPair>
+#include <assert.h>
+#include <algorithm>
+
+/**
+ * @brief compareTileCode: order tiles by their Morton code
+ */
+static bool compareTileCode(const QPair<unsigned, Tile>& a,
+                            const QPair<unsigned, Tile>& b)
+{
+    return a.first < b.first;
+}
+
+TileScheduler::TileScheduler()
+{
+
+    m_queues      = NULL;
+    m_workerCount = 0;
+    m_tileSize    = TILE_SIZE;
+    m_width       = 0;
+    m_height      = 0;
+}
+
+TileScheduler::~TileScheduler()
+{
+
+    if (m_queues)
+        delete []m_queues;
+}
+
+void TileScheduler::init(int width, int height, int tileSize, int workerCount)
+{
+
+    assert(width > 0 && height > 0);
+    assert(tileSize > 0 && workerCount > 0);
+
+    m_stolen.store(0);
+
+    if (width != m_width || height != m_height || tileSize != m_tileSize)
+    {
+        m_width    = width;
+        m_height   = height;
+        m_tileSize = tileSize;
+
+        // Build the tiles and sort them along the Morton curve, so that a
+        // run of tiles covers a compact region of the canvas
+        int columns = (width + tileSize - 1) / tileSize;
+        int rows    = (height + tileSize - 1) / tileSize;
+
+        QVector< QPair<unsigned, Tile> > codes;
+        codes.reserve(columns * rows);
+
+        for (int j = 0; j < rows; j++)
+        {
+            for (int i = 0; i < columns; i++)
+            {
+                Tile tile;
+                tile.x      = i * tileSize;
+                tile.y      = j * tileSize;
+                tile.width  = std::min(tileSize, width - tile.x);
+                tile.height = std::min(tileSize, height - tile.y);
+                codes.push_back(qMakePair(mortonCode(i, j), tile));
+            }
+        }
+        std::sort(codes.begin(), codes.end(), compareTileCode);
+
+        m_tiles.resize(codes.size());
+        for (int i = 0; i < codes.size(); i++)
+            m_tiles[i] = codes[i].second;
+    }
+
+    // Deal contiguous runs of tiles to the workers
+    if (m_workerCount != workerCount)
+    {
+        if (m_queues)
+            delete []m_queues;
+        m_queues      = new TileQueue[workerCount];
+        m_workerCount = workerCount;
+    }
+
+    int tileCount = m_tiles.size();
+    for (int i = 0; i < workerCount; i++)
+    {
+        m_queues[i].m_head = tileCount * i / workerCount;
+        m_queues[i].m_tail = tileCount * (i + 1) / workerCount;
+    }
+}
+
+bool TileScheduler::next(int worker, Tile& tile)
+{
+
+    assert(worker >= 0 && worker < m_workerCount);
+
+    // Take the front of my own queue
+    TileQueue& own = m_queues[worker];
+    own.m_lock.lock();
+    if (own.m_head < own.m_tail)
+    {
+        tile = m_tiles[own.m_head++];
+        own.m_lock.unlock();
+        return true;
+    }
+    own.m_lock.unlock();
+
+    // Steal from the back of the others
+    for (int i = 1; i < m_workerCount; i++)
+    {
+        TileQueue& victim = m_queues[(worker + i) % m_workerCount];
+        victim.m_lock.lock();
+        if (victim.m_head < victim.m_tail)
+        {
+            tile = m_tiles[--victim.m_tail];
+            victim.m_lock.unlock();
+            m_stolen.fetchAndAddOrdered(1);
+            return true;
+        }
+        victim.m_lock.unlock();
+    }
+
+    return false;
+}
+
+unsigned TileScheduler::mortonCode(unsigned x, unsigned y)
+{
+
+    unsigned code = 0;
+    for (int i = 0; i < 16; i++)
+    {
+        code |= ((x >> i) & 1) << (2 * i);
+        code |= ((y >> i) & 1) << (2 * i + 1);
+    }
+    return code;
+}
@@ -0,0 +1,100 @@
+/*!
+    @file tile_scheduler.h
+    @desc: declarations of Tile and TileScheduler class
+    @author: yanli
+    @date: May 2013
+ */
+
+#ifndef TILE_SCHEDULER_H
+#define TILE_SCHEDULER_H
+
+#include <QMutex>
+#include <QVector>
+#include <QAtomicInt>
+#include "defaults.h"
+
+/**
+ * @struct: Tile
+ * @brief The Tile struct is a rectangle of pixels traced as one work item
+ */
+struct Tile
+{
+    int x; // Left column
+    int y; // Top row
+    int width; // Width in pixels
+    int height; // Height in pixels
+};
+
+/**
+ * @struct: TileQueue
+ * @brief The TileQueue struct is the deque of one worker, it holds a range
+ *        of the tile array. The owner pops from the front and the thieves
+ *        steal from the back
+ */
+struct TileQueue
+{
+    QMutex m_lock; // Lock for the range
+    int m_head; // First tile not taken
+    int m_tail; // One past the last tile not taken
+};
+
+/**
+ * @class: TileScheduler
+ * @brief The TileScheduler class splits the canvas into tiles in Morton
+ *        order, gives each worker a contiguous run of tiles and lets idle
+ *        workers steal from the others
+ */
+class TileScheduler
+{
+public:
+
+    TileScheduler();
+    ~TileScheduler();
+
+    /**
+     * @brief init: split the canvas into tiles and deal them to the workers,
+     *              the tiles are only rebuilt when the canvas or the tile
+     *              size changes, so a frame like the last allocates nothing
+     * @param width: width of the canvas
+     * @param height: height of the canvas
+     * @param tileSize: size of the tile in pixels
+     * @param workerCount: number of workers
+     */
+    void init(int width, int height, int tileSize, int workerCount);
+
+    /**
+     * @brief next: get the next tile for a worker, steal one if the worker's
+     *              own queue is empty
+     * @param worker: the worker index
+     * @param tile: the tile (output)
+     * @return: true if got a tile, false if all of the tiles are taken
+     */
+    bool next(int worker, Tile& tile);
+
+    /**
+     * Getters
+     */
+    int getTileCount() const { return m_tiles.size(); }
+    int getStolenCount() const { return m_stolen.load(); }
+    int getTileSize() const { return m_tileSize; }
+
+private:
+
+    /**
+     * @brief mortonCode: interleave the bits of the tile coordinates
+     * @param x: tile column
+     * @param y: tile row
+     * @return: the Morton code
+     */
+    static unsigned mortonCode(unsigned x, unsigned y);
+
+    QVector<Tile> m_tiles; // Tiles in Morton order
+    TileQueue* m_queues; // One queue per worker
+    int m_workerCount; // Number of workers
+    int m_tileSize; // Tile size
+    int m_width; // Width of the canvas the tiles cover
+    int m_height; // Height of the canvas the tiles cover
+    QAtomicInt m_stolen; // Number of tiles stolen in this frame
+};
+
+#endif // TILE_SCHEDULER_H
@@ -0,0 +1,78 @@
+/*!
+    @file trace_pool.cpp
+    @desc: definitions of TracePool class
+    @author: yanli
+    @date: May 2013
+ */
+
+#include "trace_pool.h"
+
+TracePool::TracePool(const int threadCount)
+{
+
+    assert(threadCount > 0);
+
+    m_generation = 0;
+    m_running    = 0;
+    m_quit       = false;
+
+    m_threads.resize(threadCount);
+    for (int i = 0; i < threadCount; i++)
+    {
+        m_threads[i] = new TraceThread(this, i);
+        m_threads[i]->start();
+    }
+}
+
+TracePool::~TracePool()
+{
+
+    m_lock.lock();
+    m_quit = true;
+    m_frameReady.wakeAll();
+    m_lock.unlock();
+
+    for (int i = 0; i < m_threads.size(); i++)
+    {
+        m_threads[i]->wait();
+        delete m_threads[i];
+    }
+}
+
+void TracePool::trace(const TraceFrame& frame)
+{
+
+    m_lock.lock();
+    m_frame   = frame;
+    m_running = m_threads.size();
+    m_generation++;
+    m_frameReady.wakeAll();
+
+    while (m_running > 0)
+        m_frameDone.wait(&m_lock);
+    m_lock.unlock();
+}
+
+bool TracePool::waitForFrame(int& generation)
+{
+
+    m_lock.lock();
+    while (!m_quit && m_generation == generation)
+        m_frameReady.wait(&m_lock);
+
+    bool quit  = m_quit;
+    generation = m_generation;
+    m_lock.unlock();
+
+    return !quit;
+}
+
+void TracePool::finishFrame()
+{
+
+    m_lock.lock();
+    m_running--;
+    if (m_running == 0)
+        m_frameDone.wakeAll();
+    m_lock.unlock();
+}
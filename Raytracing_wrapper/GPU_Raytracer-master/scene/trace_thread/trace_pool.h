@@ -0,0 +1,64 @@
+/*!
+    @file trace_pool.h
+    @desc: declarations of TracePool class
+    @author: yanli
+    @date: May 2013
+ */
+
+#ifndef TRACE_POOL_H
+#define TRACE_POOL_H
+
+#include "trace_thread.h"
+#include <QMutex>
+#include <QWaitCondition>
+
+/**
+ * @class: TracePool
+ * @brief The TracePool class owns a fixed set of trace threads which are
+ *        started once and reused for every frame
+ */
+class TracePool
+{
+public:
+
+    TracePool(const int threadCount);
+    ~TracePool();
+
+    /**
+     * @brief trace: hand a frame to the threads and wait until it's done
+     * @param frame: the frame to trace
+     */
+    void trace(const TraceFrame& frame);
+
+    /**
+     * @brief waitForFrame: called by the threads, block until a frame newer
+     *                      than generation is published
+     * @param generation: the last frame seen by the thread, updated
+     * @return: true if there is a new frame, false if the pool is quitting
+     */
+    bool waitForFrame(int& generation);
+
+    /**
+     * @brief finishFrame: called by the threads when they are out of tiles
+     */
+    void finishFrame();
+
+    /**
+     * Getters
+     */
+    const TraceFrame& getFrame() { return m_frame; }
+    int getThreadCount() { return m_threads.size(); }
+
+private:
+
+    QVector<TraceThread*> m_threads; // The threads
+    QMutex m_lock; // Lock for the frame state
+    QWaitCondition m_frameReady; // Wakes the threads for a new frame
+    QWaitCondition m_frameDone; // Wakes the caller when all threads finish
+    TraceFrame m_frame; // The current frame
+    int m_generation; // Frame counter
+    int m_running; // Threads still working on the current frame
+    bool m_quit; // Threads should quit
+};
+
+#endif // TRACE_POOL_H
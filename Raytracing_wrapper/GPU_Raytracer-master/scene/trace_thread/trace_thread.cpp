@@ -6,98 +6,149 @@
  */
 
 #include "trace_thread.h"
+#include "trace_pool.h"
 
-TraceThread::TraceThread(QObject *parent) : QThread(parent)
+TraceThread::TraceThread(TracePool* pool, const int workerId, QObject *parent)
+    : QThread(parent)
 {
 
+    m_pool     = pool;
+    m_workerId = workerId;
 }
 
-void TraceThread::pack(BGRA* pixel,
-                       const int width,
-                       const int height,
-                       const int beginIndex,
-                       const int endIndex,
-                       CS123SceneGlobalData& global,
-                       QVector<SceneObject>& objects,
-                       QList<CS123SceneLightData>& lights,
-                       Vector4& eyePos,
-                       float near,
-                       Matrix4x4& invViewTransMat,
-                       KdTree* tree,
-                       AABB extends)
+TraceThread::~TraceThread()
 {
 
-    m_pixel           = pixel;
-    m_width           = width;
-    m_height          = height;
-    m_beginIndex      = beginIndex;
-    m_endIndex        = endIndex;
-    m_global          = global;
-    m_objects         = objects;
-    m_lights          = lights;
-    m_eyePos          = eyePos;
-    m_near            = near;
-    m_invViewTransMat = invViewTransMat;
-    m_tree            = tree;
-    m_extends         = extends;
 }
 
-TraceThread::TraceThread(BGRA *pixel,
-                         const int width,
-                         const int height,
-                         const int beginIndex,
-                         const int endIndex,
-                         CS123SceneGlobalData &global,
-                         QVector<SceneObject> &objects,
-                         QList<CS123SceneLightData> &lights,
-                         vec4<REAL> &eyePos,
-                         float near,
-                         Matrix4x4 &invViewTransMat,
-                         KdTree* tree,
-                         AABB extends)
+void TraceThread::render(const TraceFrame& frame)
 {
 
-    m_pixel           = pixel;
-    m_width           = width;
-    m_height          = height;
-    m_beginIndex      = beginIndex;
-    m_endIndex        = endIndex;
-    m_global          = global;
-    m_objects         = objects;
-    m_lights          = lights;
-    m_eyePos          = eyePos;
-    m_near            = near;
-    m_invViewTransMat = invViewTransMat;
-    m_tree            = tree;
-    m_extends         = extends;
-}
+    Tile tile;
+    while (frame.m_scheduler->next(m_workerId, tile))
+    {
+        if (frame.m_previewStep > 0)
+        {
+            tracePreviewTile(frame, tile);
+            continue;
+        }
 
-TraceThread::~TraceThread()
-{
+        if (frame.m_refine)
+        {
+            doRefineTrace(frame.m_pixel,
+                          frame.m_width,
+                          frame.m_height,
+                          tile.x,
+                          tile.y,
+                          tile.width,
+                          tile.height,
+                          *frame.m_global,
+                          *frame.m_objects,
+                          *frame.m_view,
+                          *frame.m_lights,
+                          frame.m_eyePos,
+                          frame.m_near,
+                          frame.m_invViewTransMat,
+                          frame.m_tree,
+                          frame.m_bvh,
+                          frame.m_extends,
+                          *frame.m_samples,
+                          frame.m_refineStep);
+            continue;
+        }
 
+        if (checkPacketTrace())
+        {
+            doPacketRayTrace(frame.m_pixel,
+                             frame.m_width,
+                             frame.m_height,
+                             tile.x,
+                             tile.y,
+                             tile.width,
+                             tile.height,
+                             *frame.m_global,
+                             *frame.m_objects,
+                             *frame.m_view,
+                             *frame.m_lights,
+                             frame.m_eyePos,
+                             frame.m_near,
+                             frame.m_invViewTransMat,
+                             frame.m_tree,
+                             frame.m_bvh,
+                             frame.m_extends,
+                             frame.m_samples);
+            continue;
+        }
+
+        // Trace the tile row by row
+        for (int row = tile.y; row < tile.y + tile.height; row++)
+        {
+            int beginIndex = row * frame.m_width + tile.x;
+            doRayTrace(frame.m_pixel,
+                       frame.m_width,
+                       frame.m_height,
+                       beginIndex,
+                       beginIndex + tile.width,
+                       *frame.m_global,
+                       *frame.m_objects,
+                       *frame.m_view,
+                       *frame.m_lights,
+                       frame.m_eyePos,
+                       frame.m_near,
+                       frame.m_invViewTransMat,
+                       frame.m_tree,
+                       frame.m_bvh,
+                       frame.m_extends,
+                       frame.m_samples);
+        }
+    }
 }
 
-void TraceThread::render()
+void tracePreviewTile(const TraceFrame& frame, const Tile& tile)
 {
 
-    doRayTrace(m_pixel,
-               m_width,
-               m_height,
-               m_beginIndex,
-               m_endIndex,
-               m_global,
-               m_objects,
-               m_lights,
-               m_eyePos,
-               m_near,
-               m_invViewTransMat,
-               m_tree,
-               m_extends
-               );
+    int tileSize = frame.m_scheduler->getTileSize();
+    int columns  = (frame.m_width + tileSize - 1) / tileSize;
+    char& traced = frame.m_previewTiles[(tile.y / tileSize) * columns +
+                                        tile.x / tileSize];
+    if (traced)
+        return;
+
+    // The tiles left out are traced by the next preview frame
+    if (frame.m_budget >= 0 &&
+            frame.m_timer->nsecsElapsed() / 1000000.f > frame.m_budget)
+        return;
+
+    doPreviewTrace(frame.m_pixel,
+                   frame.m_width,
+                   frame.m_height,
+                   tile.x,
+                   tile.y,
+                   tile.width,
+                   tile.height,
+                   frame.m_previewStep,
+                   frame.m_previewCoarse,
+                   *frame.m_global,
+                   *frame.m_objects,
+                   *frame.m_view,
+                   *frame.m_lights,
+                   frame.m_eyePos,
+                   frame.m_near,
+                   frame.m_invViewTransMat,
+                   frame.m_tree,
+                   frame.m_bvh,
+                   frame.m_extends);
+    traced = 1;
 }
 
 void TraceThread::run()
 {
 
-   render();
+    // Sleep until the pool publishes a frame, quit when the pool is deleted
+    int generation = 0;
+    while (m_pool->waitForFrame(generation))
+    {
+        render(m_pool->getFrame());
+        m_pool->finishFrame();
+    }
 }
@@ -1,6 +1,6 @@
 /*!
     @file trace_thread.h
-    @desc: declarations of TraceThread class
+    @desc: declarations of TraceFrame struct and TraceThread class
     @author: yanli
     @date: May 2013
  */
@@ -10,15 +10,60 @@
 
 #include "trace.h"
 #include "scene.h"
+#include "tile_scheduler.h"
 #include <QHash>
 #include <QThread>
+#include <QElapsedTimer>
 
 class KdTree;
+class Bvh;
+class TracePool;
+
+/**
+ * @struct: TraceFrame
+ * @brief The TraceFrame struct describes one frame to trace. The scene data
+ *        is only pointed to, all of the threads share it and read it only
+ */
+struct TraceFrame
+{
+    BGRA* m_pixel; // Pixel buffers
+    int m_width; // Width of the canvas
+    int m_height; // Height of the canvas
+    const CS123SceneGlobalData* m_global; // Global scene data
+    const QVector<SceneObject>* m_objects; // Object lists
+    const IntersectView* m_view; // Objects as seen by the intersection loops
+    const QList<CS123SceneLightData>* m_lights; // Lights
+    Vector4 m_eyePos; // Eye position
+    float m_near; // Near plane
+    Matrix4x4 m_invViewTransMat; // Inverse view transformation matrix
+    KdTree* m_tree; // Pointer to the kdtree
+    Bvh* m_bvh; // Pointer to the BVH
+    AABB m_extends; // Bounding box for the whole scene
+    TileScheduler* m_scheduler; // Tile scheduler shared by all threads
+    SampleBuffer* m_samples; // Samples of supersampling, NULL for none
+    bool m_refine; // Refine the samples instead of tracing the centers
+    int m_refineStep; // Most samples added to a pixel by the refine pass
+    int m_previewStep; // Step of the preview level to trace, 0 traces the
+                       // whole frame
+    bool m_previewCoarse; // The preview level is the coarsest
+    char* m_previewTiles; // Tiles of the preview level already traced
+    const QElapsedTimer* m_timer; // Timer started with the preview frame
+    float m_budget; // Time after which no tile is started in ms, negative
+                    // for none
+};
+
+/**
+ * @brief tracePreviewTile: trace a tile of a preview level, unless it's
+ *                          traced already or the budget is spent
+ * @param frame: the frame
+ * @param tile: the tile
+ */
+void tracePreviewTile(const TraceFrame& frame, const Tile& tile);
 
 /**
  * @class: TraceThread
- * @brief The TraceThread class is the structure for running a separate thread
- *        and holding the necessary data for running
+ * @brief The TraceThread class is a long-lived worker of TracePool, it
+ *        sleeps between frames and traces tiles of the pool's frame
  */
 class TraceThread :
         public QThread
@@ -27,60 +72,15 @@ class TraceThread :
 
 public:
 
-    TraceThread(QObject *parent = 0 );
+    TraceThread(TracePool* pool, const int workerId, QObject *parent = 0);
 
-
-    TraceThread(BGRA* pixel,
-                const int width,
-                const int height,
-                const int beginIndex,
-                const int endIndex,
-                CS123SceneGlobalData& global,
-                QVector<SceneObject>& objects,
-                QList<CS123SceneLightData>& lights,
-                Vector4& eyePos,
-                const float near,
-                Matrix4x4& invViewTransMat,
-                KdTree* tree,
-                AABB extends);
-
-    /**
-     * @brief pack: copy all of the necessary data into thread
-     * @param pixel: the pixels
-     * @param width: width
-     * @param height: height
-     * @param beginIndex: begin index of pixels
-     * @param endIndex: end index of pixels
-     * @param global: global scene data
-     * @param objects: object list
-     * @param lights: light list
-     * @param eyePos: eye position
-     * @param near: near plane
-     * @param invViewTransMat: inverse view transformation matrix
-     * @param tree: the pointer to the tree
-     * @param extends: the bounding box of the whole scene
-     */
-    void pack(BGRA* pixel,
-              const int width,
-              const int height,
-              const int beginIndex,
-              const int endIndex,
-              CS123SceneGlobalData& global,
-              QVector<SceneObject>& objects,
-              QList<CS123SceneLightData>& lights,
-              Vector4& eyePos,
-              const float near,
-              Matrix4x4& invViewTransMat,
-              KdTree* tree,
-              AABB extends);
+    ~TraceThread();
 
     /**
-     * @brief render: do rendering
+     * @brief render: do rendering, trace tiles until the scheduler runs out
+     * @param frame: the frame to trace
      */
-    void render();
-
-
-    ~TraceThread();
+    void render(const TraceFrame& frame);
 
     /**
      * @brief run: start the thread
@@ -89,19 +89,8 @@ public:
 
 private:
 
-    BGRA* m_pixel; // Pixel buffers
-    int m_width; // Width of the canvas
-    int m_height; // Height of the canvas
-    int m_beginIndex; // Begin index of pixels
-    int m_endIndex; // End index of pixels
-    CS123SceneGlobalData m_global; // Global scene data
-    QVector<SceneObject> m_objects; // Object lists
-    QList<CS123SceneLightData> m_lights; // Lights
-    Vector4 m_eyePos; // Eye position
-    float m_near; // Near plane
-    Matrix4x4 m_invViewTransMat; // Inverse view transformation matrix
-    KdTree* m_tree; // Pointer to the kdtree
-    AABB m_extends; // Bounding box for the whole scene
+    TracePool* m_pool; // The pool owning this thread
+    int m_workerId; // Index of this thread in the scheduler
 };
 
 #endif
@@ -11,6 +11,7 @@
 #include "shape_draw.h"
 #include "vector.h"
 #include "global.h"
+#include "mesh.h"
 
 #include <GL/glext.h>
 #include <GL/glut.h>
@@ -935,6 +936,47 @@ void drawSphere(GLuint vbo, GLuint vboElement, GLuint texHandle)
     PRINT_GL_ERROR();
 }
 
+void drawMesh(const Mesh* mesh, GLuint texHandle)
+{
+
+    assert(mesh);
+
+    // Meshes have no VBO, the arrays are read from memory
+    glMatrixMode(GL_MODELVIEW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    glVertexPointer(3, GL_FLOAT, 0, mesh->getPositions());
+    glNormalPointer(GL_FLOAT, 0, mesh->getNormals());
+    glEnableClientState(GL_NORMAL_ARRAY);
+    glEnableClientState(GL_VERTEX_ARRAY);
+
+    bool useTexture = texHandle && settings.showTexture &&
+            mesh->getTexCoords();
+    if (useTexture)
+    {
+        glTexCoordPointer(2, GL_FLOAT, 0, mesh->getTexCoords());
+        glEnable(GL_TEXTURE_2D);
+        glBindTexture(GL_TEXTURE_2D, texHandle);
+        glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    }
+
+    glFrontFace(GL_CCW);
+    glDrawElements(GL_TRIANGLES, mesh->getTriangleCount() * 3,
+                   GL_UNSIGNED_INT, mesh->getTriangles());
+
+    if (useTexture)
+    {
+        // Reset texture
+        glBindTexture(GL_TEXTURE_2D, 0);
+        glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+    }
+
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+
+    PRINT_GL_ERROR();
+}
+
 void drawNormals(GLuint vbo, int vertNum)
 {
 
@@ -10,6 +10,8 @@
 
 #include <qgl.h>
 
+class Mesh;
+
 /**
  * External declarations of tessellation variables
  */
@@ -84,6 +86,13 @@ void drawCone(GLuint vbo, GLuint vboElement, GLuint texHandle = 0);
  */
 void drawSphere(GLuint vbo, GLuint vboElement, GLuint texHandle = 0);
 
+/**
+ * @brief drawMesh: draw the triangles of a mesh from its arrays in memory
+ * @param mesh: the mesh
+ * @param texHandle: texture handle
+ */
+void drawMesh(const Mesh* mesh, GLuint texHandle = 0);
+
 /**
  * @brief drawNormals: draw normals
  * @param vbo: vbo handle
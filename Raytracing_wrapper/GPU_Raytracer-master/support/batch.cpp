@@ -0,0 +1,1036 @@
+/*!
+    @file batch.cpp
+    @desc: headless batch renderer, traces scene files with the CPU ray
+           tracer and writes the images without any GUI or GL context.
+           Given several scenes it prints one line per scene for
+           benchmarks. The modes timing parts of the tracer instead, and
+           the OpenCL kernel of --opencl and --compare, are in the
+           batch_*.cpp files, batchModes lists them
+    @author: yanli
+    @date: May 2013
+ */
+
+#include <QCoreApplication>
+#include <QDir>
+#include <QFileInfo>
+#include <iomanip>
+#include <algorithm>
+
+#include "batch.h"
+#include "scene.h"
+#include "CPUrayscene.h"
+#include "kdtree.h"
+#include "bvh.h"
+#include "scene_group.h"
+#include "intersect_view.h"
+#include "CS123XmlSceneParser.h"
+#include "camtrans_camera.h"
+
+#ifdef __GLIBC__
+#define BATCH_COUNT_ALLOCATIONS // malloc is wrapped to count the allocations
+
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* pointer, size_t size);
+
+static volatile int allocationCount     = 0; // Allocations while counting
+static volatile bool countingAllocations = false; // Count the allocations?
+
+/**
+ * @brief malloc, calloc, realloc: glibc's allocator, the calls made while
+ *        countingAllocations is set are counted. operator new and the Qt
+ *        containers allocate through them too
+ */
+extern "C" void* malloc(size_t size)
+{
+    if (countingAllocations)
+        __sync_fetch_and_add(&allocationCount, 1);
+    return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size)
+{
+    if (countingAllocations)
+        __sync_fetch_and_add(&allocationCount, 1);
+    return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* pointer, size_t size)
+{
+    if (countingAllocations)
+        __sync_fetch_and_add(&allocationCount, 1);
+    return __libc_realloc(pointer, size);
+}
+#endif
+
+/**
+ * @brief startCountingAllocations: count the heap allocations of all threads
+ *                                  from now on
+ */
+void startCountingAllocations()
+{
+#ifdef BATCH_COUNT_ALLOCATIONS
+    allocationCount     = 0;
+    countingAllocations = true;
+#endif
+}
+
+/**
+ * @brief stopCountingAllocations: stop counting the heap allocations
+ * @return: the allocations since startCountingAllocations(), -1 if they
+ *          can't be counted on this platform
+ */
+int stopCountingAllocations()
+{
+#ifdef BATCH_COUNT_ALLOCATIONS
+    countingAllocations = false;
+    return allocationCount;
+#else
+    return -1;
+#endif
+}
+
+/**
+ * @brief elapsedMs: get the elapsed time of a timer in milliseconds
+ * @param timer: the timer
+ * @return: elapsed time in milliseconds
+ */
+double elapsedMs(const QElapsedTimer& timer)
+{
+    return timer.nsecsElapsed() / 1000000.0;
+}
+
+/**
+ * @brief getRaysPerSecond: get the throughput of tracing a frame
+ * @param options: the options
+ * @param ms: time to trace the frame in ms
+ * @return: millions of rays per second
+ */
+double getRaysPerSecond(const BatchOptions& options, double ms)
+{
+    return ms > 0 ? options.width * options.height / (ms * 1000.0) : 0;
+}
+
+/**
+ * @brief printBuildColumns: print the headers of the columns of --build-only
+ */
+static void printBuildColumns()
+{
+    cout << std::setw(11) << "Nodes" << std::setw(11) << "Leaves"
+         << std::setw(11) << "KB" << endl;
+}
+
+/**
+ * @brief printBuildRow: print the columns of --build-only of a scene line
+ * @param options: the options
+ * @param stats: the statistics of the scene, or the sum
+ * @param scenes: number of scenes in the statistics
+ */
+static void printBuildRow(const BatchOptions& options,
+                          const BatchStats& stats,
+                          int scenes)
+{
+    Q_UNUSED(options);
+    Q_UNUSED(scenes);
+    cout << std::setw(11) << stats.nodes
+         << std::setw(11) << stats.leaves
+         << std::setw(11) << stats.memory << endl;
+}
+
+/**
+ * @brief addBuildStats: add the statistics of --build-only to the sum
+ * @param options: the options
+ * @param stats: the statistics of a scene
+ * @param sum: the sum, should be returned
+ */
+static void addBuildStats(const BatchOptions& options,
+                          const BatchStats& stats,
+                          BatchStats& sum)
+{
+    Q_UNUSED(options);
+    sum.nodes  += stats.nodes;
+    sum.leaves += stats.leaves;
+    sum.memory += stats.memory;
+}
+
+/**
+ * @brief printTraceColumns: print the headers of the columns of tracing
+ */
+static void printTraceColumns()
+{
+    cout << std::setw(11) << "Trace" << std::setw(11) << "Allocs" << endl;
+}
+
+/**
+ * @brief printTraceRow: print the columns of tracing of a scene line, the
+ *                       allocations are the first frame's for one frame
+ * @param options: the options
+ * @param stats: the statistics of the scene, or the sum
+ * @param scenes: number of scenes in the statistics
+ */
+static void printTraceRow(const BatchOptions& options,
+                          const BatchStats& stats,
+                          int scenes)
+{
+    Q_UNUSED(scenes);
+    cout << std::setw(11) << stats.traceTime
+         << std::setw(11) << (options.frames > 1 ? stats.allocations :
+                                                  stats.firstAllocations)
+         << endl;
+}
+
+/**
+ * @brief addTraceStats: add the statistics of tracing to the sum
+ * @param options: the options
+ * @param stats: the statistics of a scene
+ * @param sum: the sum, should be returned
+ */
+static void addTraceStats(const BatchOptions& options,
+                          const BatchStats& stats,
+                          BatchStats& sum)
+{
+    Q_UNUSED(options);
+    sum.traceTime        += stats.traceTime;
+    sum.firstAllocations += stats.firstAllocations;
+    sum.allocations      += stats.allocations;
+}
+
+// The modes in the order of BATCHMODE, tracing an image is the default.
+// Without BATCH_OPENCL the entry of --compare is empty and never selected
+const BatchMode batchModes[BATCH_MODE_COUNT] =
+{
+    { NULL, NULL, printTraceReport, printTraceColumns, printTraceRow,
+      addTraceStats },
+    { "--build-only", NULL, NULL, printBuildColumns, printBuildRow,
+      addBuildStats },
+    { "--primary", benchPrimaryRays, printPrimaryReport, printPrimaryColumns,
+      printPrimaryRow, addPrimaryStats },
+    { "--view", benchIntersectView, printViewReport, printViewColumns,
+      printViewRow, addViewStats },
+    { "--box", benchBoxTests, printBoxReport, printBoxColumns, printBoxRow,
+      addBoxStats },
+#ifdef BATCH_OPENCL
+    { "--compare", NULL, printTraceReport, printCompareColumns,
+      printCompareRow, addCompareStats }
+#endif
+};
+
+/**
+ * @brief printUsage: print the usage of the batch renderer
+ * @param name: the name of the executable
+ */
+static void printUsage(const char* name)
+{
+    cout << "Usage: " << name << " <scene.xml> [scene.xml ...] [options]"
+         << endl
+         << "  -o, --output <path>  output image, or output directory when "
+         << "tracing several" << endl
+         << "                       scenes (default: <scene>.png)" << endl
+         << "  --width <n>          image width (default: " << WIN_WIDTH
+         << ")" << endl
+         << "  --height <n>         image height (default: " << WIN_HEIGHT
+         << ")" << endl
+         << "  --threads <n>        trace threads, 1 is single threaded "
+         << "(default: " << settings.traceThreadNum << ")" << endl
+         << "  --build-threads <n>  kdtree build threads (default: "
+         << settings.kdBuildThreadNum << ")" << endl
+         << "  --tile <n>           tile size in pixels (default: "
+         << settings.traceTileSize << ")" << endl
+         << "  --frames <n>         trace the frame n times (default: 1)"
+         << endl
+         << "  --respawn            recreate the trace threads every frame"
+         << endl
+         << "  --animate <n>        move n objects before every frame after "
+         << "the first" << endl
+         << "  --preview <ms>       trace the frames as interactive previews, "
+         << "refining a" << endl
+         << "                       coarse image in calls of the given time"
+         << endl
+         << "  --build-only         stop after building the kdtree or BVH, "
+         << "no image is written" << endl
+         << "  --primary            time the primary rays without shading, "
+         << "one by one and in" << endl
+         << "                       packets, no image is written" << endl
+         << "  --view               time the primary rays against every "
+         << "object, through the" << endl
+         << "                       scene objects and through the "
+         << "intersection view, with" << endl
+         << "                       the cache misses per ray of both"
+         << endl
+         << "  --box                time the unit cube and bounding box "
+         << "tests of the primary" << endl
+         << "                       rays, legacy planes against slabs"
+         << endl
+         << "  --depth <n>          recursion depth (default: "
+         << settings.traceRaycursion << ")" << endl
+         << "  --supersample        refine the edges with more samples"
+         << endl
+         << "  --samples <n>        most samples of a pixel (default: "
+         << settings.maxSamples << ")" << endl
+         << "  --contrast <x>       color difference to a neighbour "
+         << "refining a pixel" << endl
+         << "                       (default: " << settings.sampleContrast
+         << ")" << endl
+         << "  --progressive        supersample, adding one sample to an "
+         << "edge every frame" << endl
+         << "  --shadow             trace shadows" << endl
+         << "  --transparent-shadows" << endl
+         << "                       transparent objects cast no shadows"
+         << endl
+         << "  --spotlights         use spot lights" << endl
+         << "  --bvh                use a BVH instead of the kdtree" << endl
+         << "  --no-simd            traverse the binary BVH without SSE"
+         << endl
+         << "  --no-packets         trace the primary rays one by one" << endl
+         << "  --no-kdtree          brute force intersection" << endl
+         << "  --no-instancing      expand the masters used several times "
+         << "instead of sharing" << endl
+         << "                       their objects" << endl
+         << "  --no-texture         ignore textures" << endl
+         << "  --no-mipmap          read the textures at full resolution"
+         << endl
+         << "  --no-reflection      ignore reflection and refraction" << endl;
+#ifdef BATCH_OPENCL
+    cout << "  --opencl             trace with the OpenCL kernel, without "
+         << "GL" << endl
+         << "  --cl-device <type>   gpu, cpu or any, any takes a GPU if there "
+         << "is one" << endl
+         << "                       (default: any)" << endl
+         << "  --cl-source <path>   kernel source (default: "
+         << CL_RAYTRACE_SOURCE << ")" << endl
+         << "  --no-cl-cache        build the kernels from source, without "
+         << "the binary cache" << endl
+         << "                       in " << CL_CACHE_DIR << endl
+         << "  --compare            trace with the CPU tracer and the OpenCL "
+         << "kernel, the" << endl
+         << "                       images must agree, the CPU image is "
+         << "written" << endl
+         << "  --tolerance <n>      largest channel difference of agreeing "
+         << "pixels" << endl
+         << "                       (default: " << BATCH_COMPARE_TOLERANCE
+         << ")" << endl;
+#endif
+}
+
+/**
+ * @brief findMode: find the mode an option selects
+ * @param arg: the option
+ * @return: the mode, BATCH_TRACE if the option selects none
+ */
+static BATCHMODE findMode(const QString& arg)
+{
+    for (int i = 0; i < BATCH_MODE_COUNT; i++)
+    {
+        if (batchModes[i].flag && arg == batchModes[i].flag)
+            return (BATCHMODE)i;
+    }
+    return BATCH_TRACE;
+}
+
+/**
+ * @brief parseArguments: parse the command line into options and settings
+ * @param argc: argument count
+ * @param argv: argument values
+ * @param options: the options to fill in
+ * @return: true for success and false for failure
+ */
+static bool parseArguments(int argc, char* argv[], BatchOptions& options)
+{
+    options.width   = WIN_WIDTH;
+    options.height  = WIN_HEIGHT;
+    options.threads = settings.traceThreadNum;
+    options.frames  = 1;
+    options.respawn = false;
+    options.animate = 0;
+    options.preview = 0;
+    options.mode      = BATCH_TRACE;
+    options.openCL    = false;
+    options.tolerance = BATCH_COMPARE_TOLERANCE;
+#ifdef BATCH_OPENCL
+    options.clDevice  = CL_DEVICE_TYPE_DEFAULT;
+    options.clSource  = CL_RAYTRACE_SOURCE;
+#endif
+
+    for (int i = 1; i < argc; i++)
+    {
+        QString arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        BATCHMODE mode = findMode(arg);
+
+        if (mode != BATCH_TRACE)
+        {
+            if (options.mode != BATCH_TRACE && options.mode != mode)
+            {
+                cerr << "Only one of --build-only, --primary, --view, --box "
+                     << "and --compare can be given" << endl;
+                return false;
+            }
+            options.mode = mode;
+        }
+        else if ((arg == "-o" || arg == "--output") && hasValue)
+            options.output = argv[++i];
+        else if (arg == "--width" && hasValue)
+            options.width = QString(argv[++i]).toInt();
+        else if (arg == "--height" && hasValue)
+            options.height = QString(argv[++i]).toInt();
+        else if (arg == "--threads" && hasValue)
+            options.threads = QString(argv[++i]).toInt();
+        else if (arg == "--frames" && hasValue)
+            options.frames = QString(argv[++i]).toInt();
+        else if (arg == "--respawn")
+            options.respawn = true;
+        else if (arg == "--animate" && hasValue)
+            options.animate = QString(argv[++i]).toInt();
+        else if (arg == "--preview" && hasValue)
+            options.preview = QString(argv[++i]).toFloat();
+        else if (arg == "--build-threads" && hasValue)
+            settings.kdBuildThreadNum = QString(argv[++i]).toInt();
+        else if (arg == "--tile" && hasValue)
+            settings.traceTileSize = QString(argv[++i]).toInt();
+        else if (arg == "--depth" && hasValue)
+            settings.traceRaycursion = QString(argv[++i]).toInt();
+        else if (arg == "--supersample")
+            settings.useSupersampling = true;
+        else if (arg == "--samples" && hasValue)
+            settings.maxSamples = QString(argv[++i]).toInt();
+        else if (arg == "--contrast" && hasValue)
+            settings.sampleContrast = QString(argv[++i]).toFloat();
+        else if (arg == "--progressive")
+        {
+            settings.useSupersampling = true;
+            settings.useProgressive   = true;
+        }
+        else if (arg == "--shadow")
+            settings.useShadow = true;
+        else if (arg == "--transparent-shadows")
+            settings.useTransparentShadows = true;
+        else if (arg == "--spotlights")
+            settings.useSpotLights = true;
+        else if (arg == "--bvh")
+            settings.accelStruct = BVH;
+        else if (arg == "--no-simd")
+            settings.useSimd = false;
+        else if (arg == "--no-packets")
+            settings.usePacketTracing = false;
+        else if (arg == "--no-kdtree")
+            settings.useKdTree = false;
+        else if (arg == "--no-instancing")
+            settings.useInstancing = false;
+        else if (arg == "--no-texture")
+            settings.showTexture = false;
+        else if (arg == "--no-mipmap")
+            settings.useMipmaps = false;
+        else if (arg == "--no-reflection")
+            settings.useReflection = false;
+#ifdef BATCH_OPENCL
+        else if (arg == "--opencl")
+            options.openCL = true;
+        else if (arg == "--cl-device" && hasValue)
+        {
+            QString type = argv[++i];
+            if (type == "gpu")
+                options.clDevice = CL_DEVICE_TYPE_GPU;
+            else if (type == "cpu")
+                options.clDevice = CL_DEVICE_TYPE_CPU;
+            else if (type == "any")
+                options.clDevice = CL_DEVICE_TYPE_DEFAULT;
+            else
+            {
+                cerr << "Unknown device type: " << qPrintable(type) << endl;
+                return false;
+            }
+        }
+        else if (arg == "--cl-source" && hasValue)
+            options.clSource = argv[++i];
+        else if (arg == "--no-cl-cache")
+            settings.useProgramCache = false;
+        else if (arg == "--tolerance" && hasValue)
+            options.tolerance = QString(argv[++i]).toInt();
+#endif
+        else if (!arg.startsWith("-"))
+            options.sceneFiles.append(arg);
+        else
+        {
+            cerr << "Unknown option: " << qPrintable(arg) << endl;
+            return false;
+        }
+    }
+
+    if (options.sceneFiles.isEmpty() || options.width < 1 ||
+        options.height < 1 || options.threads < 1 || options.frames < 1 ||
+        options.animate < 0 || options.preview < 0 ||
+        settings.maxSamples < 1 || options.tolerance < 0 ||
+        settings.traceTileSize < 1 || settings.kdBuildThreadNum < 1)
+        return false;
+
+#ifdef BATCH_OPENCL
+    // The kernel walks the kdtree and traces whole frames
+    bool compare = options.mode == BATCH_COMPARE;
+    if ((options.openCL || compare) &&
+        (settings.accelStruct == BVH || options.preview > 0 ||
+         settings.useProgressive))
+    {
+        cerr << "--opencl and --compare take neither --bvh, --preview nor "
+             << "--progressive" << endl;
+        return false;
+    }
+    if (compare && options.openCL)
+    {
+        cerr << "--compare traces images with both tracers, it doesn't take "
+             << "--opencl" << endl;
+        return false;
+    }
+#endif
+
+    settings.useMultithread = options.threads > 1;
+    settings.traceThreadNum = options.threads;
+    return true;
+}
+
+/**
+ * @brief getOutputFile: get the path of the image written for a scene
+ * @param options: the options
+ * @param sceneFile: the path to the scene file
+ * @return: the path to the image
+ */
+static QString getOutputFile(const BatchOptions& options,
+                             const QString& sceneFile)
+{
+    if (options.sceneFiles.size() == 1 && !options.output.isEmpty())
+        return options.output;
+
+    QString outputFile = sceneFile;
+    if (outputFile.endsWith(".xml"))
+        outputFile.chop(4);
+    outputFile += ".png";
+
+    if (options.output.isEmpty())
+        return outputFile;
+    return QDir(options.output).filePath(QFileInfo(outputFile).fileName());
+}
+
+/**
+ * @brief writeImage: write the traced image
+ * @param image: the image
+ * @param outputFile: the path to the output image
+ * @param stats: the statistics, should be returned
+ * @return: true for success and false for failure
+ */
+static bool writeImage(const QImage& image,
+                       const QString& outputFile,
+                       BatchStats& stats)
+{
+    QElapsedTimer timer;
+    timer.start();
+    if (!image.save(outputFile))
+    {
+        cerr << "Could not save image \"" << qPrintable(outputFile) << "\""
+             << endl;
+        return false;
+    }
+    stats.writeTime = elapsedMs(timer);
+    return true;
+}
+
+/**
+ * @brief traceCPU: trace the frames with the CPU tracer into the image.
+ *                  Every frame traces the same view, the first frame pays
+ *                  for starting the threads unless --respawn makes every
+ *                  frame do so
+ * @param options: the options
+ * @param scene: the scene with its kdtree or BVH built
+ * @param camera: the camera
+ * @param image: the image, should be returned
+ * @param stats: the statistics, should be returned
+ */
+static void traceCPU(const BatchOptions& options,
+                     Scene& scene,
+                     CamtransCamera& camera,
+                     QImage& image,
+                     BatchStats& stats)
+{
+    QElapsedTimer timer;
+    CPURayScene* rayScene = NULL;
+
+    for (int i = 0; i < options.frames; i++)
+    {
+        // Move the objects before the frame, the CPU scene copies them
+        double frameUpdate = 0;
+        if (i > 0 && options.animate > 0)
+        {
+            QVector<int> moved;
+            timer.start();
+            if (animateScene(options, scene, i, moved))
+                stats.rebuilds++;
+            if (rayScene)
+                rayScene->updateObjects(&scene, moved);
+            frameUpdate = elapsedMs(timer);
+            stats.updateTime += frameUpdate;
+        }
+
+        timer.start();
+        if (options.respawn && rayScene)
+        {
+            delete rayScene;
+            rayScene = NULL;
+        }
+        if (!rayScene)
+            rayScene = new CPURayScene(&scene);
+        double createTime = elapsedMs(timer);
+
+        timer.start();
+        startCountingAllocations();
+        int frameCalls = 0;
+        if (options.preview > 0)
+            frameCalls = tracePreviewFrame(options, *rayScene, camera, image,
+                                           stats);
+        else
+            rayScene->traceScene((BGRA*)image.bits(),
+                                 options.width,
+                                 options.height,
+                                 camera.getPosition(),
+                                 BATCH_NEAR,
+                                 camera.getInvViewTransMatrix());
+        int frameAllocations = stopCountingAllocations();
+        double frameTrace = elapsedMs(timer) - rayScene->getSetupTime();
+        double frameSetup = createTime + rayScene->getSetupTime();
+
+        if (i == 0)
+            stats.firstAllocations = frameAllocations;
+        else if (frameAllocations < 0)
+            stats.allocations = -1;
+        else
+            stats.allocations += frameAllocations;
+
+        if (options.frames > 1 && options.sceneFiles.size() == 1)
+        {
+            cout << "Frame " << i << ":    setup " << frameSetup
+                 << " ms, trace " << frameTrace << " ms, "
+                 << frameAllocations << " allocations";
+            if (options.animate > 0)
+                cout << ", update " << frameUpdate << " ms";
+            if (settings.useSupersampling)
+                cout << ", " << rayScene->getSamples().getSamplesPerPixel()
+                     << " samples per pixel";
+            if (options.preview > 0)
+                cout << ", " << frameCalls << " preview calls";
+            cout << endl;
+        }
+        if (settings.useSupersampling)
+            stats.samplesPerPixel +=
+                    rayScene->getSamples().getSamplesPerPixel();
+
+        stats.setupTime += frameSetup;
+        stats.traceTime += frameTrace;
+    }
+    stats.setupTime /= options.frames;
+    stats.traceTime /= options.frames;
+    stats.samplesPerPixel /= options.frames;
+    if (options.frames > 1)
+        stats.updateTime /= options.frames - 1;
+    if (scene.getBvh())
+        stats.refitCost = scene.getBvh()->getRefitCost();
+
+    const TileScheduler& scheduler = rayScene->getScheduler();
+    stats.tileCount   = scheduler.getTileCount();
+    stats.tileSize    = scheduler.getTileSize();
+    stats.stolenCount = scheduler.getStolenCount();
+    if (options.preview > 0)
+        stats.previewStart = rayScene->getPreviewStart();
+    if (settings.useSupersampling)
+    {
+        stats.refinedRatio = rayScene->getSamples().getRefinedRatio();
+        stats.maxSamples   = rayScene->getSamples().getMaxCount();
+    }
+    delete rayScene;
+}
+
+/**
+ * @brief renderScene: parse, build, trace and write one scene
+ * @param options: the options
+ * @param sceneFile: the path to the scene file
+ * @param outputFile: the path to the output image
+ * @param cl: the headless OpenCL package tracing the frames, or comparing
+ *            them for --compare, NULL for the CPU tracer and always
+ *            without BATCH_OPENCL
+ * @param stats: the statistics, should be returned
+ * @return: true for success and false for failure
+ */
+static bool renderScene(const BatchOptions& options,
+                        const QString& sceneFile,
+                        const QString& outputFile,
+                        CLPack* cl,
+                        BatchStats& stats)
+{
+    QElapsedTimer timer;
+
+    // Parse the scene, textures are read without GL
+    timer.start();
+    CS123XmlSceneParser parser(qPrintable(sceneFile));
+    if (!parser.parse())
+    {
+        cerr << "Could not load scene \"" << qPrintable(sceneFile) << "\""
+             << endl;
+        return false;
+    }
+
+    Scene scene(false);
+    Scene::parse(&scene, &parser);
+    stats.parseTime = elapsedMs(timer);
+    stats.objects     = scene.getObjects().size();
+    stats.flatObjects = scene.getFlatObjectCount();
+    stats.groups      = scene.getGroups().size();
+    stats.lights      = scene.getLight().size();
+
+    // Every object has a SceneObject and its part of a view, a group adds
+    // the nodes and indices of its BVH
+    int objectBytes = sizeof(SceneObject) + INTERSECT_VIEW_OBJECT_SIZE;
+    long long memory = (long long)stats.objects * objectBytes;
+    QHash<CS123SceneNode*, SceneGroup*>::const_iterator iter;
+    for (iter = scene.getGroups().begin(); iter != scene.getGroups().end();
+         iter++)
+    {
+        const SceneGroup* group = *iter;
+        memory += (long long)group->getObjectCount() * objectBytes +
+                group->getBvh().getNodeCount() * sizeof(BvhWideNode) +
+                group->getBvh().getFlatNodeCount() * sizeof(BvhFlatNode) +
+                group->getBvh().getPrimitiveCount() * sizeof(int);
+    }
+    stats.objectMemory = memory / 1024;
+
+    // Build the kdtree or the BVH, the time doesn't include dumping it
+    stats.buildTime = 0;
+    stats.nodes     = 0;
+    stats.leaves    = 0;
+    stats.memory    = 0;
+    if (settings.useKdTree && settings.accelStruct == BVH)
+    {
+        scene.buildBvh();
+        Bvh* bvh        = scene.getBvh();
+        stats.buildTime = bvh->getBuildTime();
+        stats.nodes     = bvh->getNodeCount();
+        stats.leaves    = bvh->getLeafCount();
+        stats.memory    = (bvh->getNodeCount() * sizeof(BvhWideNode) +
+                           bvh->getFlatNodeCount() * sizeof(BvhFlatNode) +
+                           bvh->getPrimitiveCount() * sizeof(int)) / 1024;
+    }
+    else if (settings.useKdTree)
+    {
+        scene.buildKdTree();
+        KdTree* tree    = scene.getKdTree();
+        stats.buildTime = tree->getBuildTime();
+        stats.nodes     = tree->getFlatNodeCount();
+        stats.leaves    = tree->getLeafCount();
+        stats.memory    = (tree->getFlatNodeCount() * sizeof(KdFlatNode) +
+                           tree->getFlatPrimitiveCount() * sizeof(int)) / 1024;
+    }
+
+    stats.setupTime = 0;
+    stats.traceTime = 0;
+    stats.writeTime = 0;
+    stats.firstAllocations = -1;
+    stats.allocations      = 0;
+    stats.updateTime       = 0;
+    stats.rebuilds         = 0;
+    stats.refitCost        = 1;
+    stats.samplesPerPixel  = 0;
+    stats.refinedRatio     = 0;
+    stats.maxSamples       = 0;
+    stats.previewCalls     = 0;
+    stats.previewFirst     = 0;
+    stats.previewMax       = 0;
+    stats.previewStart     = 0;
+    stats.droppedRays      = 0;
+    if (options.mode == BATCH_BUILD_ONLY)
+        return true;
+
+    // Use the camera in the scene file since there is no orbit camera
+    CS123SceneCameraData cameraData;
+    parser.getCameraData(cameraData);
+    cameraData.pos.data[3]  = 1;
+    cameraData.look.data[3] = 0;
+    cameraData.up.data[3]   = 0;
+
+    CamtransCamera camera;
+    camera.setClip(BATCH_NEAR, BATCH_FAR);
+    camera.setAspectRatio((float)options.width / (float)options.height);
+    camera.setHeightAngle(cameraData.heightAngle);
+    camera.orientLook(cameraData.pos, cameraData.look, cameraData.up);
+
+    // --primary, --view and --box time the primary rays instead
+    BatchBench bench = batchModes[options.mode].bench;
+    if (bench)
+    {
+        bench(options, scene, camera, stats);
+        return true;
+    }
+
+    // Trace
+    QImage image(options.width, options.height, QImage::Format_RGB32);
+    memset(image.bits(), 0, options.width * options.height * sizeof(BGRA));
+
+#ifdef BATCH_OPENCL
+    if (cl && options.mode != BATCH_COMPARE)
+        return traceOpenCL(options, *cl, scene, camera, image, stats) &&
+                writeImage(image, outputFile, stats);
+
+    traceCPU(options, scene, camera, image, stats);
+    if (options.mode == BATCH_COMPARE &&
+        !compareOpenCL(options, *cl, scene, camera, image, stats))
+        return false;
+#else
+    Q_UNUSED(cl);
+    traceCPU(options, scene, camera, image, stats);
+#endif
+    return writeImage(image, outputFile, stats);
+}
+
+/**
+ * @brief comparePassed: check if the tracers agreed closely enough. The
+ *                       kernel dropping rays from full queues fails, the
+ *                       pixels missing them may still look alike
+ * @param options: the options
+ * @param stats: the statistics of a compared scene
+ * @return: true if --compare passes, always true without it
+ */
+bool comparePassed(const BatchOptions& options,
+                   const BatchStats& stats)
+{
+    return options.mode != BATCH_COMPARE ||
+            (stats.droppedRays == 0 &&
+             stats.mismatches <= BATCH_COMPARE_RATIO * options.width *
+             options.height);
+}
+
+/**
+ * @brief printTraceReport: print the times of tracing a single scene, and
+ *                          the result of --compare
+ * @param options: the options
+ * @param stats: the statistics
+ */
+void printTraceReport(const BatchOptions& options, const BatchStats& stats)
+{
+    cout << "Setup:      " << stats.setupTime << " ms per frame" << endl
+         << "Trace:      " << stats.traceTime << " ms per frame" << endl;
+
+    if (options.animate > 0 && options.frames > 1)
+    {
+        cout << "Update:     " << stats.updateTime << " ms per frame, "
+             << stats.rebuilds << " of " << options.frames - 1
+             << " frames rebuilt";
+        if (settings.accelStruct == BVH)
+            cout << ", SAH cost " << stats.refitCost << " of a rebuild";
+        cout << endl;
+    }
+
+    if (options.preview > 0)
+        cout << "Preview:    " << (float)stats.previewCalls / options.frames
+             << " calls per frame, the first took " << stats.previewFirst
+             << " ms, at most " << stats.previewMax << " ms per call, "
+             << "coarsest step " << stats.previewStart << endl;
+
+    if (settings.useSupersampling && !options.openCL)
+        cout << "Samples:    " << stats.samplesPerPixel
+             << " per pixel per frame, " << stats.refinedRatio * 100
+             << "% of the pixels refined, at most " << stats.maxSamples
+             << endl;
+
+    if (stats.firstAllocations < 0)
+        cout << "Allocs:     not counted on this platform" << endl;
+    else if (options.frames > 1)
+        cout << "Allocs:     " << stats.firstAllocations
+             << " in the first frame, " << stats.allocations
+             << " in the " << options.frames - 1 << " frames after" << endl;
+    else
+        cout << "Allocs:     " << stats.firstAllocations
+             << " in the frame" << endl;
+
+    if (settings.useMultithread && !options.openCL)
+        cout << "Tiles:      " << stats.tileCount << " of "
+             << stats.tileSize << "x" << stats.tileSize
+             << ", stolen: " << stats.stolenCount << endl;
+
+    if (options.openCL || options.mode == BATCH_COMPARE)
+        cout << "Queues:     " << stats.droppedRays << " rays dropped"
+             << endl;
+
+    if (options.mode == BATCH_COMPARE)
+        cout << "Compare:    " << stats.mismatches << " pixels differ by "
+             << "more than " << options.tolerance << ", at most by "
+             << stats.maxDifference << ", "
+             << (comparePassed(options, stats) ? "passed" : "failed")
+             << endl;
+}
+
+/**
+ * @brief printReport: print the statistics of a single scene
+ * @param options: the options
+ * @param sceneFile: the path to the scene file
+ * @param outputFile: the path to the output image
+ * @param stats: the statistics
+ */
+static void printReport(const BatchOptions& options,
+                        const QString& sceneFile,
+                        const QString& outputFile,
+                        const BatchStats& stats)
+{
+    cout << "Scene:      " << qPrintable(sceneFile) << endl
+         << "Objects:    " << stats.objects
+         << ", lights: " << stats.lights << endl
+         << "Groups:     " << stats.groups << ", "
+         << stats.flatObjects << " objects expanded, "
+         << stats.objectMemory << " KB of objects" << endl
+         << "Resolution: " << options.width << "x" << options.height
+         << ", threads: " << options.threads
+         << ", recursion: " << settings.traceRaycursion << endl
+         << "Parse:      " << stats.parseTime << " ms" << endl;
+
+    if (settings.accelStruct == BVH)
+        cout << "BVH:        " << stats.buildTime << " ms, ";
+    else
+        cout << "Kd-tree:    " << stats.buildTime << " ms, "
+             << settings.kdBuildThreadNum << " threads, ";
+    cout << stats.nodes << " nodes, " << stats.leaves << " leaves, "
+         << stats.memory << " KB" << endl;
+
+    const BatchMode& mode = batchModes[options.mode];
+    if (mode.report)
+        mode.report(options, stats);
+
+    // Only the modes tracing an image write it
+    if (options.mode != BATCH_BUILD_ONLY && !mode.bench)
+        cout << "Write:      " << stats.writeTime << " ms" << endl
+             << "Output:     " << qPrintable(outputFile) << endl;
+}
+
+/**
+ * @brief renderScenes: render the scenes of the options and print their
+ *                      statistics
+ * @param options: the options
+ * @param cl: the headless OpenCL package, NULL for the CPU tracer
+ * @param total: the timer started with the program
+ * @return: the exit code of the program
+ */
+static int renderScenes(const BatchOptions& options,
+                        CLPack* cl,
+                        const QElapsedTimer& total)
+{
+    // A single scene gets a full report
+    if (options.sceneFiles.size() == 1)
+    {
+        QString sceneFile  = options.sceneFiles[0];
+        QString outputFile = getOutputFile(options, sceneFile);
+        BatchStats stats;
+        if (!renderScene(options, sceneFile, outputFile, cl, stats))
+            return 1;
+
+        printReport(options, sceneFile, outputFile, stats);
+        cout << "Total:      " << elapsedMs(total) << " ms" << endl;
+        return comparePassed(options, stats) ? 0 : 1;
+    }
+
+    // Several scenes get one line each, times are in ms
+    const BatchMode& mode = batchModes[options.mode];
+    cout << "Resolution: " << options.width << "x" << options.height
+         << ", threads: " << options.threads
+         << ", recursion: " << settings.traceRaycursion
+         << ", frames: " << options.frames
+         << ", build threads: " << settings.kdBuildThreadNum << endl;
+    cout << std::left << std::setw(28) << "Scene" << std::right
+         << std::setw(9) << "Objects" << std::setw(11) << "Parse"
+         << std::setw(11) << (settings.accelStruct == BVH ? "BVH" : "Kd-tree");
+    mode.columns();
+    cout << std::fixed << std::setprecision(2);
+
+    BatchStats sum;
+    memset(&sum, 0, sizeof(BatchStats));
+    int traced = 0;
+    int failed = 0;
+
+    for (int i = 0; i < options.sceneFiles.size(); i++)
+    {
+        QString sceneFile = options.sceneFiles[i];
+        QString name      = QFileInfo(sceneFile).completeBaseName();
+
+        BatchStats stats;
+        bool success = renderScene(options, sceneFile,
+                                   getOutputFile(options, sceneFile), cl,
+                                   stats);
+
+        cout << std::left << std::setw(28) << qPrintable(name) << std::right;
+        if (!success)
+        {
+            cout << std::setw(9) << "failed" << endl;
+            failed++;
+            continue;
+        }
+
+        cout << std::setw(9) << stats.objects
+             << std::setw(11) << stats.parseTime
+             << std::setw(11) << stats.buildTime;
+        mode.row(options, stats, 1);
+
+        sum.objects   += stats.objects;
+        sum.parseTime += stats.parseTime;
+        sum.buildTime += stats.buildTime;
+        mode.sum(options, stats, sum);
+        traced++;
+
+        // A scene the tracers disagree on fails the differential test
+        if (!comparePassed(options, stats))
+            failed++;
+    }
+
+    cout << std::left << std::setw(28) << "Sum" << std::right
+         << std::setw(9) << sum.objects
+         << std::setw(11) << sum.parseTime
+         << std::setw(11) << sum.buildTime;
+    mode.row(options, sum, qMax(traced, 1));
+    cout << "Total:      " << elapsedMs(total) << " ms, failed: " << failed
+         << endl;
+
+    return failed ? 1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    settings.initSettings();
+    settings.traceMode = CPU;
+
+    BatchOptions options;
+    if (!parseArguments(argc, argv, options))
+    {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    QElapsedTimer total;
+    total.start();
+
+#ifdef BATCH_OPENCL
+    // The program is built once for all of the scenes
+    CLPack clPack;
+    CLPack* cl = NULL;
+    if (options.openCL || options.mode == BATCH_COMPARE)
+    {
+        if (options.openCL)
+            settings.traceMode = GPU;
+        if (!initHeadlessCL(clPack, options.clDevice) ||
+            !buildCLKernels(clPack, qPrintable(options.clSource)) ||
+            !createCLOutput(clPack, options.width, options.height))
+        {
+            releaseCLPack(clPack);
+            return 1;
+        }
+        cl = &clPack;
+    }
+
+    int result = renderScenes(options, cl, total);
+    releaseCLPack(clPack);
+    return result;
+#else
+    return renderScenes(options, NULL, total);
+#endif
+}
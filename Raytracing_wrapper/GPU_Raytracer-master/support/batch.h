@@ -0,0 +1,229 @@
+/*!
+    @file batch.h
+    @desc: options, statistics and modes of the headless batch renderer,
+           shared by batch.cpp and the batch_*.cpp files of the modes
+    @author: yanli
+    @date: May 2013
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <QElapsedTimer>
+#include <QImage>
+#include <QString>
+#include <QStringList>
+#include "global.h"
+#ifdef BATCH_OPENCL
+#include "clPack.h"
+#endif
+
+class Scene;
+class CamtransCamera;
+class CPURayScene;
+struct CLPack;
+
+#define BATCH_NEAR 0.1f // Near plane, the same as the orbit camera
+#define BATCH_FAR 500.f // Far plane, the same as the orbit camera
+#define BATCH_ANIMATE_STEP 0.002f // Distance an animated object moves per
+                                  // frame, relative to the scene's size
+#define BATCH_ANIMATE_PERIOD 16 // Frames an animated object moves the same
+                                // way before turning back
+#define BATCH_BOX_TESTS 65536 // Rays prepared at a time for --box
+#define BATCH_COMPARE_TOLERANCE 8 // Largest channel difference of a pixel
+                                  // the tracers agree on
+#define BATCH_COMPARE_RATIO 0.01f // Most pixels the tracers may disagree on
+                                  // for --compare to pass, edges round
+                                  // differently on the devices
+
+// What the batch renderer does with a scene, indexes batchModes
+enum BATCHMODE
+{
+    BATCH_TRACE,
+    BATCH_BUILD_ONLY,
+    BATCH_PRIMARY,
+    BATCH_VIEW,
+    BATCH_BOX,
+    BATCH_COMPARE, // Only selectable with BATCH_OPENCL
+    BATCH_MODE_COUNT
+};
+
+/**
+ * @struct: BatchOptions
+ * @brief The BatchOptions struct holds the command line options
+ */
+struct BatchOptions
+{
+    QStringList sceneFiles; // Paths to the scene files
+    QString output; // Output image, or output directory for several scenes
+    int width; // Width of the image
+    int height; // Height of the image
+    int threads; // Number of trace threads
+    int frames; // Number of frames to trace
+    bool respawn; // Recreate the CPU scene and its threads for every frame
+    int animate; // Objects moved before every frame after the first
+    float preview; // Time of a preview call in ms, 0 traces whole frames
+    BATCHMODE mode; // What is done with the scenes
+    bool openCL; // Trace with the OpenCL kernel instead of the CPU tracer
+#ifdef BATCH_OPENCL
+    cl_device_type clDevice; // Device type of the OpenCL kernel
+    QString clSource; // Path to the kernel source
+#endif
+    int tolerance; // Largest channel difference of pixels agreeing in
+                   // --compare
+};
+
+/**
+ * @struct: BatchStats
+ * @brief The BatchStats struct holds the statistics of one traced scene
+ */
+struct BatchStats
+{
+    int objects; // Number of objects
+    int flatObjects; // Number of objects with the groups expanded
+    int groups; // Number of groups
+    int objectMemory; // Size of the objects, their intersection view and
+                      // the groups' BVHs in KB
+    int lights; // Number of lights
+    double parseTime; // Time to parse the scene in ms
+    double buildTime; // Time to build the kdtree or the BVH in ms
+    int nodes; // Number of kdtree or BVH nodes
+    int leaves; // Number of kdtree or BVH leaves
+    int memory; // Size of the nodes and primitive indices in KB
+    double setupTime; // Time to set up a frame in ms
+    double traceTime; // Time to trace a frame in ms
+    double writeTime; // Time to write the image in ms
+    int tileCount; // Number of tiles in a frame
+    int tileSize; // Size of the tiles
+    int stolenCount; // Tiles stolen in the last frame
+    int firstAllocations; // Heap allocations tracing the first frame, which
+                          // starts the threads, -1 if not counted
+    int allocations; // Heap allocations tracing the frames after the first
+    double updateTime; // Time to move the animated objects and update the
+                       // kdtree or the BVH in ms, per frame
+    int rebuilds; // Frames whose update rebuilt the kdtree or the BVH
+    float refitCost; // SAH cost of the refit BVH relative to a built one
+    float samplesPerPixel; // Samples traced per pixel, per frame
+    float refinedRatio; // Ratio of the pixels refined in the last frame
+    int maxSamples; // Most samples of a pixel in the last frame
+    int previewCalls; // Preview calls to finish the frames
+    double previewFirst; // Time of the first preview call in ms
+    double previewMax; // Time of the longest preview call in ms
+    int previewStart; // Step of the coarsest level after the last frame
+    double singleTime; // Time to intersect the primary rays one by one in ms
+    double packetTime; // Time to intersect the primary rays in packets in ms
+    int mismatches; // Primary rays hitting other objects in packets or
+                    // through the intersection view, box tests
+                    // disagreeing, or pixels the tracers disagree on
+    int maxDifference; // Largest channel difference of the tracers' images
+    long long droppedRays; // Rays the OpenCL tracer dropped from full queues
+    double objectTime; // Time to intersect every object through the scene
+                       // objects in ms
+    double viewTime; // Time to intersect every object through the
+                     // intersection view in ms
+    double objectMisses; // Cache misses per ray through the scene objects,
+                         // -1 if the hardware counter can't be read
+    double viewMisses; // Cache misses per ray through the intersection
+                       // view, -1 if the hardware counter can't be read
+    long long boxTests; // Box tests made with each kind of test
+    double legacyTime; // Time of the legacy box tests in ms
+    double slabTime; // Time of the slab box tests in ms
+};
+
+// Times the primary rays of a scene instead of tracing them
+typedef void (*BatchBench)(const BatchOptions& options, Scene& scene,
+                           CamtransCamera& camera, BatchStats& stats);
+// Prints the lines of a mode in the report of a single scene
+typedef void (*BatchReport)(const BatchOptions& options,
+                            const BatchStats& stats);
+// Prints the headers of a mode's columns in the lines of several scenes
+typedef void (*BatchColumns)();
+// Prints a mode's columns of a scene line, or of the sum of several scenes
+typedef void (*BatchRow)(const BatchOptions& options,
+                         const BatchStats& stats,
+                         int scenes);
+// Adds a scene's statistics of a mode to the sum
+typedef void (*BatchSum)(const BatchOptions& options,
+                         const BatchStats& stats,
+                         BatchStats& sum);
+
+/**
+ * @struct: BatchMode
+ * @brief The BatchMode struct is an entry of batchModes, what the batch
+ *        renderer does with a scene and prints about it
+ */
+struct BatchMode
+{
+    const char* flag; // Option selecting the mode, NULL for the default
+    BatchBench bench; // Runs instead of tracing, NULL traces an image or
+                      // stops after the build
+    BatchReport report; // Prints the report of a single scene, may be NULL
+    BatchColumns columns; // Prints the headers of the scene lines
+    BatchRow row; // Prints the columns of a scene line
+    BatchSum sum; // Adds a scene to the sum line
+};
+
+extern const BatchMode batchModes[BATCH_MODE_COUNT];
+
+// batch.cpp
+double elapsedMs(const QElapsedTimer& timer);
+double getRaysPerSecond(const BatchOptions& options, double ms);
+void startCountingAllocations();
+int stopCountingAllocations();
+void printTraceReport(const BatchOptions& options, const BatchStats& stats);
+bool comparePassed(const BatchOptions& options, const BatchStats& stats);
+
+// batch_primary.cpp, --primary
+void benchPrimaryRays(const BatchOptions& options, Scene& scene,
+                      CamtransCamera& camera, BatchStats& stats);
+void printPrimaryReport(const BatchOptions& options, const BatchStats& stats);
+void printPrimaryColumns();
+void printPrimaryRow(const BatchOptions& options, const BatchStats& stats,
+                     int scenes);
+void addPrimaryStats(const BatchOptions& options, const BatchStats& stats,
+                     BatchStats& sum);
+
+// batch_view.cpp, --view
+void benchIntersectView(const BatchOptions& options, Scene& scene,
+                        CamtransCamera& camera, BatchStats& stats);
+void printViewReport(const BatchOptions& options, const BatchStats& stats);
+void printViewColumns();
+void printViewRow(const BatchOptions& options, const BatchStats& stats,
+                  int scenes);
+void addViewStats(const BatchOptions& options, const BatchStats& stats,
+                  BatchStats& sum);
+
+// batch_box.cpp, --box
+void benchBoxTests(const BatchOptions& options, Scene& scene,
+                   CamtransCamera& camera, BatchStats& stats);
+void printBoxReport(const BatchOptions& options, const BatchStats& stats);
+void printBoxColumns();
+void printBoxRow(const BatchOptions& options, const BatchStats& stats,
+                 int scenes);
+void addBoxStats(const BatchOptions& options, const BatchStats& stats,
+                 BatchStats& sum);
+
+// batch_animate.cpp, --animate
+bool animateScene(const BatchOptions& options, Scene& scene, int frame,
+                  QVector<int>& moved);
+
+// batch_preview.cpp, --preview
+int tracePreviewFrame(const BatchOptions& options, CPURayScene& rayScene,
+                      CamtransCamera& camera, QImage& image,
+                      BatchStats& stats);
+
+#ifdef BATCH_OPENCL
+// batch_opencl.cpp, --opencl and --compare
+bool traceOpenCL(const BatchOptions& options, CLPack& cl, Scene& scene,
+                 CamtransCamera& camera, QImage& image, BatchStats& stats);
+bool compareOpenCL(const BatchOptions& options, CLPack& cl, Scene& scene,
+                   CamtransCamera& camera, const QImage& image,
+                   BatchStats& stats);
+void printCompareColumns();
+void printCompareRow(const BatchOptions& options, const BatchStats& stats,
+                     int scenes);
+void addCompareStats(const BatchOptions& options, const BatchStats& stats,
+                     BatchStats& sum);
+#endif
+
+#endif // BATCH_H
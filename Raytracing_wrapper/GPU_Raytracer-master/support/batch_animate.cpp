@@ -0,0 +1,49 @@
+/*!
+    @file batch_animate.cpp
+    @desc: --animate of the batch renderer, moves objects between the
+           frames to time the updates of the kdtree or the BVH
+    @author: yanli
+    @date: May 2013
+ */
+
+#include "batch.h"
+#include "scene.h"
+
+/**
+ * @brief animateScene: move some of the objects of the scene for a frame,
+ *                      spread over the object list. They move along one
+ *                      axis each and turn back every BATCH_ANIMATE_PERIOD
+ *                      frames, so the scene stays where it is
+ * @param options: the options
+ * @param scene: the scene
+ * @param frame: the frame
+ * @param moved: indices of the moved objects, should be returned
+ * @return: true if the kdtree or the BVH was rebuilt
+ */
+bool animateScene(const BatchOptions& options,
+                  Scene& scene,
+                  int frame,
+                  QVector<int>& moved)
+{
+    const QVector<SceneObject>& objects = scene.getObjects();
+    int count = qMin(options.animate, objects.size());
+
+    AABB extends = scene.getExtends();
+    float step = BATCH_ANIMATE_STEP *
+            qMax(extends.w(), qMax(extends.h(), extends.d()));
+    if ((frame / BATCH_ANIMATE_PERIOD) % 2)
+        step = -step;
+
+    moved.resize(count);
+    QVector<Matrix4x4> transforms(count);
+    for (int j = 0; j < count; j++)
+    {
+        moved[j] = (int)((long long)j * objects.size() / count);
+
+        Vector4 offset(0, 0, 0, 0);
+        offset.data[j % 3] = step;
+        transforms[j] = getTransMat(offset) * objects[moved[j]].m_transform;
+    }
+
+    return scene.updateTransforms(moved, transforms);
+}
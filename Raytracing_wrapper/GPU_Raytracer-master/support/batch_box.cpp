@@ -0,0 +1,375 @@
+/*!
+    @file batch_box.cpp
+    @desc: --box of the batch renderer, times the unit cube and
+           bounding box tests of the primary rays, the legacy plane tests
+           against the slab tests
+    @author: yanli
+    @date: May 2013
+ */
+
+#include <iomanip>
+#include <algorithm>
+
+#include "batch.h"
+#include "scene.h"
+#include "trace.h"
+#include "intersect_view.h"
+#include "plane_intersect.h"
+#include "cube_intersect.h"
+#include "kdbox_intersect.h"
+#include "camtrans_camera.h"
+
+/**
+ * @struct: BoxRay
+ * @brief The BoxRay struct is a ray ready for the box tests of --box, with
+ *        the reciprocal of its direction
+ */
+struct BoxRay
+{
+    Vector4 pos; // Start of the ray
+    Vector4 d; // Direction of the ray
+    Vector4 invD; // Reciprocal of the direction
+    AABB box; // The box tested, unused for the unit cube
+};
+
+/**
+ * @brief legacyCheckRange: check a hit on a face of a box against the two
+ *                          other axes, as kd box tests did before the slabs
+ * @param intersect: the hit
+ * @param range: lower and upper bounds of the two other axes
+ * @param axis: the axis of the face
+ * @return: true if the hit is on the face
+ */
+static bool legacyCheckRange(const Vector4 intersect,
+                             const Vector4 range,
+                             const int axis)
+{
+    switch (axis)
+    {
+    case 0:
+        return intersect.y >= range.x && intersect.y <= range.y &&
+               intersect.z >= range.z && intersect.z <= range.w;
+    case 1:
+        return intersect.x >= range.x && intersect.x <= range.y &&
+               intersect.z >= range.z && intersect.z <= range.w;
+    default:
+        return intersect.x >= range.x && intersect.x <= range.y &&
+               intersect.y >= range.z && intersect.y <= range.w;
+    }
+}
+
+/**
+ * @brief legacyIntersectKdBox: the kd box test before the slabs, six planes
+ *                              each checked against the box
+ * @param eyePos: the eye position
+ * @param d: the direction
+ * @param box: the box
+ * @return: the closest 't' value in front of the eye, -1 for a miss
+ */
+static REAL legacyIntersectKdBox(const Vector4& eyePos,
+                                 const Vector4& d,
+                                 AABB box)
+{
+    Vector3 start = box.getPos();
+    Vector3 end   = box.getPos() + box.getSize();
+    Vector3 norm[3] = {Vector3(1, 0, 0), Vector3(0, 1, 0), Vector3(0, 0, 1)};
+    Vector4 range[3] = {Vector4(start.y, end.y, start.z, end.z),
+                        Vector4(start.x, end.x, start.z, end.z),
+                        Vector4(start.x, end.x, start.y, end.y)};
+
+    REAL near = POS_INF;
+    for (int i = 0; i < 6; i++)
+    {
+        REAL t = doIntersectPlane(i % 2 ? end : start, norm[i / 2],
+                                  eyePos, d);
+        if (t > 0 && t < near &&
+            legacyCheckRange(eyePos + t * d, range[i / 2], i / 2))
+            near = t;
+    }
+    return near != POS_INF ? near : -1;
+}
+
+/**
+ * @brief legacyIntersectUnitCube: the unit cube test before the slabs, six
+ *                                 planes each checked against the cube with
+ *                                 a tolerance of EPSILON
+ * @param eyePos: the eye position
+ * @param d: the direction
+ * @param faceIndex: the face hit, should be returned
+ * @return: the 't' value, -1 for a miss
+ */
+static REAL legacyIntersectUnitCube(const Vector4& eyePos,
+                                    const Vector4& d,
+                                    int& faceIndex)
+{
+    static const int axes[6]      = {2, 2, 0, 0, 1, 1};
+    static const float sides[6]   = {1, -1, -1, 1, 1, -1};
+    static const int checks[6][2] = {{1, 0}, {1, 0}, {1, 2},
+                                     {1, 2}, {2, 0}, {2, 0}};
+
+    REAL minT = POS_INF;
+    for (int i = 0; i < 6; i++)
+    {
+        Vector3 norm(0, 0, 0);
+        norm.xyz[axes[i]] = sides[i];
+        REAL t = doIntersectPlane(norm * 0.5f, norm, eyePos, d);
+
+        Vector4 hit = eyePos + t * d;
+        REAL p0 = hit.data[checks[i][0]];
+        REAL p1 = hit.data[checks[i][1]];
+        if (!(p0 <= 0.5 + EPSILON && p0 >= -0.5 - EPSILON &&
+              p1 <= 0.5 + EPSILON && p1 >= -0.5 - EPSILON))
+            t = -1;
+
+        if (t > 0 && t < minT)
+        {
+            minT = t;
+            faceIndex = i;
+        }
+    }
+    return minT != POS_INF ? minT : -1;
+}
+
+/**
+ * @struct: BoxBatch
+ * @brief The BoxBatch struct holds up to BATCH_BOX_TESTS rays waiting for
+ *        the box tests of --box, and the results of both kinds of tests
+ */
+struct BoxBatch
+{
+    QVector<BoxRay> cubeRays; // Rays in the space of a unit cube
+    QVector<BoxRay> boxRays; // Rays against a bounding box
+    QVector<REAL> legacyT; // 't' values of the legacy tests
+    QVector<int> legacyFaces; // Faces hit by the legacy cube test
+    QVector<REAL> slabT; // 't' values of the slab tests
+    QVector<int> slabFaces; // Faces hit by the slab cube test
+};
+
+/**
+ * @brief sameHit: check that two box tests agree
+ * @param t0: the 't' value of the first test, -1 for a miss
+ * @param t1: the 't' value of the second test, -1 for a miss
+ * @return: true if both miss, or both hit at about the same 't'
+ */
+static bool sameHit(REAL t0, REAL t1)
+{
+    if (t0 <= 0 || t1 <= 0)
+        return t0 <= 0 && t1 <= 0;
+    return fabs(t0 - t1) <= EPSILON * std::max(1.f, t0);
+}
+
+/**
+ * @brief runBoxTests: time the waiting rays of a batch with the legacy and
+ *                     the slab tests, compare the hits and empty the batch
+ * @param batch: the batch
+ * @param stats: the statistics, should be returned
+ */
+static void runBoxTests(BoxBatch& batch, BatchStats& stats)
+{
+    const QVector<BoxRay>& cubeRays = batch.cubeRays;
+    const QVector<BoxRay>& boxRays  = batch.boxRays;
+    QElapsedTimer timer;
+
+    // Cubes
+    timer.start();
+    for (int k = 0; k < cubeRays.size(); k++)
+        batch.legacyT[k] = legacyIntersectUnitCube(cubeRays[k].pos,
+                                                   cubeRays[k].d,
+                                                   batch.legacyFaces[k]);
+    stats.legacyTime += elapsedMs(timer);
+
+    timer.start();
+    for (int k = 0; k < cubeRays.size(); k++)
+        batch.slabT[k] = doIntersectUnitCube(cubeRays[k].pos, cubeRays[k].d,
+                                             batch.slabFaces[k]);
+    stats.slabTime += elapsedMs(timer);
+
+    for (int k = 0; k < cubeRays.size(); k++)
+    {
+        if (!sameHit(batch.legacyT[k], batch.slabT[k]) ||
+            (batch.slabT[k] > 0 &&
+             batch.slabFaces[k] != batch.legacyFaces[k]))
+            stats.mismatches++;
+    }
+
+    // Bounding boxes, the eye inside a box hits where it leaves
+    timer.start();
+    for (int k = 0; k < boxRays.size(); k++)
+        batch.legacyT[k] = legacyIntersectKdBox(boxRays[k].pos,
+                                                boxRays[k].d,
+                                                boxRays[k].box);
+    stats.legacyTime += elapsedMs(timer);
+
+    timer.start();
+    for (int k = 0; k < boxRays.size(); k++)
+    {
+        REAL near, far;
+        int nearFace, farFace;
+        batch.slabT[k] = -1;
+        if (doIntersectRayKdBox(boxRays[k].pos, boxRays[k].invD,
+                                near, far, nearFace, farFace,
+                                boxRays[k].box))
+            batch.slabT[k] = near > 0 ? near : far;
+    }
+    stats.slabTime += elapsedMs(timer);
+
+    for (int k = 0; k < boxRays.size(); k++)
+    {
+        if (!sameHit(batch.legacyT[k], batch.slabT[k]))
+            stats.mismatches++;
+    }
+
+    stats.boxTests += cubeRays.size() + boxRays.size();
+    batch.cubeRays.clear();
+    batch.boxRays.clear();
+}
+
+/**
+ * @brief benchBoxTests: intersect the primary rays of a frame with every
+ *                       unit cube in object space and every object's
+ *                       bounding box on the calling thread, once with the
+ *                       legacy plane tests and once with the slab tests, and
+ *                       compare the hits. The rays are prepared in batches
+ *                       outside of the timers
+ * @param options: the options
+ * @param scene: the scene
+ * @param camera: the camera
+ * @param stats: the statistics, should be returned
+ */
+void benchBoxTests(const BatchOptions& options,
+                   Scene& scene,
+                   CamtransCamera& camera,
+                   BatchStats& stats)
+{
+    const QVector<SceneObject>& objects = scene.getObjects();
+    const IntersectView& view           = *scene.getIntersectView();
+    Vector4 eyePos            = camera.getPosition();
+    Matrix4x4 invViewTransMat = camera.getInvViewTransMatrix();
+    int width  = options.width;
+    int height = options.height;
+
+    BoxBatch batch;
+    batch.cubeRays.reserve(BATCH_BOX_TESTS);
+    batch.boxRays.reserve(BATCH_BOX_TESTS);
+    batch.legacyT.resize(BATCH_BOX_TESTS);
+    batch.legacyFaces.resize(BATCH_BOX_TESTS);
+    batch.slabT.resize(BATCH_BOX_TESTS);
+    batch.slabFaces.resize(BATCH_BOX_TESTS);
+
+    stats.boxTests   = 0;
+    stats.legacyTime = 0;
+    stats.slabTime   = 0;
+    stats.mismatches = 0;
+
+    for (int i = 0; i < options.frames; i++)
+    {
+        for (int row = 0; row < height; row++)
+        {
+            for (int col = 0; col < width; col++)
+            {
+                Vector4 pos, d;
+                generatePrimaryRay(col, row, width, height, eyePos,
+                                   BATCH_NEAR, invViewTransMat, pos, d);
+                BoxRay ray;
+                for (int k = 0; k < view.getCount(); k++)
+                {
+                    if (view.getType(k) != PRIMITIVE_CUBE)
+                        continue;
+                    view.transform(k, pos, d, ray.pos, ray.d);
+                    ray.invD = Vector4(1.f / ray.d.x, 1.f / ray.d.y,
+                                       1.f / ray.d.z, 0);
+                    batch.cubeRays.append(ray);
+                    if (batch.cubeRays.size() == BATCH_BOX_TESTS)
+                        runBoxTests(batch, stats);
+                }
+
+                ray.pos  = pos;
+                ray.d    = d;
+                ray.invD = Vector4(1.f / d.x, 1.f / d.y, 1.f / d.z, 0);
+                for (int k = 0; k < objects.size(); k++)
+                {
+                    ray.box = objects[k].m_boundingBox;
+                    batch.boxRays.append(ray);
+                    if (batch.boxRays.size() == BATCH_BOX_TESTS)
+                        runBoxTests(batch, stats);
+                }
+            }
+        }
+    }
+    runBoxTests(batch, stats);
+
+    stats.legacyTime /= options.frames;
+    stats.slabTime   /= options.frames;
+    stats.boxTests   /= options.frames;
+    stats.mismatches /= options.frames;
+}
+
+/**
+ * @brief getTestsPerSecond: get the throughput of box tests
+ * @param tests: number of tests
+ * @param ms: time of the tests in ms
+ * @return: millions of tests per second
+ */
+static double getTestsPerSecond(long long tests, double ms)
+{
+    return ms > 0 ? tests / (ms * 1000.0) : 0;
+}
+
+/**
+ * @brief printBoxReport: print the times of --box for a single scene
+ * @param options: the options
+ * @param stats: the statistics
+ */
+void printBoxReport(const BatchOptions& options, const BatchStats& stats)
+{
+    Q_UNUSED(options);
+    cout << "Box tests:  " << stats.boxTests << " of each" << endl
+         << "Legacy:     " << stats.legacyTime << " ms, "
+         << getTestsPerSecond(stats.boxTests, stats.legacyTime)
+         << " Mtests/s" << endl
+         << "Slabs:      " << stats.slabTime << " ms, "
+         << getTestsPerSecond(stats.boxTests, stats.slabTime)
+         << " Mtests/s, " << stats.mismatches << " mismatches" << endl;
+}
+
+/**
+ * @brief printBoxColumns: print the headers of the columns of --box
+ */
+void printBoxColumns()
+{
+    cout << std::setw(11) << "Legacy" << std::setw(11) << "Slabs"
+         << std::setw(11) << "Mismatches" << endl;
+}
+
+/**
+ * @brief printBoxRow: print the columns of --box of a scene line
+ * @param options: the options
+ * @param stats: the statistics of the scene, or the sum
+ * @param scenes: number of scenes in the statistics
+ */
+void printBoxRow(const BatchOptions& options,
+                 const BatchStats& stats,
+                 int scenes)
+{
+    Q_UNUSED(options);
+    Q_UNUSED(scenes);
+    cout << std::setw(11) << stats.legacyTime
+         << std::setw(11) << stats.slabTime
+         << std::setw(11) << stats.mismatches << endl;
+}
+
+/**
+ * @brief addBoxStats: add the statistics of --box to the sum
+ * @param options: the options
+ * @param stats: the statistics of a scene
+ * @param sum: the sum, should be returned
+ */
+void addBoxStats(const BatchOptions& options,
+                 const BatchStats& stats,
+                 BatchStats& sum)
+{
+    Q_UNUSED(options);
+    sum.legacyTime += stats.legacyTime;
+    sum.slabTime   += stats.slabTime;
+    sum.mismatches += stats.mismatches;
+}
@@ -0,0 +1,223 @@
+/*!
+    @file batch_opencl.cpp
+    @desc: --opencl and --compare of the batch renderer, traces the
+           frames with the kernel of the GPU tracer on a headless OpenCL
+           device, or compares its images with the CPU tracer's
+    @author: yanli
+    @date: May 2013
+ */
+
+#include <iomanip>
+#include <algorithm>
+
+#include "batch.h"
+#include "scene.h"
+#include "camtrans_camera.h"
+#include "GPUrayscene.h"
+
+/**
+ * @brief traceOpenCL: trace the frames with the OpenCL kernels into the
+ *                     image, the way the CPU frames are traced. A frame is
+ *                     read back while the next one traces
+ * @param options: the options
+ * @param cl: the headless OpenCL package
+ * @param scene: the scene with its kdtree built
+ * @param camera: the camera
+ * @param image: the image, should be returned
+ * @param stats: the statistics, should be returned
+ * @return: true for success and false for failure
+ */
+bool traceOpenCL(const BatchOptions& options,
+                 CLPack& cl,
+                 Scene& scene,
+                 CamtransCamera& camera,
+                 QImage& image,
+                 BatchStats& stats)
+{
+    QElapsedTimer timer;
+    GPURayScene* gpuScene = NULL;
+    bool success = true;
+    bool pending = false; // A frame is read back while the next traces
+
+    for (int i = 0; i < options.frames && success; i++)
+    {
+        double frameUpdate = 0;
+        if (i > 0 && options.animate > 0)
+        {
+            QVector<int> moved;
+            timer.start();
+            if (animateScene(options, scene, i, moved))
+                stats.rebuilds++;
+            if (gpuScene)
+                gpuScene->updateObjects(&scene, moved);
+            frameUpdate = elapsedMs(timer);
+            stats.updateTime += frameUpdate;
+        }
+
+        // The buffers of the scene are uploaded when it's created
+        timer.start();
+        if (options.respawn && gpuScene)
+        {
+            if (pending)
+                success = gpuScene->readOffscreen((BGRA*)image.bits());
+            pending = false;
+            stats.droppedRays += gpuScene->getDroppedRays();
+            delete gpuScene;
+            gpuScene = NULL;
+        }
+        if (!gpuScene)
+            gpuScene = new GPURayScene(&cl, NULL, &scene, 0, 0,
+                                       options.width, options.height);
+        clFinish(cl.m_queue);
+        double frameSetup = elapsedMs(timer);
+
+        timer.start();
+        startCountingAllocations();
+        success = success &&
+                gpuScene->renderOffscreen(camera.getPosition(),
+                                          BATCH_NEAR,
+                                          camera.getInvViewTransMatrix());
+        if (success && pending)
+            success = gpuScene->readOffscreen((BGRA*)image.bits());
+        pending = success;
+        int frameAllocations = stopCountingAllocations();
+        double frameTrace = elapsedMs(timer);
+
+        if (i == 0)
+            stats.firstAllocations = frameAllocations;
+        else if (frameAllocations < 0)
+            stats.allocations = -1;
+        else
+            stats.allocations += frameAllocations;
+
+        if (options.frames > 1 && options.sceneFiles.size() == 1)
+        {
+            cout << "Frame " << i << ":    setup " << frameSetup
+                 << " ms, trace " << frameTrace << " ms, "
+                 << frameAllocations << " allocations";
+            if (options.animate > 0)
+                cout << ", update " << frameUpdate << " ms";
+            cout << endl;
+        }
+
+        stats.setupTime += frameSetup;
+        stats.traceTime += frameTrace;
+    }
+
+    // The last frame is still in flight
+    if (pending)
+    {
+        timer.start();
+        success = gpuScene->readOffscreen((BGRA*)image.bits());
+        stats.traceTime += elapsedMs(timer);
+    }
+    stats.setupTime /= options.frames;
+    stats.traceTime /= options.frames;
+    if (options.frames > 1)
+        stats.updateTime /= options.frames - 1;
+
+    stats.tileCount   = 0;
+    stats.tileSize    = 0;
+    stats.stolenCount = 0;
+    if (gpuScene)
+        stats.droppedRays += gpuScene->getDroppedRays();
+    delete gpuScene;
+    return success;
+}
+
+/**
+ * @brief compareOpenCL: trace the last frame of the CPU tracer again with
+ *                       the OpenCL kernel and count the pixels the images
+ *                       disagree on
+ * @param options: the options
+ * @param cl: the headless OpenCL package
+ * @param scene: the scene as the CPU tracer left it
+ * @param camera: the camera
+ * @param image: the image of the CPU tracer
+ * @param stats: the statistics, should be returned
+ * @return: true for success and false for failure
+ */
+bool compareOpenCL(const BatchOptions& options,
+                   CLPack& cl,
+                   Scene& scene,
+                   CamtransCamera& camera,
+                   const QImage& image,
+                   BatchStats& stats)
+{
+    // The objects are already moved, the timings stay the CPU tracer's
+    BatchOptions single = options;
+    single.frames  = 1;
+    single.animate = 0;
+    single.respawn = false;
+    BatchStats clStats = stats;
+    QImage clImage(options.width, options.height, QImage::Format_RGB32);
+    if (!traceOpenCL(single, cl, scene, camera, clImage, clStats))
+        return false;
+    stats.droppedRays = clStats.droppedRays;
+
+    stats.mismatches    = 0;
+    stats.maxDifference = 0;
+    for (int y = 0; y < options.height; y++)
+    {
+        const QRgb* cpuLine = (const QRgb*)image.constScanLine(y);
+        const QRgb* clLine  = (const QRgb*)clImage.constScanLine(y);
+        for (int x = 0; x < options.width; x++)
+        {
+            int difference = std::max(abs(qRed(cpuLine[x]) -
+                                          qRed(clLine[x])),
+                                      std::max(abs(qGreen(cpuLine[x]) -
+                                                   qGreen(clLine[x])),
+                                               abs(qBlue(cpuLine[x]) -
+                                                   qBlue(clLine[x]))));
+            stats.maxDifference = std::max(stats.maxDifference, difference);
+            if (difference > options.tolerance)
+                stats.mismatches++;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief printCompareColumns: print the headers of the columns of --compare
+ */
+void printCompareColumns()
+{
+    cout << std::setw(11) << "Trace" << std::setw(11) << "Mismatches"
+         << std::setw(11) << "Max diff" << std::setw(11) << "Dropped"
+         << endl;
+}
+
+/**
+ * @brief printCompareRow: print the columns of --compare of a scene line
+ * @param options: the options
+ * @param stats: the statistics of the scene, or the sum
+ * @param scenes: number of scenes in the statistics
+ */
+void printCompareRow(const BatchOptions& options,
+                     const BatchStats& stats,
+                     int scenes)
+{
+    Q_UNUSED(options);
+    Q_UNUSED(scenes);
+    cout << std::setw(11) << stats.traceTime
+         << std::setw(11) << stats.mismatches
+         << std::setw(11) << stats.maxDifference
+         << std::setw(11) << stats.droppedRays << endl;
+}
+
+/**
+ * @brief addCompareStats: add the statistics of --compare to the sum
+ * @param options: the options
+ * @param stats: the statistics of a scene
+ * @param sum: the sum, should be returned
+ */
+void addCompareStats(const BatchOptions& options,
+                     const BatchStats& stats,
+                     BatchStats& sum)
+{
+    Q_UNUSED(options);
+    sum.traceTime    += stats.traceTime;
+    sum.mismatches   += stats.mismatches;
+    sum.maxDifference = std::max(sum.maxDifference, stats.maxDifference);
+    sum.droppedRays  += stats.droppedRays;
+}
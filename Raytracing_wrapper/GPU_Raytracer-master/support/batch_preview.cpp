@@ -0,0 +1,53 @@
+/*!
+    @file batch_preview.cpp
+    @desc: --preview of the batch renderer, traces the frames the way the
+           interactive preview of View2D does, in calls of a given time
+    @author: yanli
+    @date: May 2013
+ */
+
+#include <algorithm>
+
+#include "batch.h"
+#include "CPUrayscene.h"
+#include "camtrans_camera.h"
+
+/**
+ * @brief tracePreviewFrame: call the preview until the frame is complete,
+ *                           like the timer of View2D does while the camera
+ *                           is still
+ * @param options: the options
+ * @param rayScene: the CPU scene
+ * @param camera: the camera
+ * @param image: the image, should be returned
+ * @param stats: the statistics of the calls, should be returned
+ * @return: the calls made for the frame
+ */
+int tracePreviewFrame(const BatchOptions& options,
+                      CPURayScene& rayScene,
+                      CamtransCamera& camera,
+                      QImage& image,
+                      BatchStats& stats)
+{
+    int calls = 0;
+    bool done = false;
+    while (!done)
+    {
+        QElapsedTimer callTimer;
+        callTimer.start();
+        done = rayScene.tracePreview((BGRA*)image.bits(),
+                                     options.width,
+                                     options.height,
+                                     camera.getPosition(),
+                                     BATCH_NEAR,
+                                     camera.getInvViewTransMatrix(),
+                                     options.preview);
+        double callTime = elapsedMs(callTimer);
+        if (stats.previewCalls == 0)
+            stats.previewFirst = callTime;
+        stats.previewMax = std::max(stats.previewMax, callTime);
+        stats.previewCalls++;
+        calls++;
+    }
+    return calls;
+}
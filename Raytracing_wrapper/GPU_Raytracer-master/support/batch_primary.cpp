@@ -0,0 +1,156 @@
+/*!
+    @file batch_primary.cpp
+    @desc: --primary of the batch renderer, times the primary rays of a
+           frame without shading, one by one and in packets
+    @author: yanli
+    @date: May 2013
+ */
+
+#include <iomanip>
+
+#include "batch.h"
+#include "scene.h"
+#include "trace.h"
+#include "intersect.h"
+#include "packet_intersect.h"
+#include "camtrans_camera.h"
+
+/**
+ * @brief benchPrimaryRays: intersect the primary rays of a frame one by one
+ *                          and in packets on the calling thread, without
+ *                          shading, and compare the hits
+ * @param options: the options
+ * @param scene: the scene with its kdtree or BVH built
+ * @param camera: the camera
+ * @param stats: the statistics, should be returned
+ */
+void benchPrimaryRays(const BatchOptions& options,
+                      Scene& scene,
+                      CamtransCamera& camera,
+                      BatchStats& stats)
+{
+    const IntersectView& view = *scene.getIntersectView();
+    Vector4 eyePos            = camera.getPosition();
+    Matrix4x4 invViewTransMat = camera.getInvViewTransMatrix();
+    int width  = options.width;
+    int height = options.height;
+
+    QVector<int> singleObjects(width * height);
+    QVector<int> packetObjects(width * height);
+    QElapsedTimer timer;
+    stats.singleTime = 0;
+    stats.packetTime = 0;
+
+    for (int i = 0; i < options.frames; i++)
+    {
+        timer.start();
+        for (int row = 0; row < height; row++)
+        {
+            for (int col = 0; col < width; col++)
+            {
+                Vector4 pos, d;
+                generatePrimaryRay(col, row, width, height, eyePos,
+                                   BATCH_NEAR, invViewTransMat, pos, d);
+
+                int objectIndex = -1;
+                int faceIndex   = -1;
+                REAL t = intersect(pos, view, d, objectIndex, faceIndex,
+                                   scene.getKdTree(), scene.getBvh(),
+                                   scene.getExtends());
+                singleObjects[row * width + col] = t > 0 ? objectIndex : -1;
+            }
+        }
+        stats.singleTime += elapsedMs(timer);
+
+        timer.start();
+        RayPacket packet;
+        for (int row = 0; row < height; row += RAY_PACKET_WIDTH)
+        {
+            for (int col = 0; col < width; col += RAY_PACKET_WIDTH)
+            {
+                int packetWidth  = qMin(RAY_PACKET_WIDTH, width - col);
+                int packetHeight = qMin(RAY_PACKET_WIDTH, height - row);
+                generatePrimaryPacket(packet, col, row, packetWidth,
+                                      packetHeight, width, height, eyePos,
+                                      BATCH_NEAR, invViewTransMat);
+                intersectPacket(packet, view, scene.getKdTree(),
+                                scene.getBvh(), scene.getExtends());
+
+                for (int j = 0; j < packet.m_count; j++)
+                {
+                    int index = (row + j / packetWidth) * width +
+                            col + j % packetWidth;
+                    packetObjects[index] = packet.m_t[j] > 0 ?
+                                packet.m_object[j] : -1;
+                }
+            }
+        }
+        stats.packetTime += elapsedMs(timer);
+    }
+    stats.singleTime /= options.frames;
+    stats.packetTime /= options.frames;
+
+    stats.mismatches = 0;
+    for (int i = 0; i < width * height; i++)
+    {
+        if (singleObjects[i] != packetObjects[i])
+            stats.mismatches++;
+    }
+}
+
+/**
+ * @brief printPrimaryReport: print the times of --primary for a single scene
+ * @param options: the options
+ * @param stats: the statistics
+ */
+void printPrimaryReport(const BatchOptions& options, const BatchStats& stats)
+{
+    cout << "Single:     " << stats.singleTime << " ms, "
+         << getRaysPerSecond(options, stats.singleTime) << " Mrays/s"
+         << endl
+         << "Packets:    " << stats.packetTime << " ms, "
+         << getRaysPerSecond(options, stats.packetTime) << " Mrays/s, "
+         << stats.mismatches << " mismatches" << endl;
+}
+
+/**
+ * @brief printPrimaryColumns: print the headers of the columns of --primary
+ */
+void printPrimaryColumns()
+{
+    cout << std::setw(11) << "Single" << std::setw(11) << "Packets"
+         << std::setw(11) << "Mismatches" << endl;
+}
+
+/**
+ * @brief printPrimaryRow: print the columns of --primary of a scene line
+ * @param options: the options
+ * @param stats: the statistics of the scene, or the sum
+ * @param scenes: number of scenes in the statistics
+ */
+void printPrimaryRow(const BatchOptions& options,
+                     const BatchStats& stats,
+                     int scenes)
+{
+    Q_UNUSED(options);
+    Q_UNUSED(scenes);
+    cout << std::setw(11) << stats.singleTime
+         << std::setw(11) << stats.packetTime
+         << std::setw(11) << stats.mismatches << endl;
+}
+
+/**
+ * @brief addPrimaryStats: add the statistics of --primary to the sum
+ * @param options: the options
+ * @param stats: the statistics of a scene
+ * @param sum: the sum, should be returned
+ */
+void addPrimaryStats(const BatchOptions& options,
+                     const BatchStats& stats,
+                     BatchStats& sum)
+{
+    Q_UNUSED(options);
+    sum.singleTime += stats.singleTime;
+    sum.packetTime += stats.packetTime;
+    sum.mismatches += stats.mismatches;
+}
@@ -0,0 +1,375 @@
+/*!
+    @file batch_view.cpp
+    @desc: --view of the batch renderer, times the primary rays
+           against every object through the scene objects and through
+           the intersection view, with the cache misses per ray of both
+    @author: yanli
+    @date: May 2013
+ */
+
+#include <iomanip>
+
+#include "batch.h"
+#include "scene.h"
+#include "trace.h"
+#include "intersect.h"
+#include "intersect_view.h"
+#include "camtrans_camera.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define BATCH_COUNT_CACHE_MISSES // The hardware counter of the cache misses
+                                 // is read through perf_event_open
+#endif
+
+/**
+ * @brief openCacheMissCounter: open the hardware counter of the cache
+ *                              misses of the calling thread, stopped
+ * @return: the counter, -1 if it can't be opened on this platform or
+ *          perf_event_paranoid doesn't allow it
+ */
+static int openCacheMissCounter()
+{
+#ifdef BATCH_COUNT_CACHE_MISSES
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type           = PERF_TYPE_HARDWARE;
+    attr.size           = sizeof(attr);
+    attr.config         = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled       = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+
+/**
+ * @brief startCacheMissCounter: count the cache misses from zero
+ * @param counter: the counter, -1 does nothing
+ */
+static void startCacheMissCounter(int counter)
+{
+#ifdef BATCH_COUNT_CACHE_MISSES
+    if (counter < 0)
+        return;
+    ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+    ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+}
+
+/**
+ * @brief stopCacheMissCounter: stop counting the cache misses
+ * @param counter: the counter
+ * @return: the misses since startCacheMissCounter(), -1 if they can't be
+ *          read
+ */
+static long long stopCacheMissCounter(int counter)
+{
+#ifdef BATCH_COUNT_CACHE_MISSES
+    if (counter < 0)
+        return -1;
+    ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+    long long misses;
+    if (read(counter, &misses, sizeof(misses)) != sizeof(misses))
+        return -1;
+    return misses;
+#else
+    return -1;
+#endif
+}
+
+/**
+ * @brief closeCacheMissCounter: close the counter
+ * @param counter: the counter, -1 does nothing
+ */
+static void closeCacheMissCounter(int counter)
+{
+#ifdef BATCH_COUNT_CACHE_MISSES
+    if (counter >= 0)
+        close(counter);
+#endif
+}
+
+/**
+ * @brief intersectObjects: find the closest hit of a ray by reading every
+ *                          scene object, the way the intersection loops did
+ *                          before the intersection view
+ * @param pos: start of the ray
+ * @param d: direction of the ray
+ * @param objects: object list with the groups expanded
+ * @param objectIndex: the object index, should be returned
+ * @return: the 't' value
+ */
+static REAL intersectObjects(const Vector4& pos,
+                             const Vector4& d,
+                             const QVector<SceneObject>& objects,
+                             int& objectIndex)
+{
+    REAL minT     = POS_INF;
+    int faceIndex = -1;
+    for (int i = 0; i < objects.size(); i++)
+    {
+        const SceneObject& curObj = objects[i];
+        Matrix4x4 invCompMat = curObj.m_invTransform;
+
+        Vector4 eyePosObjSpace = invCompMat * pos;
+        Vector4 dObjSpace      = invCompMat * d;
+
+        REAL t = doIntersect(curObj.m_primitive.type, curObj.m_mesh,
+                             eyePosObjSpace, dObjSpace, faceIndex);
+        if (t > 0 && t < minT)
+        {
+            minT = t;
+            objectIndex = i;
+        }
+    }
+    return minT != POS_INF ? minT : -1;
+}
+
+/**
+ * @brief intersectView: find the closest hit of a ray by reading every
+ *                       object of the intersection view
+ * @param pos: start of the ray
+ * @param d: direction of the ray
+ * @param view: the intersection view
+ * @param objectIndex: the object index, should be returned
+ * @return: the 't' value
+ */
+static REAL intersectView(const Vector4& pos,
+                          const Vector4& d,
+                          const IntersectView& view,
+                          int& objectIndex)
+{
+    REAL minT     = POS_INF;
+    int faceIndex = -1;
+    for (int i = 0; i < view.getCount(); i++)
+    {
+        Vector4 eyePosObjSpace, dObjSpace;
+        view.transform(i, pos, d, eyePosObjSpace, dObjSpace);
+
+        // A group's objects have ids counting from the group's id
+        int id = view.getObjectId(i);
+        REAL t = -1;
+        if (view.getType(i) == PRIMITIVE_GROUP)
+        {
+            int groupObject = -1;
+            t = intersectGroup(view.getGroup(i), eyePosObjSpace, dObjSpace,
+                               minT, groupObject, faceIndex);
+            id += groupObject;
+        }
+        else
+        {
+            t = doIntersect(view.getType(i), view.getMesh(i),
+                            eyePosObjSpace, dObjSpace, faceIndex);
+        }
+        if (t > 0 && t < minT)
+        {
+            minT = t;
+            objectIndex = id;
+        }
+    }
+    return minT != POS_INF ? minT : -1;
+}
+
+/**
+ * @brief benchIntersectView: intersect the primary rays of a frame with
+ *                            every object on the calling thread, once
+ *                            reading the scene objects and once reading the
+ *                            intersection view, and compare the hits. No
+ *                            acceleration structure is used but the groups'
+ *                            BVHs, so the time is all in the object loop.
+ *                            The scene objects are read with the groups
+ *                            expanded
+ * @param options: the options
+ * @param scene: the scene
+ * @param camera: the camera
+ * @param stats: the statistics, should be returned
+ */
+void benchIntersectView(const BatchOptions& options,
+                        Scene& scene,
+                        CamtransCamera& camera,
+                        BatchStats& stats)
+{
+    QVector<SceneObject> objects;
+    scene.expandGroups(objects);
+    const IntersectView& view = *scene.getIntersectView();
+    Vector4 eyePos            = camera.getPosition();
+    Matrix4x4 invViewTransMat = camera.getInvViewTransMatrix();
+    int width  = options.width;
+    int height = options.height;
+
+    QVector<int> objectHits(width * height);
+    QVector<int> viewHits(width * height);
+    QElapsedTimer timer;
+    stats.objectTime = 0;
+    stats.viewTime   = 0;
+
+    // The counters only count this thread, the loops run on it
+    int counters[2] = { openCacheMissCounter(), openCacheMissCounter() };
+    long long misses[2] = { 0, 0 };
+
+    for (int i = 0; i < options.frames; i++)
+    {
+        for (int pass = 0; pass < 2; pass++)
+        {
+            startCacheMissCounter(counters[pass]);
+            timer.start();
+            for (int row = 0; row < height; row++)
+            {
+                for (int col = 0; col < width; col++)
+                {
+                    Vector4 pos, d;
+                    generatePrimaryRay(col, row, width, height, eyePos,
+                                       BATCH_NEAR, invViewTransMat, pos, d);
+
+                    int objectIndex = -1;
+                    REAL t = pass == 0 ?
+                                intersectObjects(pos, d, objects,
+                                                 objectIndex) :
+                                intersectView(pos, d, view, objectIndex);
+                    int hit = t > 0 ? objectIndex : -1;
+                    if (pass == 0)
+                        objectHits[row * width + col] = hit;
+                    else
+                        viewHits[row * width + col] = hit;
+                }
+            }
+            if (pass == 0)
+                stats.objectTime += elapsedMs(timer);
+            else
+                stats.viewTime += elapsedMs(timer);
+
+            long long passMisses = stopCacheMissCounter(counters[pass]);
+            if (passMisses < 0 || misses[pass] < 0)
+                misses[pass] = -1;
+            else
+                misses[pass] += passMisses;
+        }
+    }
+    stats.objectTime /= options.frames;
+    stats.viewTime   /= options.frames;
+
+    double rays = (double)options.frames * width * height;
+    stats.objectMisses = misses[0] < 0 ? -1 : misses[0] / rays;
+    stats.viewMisses   = misses[1] < 0 ? -1 : misses[1] / rays;
+    closeCacheMissCounter(counters[0]);
+    closeCacheMissCounter(counters[1]);
+
+    stats.mismatches = 0;
+    for (int i = 0; i < width * height; i++)
+    {
+        if (objectHits[i] != viewHits[i])
+            stats.mismatches++;
+    }
+}
+
+/**
+ * @brief printCacheMisses: print the cache misses per ray of a loop of
+ *                          --view
+ * @param misses: the misses per ray, -1 if they couldn't be counted
+ */
+static void printCacheMisses(double misses)
+{
+    if (misses < 0)
+        cout << "cache misses unavailable";
+    else
+        cout << misses << " cache misses per ray";
+}
+
+/**
+ * @brief printCacheMissColumn: print the cache misses per ray of a loop of
+ *                              --view in a column of the scene lines
+ * @param misses: the misses per ray, -1 if they couldn't be counted
+ */
+static void printCacheMissColumn(double misses)
+{
+    cout << std::setw(11);
+    if (misses < 0)
+        cout << "-";
+    else
+        cout << misses;
+}
+
+/**
+ * @brief printViewReport: print the times and cache misses of --view for a
+ *                         single scene. The bytes the object loop reads per
+ *                         object explain the cache misses
+ * @param options: the options
+ * @param stats: the statistics
+ */
+void printViewReport(const BatchOptions& options, const BatchStats& stats)
+{
+    cout << "Objects:    " << stats.objectTime << " ms, "
+         << getRaysPerSecond(options, stats.objectTime) << " Mrays/s, "
+         << sizeof(SceneObject) << " bytes per object, ";
+    printCacheMisses(stats.objectMisses);
+    cout << endl
+         << "View:       " << stats.viewTime << " ms, "
+         << getRaysPerSecond(options, stats.viewTime) << " Mrays/s, "
+         << INTERSECT_VIEW_OBJECT_SIZE << " bytes per object, ";
+    printCacheMisses(stats.viewMisses);
+    cout << ", " << stats.mismatches << " mismatches" << endl;
+}
+
+/**
+ * @brief printViewColumns: print the headers of the columns of --view
+ */
+void printViewColumns()
+{
+    cout << std::setw(11) << "SceneObj" << std::setw(11) << "View"
+         << std::setw(11) << "Mismatches" << std::setw(11) << "ObjMiss"
+         << std::setw(11) << "ViewMiss" << endl;
+}
+
+/**
+ * @brief printViewRow: print the columns of --view of a scene line, the
+ *                      cache misses of the sum are the mean of the scenes
+ * @param options: the options
+ * @param stats: the statistics of the scene, or the sum
+ * @param scenes: number of scenes in the statistics
+ */
+void printViewRow(const BatchOptions& options,
+                  const BatchStats& stats,
+                  int scenes)
+{
+    Q_UNUSED(options);
+    cout << std::setw(11) << stats.objectTime
+         << std::setw(11) << stats.viewTime
+         << std::setw(11) << stats.mismatches;
+    printCacheMissColumn(stats.objectMisses < 0 ?
+                             -1 : stats.objectMisses / scenes);
+    printCacheMissColumn(stats.viewMisses < 0 ?
+                             -1 : stats.viewMisses / scenes);
+    cout << endl;
+}
+
+/**
+ * @brief addViewStats: add the statistics of --view to the sum
+ * @param options: the options
+ * @param stats: the statistics of a scene
+ * @param sum: the sum, should be returned
+ */
+void addViewStats(const BatchOptions& options,
+                  const BatchStats& stats,
+                  BatchStats& sum)
+{
+    Q_UNUSED(options);
+    sum.objectTime += stats.objectTime;
+    sum.viewTime   += stats.viewTime;
+    sum.mismatches += stats.mismatches;
+
+    // Once unavailable the sum stays so
+    if (stats.objectMisses < 0 || sum.objectMisses < 0)
+        sum.objectMisses = -1;
+    else
+        sum.objectMisses += stats.objectMisses;
+    if (stats.viewMisses < 0 || sum.viewMisses < 0)
+        sum.viewMisses = -1;
+    else
+        sum.viewMisses += stats.viewMisses;
+}
@@ -20,7 +20,9 @@
 
 #include "camtrans_camera.h"
 #include "global.h"
+#ifndef NO_GL
 #include <qgl.h>
+#endif
 
 CamtransCamera::CamtransCamera()
 {
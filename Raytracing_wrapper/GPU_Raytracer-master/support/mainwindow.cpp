@@ -41,6 +41,9 @@ void MainWindow::on_actionOpen_triggered()
                                                     "Scene Files (*.xml)");
     ui->view3D->loadScene(fileName);
     ui->view3D->createGPUScene();
+
+    // The CPU scene points to the old scene's kdtree
+    ui->view2D->releaseScene();
 }
 
 void MainWindow::on_radioButtonCPUTrace_clicked()
@@ -109,6 +112,7 @@ void MainWindow::on_checkBox_supersampling_toggled(bool checked)
 void MainWindow::on_stopButton_clicked()
 {
       ui->view3D->activateGPUtrace(false);
+      ui->view2D->stopPreview();
 }
 
 void MainWindow::on_traceButton_clicked()
@@ -117,11 +121,17 @@ void MainWindow::on_traceButton_clicked()
 
     if (curScene && settings.traceMode == CPU)
     {
-        CPURayScene* newScene = new CPURayScene(curScene);
-        ui->view2D->setScene(newScene);
-        ui->view2D->traceScene(ui->view3D->getCamera(),
-                               ui->view2D->size().width(),
-                               ui->view2D->size().height());
+        // Reuse the CPU scene and its threads until a new scene is loaded
+        if (!ui->view2D->getScene())
+            ui->view2D->setScene(new CPURayScene(curScene));
+
+        // The preview traces a bit of the scene every tick until stopped
+        if (settings.useInteractivePreview)
+            ui->view2D->startPreview(ui->view3D->getCamera());
+        else
+            ui->view2D->traceScene(ui->view3D->getCamera(),
+                                   ui->view2D->size().width(),
+                                   ui->view2D->size().height());
         if (ui->radioButtonCPUTrace->isChecked())
             activateView2D();
     }
@@ -136,3 +146,10 @@ void MainWindow::on_checkBox_use_kdtree_toggled(bool checked)
     settings.useKdTree = checked;
     ui->view3D->syncGPUGlobalSetting();
 }
+
+void MainWindow::on_checkBox_preview_toggled(bool checked)
+{
+    settings.useInteractivePreview = checked;
+    if (!checked)
+        ui->view2D->stopPreview();
+}
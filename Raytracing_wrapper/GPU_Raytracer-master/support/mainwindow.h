@@ -53,6 +53,7 @@ private slots:
     void on_stopButton_clicked();
     void on_traceButton_clicked();
     void on_checkBox_use_kdtree_toggled(bool checked);
+    void on_checkBox_preview_toggled(bool checked);
 };
 
 #endif // MAINWINDOW_H
@@ -14,15 +14,21 @@
 
 #include "view2d.h"
 #include "CPUrayscene.h"
+#include "camera.h"
 
 View2D::View2D(QWidget *parent) :
-    QWidget(parent)
+    QWidget(parent), m_previewTimer(this)
 {
 
     COMPILE_TIME_ASSERT(sizeof(BGRA) == 4);
 
-    m_image = NULL;
-    m_scene = NULL;
+    m_image           = NULL;
+    m_scene           = NULL;
+    m_previewCamera   = NULL;
+    m_mouseRightDown  = false;
+    m_mouseMiddleDown = false;
+
+    connect(&m_previewTimer, SIGNAL(timeout()), this, SLOT(refinePreview()));
 
     resize(WIN_WIDTH, WIN_HEIGHT);
     setFixedSize(WIN_WIDTH, WIN_HEIGHT);
@@ -118,6 +124,16 @@ void View2D::setScene(CPURayScene* scene)
     m_scene = scene;
 }
 
+void View2D::releaseScene()
+{
+    stopPreview();
+
+    if(m_scene)
+        delete m_scene;
+
+    m_scene = NULL;
+}
+
 void View2D::traceScene(OrbitCamera* camera, int width, int height)
 {
     if(m_scene)
@@ -126,6 +142,80 @@ void View2D::traceScene(OrbitCamera* camera, int width, int height)
     }
 }
 
+void View2D::startPreview(OrbitCamera* camera)
+{
+    assert(camera);
+
+    m_previewCamera = camera;
+    refinePreview();
+
+    // A finished preview keeps polling the camera, it starts over as soon
+    // as the camera moves
+    m_previewTimer.start(1000 / 60);
+}
+
+void View2D::stopPreview()
+{
+    m_previewTimer.stop();
+    m_previewCamera   = NULL;
+    m_mouseRightDown  = false;
+    m_mouseMiddleDown = false;
+}
+
+void View2D::refinePreview()
+{
+    if (!m_scene || !m_previewCamera)
+        return;
+
+    // Nothing to show if the last frame finished the preview and the camera
+    // is still
+    int step = m_scene->getPreviewStep();
+    bool done = m_scene->tracePreview(this, m_previewCamera, width(),
+                                      height(), settings.previewBudget);
+    if (step > 0 || !done)
+        update();
+}
+
+void View2D::mousePressEvent(QMouseEvent *event)
+{
+    if (!m_previewCamera)
+        return;
+
+    if (event->button() == Qt::RightButton)
+    {
+        m_previewCamera->mouseDown(event->x(), event->y());
+        m_mouseRightDown = true;
+    }
+    else if (event->button() == Qt::MiddleButton)
+    {
+        m_previewCamera->mouseDown(event->x(), event->y());
+        m_mouseMiddleDown = true;
+    }
+}
+
+void View2D::mouseMoveEvent(QMouseEvent *event)
+{
+    if (!m_previewCamera)
+        return;
+
+    if (m_mouseRightDown)
+        m_previewCamera->mouseMove(event->x(), event->y());
+    else if (m_mouseMiddleDown)
+        m_previewCamera->mouseMovePan(event->x(), event->y());
+}
+
+void View2D::mouseReleaseEvent(QMouseEvent *)
+{
+    m_mouseRightDown  = false;
+    m_mouseMiddleDown = false;
+}
+
+void View2D::wheelEvent(QWheelEvent *event)
+{
+    if (m_previewCamera)
+        m_previewCamera->mouseWheel(event->delta());
+}
+
 void View2D::paintEvent(QPaintEvent *)
 {
     QPainter painter(this);
@@ -9,6 +9,7 @@
 #define VIEW2D_H
 
 #include <QWidget>
+#include <QTimer>
 #include "global.h"
 
 class Scene;
@@ -69,6 +70,16 @@ public:
      */
     void setScene(CPURayScene* scene);
 
+    /**
+     * @brief releaseScene: delete my scene, e.g. when a new scene is loaded
+     */
+    void releaseScene();
+
+    /**
+     * Getters
+     */
+    CPURayScene* getScene() { return m_scene; }
+
     /**
      * @brief traceScene: do CPU ray tracing
      * @param camera: orbit camera
@@ -77,6 +88,25 @@ public:
      */
     void traceScene(OrbitCamera* camera, int width, int height);
 
+    /**
+     * @brief startPreview: trace the scene interactively, a coarse image
+     *                      shows up at once and is refined while the camera
+     *                      stays still. The mouse moves the camera like in
+     *                      View3D
+     * @param camera: orbit camera
+     */
+    void startPreview(OrbitCamera* camera);
+
+    /**
+     * @brief stopPreview: stop tracing the scene interactively
+     */
+    void stopPreview();
+
+    /**
+     * Getters
+     */
+    bool isPreviewing() { return m_previewCamera != NULL; }
+
 protected:
 
     /**
@@ -84,11 +114,31 @@ protected:
      */
     virtual void paintEvent(QPaintEvent *);
 
+    /**
+     * Mouse Event handlers, they move the camera of the preview
+     */
+    virtual void mousePressEvent(QMouseEvent *event);
+    virtual void mouseMoveEvent(QMouseEvent *event);
+    virtual void mouseReleaseEvent(QMouseEvent *event);
+    virtual void wheelEvent(QWheelEvent *event);
+
     QImage *m_image; // image for the current canvas
 
+private slots:
+
+    /**
+     * @brief refinePreview: callback function for the preview timer, trace
+     *                       the next part of the preview
+     */
+    void refinePreview();
+
 private:
 
     CPURayScene* m_scene; // My CPU ray scene
+    QTimer m_previewTimer; // Timer of the preview frames
+    OrbitCamera* m_previewCamera; // Camera of the preview, NULL for none
+    bool m_mouseRightDown; // Right button orbits the camera
+    bool m_mouseMiddleDown; // Middle button pans the camera
 };
 
 #endif // VIEW2D_H
@@ -45,7 +45,6 @@ extern "C"
 }
 
 /* static variables */
-static const char* clRayTraceGPU = "./OpenCL/shader/raytraceGPU.cl";
 static const char* fontBMP       = "./resource/Font.bmp";
 
 View3D::View3D(QWidget *parent) : QGLWidget(parent),
@@ -138,8 +137,16 @@ Scene* View3D::loadScene(const QString& sceneName)
 
             m_scene = newScene;
 
+            // The GPU tracer always uses the kdtree
+            // Only the GUI dumps the kdtree info, the batch renderer
+            // builds far larger trees
             if (settings.useKdTree)
+            {
                 m_scene->buildKdTree();
+                m_scene->dumpKdTree();
+            }
+            if (settings.useKdTree && settings.accelStruct == BVH)
+                m_scene->buildBvh();
 
             return m_scene;
         }
@@ -377,6 +384,12 @@ void View3D::initCL()
         return;
     }
 
+    if (!createTransferQueue(m_cl))
+    {
+        m_supportGPU = false;
+        return;
+    }
+
     m_supportGPU = true;
 
     initCLProgramAndKernel();
@@ -384,115 +397,26 @@ void View3D::initCL()
 
 void View3D::releaseCL()
 {
-    if (m_cl.m_queue)
-    {
-        clFinish(m_cl.m_queue);
-        clReleaseCommandQueue(m_cl.m_queue);
-    }
-    if (m_cl.m_program)
-        clReleaseProgram(m_cl.m_program);
-
-    if (m_cl.m_context)
-        clReleaseContext(m_cl.m_context);
-    if (m_cl.m_kernelRay)
-        clReleaseKernel(m_cl.m_kernelRay);
-
-    if (m_cl.m_cmPbo)
-        clReleaseMemObject(m_cl.m_cmPbo);
+    releaseCLPack(m_cl);
 }
 
 void View3D::initCLProgramAndKernel()
 {
     cl_int ciErrNum;
 
-    size_t szProgramLength;
-
-    char* cSourceCL = oclLoadProgSource(clRayTraceGPU, "", &szProgramLength);
-
-    m_cl.m_program = clCreateProgramWithSource(m_cl.m_context,
-                                               1,
-                                               (const char**)&cSourceCL,
-                                               &szProgramLength,
-                                               &ciErrNum);
-
-    if (ciErrNum != CL_SUCCESS)
-    {
-        cerr << "Create program failed in line:"
-             << __LINE__ << ", File:" << __FILE__ << endl;
-        free(cSourceCL);
-        return ;
-    }
-    ciErrNum = clBuildProgram(m_cl.m_program,
-                              1,
-                              &m_cl.m_device,
-                              NULL,
-                              NULL,
-                              NULL);
-
-    if (ciErrNum != CL_SUCCESS)
-    {
-        cerr << "Build program failed in line:"
-             << __LINE__ << ", File:" << __FILE__ << endl;
-
-        cerr << "The log is: " << endl;
-
-        char* buildLog;
-        size_t logSize;
-        clGetProgramBuildInfo(m_cl.m_program, m_cl.m_device,
-                              CL_PROGRAM_BUILD_LOG, 0, NULL, &logSize);
-        buildLog = new char[logSize + 1];
-
-        clGetProgramBuildInfo(m_cl.m_program, m_cl.m_device,
-                              CL_PROGRAM_BUILD_LOG, logSize, buildLog, NULL);
-        buildLog[logSize + 1] = '\0';
-        cout <<  buildLog  <<   endl;
-        delete []buildLog;
-
-        free(cSourceCL);
+    if (!buildCLKernels(m_cl, CL_RAYTRACE_SOURCE))
         return;
-    }
 
+    // The kernel writes into the pixel buffer the screen texture reads
     m_cl.m_cmPbo = clCreateFromGLBuffer(m_cl.m_context, CL_MEM_WRITE_ONLY,
                                         m_pbo, &ciErrNum);
     if (ciErrNum != CL_SUCCESS)
     {
         cerr << "Create buffer from GL failed in line:"
              << __LINE__ << ", File:" << __FILE__ << endl;
-        free(cSourceCL);
+        m_cl.m_cmPbo = NULL;
         return ;
     }
-
-    // Create the kernel and setup the arguments
-
-    m_cl.m_kernelRay = clCreateKernel(m_cl.m_program, "raytrace", &ciErrNum);
-    if (ciErrNum != CL_SUCCESS)
-    {
-            cerr << "Create kernel failed in line:"
-                 << __LINE__ << ", File:" << __FILE__ << endl;
-            free(cSourceCL);
-            return ;
-     }
-
-    m_cl.m_localWorkSize[0]  = GPU_LOCAL_WORK_SIZE_X;
-    m_cl.m_localWorkSize[1]  = GPU_LOCAL_WORK_SIZE_Y;
-    m_cl.m_globalWorkSize[0] = shrRoundUp(m_cl.m_localWorkSize[0], WIN_WIDTH);
-    m_cl.m_globalWorkSize[1] = shrRoundUp(m_cl.m_localWorkSize[1], WIN_HEIGHT);
-
-    cout << "Local work size" << m_cl.m_localWorkSize[0] << " "
-         << m_cl.m_localWorkSize[1] << endl;
-    cout << "Global work size" << m_cl.m_globalWorkSize[0] << " "
-         << m_cl.m_globalWorkSize[1] << endl;
-
-    cout << "Max work group item size is " << CL_DEVICE_MAX_WORK_ITEM_SIZES;
-
-    if (m_cl.m_localWorkSize[0] * m_cl.m_localWorkSize[1] >
-            CL_DEVICE_MAX_WORK_ITEM_SIZES)
-    {
-        cerr << "Invalid local work size" << endl;
-        free(cSourceCL);
-        return;
-    }
-    free(cSourceCL);
 }
 
 void View3D::renderScene()
@@ -591,6 +515,12 @@ void View3D::keyPressEvent(QKeyEvent *event)
         if (m_gpuscene)
             m_gpuscene->syncGlobalSettings();
     }
+    else if (event->key() == Qt::Key_M)
+    {
+        settings.useMipmaps = !settings.useMipmaps;
+        if (m_gpuscene)
+            m_gpuscene->syncGlobalSettings();
+    }
     else if (event->key() == Qt::Key_A)
     {
         settings.showAxis = !settings.showAxis;
@@ -669,6 +599,11 @@ void View3D::paintText()
     printText(10, WIN_HEIGHT -  140,  str.toStdString().c_str(), 0);
     ss.str("");
 
+    ss << "M: Use mipmaps = " << (settings.useMipmaps ? "true" : "false");
+    str = ss.str().c_str();
+    printText(10, WIN_HEIGHT -  155,  str.toStdString().c_str(), 0);
+    ss.str("");
+
     glDisable(GL_BLEND);
 }
 
@@ -843,7 +778,7 @@ void View3D::GPUrender()
         return;
     }
 
-    if (!m_cl.m_kernelRay)
+    if (!m_cl.m_kernelGenerate)
     {
         cerr << "Kernel has not been set up" << endl;
         return;
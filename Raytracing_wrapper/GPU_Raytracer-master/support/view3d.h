@@ -18,7 +18,7 @@
 
 #include "global.h"
 #include "camera.h"
-#include "CL/cl.h"
+#include "clPack.h"
 #include "GL/glu.h"
 
 class Scene;
@@ -42,29 +42,6 @@ struct VboHandles
     GLuint sphereElementVBO;
 };
 
-/**
- * @struct: CLPack
- * @brief The CLPack struct is merely used for storing OpenCL platform informations
- */
-struct CLPack
-{
-    cl_platform_id m_platform;
-    cl_context m_context;
-    cl_command_queue m_queue;
-    cl_program m_program;
-    cl_uint m_uiDevCount;
-    cl_device_id m_device;
-    cl_kernel m_kernelRay;
-
-    cl_mem m_cmPbo;
-    cl_mem m_cmOut;
-
-    size_t m_localWorkSize[2];
-    size_t m_globalWorkSize[2];
-
-    QVector<cl_device_id> m_deviceList;
-};
-
 /**
  * @class View3D
  * @brief The View3D class inherits QGLWidghet; its job is to render the scene